@@ -0,0 +1,182 @@
+#include "arena.h"
+#include "job.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char * const frameStageNames[ FRAME_STAGE_CNT ] = { "vertex",
+                                                          "raster",
+                                                          "rays" };
+
+static inline __attribute__ ( ( always_inline ) ) size_t
+align_up ( size_t n )
+{
+    return ( n + ARENA_ALIGN - 1 ) & ~( size_t ) ( ARENA_ALIGN - 1 );
+}
+
+/* size bytes plus room to align them, exits like U_ALLOC () on failure */
+static void *
+raw_alloc ( size_t size )
+{
+    void * p = malloc ( size + ARENA_ALIGN );
+    if ( ! p )
+    {
+        printf ( "error: frame arena block of size %zu", size );
+        exit ( EXIT_FAILURE );
+    }
+    return p;
+}
+
+static inline __attribute__ ( ( always_inline ) ) uint8_t *
+aligned ( void * p )
+{
+    return ( uint8_t * ) align_up ( ( uintptr_t ) p );
+}
+
+static void
+set_block ( FrameArena * a, size_t cap )
+{
+    free ( a->raw );
+    a->raw  = raw_alloc ( cap );
+    a->base = aligned ( a->raw );
+    a->cap  = cap;
+}
+
+int
+createFrameArenas ( FrameArenas * fa, int worker_cnt )
+{
+    memset ( fa, 0, sizeof ( FrameArenas ) );
+    fa->cnt   = worker_cnt > 0 ? worker_cnt : 1;
+    fa->stage = -1;
+
+    /* FrameArena is cache line aligned, the array has to be as well */
+    fa->raw = malloc ( fa->cnt * sizeof ( FrameArena ) + ARENA_ALIGN );
+    if ( ! fa->raw )
+    {
+        printf ( "error: %d frame arenas\n", fa->cnt );
+        return -1;
+    }
+    fa->arenas = ( FrameArena * ) aligned ( fa->raw );
+    memset ( fa->arenas, 0, fa->cnt * sizeof ( FrameArena ) );
+
+    for ( int i = 0; i < fa->cnt; i++ )
+        set_block ( fa->arenas + i, ARENA_BLOCK );
+    return 0;
+}
+
+static void
+free_spills ( FrameArena * a )
+{
+    while ( a->spill )
+    {
+        ArenaSpill * next = a->spill->next;
+        free ( a->spill );
+        a->spill = next;
+    }
+    a->spilled = 0;
+}
+
+void
+destroyFrameArenas ( FrameArenas * fa )
+{
+    if ( ! fa->arenas ) return;
+
+    for ( int i = 0; i < fa->cnt; i++ )
+    {
+        free_spills ( fa->arenas + i );
+        free ( fa->arenas[ i ].raw );
+    }
+    free ( fa->raw );
+    fa->raw    = NULL;
+    fa->arenas = NULL;
+}
+
+void *
+frameAlloc ( FrameArenas * fa, size_t size )
+{
+    FrameArena * a = fa->arenas + jobWorker ();
+    void *       p;
+
+    size = align_up ( size );
+    if ( a->used + size <= a->cap )
+    {
+        p = a->base + a->used;
+        a->used += size;
+    }
+    else
+    {
+        /* the header takes a whole ARENA_ALIGN so p stays aligned */
+        ArenaSpill * s = raw_alloc ( size + ARENA_ALIGN );
+        s->next        = a->spill;
+        a->spill       = s;
+        a->spilled += size;
+        p = aligned ( ( uint8_t * ) s + sizeof ( ArenaSpill ) );
+    }
+
+    const size_t live = a->used + a->spilled;
+    if ( live > a->high ) a->high = live;
+    if ( live > a->stage_high ) a->stage_high = live;
+    return p;
+}
+
+void
+resetFrameArenas ( FrameArenas * fa )
+{
+    size_t total = 0;
+
+    for ( int i = 0; i < fa->cnt; i++ )
+    {
+        FrameArena * a = fa->arenas + i;
+        total += a->high;
+
+        /* one block big enough for all of the last frame */
+        if ( a->spill )
+        {
+            free_spills ( a );
+            set_block ( a, align_up ( a->high + a->high / 4 ) );
+        }
+        a->used = 0;
+        a->high = 0;
+    }
+
+    for ( int s = 0; s < FRAME_STAGE_CNT; s++ )
+    {
+        fa->last[ s ]  = fa->frame[ s ];
+        fa->frame[ s ] = 0;
+        if ( fa->last[ s ] > fa->peak[ s ] ) fa->peak[ s ] = fa->last[ s ];
+    }
+    fa->last_total = total;
+    if ( total > fa->peak_total ) fa->peak_total = total;
+}
+
+void
+beginFrameStage ( FrameArenas * fa, int stage )
+{
+    fa->stage = stage;
+    for ( int i = 0; i < fa->cnt; i++ )
+    {
+        FrameArena * a  = fa->arenas + i;
+        a->mark         = a->used;
+        a->mark_spilled = a->spilled;
+        a->stage_high   = a->used + a->spilled;
+    }
+}
+
+void
+endFrameStage ( FrameArenas * fa )
+{
+    size_t bytes = 0;
+
+    for ( int i = 0; i < fa->cnt; i++ )
+    {
+        FrameArena * a = fa->arenas + i;
+        bytes += a->stage_high - a->mark - a->mark_spilled;
+
+        /* spills stay until the reset, the block is free again */
+        a->used = a->mark;
+    }
+
+    if ( bytes > fa->frame[ fa->stage ] ) fa->frame[ fa->stage ] = bytes;
+    fa->stage = -1;
+}
@@ -0,0 +1,95 @@
+#pragma once
+#ifndef CUSTOM_RENDER_ARENA_H
+#define CUSTOM_RENDER_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 19.10.26 ::: Frame arenas. Scratch that does not outlive a frame is
+ * bumped off a block per job worker, so allocating is an add and workers
+ * never share a cache line or a lock. resetFrameArenas () drops all of it
+ * at frame start; stages bracketed by beginFrameStage () / endFrameStage ()
+ * give their scratch back when they end and get their peak recorded.
+ * Whatever does not fit a block is malloc'ed on the side and the block is
+ * grown to the high water mark at the next reset, so a steady scene stops
+ * touching malloc after its first frame. Only the job system's threads
+ * (and the main thread, worker 0) may allocate. */
+
+#define ARENA_ALIGN 64          /* cache line */
+#define ARENA_BLOCK ( 1 << 20 ) /* initial block size per worker */
+
+enum
+{
+    FRAME_STAGE_VERTEX,
+    FRAME_STAGE_RASTER,
+    FRAME_STAGE_RAYS,
+    FRAME_STAGE_CNT
+};
+
+extern const char * const frameStageNames[ FRAME_STAGE_CNT ];
+
+typedef struct ArenaSpill
+{
+    struct ArenaSpill * next;
+} ArenaSpill;
+
+typedef struct FrameArena
+{
+    void *    raw; /* as malloc'ed, base is raw aligned up */
+    uint8_t * base;
+    size_t    cap;
+    size_t    used;
+
+    ArenaSpill * spill; /* what did not fit, freed on reset */
+    size_t       spilled;
+
+    size_t high;       /* most used + spilled since the reset */
+    size_t stage_high; /* the same since beginFrameStage () */
+    size_t mark;       /* used at beginFrameStage () */
+    size_t mark_spilled;
+} __attribute__ ( ( aligned ( ARENA_ALIGN ) ) ) FrameArena;
+
+typedef struct FrameArenas
+{
+    void *       raw;    /* as malloc'ed, arenas is raw aligned up */
+    FrameArena * arenas; /* one per worker */
+    int          cnt;
+    int          stage; /* open stage or -1 */
+
+    /* bytes; frame is being recorded, last is the previous frame and
+     * peak the most any frame needed */
+    size_t frame[ FRAME_STAGE_CNT ];
+    size_t last[ FRAME_STAGE_CNT ];
+    size_t peak[ FRAME_STAGE_CNT ];
+    size_t last_total;
+    size_t peak_total;
+} FrameArenas;
+
+int
+createFrameArenas ( FrameArenas * fa, int worker_cnt );
+
+void
+destroyFrameArenas ( FrameArenas * fa );
+
+/* ARENA_ALIGN aligned, valid until the end of the open stage (or the next
+ * reset outside of one); never fails */
+void *
+frameAlloc ( FrameArenas * fa, size_t size );
+
+/* U_ALLOC () off the calling worker's arena */
+#define F_ALLOC( fa, var, type, len ) \
+    ( ( var ) = ( type * ) frameAlloc ( ( fa ), ( len ) * sizeof ( type ) ) )
+
+/* main thread, no jobs running: publishes the stats of the frame that
+ * ended and empties every arena */
+void
+resetFrameArenas ( FrameArenas * fa );
+
+/* main thread, no jobs running; stages do not nest */
+void
+beginFrameStage ( FrameArenas * fa, int stage );
+
+void
+endFrameStage ( FrameArenas * fa );
+
+#endif /* CUSTOM_RENDER_ARENA_H */
@@ -0,0 +1,431 @@
+#include "capture.h"
+#include "pipeline.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline __attribute__ ( ( always_inline ) ) uint32_t
+padded ( size_t bytes )
+{
+    return ( bytes + CAPTURE_ALIGN - 1 ) & ~( size_t ) ( CAPTURE_ALIGN - 1 );
+}
+
+static void
+write_or_close ( Capture * c, const void * p, size_t bytes )
+{
+    if ( ! c->file ) return;
+
+    if ( fwrite ( p, 1, bytes, c->file ) != bytes )
+    {
+        printf ( "error: capture write failed, capture stopped\n" );
+        closeCapture ( c );
+        return;
+    }
+    c->bytes += bytes;
+}
+
+static void
+write_pad ( Capture * c, size_t bytes )
+{
+    static const uint8_t zero[ CAPTURE_ALIGN ] = { 0 };
+    write_or_close ( c, zero, padded ( bytes ) - bytes );
+}
+
+static void
+write_record ( Capture * c, uint32_t type, size_t bytes )
+{
+    CaptureRecord r = { type, padded ( bytes ), { 0, 0 } };
+    write_or_close ( c, &r, sizeof ( r ) );
+}
+
+int
+openCapture ( Capture * c, const char * path )
+{
+    memset ( c, 0, sizeof ( Capture ) );
+
+    c->file = fopen ( path, "wb" );
+    if ( ! c->file )
+    {
+        printf ( "error: can't open capture file %s\n", path );
+        return -1;
+    }
+    /* draws are large and come in bursts */
+    setvbuf ( c->file, NULL, _IOFBF, 1 << 20 );
+
+    CaptureHeader h = { CAPTURE_MAGIC, CAPTURE_VERSION, { 0, 0 } };
+    write_or_close ( c, &h, sizeof ( h ) );
+    return c->file ? 0 : -1;
+}
+
+void
+closeCapture ( Capture * c )
+{
+    if ( ! c->file ) return;
+
+    if ( fclose ( c->file ) ) printf ( "error: capture file close failed\n" );
+    c->file = NULL;
+}
+
+/* by CAPTURE_LOST_* bit */
+static const char * const lost_names[] = {
+    "point splats", "fragment shaders", "ray tracing", "the heatmap" };
+#define LOST_CNT ( int ) ( sizeof ( lost_names ) / sizeof ( *lost_names ) )
+
+void
+captureFrame ( Capture * c, Framebuffer * f, uint32_t lost )
+{
+    const uint32_t fresh = lost & ~c->warned;
+    for ( int k = 0; k < LOST_CNT; k++ )
+    {
+        if ( ! ( fresh >> k & 1 ) ) continue;
+        printf ( "warning: capture frame %u uses %s, not recorded; its "
+                 "replay differs\n",
+                 c->frames,
+                 lost_names[ k ] );
+    }
+    c->warned |= lost;
+
+    CaptureFrame fr;
+    memset ( &fr, 0, sizeof ( fr ) );
+    fr.w         = f->w;
+    fr.h         = f->h;
+    fr.surface_w = f->surface->w;
+    fr.surface_h = f->surface->h;
+    fr.msaa      = f->msaa;
+    fr.tiled     = f->tiled;
+    fr.ordered   = f->ordered;
+
+    write_record ( c, CAPTURE_FRAME, sizeof ( fr ) );
+    write_or_close ( c, &fr, sizeof ( fr ) );
+    write_pad ( c, sizeof ( fr ) );
+    c->frames++;
+}
+
+/* calls before the first captureFrame () belong to no frame, they are
+ * dropped */
+void
+captureRect ( Capture * c, uint32_t type, const int * rect )
+{
+    if ( ! c->frames ) return;
+
+    CaptureRect r = { rect == NULL, { 0, 0, 0, 0 } };
+    if ( rect ) memcpy ( r.rect, rect, sizeof ( r.rect ) );
+
+    write_record ( c, type, sizeof ( r ) );
+    write_or_close ( c, &r, sizeof ( r ) );
+    write_pad ( c, sizeof ( r ) );
+}
+
+void
+captureDraw ( Capture * c, vec3 * v, uint64_t * zi, vec4 * col, int cnt )
+{
+    if ( ! c->frames ) return;
+
+    const CaptureDraw d     = { cnt, { 0, 0, 0 } };
+    const size_t      bytes = sizeof ( d ) + 3 * sizeof ( vec4 ) +
+                         cnt * 3 * ( sizeof ( uint64_t ) + sizeof ( vec3 ) );
+
+    write_record ( c, CAPTURE_DRAW, bytes );
+    write_or_close ( c, &d, sizeof ( d ) );
+    write_or_close ( c, col, 3 * sizeof ( vec4 ) );
+    write_or_close ( c, zi, cnt * 3 * sizeof ( uint64_t ) );
+    write_or_close ( c, v, cnt * 3 * sizeof ( vec3 ) );
+    write_pad ( c, bytes );
+}
+
+/* ---- replay ---- */
+
+typedef struct
+{
+    uint32_t tris;
+    double   clean, raster, merge; /* ms, best over the loops */
+    uint32_t hash;
+} ReplayFrame;
+
+static double
+ms_since ( uint64_t t0 )
+{
+    return ( double ) ( SDL_GetPerformanceCounter () - t0 ) * 1000.0 /
+           SDL_GetPerformanceFrequency ();
+}
+
+/* FNV-1a over the merged surface, to tell a raster change kept the image */
+static uint32_t
+surface_hash ( SDL_Surface * s )
+{
+    const uint8_t * p = s->pixels;
+    uint32_t        h = 2166136261u;
+
+    for ( int i = 0; i < s->h * s->pitch; i++ )
+    {
+        h ^= p[ i ];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* the whole file, CAPTURE_ALIGN aligned (malloc is) */
+static uint8_t *
+read_capture ( const char * path, size_t * len )
+{
+    FILE * file = fopen ( path, "rb" );
+    if ( ! file )
+    {
+        printf ( "error: can't open capture file %s\n", path );
+        return NULL;
+    }
+
+    fseek ( file, 0, SEEK_END );
+    *len = ftell ( file );
+    fseek ( file, 0, SEEK_SET );
+
+    uint8_t * data = malloc ( *len );
+    if ( ! data || fread ( data, 1, *len, file ) != *len )
+    {
+        printf ( "error: can't read capture file %s\n", path );
+        free ( data );
+        data = NULL;
+    }
+    fclose ( file );
+
+    const CaptureHeader * h = ( const CaptureHeader * ) data;
+    if ( data && ( *len < sizeof ( CaptureHeader ) ||
+                   h->magic != CAPTURE_MAGIC ||
+                   h->version != CAPTURE_VERSION ) )
+    {
+        printf ( "error: %s is not a version %d capture\n",
+                 path,
+                 CAPTURE_VERSION );
+        free ( data );
+        data = NULL;
+    }
+    return data;
+}
+
+/* frames in the capture, 0 when a record runs past the end or a draw
+ * past its record */
+static int
+count_frames ( const uint8_t * data, size_t len )
+{
+    int    frames = 0;
+    size_t at     = sizeof ( CaptureHeader );
+
+    while ( at + sizeof ( CaptureRecord ) <= len )
+    {
+        const CaptureRecord * r = ( const CaptureRecord * ) ( data + at );
+        const CaptureDraw *   d = ( const CaptureDraw * ) ( r + 1 );
+        at += sizeof ( CaptureRecord ) + r->bytes;
+        if ( at > len ) return 0;
+
+        if ( r->type == CAPTURE_DRAW &&
+             ( r->bytes < sizeof ( CaptureDraw ) ||
+               r->bytes < sizeof ( CaptureDraw ) + 3 * sizeof ( vec4 ) +
+                              ( uint64_t ) d->cnt * 3 *
+                                  ( sizeof ( uint64_t ) + sizeof ( vec3 ) ) ) )
+        {
+            return 0;
+        }
+        frames += r->type == CAPTURE_FRAME;
+    }
+    return at == len ? frames : 0;
+}
+
+typedef struct
+{
+    Framebuffer * f;
+    JobSystem     jobs;
+    FrameArenas   arenas;
+} Replay;
+
+/* a framebuffer for fr, the old one when the surface size matches */
+static int
+replay_frame ( Replay * rp, const CaptureFrame * fr )
+{
+    Framebuffer * f = rp->f;
+
+    if ( f && ( ( uint32_t ) f->surface->w != fr->surface_w ||
+                ( uint32_t ) f->surface->h != fr->surface_h ) )
+    {
+        destroyFramebuffer ( f );
+        f = rp->f = NULL;
+    }
+    if ( ! f )
+    {
+        f = rp->f = createFramebuffer ( fr->surface_h, fr->surface_w );
+        if ( ! f ) return -1;
+        f->jobs   = &rp->jobs;
+        f->arenas = &rp->arenas;
+    }
+
+    if ( f->w != fr->w || f->h != fr->h )
+        resizeFramebuffer ( f, fr->h, fr->w );
+    f->msaa    = fr->msaa;
+    f->tiled   = fr->tiled;
+    f->ordered = fr->ordered;
+
+    resetFrameArenas ( &rp->arenas );
+    return 0;
+}
+
+/* t ends frame fr: keeps it when it is the first pass or faster */
+static void
+end_frame ( Replay * rp, ReplayFrame * fr, ReplayFrame * t, int first )
+{
+    t->hash = surface_hash ( rp->f->surface );
+    if ( first || t->clean + t->raster + t->merge <
+                      fr->clean + fr->raster + fr->merge )
+    {
+        *fr = *t;
+    }
+    memset ( t, 0, sizeof ( ReplayFrame ) );
+}
+
+/* one pass over the capture, times into frames[] (best of the passes) */
+static int
+replay_pass ( Replay *        rp,
+              const uint8_t * data,
+              size_t          len,
+              ReplayFrame *   frames,
+              int             first )
+{
+    ReplayFrame * fr = NULL;
+    ReplayFrame   t;
+    size_t        at = sizeof ( CaptureHeader );
+
+    memset ( &t, 0, sizeof ( t ) );
+    while ( at < len )
+    {
+        const CaptureRecord * r = ( const CaptureRecord * ) ( data + at );
+        const uint8_t *       p = data + at + sizeof ( CaptureRecord );
+        at += sizeof ( CaptureRecord ) + r->bytes;
+
+        if ( ! fr && r->type != CAPTURE_FRAME )
+        {
+            printf ( "error: capture does not start with a frame\n" );
+            return -1;
+        }
+
+        const CaptureRect * rect = ( const CaptureRect * ) p;
+        const uint64_t      t0   = SDL_GetPerformanceCounter ();
+
+        switch ( r->type )
+        {
+            case CAPTURE_FRAME:
+                if ( fr ) end_frame ( rp, fr++, &t, first );
+                if ( ! fr ) fr = frames;
+                if ( replay_frame ( rp, ( const CaptureFrame * ) p ) )
+                    return -1;
+                break;
+
+            case CAPTURE_CLEAN:
+                if ( rect->full )
+                    cleanFramebuffer ( rp->f );
+                else
+                    cleanFramebufferRect ( rp->f, rect->rect );
+                t.clean += ms_since ( t0 );
+                break;
+
+            case CAPTURE_CLIP:
+                setClipRect ( rp->f, rect->full ? NULL : rect->rect );
+                break;
+
+            case CAPTURE_DRAW:
+            {
+                const CaptureDraw * d   = ( const CaptureDraw * ) p;
+                vec4 *              col = ( vec4 * ) ( d + 1 );
+                uint64_t *          zi  = ( uint64_t * ) ( col + 3 );
+                vec3 *              v   = ( vec3 * ) ( zi + d->cnt * 3 );
+
+                beginFrameStage ( &rp->arenas, FRAME_STAGE_RASTER );
+                rasterizeBinned ( rp->f, v, zi, col, d->cnt );
+                endFrameStage ( &rp->arenas );
+                t.raster += ms_since ( t0 );
+                t.tris += d->cnt;
+                break;
+            }
+
+            case CAPTURE_MERGE:
+                if ( rect->full )
+                    merge ( rp->f );
+                else
+                    mergeRect ( rp->f, rect->rect, NULL );
+                t.merge += ms_since ( t0 );
+                break;
+
+            default:
+                printf ( "error: unknown capture record %u\n", r->type );
+                return -1;
+        }
+    }
+
+    if ( fr ) end_frame ( rp, fr, &t, first );
+    return 0;
+}
+
+int
+replayCapture ( const char * path, int loops )
+{
+    size_t    len;
+    uint8_t * data = read_capture ( path, &len );
+    if ( ! data ) return -1;
+
+    const int frame_cnt = count_frames ( data, len );
+    if ( ! frame_cnt )
+    {
+        printf ( "error: %s is empty or truncated\n", path );
+        free ( data );
+        return -1;
+    }
+
+    selectIsa ();
+
+    Replay rp;
+    memset ( &rp, 0, sizeof ( rp ) );
+    if ( createJobSystem ( &rp.jobs, SDL_GetCPUCount () ) )
+    {
+        free ( data );
+        return -1;
+    }
+    int err = createFrameArenas ( &rp.arenas, rp.jobs.worker_cnt );
+
+    ReplayFrame * frames;
+    U_ALLOC ( frames, ReplayFrame, frame_cnt );
+
+    for ( int l = 0; l < ( loops > 0 ? loops : 1 ) && ! err; l++ )
+        err = replay_pass ( &rp, data, len, frames, l == 0 );
+
+    if ( ! err )
+    {
+        double total[ 3 ] = { 0, 0, 0 };
+
+        printf ( "frame    tris   clean  raster   merge  (ms, best of %d)  "
+                 "hash\n",
+                 loops > 0 ? loops : 1 );
+        for ( int i = 0; i < frame_cnt; i++ )
+        {
+            const ReplayFrame * fr = frames + i;
+            printf ( "%5d %7u %7.2f %7.2f %7.2f  %08x\n",
+                     i,
+                     fr->tris,
+                     fr->clean,
+                     fr->raster,
+                     fr->merge,
+                     fr->hash );
+            total[ 0 ] += fr->clean;
+            total[ 1 ] += fr->raster;
+            total[ 2 ] += fr->merge;
+        }
+        printf ( "mean          %7.2f %7.2f %7.2f\n",
+                 total[ 0 ] / frame_cnt,
+                 total[ 1 ] / frame_cnt,
+                 total[ 2 ] / frame_cnt );
+    }
+
+    destroyFramebuffer ( rp.f );
+    destroyFrameArenas ( &rp.arenas );
+    destroyJobSystem ( &rp.jobs );
+    free ( frames );
+    free ( data );
+    return err ? -1 : 0;
+}
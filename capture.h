@@ -0,0 +1,117 @@
+#pragma once
+#ifndef CUSTOM_RENDER_CAPTURE_H
+#define CUSTOM_RENDER_CAPTURE_H
+
+#include "engine.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* 19.10.26 ::: Raster capture. While Framebuffer.capture is set, the
+ * triangle path into the planes (clears, clip rect, rasterize*, merges) is
+ * appended to a file with its exact arguments, in screen space as the
+ * rasterizer received them. app --replay runs a capture against the
+ * rasterizer alone: no window, input, transforms or culling in the
+ * timings. Start capturing on a full redraw, partial frames build on
+ * what the frames before them left in the planes.
+ *
+ * Point splats, FragShader batches, traceLighting () and drawHeatmap ()
+ * are not recorded; a replay of a frame that used them differs from it.
+ * captureFrame () is told which of them the frame uses, CAPTURE_LOST_*,
+ * and says so once per capture.
+ *
+ * The file is native byte order: a CaptureHeader, then records of a
+ * CaptureRecord and its payload, each padded to CAPTURE_ALIGN so a file
+ * read whole can be rasterized from in place. */
+
+#define CAPTURE_MAGIC   0x50414352 /* "RCAP" */
+#define CAPTURE_VERSION 1
+#define CAPTURE_ALIGN   16
+
+enum
+{
+    CAPTURE_FRAME, /* CaptureFrame */
+    CAPTURE_CLEAN, /* CaptureRect, clear */
+    CAPTURE_CLIP,  /* CaptureRect, setClipRect () */
+    CAPTURE_DRAW,  /* CaptureDraw, vec4 c[ 3 ], zi[ cnt * 3 ], v[ cnt * 3 ] */
+    CAPTURE_MERGE  /* CaptureRect, merge */
+};
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t reserved[ 2 ];
+} CaptureHeader;
+
+typedef struct
+{
+    uint32_t type;
+    uint32_t bytes; /* payload, padded */
+    uint32_t reserved[ 2 ];
+} CaptureRecord;
+
+typedef struct
+{
+    uint32_t w, h;                 /* render target */
+    uint32_t surface_w, surface_h; /* merge() target */
+    uint8_t  msaa;
+    uint8_t  tiled;
+    uint8_t  ordered; /* 0 in captures from before draw ordering */
+    uint8_t  reserved[ 5 ];
+} CaptureFrame;
+
+/* full is the whole target (or no clip), rect is then unused */
+typedef struct
+{
+    int32_t full;
+    int32_t rect[ 4 ];
+} CaptureRect;
+
+typedef struct
+{
+    uint32_t cnt; /* triangles */
+    uint32_t reserved[ 3 ];
+} CaptureDraw;
+
+/* what a frame does to the planes besides the records */
+enum
+{
+    CAPTURE_LOST_SPLATS  = 1 << 0,
+    CAPTURE_LOST_SHADERS = 1 << 1,
+    CAPTURE_LOST_RAYS    = 1 << 2,
+    CAPTURE_LOST_HEATMAP = 1 << 3
+};
+
+typedef struct Capture
+{
+    FILE *   file;
+    uint32_t frames;
+    uint64_t bytes;
+    uint32_t warned; /* CAPTURE_LOST_* already reported */
+} Capture;
+
+/* 0 on success; writes the header */
+int
+openCapture ( Capture * c, const char * path );
+
+void
+closeCapture ( Capture * c );
+
+/* A failed write closes the capture, c->file is then NULL. lost is the
+ * CAPTURE_LOST_* the frame uses. */
+void
+captureFrame ( Capture * c, Framebuffer * f, uint32_t lost );
+
+void
+captureRect ( Capture * c, uint32_t type, const int * rect );
+
+void
+captureDraw ( Capture * c, vec3 * v, uint64_t * zi, vec4 * col, int cnt );
+
+/* runs the capture at path loops times, per frame timings and a hash of
+ * the merged surface go to stdout; 0 on success */
+int
+replayCapture ( const char * path, int loops );
+
+#endif /* CUSTOM_RENDER_CAPTURE_H */
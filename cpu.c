@@ -0,0 +1,97 @@
+#include "cpu.h"
+
+#include <cpuid.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char * const isaNames[ ISA_CNT ] = { "sse2", "sse4.1", "avx2", "avx512" };
+
+int isaLevel = ISA_SSE2;
+
+/* CPUID.1:ECX */
+#define CPU_SSE41   ( 1u << 19 )
+#define CPU_OSXSAVE ( 1u << 27 )
+#define CPU_AVX     ( 1u << 28 )
+
+/* CPUID.(7,0):EBX */
+#define CPU_BMI1     ( 1u << 3 )
+#define CPU_AVX2     ( 1u << 5 )
+#define CPU_BMI2     ( 1u << 8 )
+#define CPU_AVX512F  ( 1u << 16 )
+#define CPU_AVX512BW ( 1u << 30 )
+#define CPU_AVX512VL ( 1u << 31 )
+
+/* XCR0: register state the OS saves on a context switch */
+#define XCR0_AVX    0x06u /* XMM, YMM */
+#define XCR0_AVX512 0xe6u /* + opmask, ZMM 0-15 upper halves, ZMM 16-31 */
+
+static inline __attribute__ ( ( always_inline ) ) int
+has ( uint32_t reg, uint32_t bits )
+{
+    return ( reg & bits ) == bits;
+}
+
+static uint32_t
+xcr0 ( void )
+{
+    uint32_t lo, hi;
+    __asm__ ( "xgetbv" : "=a"( lo ), "=d"( hi ) : "c"( 0 ) );
+    ( void ) hi;
+    return lo;
+}
+
+int
+detectIsa ( void )
+{
+    uint32_t a, b, c, d;
+
+    if ( ! __get_cpuid ( 1, &a, &b, &c, &d ) ) return ISA_SSE2;
+    if ( ! has ( c, CPU_SSE41 ) ) return ISA_SSE2;
+
+    /* AVX state has to be enabled by the OS before any VEX code runs */
+    if ( ! has ( c, CPU_OSXSAVE | CPU_AVX ) ) return ISA_SSE41;
+    const uint32_t xcr = xcr0 ();
+    if ( ! has ( xcr, XCR0_AVX ) ) return ISA_SSE41;
+
+    if ( ! __get_cpuid_count ( 7, 0, &a, &b, &c, &d ) ) return ISA_SSE41;
+    if ( ! has ( b, CPU_AVX2 | CPU_BMI1 | CPU_BMI2 ) ) return ISA_SSE41;
+
+    if ( ! has ( b, CPU_AVX512F | CPU_AVX512BW | CPU_AVX512VL ) ||
+         ! has ( xcr, XCR0_AVX512 ) )
+    {
+        return ISA_AVX2;
+    }
+    return ISA_AVX512;
+}
+
+int
+selectIsa ( void )
+{
+    const int    best = detectIsa ();
+    const char * want = getenv ( "RENDER_ISA" );
+
+    isaLevel = best;
+    if ( want )
+    {
+        int i = 0;
+        while ( i < ISA_CNT && strcmp ( want, isaNames[ i ] ) ) i++;
+
+        if ( i == ISA_CNT )
+            printf ( "RENDER_ISA=%s unknown, using %s\n",
+                     want,
+                     isaNames[ best ] );
+        else if ( i > best )
+            printf ( "RENDER_ISA=%s unsupported here, using %s\n",
+                     want,
+                     isaNames[ best ] );
+        else
+            isaLevel = i;
+    }
+
+    printf ( "kernels: %s (cpu: %s)\n",
+             isaNames[ isaLevel ],
+             isaNames[ best ] );
+    return isaLevel;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#ifndef CUSTOM_RENDER_CPU_H
+#define CUSTOM_RENDER_CPU_H
+
+/* 19.10.26 ::: Runtime ISA dispatch. The build targets plain x86-64
+ * (SSE2) so one binary runs everywhere; the hot kernels are written once
+ * as always_inline bodies and ISA_KERNEL () compiles them again for every
+ * level below with target attributes. selectIsa () picks the level once
+ * at startup from CPUID, kernels are then called through their table:
+ *
+ *     parallelFor ( jobs, merge_rows_isa[ isaLevel ], ... );
+ *
+ * A body gets its level as a constant first argument and may branch on
+ * it to code written for that level (static ISA_TARGET_xxx functions, not
+ * always_inline: only a clone of the same level may inline them). FMA is
+ * left out on purpose, fused results would differ in the last bit between
+ * levels and every level has to render the same image. */
+
+enum
+{
+    ISA_SSE2,
+    ISA_SSE41,
+    ISA_AVX2,   /* + BMI1/2 */
+    ISA_AVX512, /* F, BW, VL */
+    ISA_CNT
+};
+
+extern const char * const isaNames[ ISA_CNT ];
+
+/* the level kernels dispatch on, ISA_SSE2 until selectIsa () */
+extern int isaLevel;
+
+#define ISA_TARGET_SSE41  __attribute__ ( ( target ( "sse4.1" ) ) )
+#define ISA_TARGET_AVX2   __attribute__ ( ( target ( "avx2,bmi,bmi2" ) ) )
+#define ISA_TARGET_AVX512 \
+    __attribute__ ( ( target ( "avx512f,avx512bw,avx512vl,avx2,bmi,bmi2" ) ) )
+
+/* static void name##_sse2 params .. name##_avx512 params, each calling
+ * name##_body ( <level>, args ), and name##_isa[ ISA_CNT ] of them */
+#define ISA_KERNEL( name, params, ... )                                    \
+    static void name##_sse2 params                                         \
+    {                                                                      \
+        name##_body ( ISA_SSE2, __VA_ARGS__ );                             \
+    }                                                                      \
+    static ISA_TARGET_SSE41 void name##_sse41 params                       \
+    {                                                                      \
+        name##_body ( ISA_SSE41, __VA_ARGS__ );                            \
+    }                                                                      \
+    static ISA_TARGET_AVX2 void name##_avx2 params                         \
+    {                                                                      \
+        name##_body ( ISA_AVX2, __VA_ARGS__ );                             \
+    }                                                                      \
+    static ISA_TARGET_AVX512 void name##_avx512 params                     \
+    {                                                                      \
+        name##_body ( ISA_AVX512, __VA_ARGS__ );                           \
+    }                                                                      \
+    static void ( *const name##_isa[ ISA_CNT ] ) params = {                \
+        name##_sse2, name##_sse41, name##_avx2, name##_avx512 }
+
+/* best level the CPU and the OS (saved register state) support */
+int
+detectIsa ( void );
+
+/* sets isaLevel to detectIsa (), or lower when RENDER_ISA names a level
+ * (sse2, sse4.1, avx2, avx512) for testing; returns it */
+int
+selectIsa ( void );
+
+#endif /* CUSTOM_RENDER_CPU_H */
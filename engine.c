@@ -1,4 +1,15 @@
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS, madvise () */
+
 #include "engine.h"
+#include "capture.h"
+#include "mesh.h"
+#include "occlusion.h"
+#include "points.h"
+#include "raytrace.h"
+#include "stream.h"
+
+#include <immintrin.h>
+#include <sys/mman.h>
 #define DBG_CALLCNT( func_name ) \
     static int u_calls = 0;      \
     printf ( "%s called: %d times\n", func_name, ++u_calls );
@@ -28,17 +39,76 @@ createDBufferPool ( uint32_t size )
 DBuffer *
 getAuxDBuffer ( Framebuffer * f )
 {
+    DBuffer * b = NULL;
+
+    /* raster jobs of different bands share the pool */
+    pthread_mutex_lock ( &f->lock );
     if ( f->pool->used >= f->pool->size )
     {
         DBufferPool * p;
         p = createDBufferPool ( f->pool->size * 2 );
-        if ( p == NULL ) return NULL;
+        if ( p == NULL ) goto out;
         p->prev = f->pool;
         f->pool = p;
     }
 
     f->pool->used++;
-    return f->pool->current++;
+    b = f->pool->current++;
+out:
+    pthread_mutex_unlock ( &f->lock );
+    return b;
+}
+
+MSBlock *
+getMSBlock ( Framebuffer * f, uint32_t px )
+{
+    const uint32_t i =
+        __atomic_fetch_add ( &f->ms_used, 1, __ATOMIC_RELAXED );
+    const uint32_t chunk = i >> MS_CHUNK_BITS;
+
+    if ( chunk >= MS_CHUNK_MAX )
+    {
+        printf ( "error: more than %u MSAA blocks\n",
+                 MS_CHUNK_MAX * MS_CHUNK_LEN );
+        exit ( EXIT_FAILURE );
+    }
+
+    if ( ! __atomic_load_n ( &f->ms_chunks[ chunk ], __ATOMIC_ACQUIRE ) )
+    {
+        pthread_mutex_lock ( &f->lock );
+
+        /* doubles the capacity, like the realloc it replaced, so
+         * framebufferSpent () keeps its meaning */
+        if ( ! f->ms_chunks[ chunk ] )
+        {
+            uint32_t last = ( f->ms_cap >> MS_CHUNK_BITS ) * 2;
+            if ( last <= chunk ) last = chunk + 1;
+            if ( last > MS_CHUNK_MAX ) last = MS_CHUNK_MAX;
+
+            for ( uint32_t k = f->ms_cap >> MS_CHUNK_BITS; k < last; k++ )
+            {
+                MSBlock * b;
+                U_ALLOC ( b, MSBlock, MS_CHUNK_LEN );
+                __atomic_store_n (
+                    &f->ms_chunks[ k ], b, __ATOMIC_RELEASE );
+            }
+            f->ms_cap = last << MS_CHUNK_BITS;
+        }
+
+        pthread_mutex_unlock ( &f->lock );
+    }
+
+    MSBlock * b     = MS_BLOCK ( f, i );
+    b->px           = px;
+    f->ms_idx[ px ] = i + 1;
+    return b;
+}
+
+int
+framebufferSpent ( Framebuffer * f )
+{
+    return f->pool->prev || f->pool->used > f->pool->size / 2 ||
+           f->ms_used > f->ms_cap / 2;
 }
 
 void
@@ -53,25 +123,127 @@ destroyDBufferPool ( DBufferPool * p )
     }
 }
 
-void
-cleanFramebuffer ( Framebuffer * f )
+/* 19.10.26 ::: memset () past the cache. A full clear writes far more
+ * than the cache holds before the raster comes back to it, so the lines
+ * would only be read for ownership and evicted again. One cache line per
+ * step, as wide as the level allows. */
+static void
+zero_lines_sse2 ( uint8_t * b, size_t lines )
 {
-    vec4 *     c    = f->opaque_c;
-    uint64_t * z    = f->opaque_z;
-    DBuffer ** t    = f->transparent;
-    uint32_t * s_px = f->surface->pixels;
+    const __m128i zero = _mm_setzero_si128 ();
+    for ( ; lines; lines--, b += 64 )
+    {
+        _mm_stream_si128 ( ( __m128i * ) b, zero );
+        _mm_stream_si128 ( ( __m128i * ) ( b + 16 ), zero );
+        _mm_stream_si128 ( ( __m128i * ) ( b + 32 ), zero );
+        _mm_stream_si128 ( ( __m128i * ) ( b + 48 ), zero );
+    }
+}
 
-    const uint32_t px_cnt = f->surface->h * f->surface->w;
+static ISA_TARGET_AVX2 void
+zero_lines_avx2 ( uint8_t * b, size_t lines )
+{
+    const __m256i zero = _mm256_setzero_si256 ();
+    for ( ; lines; lines--, b += 64 )
+    {
+        _mm256_stream_si256 ( ( __m256i * ) b, zero );
+        _mm256_stream_si256 ( ( __m256i * ) ( b + 32 ), zero );
+    }
+}
 
-    memset ( s_px, 0, px_cnt * sizeof ( uint32_t ) );
-    memset ( t, 0, px_cnt * sizeof ( DBuffer ** ) );
+static ISA_TARGET_AVX512 void
+zero_lines_avx512 ( uint8_t * b, size_t lines )
+{
+    const __m512i zero = _mm512_setzero_si512 ();
+    for ( ; lines; lines--, b += 64 )
+        _mm512_stream_si512 ( ( __m512i * ) b, zero );
+}
+
+static inline __attribute__ ( ( always_inline ) ) void
+stream_zero ( int isa, void * p, size_t bytes )
+{
+    uint8_t * b = p;
+
+    size_t head = ( 64 - ( ( uintptr_t ) b & 63 ) ) & 63;
+    if ( head > bytes ) head = bytes;
+    memset ( b, 0, head );
+    b += head;
+    bytes -= head;
+
+    if ( isa >= ISA_AVX512 )
+        zero_lines_avx512 ( b, bytes / 64 );
+    else if ( isa >= ISA_AVX2 )
+        zero_lines_avx2 ( b, bytes / 64 );
+    else
+        zero_lines_sse2 ( b, bytes / 64 );
+
+    memset ( b + ( bytes & ~( size_t ) 63 ), 0, bytes & 63 );
+}
+
+/* render target rows [ begin, end ) and the surface rows they map to */
+static inline __attribute__ ( ( always_inline ) ) void
+clean_rows_body ( int isa, void * arg, int begin, int end, int worker )
+{
+    Framebuffer * f = arg;
+    ( void ) worker;
 
-    for ( uint32_t i = 0; i < px_cnt; i = i + 1 )
+    uint32_t px0    = begin * f->w;
+    uint32_t px_cnt = ( end - begin ) * f->w;
+    if ( f->tiled )
     {
-        glm_vec4_zero ( *( c++ ) );
-        *( z++ ) = 0;
+        /* whole rows of tiles, begin is on one (the grain is) */
+        const uint32_t t0 = begin >> FB_TILE_BITS;
+        const uint32_t t1 = ( end + FB_TILE - 1 ) >> FB_TILE_BITS;
+        px0               = t0 * f->tile_pitch;
+        px_cnt            = ( t1 - t0 ) * f->tile_pitch;
     }
 
+    stream_zero ( isa, f->transparent + px0, px_cnt * sizeof ( DBuffer ** ) );
+    stream_zero ( isa, f->opaque_c + px0, px_cnt * sizeof ( vec4 ) );
+    stream_zero ( isa, f->opaque_z + px0, px_cnt * sizeof ( uint64_t ) );
+    stream_zero ( isa, f->ms_idx + px0, px_cnt * sizeof ( uint32_t ) );
+    if ( f->count )
+        stream_zero ( isa, f->heat + px0, px_cnt * sizeof ( uint64_t ) );
+
+    const int s0 = begin * f->surface->h / ( int ) f->h;
+    const int s1 = end * f->surface->h / ( int ) f->h;
+    stream_zero ( isa,
+                  ( uint8_t * ) f->surface->pixels + s0 * f->surface->pitch,
+                  ( s1 - s0 ) * f->surface->pitch );
+
+    /* streaming stores are weakly ordered, the job counter is not */
+    _mm_sfence ();
+}
+
+ISA_KERNEL ( clean_rows,
+             ( void * arg, int begin, int end, int worker ),
+             arg,
+             begin,
+             end,
+             worker );
+
+void
+cleanFramebuffer ( Framebuffer * f )
+{
+    JobCounter done = { 0 };
+    cleanFramebufferAsync ( f, &done );
+    waitJobs ( f->jobs, &done );
+}
+
+void
+cleanFramebufferAsync ( Framebuffer * f, JobCounter * done )
+{
+    if ( f->capture ) captureRect ( f->capture, CAPTURE_CLEAN, NULL );
+
+    f->ms_used  = 0;
+    f->ms_dirty = 0;
+
+    /* the grain is a multiple of FB_TILE, see clean_rows () */
+    parallelForAsync (
+        f->jobs, clean_rows_isa[ isaLevel ], f, f->h, 32, done );
+
+    setClipRect ( f, NULL );
+
     if ( f->pool )
     {
         f->pool->used    = 0;
@@ -82,6 +254,133 @@ cleanFramebuffer ( Framebuffer * f )
     }
 }
 
+void
+setClipRect ( Framebuffer * f, const int * rect )
+{
+    if ( f->capture ) captureRect ( f->capture, CAPTURE_CLIP, rect );
+
+    f->clip[ 0 ] = rect ? rect[ 0 ] : 0;
+    f->clip[ 1 ] = rect ? rect[ 1 ] : 0;
+    f->clip[ 2 ] = rect ? rect[ 2 ] : ( int ) f->w - 1;
+    f->clip[ 3 ] = rect ? rect[ 3 ] : ( int ) f->h - 1;
+}
+
+static inline __attribute__ ( ( always_inline ) ) void
+clean_run ( Framebuffer * f, uint32_t px, uint32_t len )
+{
+    memset ( f->transparent + px, 0, len * sizeof ( DBuffer ** ) );
+    memset ( f->opaque_c + px, 0, len * sizeof ( vec4 ) );
+    memset ( f->opaque_z + px, 0, len * sizeof ( uint64_t ) );
+    memset ( f->ms_idx + px, 0, len * sizeof ( uint32_t ) );
+    if ( f->count ) memset ( f->heat + px, 0, len * sizeof ( uint64_t ) );
+}
+
+void
+cleanFramebufferRect ( Framebuffer * f, const int * rect )
+{
+    if ( f->capture ) captureRect ( f->capture, CAPTURE_CLEAN, rect );
+
+    for ( int y = rect[ 1 ]; y <= rect[ 3 ]; y++ )
+    {
+        const uint32_t row = pxRow ( f, y );
+
+        for ( int x = rect[ 0 ]; x <= rect[ 2 ]; )
+        {
+            uint32_t len = pxRun ( f, x );
+            if ( len > ( uint32_t ) ( rect[ 2 ] + 1 - x ) )
+                len = rect[ 2 ] + 1 - x;
+            clean_run ( f, row + pxCol ( f, x ), len );
+            x += len;
+        }
+    }
+}
+
+/* 19.10.26 ::: the per pixel planes are swept whole every frame. They
+ * are mapped PLANE_ALIGN aligned with transparent huge pages asked for,
+ * so a sweep takes a TLB miss per 2 MB instead of per 4 KB. */
+#define PLANE_ALIGN ( ( size_t ) 2 << 20 )
+
+static inline __attribute__ ( ( always_inline ) ) size_t
+plane_len ( size_t bytes )
+{
+    return ( bytes + PLANE_ALIGN - 1 ) & ~( PLANE_ALIGN - 1 );
+}
+
+static void *
+alloc_plane ( size_t bytes )
+{
+    const size_t len = plane_len ( bytes );
+
+    /* over-map, then trim down to an aligned len */
+    uint8_t * p = mmap ( NULL,
+                         len + PLANE_ALIGN,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1,
+                         0 );
+    if ( p == MAP_FAILED )
+    {
+        printf ( "error: framebuffer plane of size %zu", bytes );
+        exit ( EXIT_FAILURE );
+    }
+
+    uint8_t * a =
+        ( uint8_t * ) ( ( ( uintptr_t ) p + PLANE_ALIGN - 1 ) &
+                        ~( uintptr_t ) ( PLANE_ALIGN - 1 ) );
+    if ( a > p ) munmap ( p, a - p );
+    if ( p + PLANE_ALIGN > a ) munmap ( a + len, p + PLANE_ALIGN - a );
+
+#ifdef MADV_HUGEPAGE
+    madvise ( a, len, MADV_HUGEPAGE );
+#endif
+    return a;
+}
+
+static void
+free_plane ( void * p, size_t bytes )
+{
+    if ( p ) munmap ( p, plane_len ( bytes ) );
+}
+
+/* U_ALLOC () for the planes, zero filled */
+#define P_ALLOC( var, type, len ) \
+    ( ( var ) = ( type * ) alloc_plane ( ( len ) * sizeof ( type ) ) )
+
+/* pixels of the planes for a w x h target, tiled or not */
+static inline __attribute__ ( ( always_inline ) ) uint32_t
+plane_px ( uint32_t h, uint32_t w )
+{
+    return ( ( h + FB_TILE - 1 ) & ~( FB_TILE - 1 ) ) *
+           ( ( w + FB_TILE - 1 ) & ~( FB_TILE - 1 ) );
+}
+
+static void
+alloc_planes ( Framebuffer * f, uint32_t cap )
+{
+    typedef DBuffer * dbuffer_ptr_t;
+    P_ALLOC ( f->transparent, dbuffer_ptr_t, cap );
+    P_ALLOC ( f->opaque_c, vec4, cap );
+    P_ALLOC ( f->opaque_z, uint64_t, cap );
+    P_ALLOC ( f->ms_idx, uint32_t, cap );
+    P_ALLOC ( f->heat, uint64_t, cap );
+    f->cap = cap;
+}
+
+static void
+free_planes ( Framebuffer * f )
+{
+    free_plane ( f->transparent, f->cap * sizeof ( DBuffer * ) );
+    free_plane ( f->opaque_c, f->cap * sizeof ( vec4 ) );
+    free_plane ( f->opaque_z, f->cap * sizeof ( uint64_t ) );
+    free_plane ( f->ms_idx, f->cap * sizeof ( uint32_t ) );
+    free_plane ( f->heat, f->cap * sizeof ( uint64_t ) );
+    f->transparent = NULL;
+    f->opaque_c    = NULL;
+    f->opaque_z    = NULL;
+    f->ms_idx      = NULL;
+    f->heat        = NULL;
+}
+
 Framebuffer *
 createFramebuffer ( uint32_t h, uint32_t w )
 {
@@ -95,16 +394,40 @@ createFramebuffer ( uint32_t h, uint32_t w )
         printf ( "SDL Error: %s\n", SDL_GetError () );
         return NULL;
     }
-    typedef DBuffer * dbuffer_ptr_t;
-    U_ALLOC ( f->transparent, dbuffer_ptr_t, h * w );
-    U_ALLOC ( f->opaque_c, vec4, h * w );
-    U_ALLOC ( f->opaque_z, uint64_t, h * w );
+    alloc_planes ( f, plane_px ( h, w ) );
+    U_ALLOC ( f->up_x, int, w );
+    U_ALLOC ( f->up_fx, float, w );
+
+    /* off by default: small triangles take the stamp path (pipeline.c),
+     * MSAA is opt in; edges touch a small share of the pixels, the block
+     * pool grows on demand */
+    f->msaa = 0;
+    memset ( f->ms_chunks, 0, sizeof ( f->ms_chunks ) );
+    f->ms_cap = 0;
+    for ( uint32_t k = 0; k * MS_CHUNK_LEN < h * w / 16 + 64; k++ )
+    {
+        U_ALLOC ( f->ms_chunks[ k ], MSBlock, MS_CHUNK_LEN );
+        f->ms_cap += MS_CHUNK_LEN;
+    }
+
+    f->jobs = NULL;
+    pthread_mutex_init ( &f->lock, NULL );
+    f->arenas      = NULL;
+    f->capture     = NULL;
+    f->video       = NULL;
+    f->tiled       = 1;
+    f->ordered     = 1;
+    f->count       = 0;
+    f->shader      = NULL;
+    f->shader_user = NULL;
+    memset ( &f->stats, 0, sizeof ( PipeStats ) );
+
+    f->w    = 0;
+    f->h    = 0;
     f->pool = NULL;
+    resizeFramebuffer ( f, h, w );
     cleanFramebuffer ( f );
 
-    U_ALLOC ( f->min_x, int, h );
-    U_ALLOC ( f->max_x, int, h );
-
     f->pool = createDBufferPool ( h * w );
     if ( ! f->pool )
     {
@@ -120,11 +443,11 @@ destroyFramebuffer ( Framebuffer * f )
 {
     if ( f )
     {
-        if ( f->transparent ) free ( f->transparent );
-        if ( f->opaque_z ) free ( f->opaque_z );
-        if ( f->opaque_c ) free ( f->opaque_c );
-        if ( f->min_x ) free ( f->min_x );
-        if ( f->max_x ) free ( f->max_x );
+        free_planes ( f );
+        for ( int k = 0; k < MS_CHUNK_MAX; k++ ) free ( f->ms_chunks[ k ] );
+        if ( f->up_x ) free ( f->up_x );
+        if ( f->up_fx ) free ( f->up_fx );
+        pthread_mutex_destroy ( &f->lock );
 
         destroyDBufferPool ( f->pool );
         if ( f->surface )
@@ -136,6 +459,69 @@ destroyFramebuffer ( Framebuffer * f )
     }
 }
 
+void
+resizeFramebuffer ( Framebuffer * f, uint32_t h, uint32_t w )
+{
+    if ( f->h == h && f->w == w ) return;
+
+    if ( plane_px ( h, w ) > f->cap )
+    {
+        free_planes ( f );
+        alloc_planes ( f, plane_px ( h, w ) );
+    }
+
+    f->h          = h;
+    f->w          = w;
+    f->tile_pitch =
+        ( ( w + FB_TILE - 1 ) >> FB_TILE_BITS ) * FB_TILE * FB_TILE;
+
+    /* pixel centres of the surface mapped back onto the render target */
+    const float step = ( float ) w / ( float ) f->surface->w;
+    for ( int x = 0; x < f->surface->w; x++ )
+    {
+        float sx = ( x + 0.5f ) * step - 0.5f;
+        sx       = sx < 0 ? 0 : sx;
+        int x0   = ( int ) sx;
+        if ( x0 > ( int ) w - 2 ) x0 = w > 1 ? w - 2 : 0;
+
+        f->up_x[ x ]  = x0;
+        f->up_fx[ x ] = fminf ( sx - x0, 1.0f );
+    }
+}
+
+void
+updateRenderScale ( Engine * e, double frame_ms )
+{
+    if ( e->conf.frame_budget_ms <= 0 || frame_ms <= 0 ) return;
+
+    /* Pixel cost goes with scale^2. Dead band keeps it from hunting,
+     * steps up are small so one fast frame does not cause a spike. */
+    const double budget = e->conf.frame_budget_ms;
+    float        scale  = e->res_scale;
+
+    if ( frame_ms > budget * 1.05 )
+        scale *= sqrtf ( budget / frame_ms );
+    else if ( frame_ms < budget * 0.85 )
+        scale = fminf ( scale * sqrtf ( budget / frame_ms ), scale + 0.05f );
+    else
+        return;
+
+    scale = fmaxf ( e->conf.res_scale_min, fminf ( 1.0f, scale ) );
+
+    /* multiples of 4 keep the 4 wide raster lanes on whole quads */
+    uint32_t w = ( ( uint32_t ) ( e->width * scale ) + 3 ) & ~3u;
+    uint32_t h = ( ( uint32_t ) ( e->height * scale ) + 3 ) & ~3u;
+    if ( w > e->width ) w = e->width;
+    if ( h > e->height ) h = e->height;
+
+    e->res_scale = scale;
+    if ( w != e->framebuffer->w || h != e->framebuffer->h )
+    {
+        resizeFramebuffer ( e->framebuffer, h, w );
+        e->full_redraw = 1;
+    }
+}
+
 /* IMPORTANT: (re)create Framebuffer and fb->Surface first */
 int
 createNKUI ( Engine * e )
@@ -158,7 +544,15 @@ createNKUI ( Engine * e )
     e->nk_ui.pl.bloss  = e->framebuffer->surface->format->Bloss;
     e->nk_ui.pl.aloss  = e->framebuffer->surface->format->Aloss;
 
-    e->nk_ui.context = nk_rawfb_init ( e->framebuffer->surface->pixels,
+    U_ALLOC ( e->nk_ui.layer,
+              uint8_t,
+              e->framebuffer->surface->h * e->framebuffer->surface->pitch );
+    memset ( e->nk_ui.layer,
+             0,
+             e->framebuffer->surface->h * e->framebuffer->surface->pitch );
+    e->nk_ui.hash = 0;
+
+    e->nk_ui.context = nk_rawfb_init ( e->nk_ui.layer,
                                        e->nk_ui.tex_scratch,
                                        e->framebuffer->surface->w,
                                        e->framebuffer->surface->h,
@@ -172,9 +566,91 @@ createNKUI ( Engine * e )
     return 0;
 }
 
+uint64_t
+hashNKCommands ( struct nk_context * ctx )
+{
+    /* the commands are at the front, allocated is their size; total
+     * would be the capacity, stale commands of longer frames included */
+    const uint8_t * p   = nk_buffer_memory_const ( &ctx->memory );
+    const nk_size   len = ctx->memory.allocated;
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for ( nk_size i = 0; i < len; i++ )
+    {
+        hash ^= p[ i ];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/* 19.10.26 ::: everything but the window, SDL renderer and UI */
+static int
+init_core ( Engine * e, uint32_t h, uint32_t w )
+{
+    selectIsa ();
+
+    /* first, destroyEngine () may run after any failure below */
+    e->window        = NULL;
+    e->renderer      = NULL;
+    e->texture       = NULL;
+    e->framebuffer   = NULL;
+    e->nk_ui.context = NULL;
+    e->nk_ui.layer   = NULL;
+    memset ( &e->arenas, 0, sizeof ( FrameArenas ) );
+    memset ( &e->occ, 0, sizeof ( OcclusionBuffer ) );
+    if ( createJobSystem ( &e->jobs, SDL_GetCPUCount () ) ) return -1;
+    if ( createFrameArenas ( &e->arenas, e->jobs.worker_cnt ) ) return -1;
+
+    e->height = h;
+    e->width  = w;
+
+    e->framebuffer = createFramebuffer ( h, w );
+    if ( ! e->framebuffer ) return -1;
+    e->framebuffer->jobs   = &e->jobs;
+    e->framebuffer->arenas = &e->arenas;
+
+    /* ========== Game objects init ========== */
+
+    e->camera.default_at[ 2 ] = 1.0f;
+    glm_vec3_zero ( e->camera.position );
+    glm_quat_identity ( e->camera.quaternion );
+    e->camera.speed = 1.0f;
+
+    e->key_states = 0;
+
+    e->conf.fovy_rad      = glm_rad ( 60.0f );
+    e->conf.nearClipPlane = -0.5f;
+    e->conf.faarClipPlane = -200.0f;
+
+    e->conf.mouse_sensitivity = 0.1f;
+    e->conf.lod_tris_per_px   = 0.5f;
+    e->conf.frame_budget_ms   = 1000.0f / 30.0f;
+    e->conf.res_scale_min     = 0.5f;
+    e->conf.point_fill        = 1;
+    e->conf.late_latch        = 1;
+    e->conf.counters          = 0;
+    e->conf.heatmap           = 0;
+    e->conf.rt                = 0;
+    e->conf.rt_budget         = 1u << 19;
+    e->conf.rt_ao_radius      = 0.3f;
+    glm_vec3_copy ( ( vec3 ) { 0.4f, 1.0f, 0.3f }, e->conf.rt_light );
+    glm_vec3_normalize ( e->conf.rt_light );
+    e->res_scale              = 1.0f;
+
+    e->running     = 1;
+    e->godmod      = 0;
+    e->full_redraw = 1;
+    e->nk_ui.shown = 0;
+    e->latch       = NULL;
+    e->input_tick  = 0;
+    return 0;
+}
+
 int
 initEngine ( Engine * e, uint32_t h, uint32_t w )
 {
+    if ( init_core ( e, h, w ) ) return -1;
+
     if ( SDL_Init ( SDL_INIT_VIDEO ) != 0 )
     {
         printf ( "SDL Error: %s\n", SDL_GetError () );
@@ -216,31 +692,17 @@ initEngine ( Engine * e, uint32_t h, uint32_t w )
         return -1;
     }
 
-    e->height = h;
-    e->width  = w;
-
-    e->framebuffer = createFramebuffer ( h, w );
-    if ( ! e->framebuffer ) return -1;
-
     if ( createNKUI ( e ) ) return -1;
+    return 0;
+}
 
-    /* ========== Game objects init ========== */
-
-    e->camera.default_at[ 2 ] = 1.0f;
-    glm_vec3_zero ( e->camera.position );
-    glm_quat_identity ( e->camera.quaternion );
-    e->camera.speed = 1.0f;
-
-    e->key_states = 0;
-
-    e->conf.fovy_rad      = glm_rad ( 60.0f );
-    e->conf.nearClipPlane = -0.5f;
-    e->conf.faarClipPlane = -200.0f;
-
-    e->conf.mouse_sensitivity = 0.1f;
+int
+initHeadlessEngine ( Engine * e, uint32_t h, uint32_t w )
+{
+    if ( init_core ( e, h, w ) ) return -1;
 
-    e->running = 1;
-    e->godmod  = 0;
+    /* frames are asked for, there is no frame rate to hold */
+    e->conf.frame_budget_ms = 0.0f;
     return 0;
 }
 
@@ -343,13 +805,112 @@ loadRObject ( const char * objPath )
     o->center[ 1 ] = ( min_y + max_y ) / 2;
     o->center[ 2 ] = ( min_z + max_z ) / 2;
 
-    U_ALLOC ( o->v, float, ( max_vert_cnt + 1 ) * 3 );
-    o->v_cnt = 0;
+    triangulateMesh ( &o->attrib, &o->lods[ 0 ] );
+    optimizeMesh ( &o->lods[ 0 ] );
+
+    RMesh * m = &o->lods[ 0 ];
+
+    /* every level has at most the triangles of lods[ 0 ] */
+    o->v_cap = m->tri_cnt * 3 + 3;
+    U_ALLOC ( o->v, vec3, o->v_cap );
+    o->v_cnt  = 0;
+    o->stream      = NULL;
+    o->points      = NULL;
+    o->shader      = NULL;
+    o->shader_user = NULL;
+    o->bvh         = NULL;
+    glm_vec3_copy ( m->vertices, o->aabb_min );
+    glm_vec3_copy ( m->vertices, o->aabb_max );
+    for ( uint32_t i = 1; i < m->vert_cnt; i++ )
+    {
+        glm_vec3_minv ( o->aabb_min, m->vertices + i * 3, o->aabb_min );
+        glm_vec3_maxv ( o->aabb_max, m->vertices + i * 3, o->aabb_max );
+    }
+
+    buildLodChain ( o );
+
+    /* collapsed vertices may land outside lods[ 0 ]; occlusion tests need
+     * bounds that hold for whatever level gets drawn */
+    for ( int l = 1; l < o->lod_cnt; l++ )
+    {
+        for ( uint32_t i = 0; i < o->lods[ l ].vert_cnt; i++ )
+        {
+            float * p = o->lods[ l ].vertices + i * 3;
+            glm_vec3_minv ( o->aabb_min, p, o->aabb_min );
+            glm_vec3_maxv ( o->aabb_max, p, o->aabb_max );
+        }
+    }
+    o->occluder = 0;
+    o->culled   = 0;
+
+    glm_vec3_one ( o->scale );
+    glm_quat_identity ( o->quaternion );
+    glm_vec3_zero ( o->position );
+
+    o->rect[ 0 ] = o->rect[ 1 ] = 0;
+    o->rect[ 2 ] = o->rect[ 3 ] = -1;
+    markDrawnRObject ( o );
+
+    return o;
+}
+
+RObject *
+loadStreamedRObject ( const char * path, size_t budget )
+{
+    ClusterStream * s = openClusterStream ( path, budget );
+    if ( ! s ) return NULL;
+
+    RObject * o;
+    U_ALLOC ( o, RObject, 1 );
+    memset ( o, 0, sizeof ( RObject ) );
+    o->stream = s;
+
+    /* v grows with the resident set, see vertexStage () */
+    o->v_cap = 3;
+    U_ALLOC ( o->v, vec3, o->v_cap );
+
+    glm_vec3_copy ( s->header.aabb_min, o->aabb_min );
+    glm_vec3_copy ( s->header.aabb_max, o->aabb_max );
+    glm_vec3_center ( o->aabb_min, o->aabb_max, o->center );
+
+    glm_vec3_one ( o->scale );
+    glm_quat_identity ( o->quaternion );
+    glm_vec3_zero ( o->position );
+
+    o->rect[ 0 ] = o->rect[ 1 ] = 0;
+    o->rect[ 2 ] = o->rect[ 3 ] = -1;
+    markDrawnRObject ( o );
+
+    return o;
+}
+
+RObject *
+loadPointRObject ( const char * path )
+{
+    PointCloud * pc = openPointCloud ( path );
+    if ( ! pc ) return NULL;
+
+    RObject * o;
+    U_ALLOC ( o, RObject, 1 );
+    memset ( o, 0, sizeof ( RObject ) );
+    o->points = pc;
+
+    /* nothing goes through o->v, see vertexStage () */
+    o->v_cap = 3;
+    U_ALLOC ( o->v, vec3, o->v_cap );
+
+    glm_vec3_copy ( pc->header.aabb_min, o->aabb_min );
+    glm_vec3_copy ( pc->header.aabb_max, o->aabb_max );
+    glm_vec3_center ( o->aabb_min, o->aabb_max, o->center );
 
     glm_vec3_one ( o->scale );
     glm_quat_identity ( o->quaternion );
     glm_vec3_zero ( o->position );
 
+    o->rect[ 0 ] = o->rect[ 1 ] = 0;
+    o->rect[ 2 ] = o->rect[ 3 ] = -1;
+    markDrawnRObject ( o );
+
     return o;
 }
 
@@ -361,10 +922,33 @@ destroyRObject ( RObject * o )
         tinyobj_attrib_free ( &o->attrib );
         tinyobj_shapes_free ( o->shapes, o->num_shapes );
         tinyobj_materials_free ( o->materials, o->num_materials );
+        for ( int l = 0; l < o->lod_cnt; l++ ) destroyMesh ( &o->lods[ l ] );
+        closeClusterStream ( o->stream );
+        closePointCloud ( o->points );
+        destroyBVH ( o->bvh );
+        free ( o->v );
         free ( o );
     }
 }
 
+int
+movedRObject ( RObject * o )
+{
+    return memcmp ( o->drawn.quaternion, o->quaternion, sizeof ( versor ) ) ||
+           memcmp ( o->drawn.position, o->position, sizeof ( vec3 ) ) ||
+           memcmp ( o->drawn.center, o->center, sizeof ( vec3 ) ) ||
+           memcmp ( o->drawn.scale, o->scale, sizeof ( vec3 ) );
+}
+
+void
+markDrawnRObject ( RObject * o )
+{
+    glm_vec4_copy ( o->quaternion, o->drawn.quaternion );
+    glm_vec3_copy ( o->position, o->drawn.position );
+    glm_vec3_copy ( o->center, o->drawn.center );
+    glm_vec3_copy ( o->scale, o->drawn.scale );
+}
+
 int
 destroyEngine ( Engine * e )
 {
@@ -372,7 +956,11 @@ destroyEngine ( Engine * e )
     if ( e->renderer ) { SDL_DestroyRenderer ( e->renderer ); }
     if ( e->texture ) { SDL_DestroyTexture ( e->texture ); }
     if ( e->nk_ui.context ) { nk_rawfb_shutdown ( e->nk_ui.context ); }
+    if ( e->nk_ui.layer ) { free ( e->nk_ui.layer ); }
 
+    destroyJobSystem ( &e->jobs );
+    destroyFrameArenas ( &e->arenas );
+    destroyOcclusion ( &e->occ );
     destroyFramebuffer ( e->framebuffer );
     SDL_Quit ();
     return 0;
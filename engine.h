@@ -24,6 +24,10 @@
 //
 #include "nk_raw_fb.h"
 
+#include "arena.h"
+#include "cpu.h"
+#include "job.h"
+
 #define PX_VAL( R, G, B, A ) \
     ( ( uint32_t ) ( A ) << 24 ) | ( ( B ) << 16 ) | ( ( G ) << 8 ) | ( R )
 
@@ -47,6 +51,16 @@ typedef struct
     struct rawfb_pl        pl;
     unsigned char          tex_scratch[ 512 * 512 ];
 
+    /* where the window was drawn last frame, surface coords */
+    struct nk_rect drawn;
+    uint8_t        shown;
+
+    /* 19.10.26 ::: retained layer nk_rawfb draws into (surface sized and
+     * formatted, alpha 0 outside the window), redrawn only when the hash
+     * of the command buffer changes */
+    uint32_t * layer;
+    uint64_t   hash;
+
 } NuklearUI;
 
 typedef struct DBuffer
@@ -67,23 +81,197 @@ typedef struct DBufferPool
     struct DBufferPool * prev;
 } DBufferPool;
 
+/* 19.10.26 ::: 4x MSAA storage, only for pixels an edge passes through;
+ * pixels covered by a single triangle keep using opaque_c / opaque_z */
+#define MSAA_SAMPLES 4
+
+typedef struct MSBlock
+{
+    vec4     color[ MSAA_SAMPLES ];
+    uint64_t z[ MSAA_SAMPLES ];
+    uint32_t px;
+} MSBlock;
+
+/* blocks live in fixed size chunks that never move, so raster jobs can
+ * keep using theirs while another job grows the pool */
+#define MS_CHUNK_BITS 14
+#define MS_CHUNK_LEN  ( 1u << MS_CHUNK_BITS )
+#define MS_CHUNK_MAX  1024
+
+#define MS_BLOCK( f, i )                           \
+    ( ( f )->ms_chunks[ ( i ) >> MS_CHUNK_BITS ] + \
+      ( ( i ) & ( MS_CHUNK_LEN - 1 ) ) )
+
+/* 19.10.26 ::: Pipeline counters of one frame, in triangles unless noted.
+ * Every triangle submitted ends up in exactly one of the rows between
+ * clipped and rasterized. */
+typedef struct PipeStats
+{
+    uint64_t submitted;  /* into the vertex stage */
+    uint64_t clipped;    /* a vertex outside the near or far plane; there
+                          * is no clipper, these are dropped */
+    uint64_t backface;   /* facing away */
+    uint64_t frustum;    /* reaching off the render target */
+    uint64_t degenerate; /* no area once snapped to subpixels */
+    uint64_t scissored;  /* no pixel inside the clip rect */
+    uint64_t rasterized; /* set up and walked */
+
+    /* pixels (not samples), only while Framebuffer.count is set */
+    uint64_t tested;      /* depth tested */
+    uint64_t passed;      /* written */
+    uint64_t transparent; /* DBuffer fragments allocated */
+
+    uint64_t rays; /* cast by traceLighting (), any kind */
+} PipeStats;
+
+/* a Framebuffer.heat entry: tests below, writes above; 32 bits each, the
+ * tests of dense distant meshes overflow 16 */
+#define HEAT_TEST  1ull
+#define HEAT_WRITE ( 1ull << 32 )
+
+struct Capture;
+struct VideoSink;
+
+/* colours a batch of fragments, see FragBatch in pipeline.h */
+struct FragBatch;
+typedef void ( *FragShader ) ( struct FragBatch * b, void * user );
+
 typedef struct Framebuffer
 {
     SDL_Surface * surface;
 
-    // left bound of current triangle scanline
-    int * min_x;
-    // right bound
-    int * max_x;
-
     /* 22.02.25 ::: Converted opaque DBuffer AOS -> SOA */
     DBuffer ** transparent;
     vec4 *     opaque_c;
     uint64_t * opaque_z;
 
     DBufferPool * pool;
+
+    /* 19.10.26 ::: render target is w x h inside planes sized for cap
+     * pixels, laid out as pxIndex () says; merge() upscales it to the
+     * surface when smaller */
+    uint32_t w;
+    uint32_t h;
+    uint32_t cap;
+
+    /* per surface column: left source column and its bilinear weight */
+    int *   up_x;
+    float * up_fx;
+
+    /* rasterizer scissor, { xmin, ymin, xmax, ymax } inclusive */
+    int clip[ 4 ];
+
+    /* per pixel 0, or 1 + block index (see MS_BLOCK); merge() resolves
+     * the blocks into opaque_c when ms_dirty */
+    uint8_t    msaa;
+    uint8_t    ms_dirty;
+    uint32_t * ms_idx;
+    MSBlock *  ms_chunks[ MS_CHUNK_MAX ];
+    uint32_t   ms_cap;
+    uint32_t   ms_used;
+
+    /* 19.10.26 ::: stages split their work over these jobs (NULL runs
+     * them inline); lock guards pool growth from raster jobs */
+    JobSystem *     jobs;
+    pthread_mutex_t lock;
+
+    /* per frame scratch, the engine's; rasterizeBinned () needs it */
+    FrameArenas * arenas;
+
+    /* records what the planes get while set, see capture.h */
+    struct Capture * capture;
+
+    /* merges also fill its YUV frame while set, see video.h */
+    struct VideoSink * video;
+
+    /* 19.10.26 ::: plane layout, see pxIndex (); the planes are sized for
+     * either, switching takes a full redraw */
+    uint8_t  tiled;
+    uint32_t tile_pitch; /* pixels per row of tiles */
+
+    /* rasterizeBinned () sorts big batches front to back */
+    uint8_t ordered;
+
+    /* 19.10.26 ::: triangles are coloured by shader while set, by their
+     * interpolated vertex colours when NULL; see FragBatch */
+    FragShader shader;
+    void *     shader_user;
+
+    /* 19.10.26 ::: stats of the frame being drawn. With count set the
+     * raster also counts every pixel into heat, a plane like opaque_z
+     * (see HEAT_TEST), and renderScene () redraws in full. renderScene ()
+     * sets count each frame from Config.counters and Config.heatmap. */
+    PipeStats  stats;
+    uint8_t    count;
+    uint64_t * heat;
 } Framebuffer;
 
+/* Tiled planes hold FB_TILE x FB_TILE pixel tiles, row major inside and
+ * over the render target, so the pixels of a small footprint share a few
+ * cache lines and one page instead of one line per scanline. */
+#define FB_TILE_BITS 3
+#define FB_TILE      ( 1 << FB_TILE_BITS )
+
+/* plane index of render target pixel x, y is pxRow ( y ) + pxCol ( x ) */
+static inline __attribute__ ( ( always_inline ) ) uint32_t
+pxRow ( const Framebuffer * f, uint32_t y )
+{
+    if ( ! f->tiled ) return y * f->w;
+
+    return ( y >> FB_TILE_BITS ) * f->tile_pitch +
+           ( ( y & ( FB_TILE - 1 ) ) << FB_TILE_BITS );
+}
+
+static inline __attribute__ ( ( always_inline ) ) uint32_t
+pxCol ( const Framebuffer * f, uint32_t x )
+{
+    if ( ! f->tiled ) return x;
+
+    return ( ( x >> FB_TILE_BITS ) << ( 2 * FB_TILE_BITS ) ) +
+           ( x & ( FB_TILE - 1 ) );
+}
+
+static inline __attribute__ ( ( always_inline ) ) uint32_t
+pxIndex ( const Framebuffer * f, uint32_t x, uint32_t y )
+{
+    return pxRow ( f, y ) + pxCol ( f, x );
+}
+
+/* pixels from x on that are contiguous in the planes, to the end of the
+ * row or of x's tile */
+static inline __attribute__ ( ( always_inline ) ) uint32_t
+pxRun ( const Framebuffer * f, uint32_t x )
+{
+    return f->tiled ? FB_TILE - ( x & ( FB_TILE - 1 ) ) : f->w - x;
+}
+
+/* 19.10.26 ::: Masked occlusion culling (Hasselgren et al.) on a coarse
+ * buffer, OCC_SCALE render target pixels per coarse pixel and axis. A tile
+ * is OCC_TILE_W x OCC_TILE_H coarse pixels, one mask bit each. Depth is in
+ * the rasterizer's order (larger wins): every pixel of a tile has occluder
+ * geometry at least as near as z0; the mask bits have it at least as near
+ * as the working layer z1. */
+#define OCC_SCALE  4
+#define OCC_TILE_W 8
+#define OCC_TILE_H 4
+
+typedef struct OcclusionTile
+{
+    float    z0;
+    float    z1;
+    uint32_t mask;
+} OcclusionTile;
+
+typedef struct OcclusionBuffer
+{
+    OcclusionTile * tiles;
+    int             cap; /* tiles allocated */
+    int             w;   /* coarse pixels */
+    int             h;
+    int             tw; /* tiles */
+    int             th;
+} OcclusionBuffer;
+
 /*
         /////|
        ///// |
@@ -113,6 +301,22 @@ typedef struct Camera
     float pitch;
 } Camera;
 
+/* 19.10.26 ::: one camera of renderViews () (main.c) and the framebuffer
+ * (createFramebuffer ()) it draws into; the aspect is the target's */
+typedef struct View
+{
+    Camera        camera;   /* position, yaw and pitch */
+    float         fovy_rad; /* 0 for Engine.conf.fovy_rad */
+    Framebuffer * target;
+
+    /* projected vertices of the object being drawn, kept across frames
+     * like RObject.v; free () v when done with the view */
+    vec3 *   v;
+    int      v_cnt;
+    uint32_t v_cap;
+    double   z_min, z_max;
+} View;
+
 typedef struct Config
 {
     float fovy_rad;
@@ -121,6 +325,34 @@ typedef struct Config
 
     float mouse_sensitivity;
 
+    /* LOD pick: wanted triangles per pixel of projected bounding sphere */
+    float lod_tris_per_px;
+
+    /* dynamic resolution: 0 budget keeps the render scale at 1 */
+    float frame_budget_ms;
+    float res_scale_min;
+
+    /* fill the holes between splatted points, see points.h */
+    uint8_t point_fill;
+
+    /* sample input right before the camera is first used in a frame
+     * instead of at the top of the main loop, see Engine.latch */
+    uint8_t late_latch;
+
+    /* pipeline counters, see Framebuffer.stats */
+    uint8_t counters;
+
+    /* show the overdraw instead of the scene: 0 off, 1 depth tests, 2
+     * depth passes per pixel; counts as well */
+    uint8_t heatmap;
+
+    /* 19.10.26 ::: ray traced shadows and AO over the raster, see
+     * raytrace.h; rt_light is the direction to the light, unit */
+    uint8_t  rt;
+    uint32_t rt_budget; /* rays per frame, at most */
+    float    rt_ao_radius;
+    vec3     rt_light;
+
 } Config;
 
 typedef struct Engine
@@ -138,12 +370,46 @@ typedef struct Engine
     SDL_Texture *  texture;
 
     Config conf;
+    float  res_scale; /* render target / output size, per axis */
 
     uint32_t key_states;
     Camera   camera;
 
+    /* 19.10.26 ::: incremental redraw: camera of the last drawn frame,
+     * anything invalidating the whole frame sets full_redraw */
+    Camera  drawn_camera;
+    uint8_t full_redraw;
+
+    /* 19.10.26 ::: late latch: renderScene () calls latch, when set, just
+     * before the first use of the camera. input_tick is the performance
+     * counter at the last input sample, for input to present latency. */
+    void ( *latch ) ( struct Engine * e );
+    uint64_t input_tick;
+
+    JobSystem   jobs;
+    FrameArenas arenas; /* one per job worker, reset by renderScene () */
+
+    /* filled from occluders at every full redraw */
+    OcclusionBuffer occ;
+
 } Engine;
 
+/* Flat triangle list: idx holds tri_cnt * 3 indices into vertices (xyz) */
+typedef struct RMesh
+{
+    float *    vertices;
+    uint32_t   vert_cnt;
+    uint32_t * idx;
+    uint32_t   tri_cnt;
+} RMesh;
+
+#define LOD_MAX       6
+#define LOD_MIN_TRIS  64
+
+struct ClusterStream;
+struct PointCloud;
+struct BVH;
+
 typedef struct
 {
     POSITION_FIELDS
@@ -154,9 +420,57 @@ typedef struct
     tinyobj_material_t * materials;
     size_t               num_materials;
 
-    /* SOA for vertices after projection applied */
-    vec3 * v;
-    int    v_cnt;
+    /* lods[ 0 ] is the triangulated source, every next level has about
+     * half the triangles of the previous one */
+    RMesh lods[ LOD_MAX ];
+    int   lod_cnt;
+    int   lod; /* picked for the current frame */
+
+    /* out-of-core objects draw the resident clusters of stream instead
+     * of lods[], see stream.h; NULL otherwise */
+    struct ClusterStream * stream;
+
+    /* point clouds splat points instead of drawing triangles, see
+     * points.h; NULL otherwise */
+    struct PointCloud * points;
+
+    /* rasterStage () draws the triangles with it, NULL for the vertex
+     * colours; see Framebuffer.shader */
+    FragShader shader;
+    void *     shader_user;
+
+    /* over lods[ 0 ], built the first time the object is ray traced; see
+     * raytrace.h */
+    struct BVH * bvh;
+
+    /* object space bounds of every level (of the whole cluster file) */
+    vec3 aabb_min;
+    vec3 aabb_max;
+
+    /* transform as of the last drawn frame and the render target rect
+     * { xmin, ymin, xmax, ymax } its triangles covered */
+    struct
+    {
+        POSITION_FIELDS
+    } drawn;
+    int rect[ 4 ];
+
+    /* depth range of v, used to quantize z */
+    double z_min;
+    double z_max;
+
+    /* occluders are drawn into Engine.occ first; every other object is
+     * culled when its bounds are behind it */
+    uint8_t occluder;
+    uint8_t culled;
+
+    /* vertices after projection applied, v_cap entries: lods[ 0 ].tri_cnt
+     * * 3 or whatever the resident clusters needed. Kept across frames, an
+     * incremental redraw rasterizes them again without a vertexStage ();
+     * their quantized depth only lives in the frame arenas. */
+    vec3 *   v;
+    int      v_cnt;
+    uint32_t v_cap;
 
     /* 0 - obj file ptr;
      * 1 - mtl file ptr
@@ -173,6 +487,15 @@ getAuxDBuffer ( Framebuffer * f );
 DBufferPool *
 createDBufferPool ( uint32_t size );
 
+/* expands pixel px to per sample storage (samples left uninitialized) */
+MSBlock *
+getMSBlock ( Framebuffer * f, uint32_t px );
+
+/* 1 if partial clears have piled up enough garbage in the DBuffer or
+ * sample pools that the next frame should be a full one */
+int
+framebufferSpent ( Framebuffer * f );
+
 void
 destroyDBufferPool ( DBufferPool * p );
 
@@ -185,18 +508,60 @@ destroyFramebuffer ( Framebuffer * f );
 void
 cleanFramebuffer ( Framebuffer * f );
 
+/* queues the plane clears on f->jobs against done and returns */
+void
+cleanFramebufferAsync ( Framebuffer * f, JobCounter * done );
+
+/* NULL resets the scissor to the whole render target */
+void
+setClipRect ( Framebuffer * f, const int * rect );
+
+/* clears only the planes under rect, keeps the DBuffer pool */
+void
+cleanFramebufferRect ( Framebuffer * f, const int * rect );
+
+/* planes only grow, shrinking just changes the pitch */
+void
+resizeFramebuffer ( Framebuffer * f, uint32_t h, uint32_t w );
+
+void
+updateRenderScale ( Engine * e, double frame_ms );
+
 int
 initEngine ( Engine * e, uint32_t h, uint32_t w );
 
+/* no window, SDL renderer or UI: the render server (see server.h) */
+int
+initHeadlessEngine ( Engine * e, uint32_t h, uint32_t w );
+
+/* FNV-1a over this frame's Nuklear command buffer, call before render */
+uint64_t
+hashNKCommands ( struct nk_context * ctx );
+
 int
 destroyEngine ( Engine * e );
 
 RObject *
 loadRObject ( const char * objPath );
 
+/* opens a cluster file (see stream.h), budget in bytes */
+RObject *
+loadStreamedRObject ( const char * path, size_t budget );
+
+/* maps a point file (see points.h) */
+RObject *
+loadPointRObject ( const char * path );
+
 void
 destroyRObject ( RObject * o );
 
+/* 1 if the transform differs from the one last drawn */
+int
+movedRObject ( RObject * o );
+
+void
+markDrawnRObject ( RObject * o );
+
 #endif /* CUSTOM_RENDER_ENGINE_H */
 
 /*
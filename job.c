@@ -0,0 +1,370 @@
+#include "job.h"
+#include "engine.h"
+
+#include <emmintrin.h>
+#include <sched.h>
+#include <string.h>
+
+/* spins before a worker with nothing to steal goes to sleep */
+#define JOB_IDLE_SPINS 256
+
+static __thread int job_worker_idx = 0;
+
+static inline __attribute__ ( ( always_inline ) ) void
+spin_lock ( int * l )
+{
+    while ( __atomic_exchange_n ( l, 1, __ATOMIC_ACQUIRE ) )
+    {
+        while ( __atomic_load_n ( l, __ATOMIC_RELAXED ) ) _mm_pause ();
+    }
+}
+
+static inline __attribute__ ( ( always_inline ) ) void
+spin_unlock ( int * l )
+{
+    __atomic_store_n ( l, 0, __ATOMIC_RELEASE );
+}
+
+/* racy peek, only used to skip locking deques that look empty */
+static inline __attribute__ ( ( always_inline ) ) int
+deque_empty ( JobDeque * d )
+{
+    return __atomic_load_n ( &d->bottom, __ATOMIC_RELAXED ) ==
+           __atomic_load_n ( &d->top, __ATOMIC_RELAXED );
+}
+
+static int
+push_job ( JobSystem * js, int w, const Job * j )
+{
+    JobDeque * d = js->deques + w;
+
+    /* counted first, so a worker that sees 0 queued can safely sleep */
+    __atomic_add_fetch ( &js->queued, 1, __ATOMIC_SEQ_CST );
+
+    pthread_mutex_lock ( &d->lock );
+    if ( d->bottom - d->top >= JOB_DEQUE_SIZE )
+    {
+        pthread_mutex_unlock ( &d->lock );
+        __atomic_sub_fetch ( &js->queued, 1, __ATOMIC_SEQ_CST );
+        return 0;
+    }
+    d->jobs[ d->bottom & ( JOB_DEQUE_SIZE - 1 ) ] = *j;
+    __atomic_store_n ( &d->bottom, d->bottom + 1, __ATOMIC_RELAXED );
+    pthread_mutex_unlock ( &d->lock );
+    return 1;
+}
+
+/* own deque bottom first, then the top of everybody else's */
+static int
+take_job ( JobSystem * js, int self, Job * j )
+{
+    JobDeque * d = js->deques + self;
+    if ( ! deque_empty ( d ) )
+    {
+        pthread_mutex_lock ( &d->lock );
+        if ( d->bottom != d->top )
+        {
+            __atomic_store_n ( &d->bottom, d->bottom - 1, __ATOMIC_RELAXED );
+            *j = d->jobs[ d->bottom & ( JOB_DEQUE_SIZE - 1 ) ];
+            pthread_mutex_unlock ( &d->lock );
+            __atomic_sub_fetch ( &js->queued, 1, __ATOMIC_SEQ_CST );
+            return 1;
+        }
+        pthread_mutex_unlock ( &d->lock );
+    }
+
+    for ( int i = 1; i < js->worker_cnt; i++ )
+    {
+        JobDeque * v = js->deques + ( self + i ) % js->worker_cnt;
+        if ( deque_empty ( v ) ) continue;
+
+        pthread_mutex_lock ( &v->lock );
+        if ( v->bottom != v->top )
+        {
+            *j = v->jobs[ v->top & ( JOB_DEQUE_SIZE - 1 ) ];
+            __atomic_store_n ( &v->top, v->top + 1, __ATOMIC_RELAXED );
+            pthread_mutex_unlock ( &v->lock );
+            __atomic_sub_fetch ( &js->queued, 1, __ATOMIC_SEQ_CST );
+            return 1;
+        }
+        pthread_mutex_unlock ( &v->lock );
+    }
+    return 0;
+}
+
+static void
+wake_workers ( JobSystem * js, int all )
+{
+    if ( ! __atomic_load_n ( &js->sleeping, __ATOMIC_SEQ_CST ) ) return;
+
+    pthread_mutex_lock ( &js->sleep_lock );
+    if ( all )
+        pthread_cond_broadcast ( &js->wake );
+    else
+        pthread_cond_signal ( &js->wake );
+    pthread_mutex_unlock ( &js->sleep_lock );
+}
+
+static void
+queue_job ( JobSystem * js, const Job * j );
+
+static void
+finish_job ( JobSystem * js, JobCounter * c )
+{
+    Job ready[ JOB_MAX_WAITING ];
+    int n = 0;
+
+    spin_lock ( &c->lock );
+    if ( __atomic_sub_fetch ( &c->pending, 1, __ATOMIC_ACQ_REL ) == 0 )
+    {
+        n = c->waiting_cnt;
+        memcpy ( ready, c->waiting, n * sizeof ( Job ) );
+        c->waiting_cnt = 0;
+    }
+    spin_unlock ( &c->lock );
+
+    /* c may be gone by now, waitJobs () returned */
+    for ( int i = 0; i < n; i++ ) queue_job ( js, ready + i );
+    if ( n ) wake_workers ( js, n > 1 );
+}
+
+static void
+run_job ( JobSystem * js, Job * j, int worker )
+{
+    j->fn ( j->arg, j->begin, j->end, worker );
+    if ( j->counter ) finish_job ( js, j->counter );
+}
+
+static void
+queue_job ( JobSystem * js, const Job * j )
+{
+    /* deque full: better to run it here than to block */
+    if ( ! push_job ( js, job_worker_idx, j ) )
+    {
+        Job tmp = *j;
+        run_job ( js, &tmp, job_worker_idx );
+    }
+}
+
+static void *
+worker_main ( void * arg )
+{
+    JobDeque *  d    = arg;
+    JobSystem * js   = d->owner;
+    const int   self = ( int ) ( d - js->deques );
+    job_worker_idx   = self;
+
+    for ( ;; )
+    {
+        Job j;
+        int spins = 0;
+        while ( spins < JOB_IDLE_SPINS )
+        {
+            if ( take_job ( js, self, &j ) )
+            {
+                run_job ( js, &j, self );
+                spins = 0;
+            }
+            else
+            {
+                spins++;
+                _mm_pause ();
+            }
+        }
+
+        pthread_mutex_lock ( &js->sleep_lock );
+        __atomic_add_fetch ( &js->sleeping, 1, __ATOMIC_SEQ_CST );
+        while ( js->running &&
+                ! __atomic_load_n ( &js->queued, __ATOMIC_SEQ_CST ) )
+        {
+            pthread_cond_wait ( &js->wake, &js->sleep_lock );
+        }
+        __atomic_sub_fetch ( &js->sleeping, 1, __ATOMIC_SEQ_CST );
+        const int running = js->running;
+        pthread_mutex_unlock ( &js->sleep_lock );
+
+        if ( ! running ) break;
+    }
+    return NULL;
+}
+
+int
+createJobSystem ( JobSystem * js, int worker_cnt )
+{
+    if ( worker_cnt < 1 ) worker_cnt = 1;
+    if ( worker_cnt > JOB_MAX_WORKERS ) worker_cnt = JOB_MAX_WORKERS;
+
+    js->worker_cnt = worker_cnt;
+    js->sleeping   = 0;
+    js->queued     = 0;
+    js->running    = 1;
+
+    U_ALLOC ( js->deques, JobDeque, worker_cnt );
+    U_ALLOC ( js->threads, pthread_t, worker_cnt );
+    pthread_mutex_init ( &js->sleep_lock, NULL );
+    pthread_cond_init ( &js->wake, NULL );
+
+    for ( int i = 0; i < worker_cnt; i++ )
+    {
+        pthread_mutex_init ( &js->deques[ i ].lock, NULL );
+        js->deques[ i ].top    = 0;
+        js->deques[ i ].bottom = 0;
+        js->deques[ i ].owner  = js;
+    }
+
+    for ( int i = 1; i < worker_cnt; i++ )
+    {
+        if ( pthread_create (
+                 &js->threads[ i - 1 ], NULL, worker_main, js->deques + i ) )
+        {
+            /* keep going with the workers we got */
+            printf ( "error: pthread_create of worker %d failed\n", i );
+            js->worker_cnt = i;
+            break;
+        }
+    }
+    return 0;
+}
+
+void
+destroyJobSystem ( JobSystem * js )
+{
+    if ( ! js->deques ) return;
+
+    pthread_mutex_lock ( &js->sleep_lock );
+    js->running = 0;
+    pthread_cond_broadcast ( &js->wake );
+    pthread_mutex_unlock ( &js->sleep_lock );
+
+    for ( int i = 1; i < js->worker_cnt; i++ )
+        pthread_join ( js->threads[ i - 1 ], NULL );
+
+    for ( int i = 0; i < js->worker_cnt; i++ )
+        pthread_mutex_destroy ( &js->deques[ i ].lock );
+    pthread_mutex_destroy ( &js->sleep_lock );
+    pthread_cond_destroy ( &js->wake );
+
+    free ( js->deques );
+    free ( js->threads );
+    js->deques  = NULL;
+    js->threads = NULL;
+}
+
+int
+jobWorker ( void )
+{
+    return job_worker_idx;
+}
+
+void
+submitJob ( JobSystem * js, JobFn fn, void * arg, JobCounter * done )
+{
+    if ( ! js )
+    {
+        fn ( arg, 0, 1, 0 );
+        return;
+    }
+
+    const Job j = { fn, arg, 0, 1, done };
+    if ( done ) __atomic_add_fetch ( &done->pending, 1, __ATOMIC_ACQ_REL );
+
+    queue_job ( js, &j );
+    wake_workers ( js, 0 );
+}
+
+void
+submitJobAfter ( JobSystem * js,
+                 JobCounter * dep,
+                 JobFn        fn,
+                 void *       arg,
+                 JobCounter * done )
+{
+    /* inline, dep is long done */
+    if ( ! js )
+    {
+        fn ( arg, 0, 1, 0 );
+        return;
+    }
+
+    const Job j = { fn, arg, 0, 1, done };
+    if ( done ) __atomic_add_fetch ( &done->pending, 1, __ATOMIC_ACQ_REL );
+
+    spin_lock ( &dep->lock );
+    if ( __atomic_load_n ( &dep->pending, __ATOMIC_ACQUIRE ) > 0 )
+    {
+        if ( dep->waiting_cnt < JOB_MAX_WAITING )
+        {
+            dep->waiting[ dep->waiting_cnt++ ] = j;
+            spin_unlock ( &dep->lock );
+            return;
+        }
+        /* no room to park it: help dep along, then queue as usual */
+        spin_unlock ( &dep->lock );
+        waitJobs ( js, dep );
+    }
+    else
+    {
+        spin_unlock ( &dep->lock );
+    }
+
+    queue_job ( js, &j );
+    wake_workers ( js, 0 );
+}
+
+void
+parallelForAsync ( JobSystem * js,
+                   JobFn        fn,
+                   void *       arg,
+                   int          cnt,
+                   int          grain,
+                   JobCounter * done )
+{
+    if ( cnt <= 0 ) return;
+    if ( ! js )
+    {
+        fn ( arg, 0, cnt, 0 );
+        return;
+    }
+    if ( grain < 1 ) grain = 1;
+
+    const int slices = ( cnt + grain - 1 ) / grain;
+    if ( done )
+        __atomic_add_fetch ( &done->pending, slices, __ATOMIC_ACQ_REL );
+
+    for ( int s = 0; s < slices; s++ )
+    {
+        const int end = ( s + 1 ) * grain;
+        const Job j   = { fn, arg, s * grain, end < cnt ? end : cnt, done };
+        queue_job ( js, &j );
+    }
+    wake_workers ( js, slices > 1 );
+}
+
+void
+waitJobs ( JobSystem * js, JobCounter * c )
+{
+    if ( ! js ) return;
+
+    const int self = job_worker_idx;
+
+    while ( __atomic_load_n ( &c->pending, __ATOMIC_ACQUIRE ) > 0 )
+    {
+        Job j;
+        if ( take_job ( js, self, &j ) )
+            run_job ( js, &j, self );
+        else
+            sched_yield ();
+    }
+
+    /* the last finish_job () may still be releasing waiting jobs */
+    spin_lock ( &c->lock );
+    spin_unlock ( &c->lock );
+}
+
+void
+parallelFor ( JobSystem * js, JobFn fn, void * arg, int cnt, int grain )
+{
+    JobCounter c = { 0 };
+    parallelForAsync ( js, fn, arg, cnt, grain, &c );
+    waitJobs ( js, &c );
+}
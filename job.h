@@ -0,0 +1,106 @@
+#pragma once
+#ifndef CUSTOM_RENDER_JOB_H
+#define CUSTOM_RENDER_JOB_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* 19.10.26 ::: Work stealing job system. Every worker owns a deque: it
+ * pushes and pops at the bottom (LIFO, cache warm), idle workers steal
+ * from the top of the others. The calling (main) thread is worker 0 and
+ * runs jobs too while it waits on a counter. A NULL system runs every
+ * job inline on the caller, counters are then left alone. */
+
+#define JOB_MAX_WORKERS 64
+#define JOB_DEQUE_SIZE  1024 /* power of 2; a full deque runs jobs inline */
+#define JOB_MAX_WAITING 16
+
+/* [ begin, end ) is the slice of a parallelFor (), 0, 1 for single jobs;
+ * worker is 0 .. worker_cnt - 1, handy for per worker scratch */
+typedef void ( *JobFn ) ( void * arg, int begin, int end, int worker );
+
+struct JobCounter;
+
+typedef struct Job
+{
+    JobFn               fn;
+    void *              arg;
+    int                 begin;
+    int                 end;
+    struct JobCounter * counter; /* may be NULL */
+} Job;
+
+/* Unfinished jobs submitted against it. Zero initialize, no cleanup
+ * needed; jobs queued with submitJobAfter () are released by whoever
+ * brings pending down to 0. */
+typedef struct JobCounter
+{
+    int pending;
+    int lock;
+    int waiting_cnt;
+    Job waiting[ JOB_MAX_WAITING ];
+} JobCounter;
+
+typedef struct JobDeque
+{
+    struct JobSystem * owner;
+    pthread_mutex_t    lock;
+    uint32_t           top;    /* thieves take here */
+    uint32_t           bottom; /* owner pushes and pops here */
+    Job                jobs[ JOB_DEQUE_SIZE ];
+} JobDeque;
+
+typedef struct JobSystem
+{
+    int         worker_cnt;
+    pthread_t * threads; /* worker i runs threads[ i - 1 ] */
+    JobDeque *  deques;
+
+    /* workers with nothing to steal sleep here */
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t  wake;
+    int             sleeping;
+    int             queued; /* jobs sitting in any deque */
+    int             running;
+} JobSystem;
+
+/* worker_cnt <= 0 or 1 gives a system that runs everything on the caller */
+int
+createJobSystem ( JobSystem * js, int worker_cnt );
+
+/* joins the workers; queued jobs are dropped */
+void
+destroyJobSystem ( JobSystem * js );
+
+/* index of the calling worker, 0 outside of the job system */
+int
+jobWorker ( void );
+
+void
+submitJob ( JobSystem * js, JobFn fn, void * arg, JobCounter * done );
+
+/* fn is queued once dep drops to 0, right away if it already has */
+void
+submitJobAfter ( JobSystem * js,
+                 JobCounter * dep,
+                 JobFn        fn,
+                 void *       arg,
+                 JobCounter * done );
+
+/* splits [ 0, cnt ) in slices of about grain items, returns at once */
+void
+parallelForAsync ( JobSystem * js,
+                   JobFn        fn,
+                   void *       arg,
+                   int          cnt,
+                   int          grain,
+                   JobCounter * done );
+
+/* runs queued jobs on the calling thread until c drops to 0 */
+void
+waitJobs ( JobSystem * js, JobCounter * c );
+
+void
+parallelFor ( JobSystem * js, JobFn fn, void * arg, int cnt, int grain );
+
+#endif /* CUSTOM_RENDER_JOB_H */
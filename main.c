@@ -6,10 +6,13 @@
 #include <SDL2/SDL_keyboard.h>
 #include <SDL2/SDL_mouse.h>
 #include <cglm/cglm.h>
+#include <float.h>
 #include <limits.h>
 #include <math.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifndef MIN2
 #define MIN2( a, b ) ( ( a ) < ( b ) ? ( a ) : ( b ) )
@@ -18,6 +21,21 @@
 #define MAX2( a, b ) ( ( a ) < ( b ) ? ( b ) : ( a ) )
 #endif
 
+#define IDLE_WAIT_MS 100
+
+/* resident cluster data of a streamed model unless given on the command
+ * line; arrivals show up within IDLE_WAIT_MS when nothing else moves */
+#define STREAM_BUDGET_MB 1024
+
+/* PipeStats rows in the debug window, the last STAT_PX_ROWS per pixel */
+#define STAT_ROWS    11
+#define STAT_PX_ROWS 3
+
+static const char * stat_name[ STAT_ROWS ] = {
+    "submitted:",  "near/far:",  "backface:",   "off target:",
+    "degenerate:", "scissored:", "rasterized:", "rays:",
+    "px tested:",  "px passed:", "fragments:" };
+
 #define NK_INCLUDE_FIXED_TYPES
 #define NK_INCLUDE_STANDARD_IO
 #define NK_INCLUDE_STANDARD_VARARGS
@@ -72,183 +90,1822 @@ $;::::::;+X;:;:::::;$&X&x;;;+&&&&&&&&+;X&$&;;+$;::::::;X$;::::;;&X
 &x;:::::::;X$;;:::::;$&+;;;;;+&&&&&&$;;;xx;;;XX;:::::;x&;;:::::;+$
  */
 #include "engine.h"
+#include "capture.h"
+#include "mesh.h"
+#include "occlusion.h"
 #include "pipeline.h"
+#include "points.h"
+#include "raytrace.h"
+#include "server.h"
+#include "stream.h"
+#include "video.h"
+
+#define CPI 3.14159265358979323846f
+
+int an_x = 20;
+int an_z = 20;
+
+static int
+sdl_button_to_nk ( int button )
+{
+    switch ( button )
+    {
+    default:
+    /* ft */
+    case SDL_BUTTON_LEFT: return NK_BUTTON_LEFT; break;
+    case SDL_BUTTON_MIDDLE: return NK_BUTTON_MIDDLE; break;
+    case SDL_BUTTON_RIGHT: return NK_BUTTON_RIGHT; break;
+    }
+}
+
+/* rects are { xmin, ymin, xmax, ymax } inclusive, empty if xmax < xmin */
+static inline int
+rect_empty ( const int * r )
+{
+    return r[ 2 ] < r[ 0 ] || r[ 3 ] < r[ 1 ];
+}
+
+static inline void
+rect_union ( int * dst, const int * r )
+{
+    if ( rect_empty ( r ) ) return;
+    if ( rect_empty ( dst ) )
+    {
+        memcpy ( dst, r, 4 * sizeof ( int ) );
+        return;
+    }
+    dst[ 0 ] = MIN2 ( dst[ 0 ], r[ 0 ] );
+    dst[ 1 ] = MIN2 ( dst[ 1 ], r[ 1 ] );
+    dst[ 2 ] = MAX2 ( dst[ 2 ], r[ 2 ] );
+    dst[ 3 ] = MAX2 ( dst[ 3 ], r[ 3 ] );
+}
+
+static inline int
+rect_overlap ( const int * a, const int * b )
+{
+    return ! rect_empty ( a ) && ! rect_empty ( b ) && a[ 0 ] <= b[ 2 ] &&
+           b[ 0 ] <= a[ 2 ] && a[ 1 ] <= b[ 3 ] && b[ 1 ] <= a[ 3 ];
+}
+
+/* 19.10.26 ::: vertexStage () runs in slices of the triangle list. Every
+ * slice writes its survivors at its own offset in o->v and they are packed
+ * afterwards, so the order is the same as a serial walk. */
+#define VERTEX_SLICES    256
+#define VERTEX_GRAIN_MIN 1024
+
+typedef struct
+{
+    int    cnt;
+    float  min_x, min_y, max_x, max_y;
+    double min_z, max_z;
+    int    tris, clipped; /* looked at, dropped at the clip planes */
+} VertexSlice;
+
+/* object to render target pixels */
+typedef struct
+{
+    mat4  world_proj, cam_proj, cam_rot, view_proj, viewport_proj;
+    float vp_w, vp_h;
+} Transforms;
+
+typedef struct
+{
+    RObject *  o;
+    Engine *   e;
+    RMesh *    m;
+    vec3 *     out; /* where the survivors of m start in o->v */
+    Transforms tf;
+    int        grain;
+
+    VertexSlice * slice; /* VERTEX_SLICES, off the frame arenas */
+} VertexJob;
+
+/* object space p to world */
+static inline __attribute__ ( ( always_inline ) ) void
+world_vertex ( const Transforms * tf, const vec3 p, vec4 v4 )
+{
+    glm_vec4 ( ( float * ) p, 1.0, v4 );
+    glm_mat4_mulv ( ( vec4 * ) tf->world_proj, v4, v4 );
+    v4[ 3 ] = 1.0f;
+}
+
+/* world v4 to camera space */
+static inline __attribute__ ( ( always_inline ) ) void
+camera_vertex ( const Transforms * tf, vec4 v4 )
+{
+    glm_mat4_mulv ( ( vec4 * ) tf->cam_proj, v4, v4 );
+    glm_mat4_mulv ( ( vec4 * ) tf->cam_rot, v4, v4 );
+}
+
+/* object space p to camera space */
+static inline __attribute__ ( ( always_inline ) ) void
+view_vertex ( const Transforms * tf, const vec3 p, vec4 v4 )
+{
+    world_vertex ( tf, p, v4 );
+    camera_vertex ( tf, v4 );
+}
+
+/* camera space v4 is between the near and far planes */
+static inline __attribute__ ( ( always_inline ) ) int
+in_depth ( const Engine * e, const vec4 v4 )
+{
+    return ! ( v4[ 2 ] < e->conf.faarClipPlane ||
+               v4[ 2 ] > e->conf.nearClipPlane );
+}
+
+/* camera space v4 (clobbered) to render target pixels in out */
+static inline __attribute__ ( ( always_inline ) ) void
+target_vertex ( const Transforms * tf, vec4 v4, vec3 out )
+{
+    v4[ 3 ] = 1.0f;
+    glm_mat4_mulv ( ( vec4 * ) tf->view_proj, v4, v4 );
+    glm_vec4_scale ( v4, 1 / v4[ 3 ], v4 );
+    v4[ 3 ] = 1.0f;
+
+    glm_mat4_mulv ( ( vec4 * ) tf->viewport_proj, v4, v4 );
+    glm_vec4_scale ( v4, 1 / v4[ 3 ], v4 );
+    glm_vec3 ( v4, out );
+}
+
+/* object space p to render target pixels in out, 0 if p is outside the
+ * near and far planes */
+static inline __attribute__ ( ( always_inline ) ) int
+project_vertex ( const Transforms * tf, Engine * e, const vec3 p, vec3 out )
+{
+    vec4 v4;
+
+    view_vertex ( tf, p, v4 );
+    if ( ! in_depth ( e, v4 ) ) return 0;
+    target_vertex ( tf, v4, out );
+    return 1;
+}
+
+static inline __attribute__ ( ( always_inline ) ) void
+slice_open ( VertexSlice * sl, float vp_w, float vp_h )
+{
+    sl->cnt     = 0;
+    sl->min_x   = vp_w;
+    sl->min_y   = vp_h;
+    sl->max_x   = -1.0f;
+    sl->max_y   = -1.0f;
+    sl->min_z   = DBL_MAX;
+    sl->max_z   = -DBL_MAX;
+    sl->tris    = 0;
+    sl->clipped = 0;
+}
+
+/* appends the projected triangle v to out if it faces the camera */
+static inline __attribute__ ( ( always_inline ) ) void
+slice_keep ( VertexSlice * sl, vec3 * out, vec3 v[ 3 ] )
+{
+    /* ========= Backface culling ========= */
+    vec3 normal, v1, v2, view_dir = { 0.0f, 0.0f, 1.0f };
+
+    glm_vec3_sub ( v[ 1 ], v[ 0 ], v1 );
+    glm_vec3_sub ( v[ 2 ], v[ 0 ], v2 );
+    glm_vec3_cross ( v1, v2, normal );
+    float dot_product = glm_vec3_dot ( normal, view_dir );
+
+    if ( dot_product > 0 )
+    {
+        for ( int k = 0; k < 3; k++ )
+        {
+            glm_vec3_copy ( v[ k ], out[ sl->cnt++ ] );
+
+            if ( v[ k ][ 2 ] < sl->min_z ) sl->min_z = v[ k ][ 2 ];
+            if ( v[ k ][ 2 ] > sl->max_z ) sl->max_z = v[ k ][ 2 ];
+
+            sl->min_x = fminf ( sl->min_x, v[ k ][ 0 ] );
+            sl->min_y = fminf ( sl->min_y, v[ k ][ 1 ] );
+            sl->max_x = fmaxf ( sl->max_x, v[ k ][ 0 ] );
+            sl->max_y = fmaxf ( sl->max_y, v[ k ][ 1 ] );
+        }
+    }
+}
+
+static inline __attribute__ ( ( always_inline ) ) void
+vertex_slice_body ( int isa, void * arg, int begin, int end, int worker )
+{
+    VertexJob *   j   = arg;
+    Engine *      e   = j->e;
+    RMesh *       m   = j->m;
+    VertexSlice * sl  = j->slice + begin / j->grain;
+    vec3 *        out = j->out + begin * 3;
+    ( void ) worker;
+
+    slice_open ( sl, j->tf.vp_w, j->tf.vp_h );
+    sl->tris = end - begin;
+
+    vec3 v[ 3 ];
+    // TODO : Handle SHAPES
+
+    for ( int t = begin; t < end; t++ )
+    {
+        for ( int k = 0; k < 3; k++ )
+        {
+            glm_vec3_copy ( m->vertices + m->idx[ t * 3 + k ] * 3, v[ k ] );
+        }
+
+        /* ========= Transforms & rotations ========= */
+        for ( int k = 0; k < 3; k++ )
+        {
+            if ( ! project_vertex ( &j->tf, e, v[ k ], v[ k ] ) )
+            {
+                sl->clipped++;
+                goto next_face;
+            }
+        }
+
+        slice_keep ( sl, out, v );
+    next_face:;
+    }
+    ( void ) isa;
+}
+
+/* same arithmetic on every level, only the encoding differs */
+ISA_KERNEL ( vertex_slice,
+             ( void * arg, int begin, int end, int worker ),
+             arg,
+             begin,
+             end,
+             worker );
+
+/* object space to world */
+static void
+setup_world ( RObject * o, Transforms * tf )
+{
+    vec3 Ncenter;
+    glm_vec3_negate_to ( o->center, Ncenter );
+    glm_translate_make ( tf->world_proj, o->position );
+    glm_quat_rotate ( tf->world_proj, o->quaternion, tf->world_proj );
+    glm_scale ( tf->world_proj, o->scale );
+    glm_translate ( tf->world_proj, Ncenter );
+}
+
+/* world to the render target of f, seen from cam */
+static void
+setup_camera ( const Camera *      cam,
+               float               fovy,
+               float               aspect,
+               const Framebuffer * f,
+               Engine *            e,
+               Transforms *        tf )
+{
+    /* Camera Space projection: I - EYE */
+
+    vec3 Neye;
+
+    glm_vec3_negate_to ( ( float * ) cam->position, Neye );
+    glm_translate_make ( tf->cam_proj, Neye );
+    glm_euler (
+        ( vec3 ) { glm_rad ( cam->pitch ), glm_rad ( cam->yaw ), 0 },
+        tf->cam_rot );
+
+    /* Perspective projection */
+    float nearVal = e->conf.nearClipPlane;
+    float farVal  = e->conf.faarClipPlane;
+    glm_perspective ( fovy, aspect, nearVal, farVal, tf->view_proj );
+
+    /* Viewport */
+
+    /* render target, not the window: see updateRenderScale () */
+    const float vp_w = f->w, vp_h = f->h;
+    tf->vp_w         = vp_w;
+    tf->vp_h         = vp_h;
+
+    glm_translate_make (
+        tf->viewport_proj, ( vec3 ) { vp_w / 2.0f, vp_h / 2.0f, 0.0f } );
+    glm_scale ( tf->viewport_proj,
+                ( vec3 ) { vp_w / 2.0f, vp_h / 2.0f, 1.0f } );
+}
+
+static void
+setupTransforms ( RObject * o, Engine * e, Transforms * tf )
+{
+    setup_world ( o, tf );
+    setup_camera ( &e->camera,
+                   e->conf.fovy_rad,
+                   ( float ) e->width / ( float ) e->height,
+                   e->framebuffer,
+                   e,
+                   tf );
+}
+
+/* moves what slice i left at out + i * grain * 3 to the front of out, in
+ * slice order, and folds the slice bounds into acc; returns the vertices
+ * kept */
+static int
+pack_slices ( const VertexSlice * slice,
+              int                 slices,
+              int                 grain,
+              vec3 *              out,
+              VertexSlice *       acc )
+{
+    int cnt = 0;
+    for ( int i = 0; i < slices; i++ )
+    {
+        const VertexSlice * sl   = slice + i;
+        const int           from = i * grain * 3;
+        acc->tris += sl->tris;
+        acc->clipped += sl->clipped;
+        if ( ! sl->cnt ) continue;
+
+        if ( from != cnt )
+            memmove ( out + cnt, out + from, sl->cnt * sizeof ( vec3 ) );
+        cnt += sl->cnt;
+
+        if ( sl->min_z < acc->min_z ) acc->min_z = sl->min_z;
+        if ( sl->max_z > acc->max_z ) acc->max_z = sl->max_z;
+
+        acc->min_x = fminf ( acc->min_x, sl->min_x );
+        acc->min_y = fminf ( acc->min_y, sl->min_y );
+        acc->max_x = fmaxf ( acc->max_x, sl->max_x );
+        acc->max_y = fmaxf ( acc->max_y, sl->max_y );
+    }
+    acc->cnt += cnt;
+    return cnt;
+}
+
+/* the vertex stage rows of PipeStats, from the folded slices */
+static void
+add_vertex_stats ( PipeStats * s, const VertexSlice * acc )
+{
+    s->submitted += acc->tris;
+    s->clipped += acc->clipped;
+    s->backface += acc->tris - acc->clipped - acc->cnt / 3;
+}
+
+/* appends the survivors of m to o->v and folds their bounds into acc */
+static void
+vertex_mesh ( VertexJob * j, RMesh * m, VertexSlice * acc )
+{
+    RObject * o = j->o;
+
+    /* only streamed objects outgrow what loadRObject () allocated */
+    const uint32_t need = o->v_cnt + m->tri_cnt * 3;
+    if ( need > o->v_cap )
+    {
+        o->v_cap = need + need / 2;
+        o->v     = realloc ( o->v, o->v_cap * sizeof ( vec3 ) );
+        if ( ! o->v )
+        {
+            printf ( "error: vertex buffer of %u entries\n", o->v_cap );
+            exit ( EXIT_FAILURE );
+        }
+    }
+
+    const int tri_cnt = m->tri_cnt;
+    j->m              = m;
+    j->out            = o->v + o->v_cnt;
+    j->grain          = MAX2 ( VERTEX_GRAIN_MIN,
+                      ( tri_cnt + VERTEX_SLICES - 1 ) / VERTEX_SLICES );
+    const int slices = ( tri_cnt + j->grain - 1 ) / j->grain;
+
+    /* without a job system the whole range is a single call, which only
+     * fills slice 0 */
+    memset ( j->slice, 0, slices * sizeof ( VertexSlice ) );
+    parallelFor ( j->e->framebuffer->jobs,
+                  vertex_slice_isa[ isaLevel ],
+                  j,
+                  tri_cnt,
+                  j->grain );
+
+    o->v_cnt += pack_slices ( j->slice, slices, j->grain, j->out, acc );
+}
+
+/* Projects the object space box min, max. 0 when it is all off the render
+ * target or outside the clip planes, 2 when it crosses the near or far
+ * plane (no usable rect), 1 with its pixel rect, nearest depth and, when
+ * z_far is not NULL, farthest depth. */
+static int
+project_bounds ( const Transforms * tf,
+                 Engine *           e,
+                 const vec3         min,
+                 const vec3         max,
+                 int *              rect,
+                 float *            z_near,
+                 float *            z_far )
+{
+    vec4 c[ 8 ];
+    int  near_cnt = 0, far_cnt = 0;
+    for ( int i = 0; i < 8; i++ )
+    {
+        const vec3 p = { i & 1 ? max[ 0 ] : min[ 0 ],
+                         i & 2 ? max[ 1 ] : min[ 1 ],
+                         i & 4 ? max[ 2 ] : min[ 2 ] };
+        view_vertex ( tf, p, c[ i ] );
+        near_cnt += c[ i ][ 2 ] > e->conf.nearClipPlane;
+        far_cnt += c[ i ][ 2 ] < e->conf.faarClipPlane;
+    }
+    if ( near_cnt == 8 || far_cnt == 8 ) return 0;
+    if ( near_cnt || far_cnt ) return 2;
+
+    float min_x = FLT_MAX, min_y = FLT_MAX;
+    float max_x = -FLT_MAX, max_y = -FLT_MAX;
+    float z_min = FLT_MAX;
+    *z_near     = -FLT_MAX;
+    for ( int i = 0; i < 8; i++ )
+    {
+        vec3 q;
+        target_vertex ( tf, c[ i ], q );
+        min_x   = fminf ( min_x, q[ 0 ] );
+        min_y   = fminf ( min_y, q[ 1 ] );
+        max_x   = fmaxf ( max_x, q[ 0 ] );
+        max_y   = fmaxf ( max_y, q[ 1 ] );
+        z_min   = fminf ( z_min, q[ 2 ] );
+        *z_near = fmaxf ( *z_near, q[ 2 ] );
+    }
+    if ( z_far ) *z_far = z_min;
+
+    const int w = tf->vp_w, h = tf->vp_h;
+    rect[ 0 ]   = MAX2 ( ( int ) floorf ( min_x ), 0 );
+    rect[ 1 ]   = MAX2 ( ( int ) floorf ( min_y ), 0 );
+    rect[ 2 ]   = MIN2 ( ( int ) ceilf ( max_x ), w - 1 );
+    rect[ 3 ]   = MIN2 ( ( int ) ceilf ( max_y ), h - 1 );
+    return ! rect_empty ( rect );
+}
+
+/* 19.10.26 ::: Point clouds (see points.h) have no triangles: the vertex
+ * stage only bounds them, the raster stage splats every point. */
+
+/* pixel rect and NDC depth range { far, near } the bounds of o cover
+ * through tf; the whole target and everything between the planes when
+ * they cross one. 0 when they are off the target. */
+static int
+point_extent ( RObject *          o,
+               Engine *           e,
+               const Transforms * tf,
+               int *              rect,
+               double *           z )
+{
+    float     z_near, z_far;
+    const int on = project_bounds (
+        tf, e, o->aabb_min, o->aabb_max, rect, &z_near, &z_far );
+    z[ 0 ] = z_far;
+    z[ 1 ] = z_near;
+    if ( on != 2 ) return on;
+
+    /* NDC z = z_a + z_b / w, w = -z of camera space */
+    const float z_a     = tf->view_proj[ 2 ][ 2 ] / tf->view_proj[ 2 ][ 3 ];
+    const float z_b     = tf->view_proj[ 3 ][ 2 ];
+    const float at_near = z_a + z_b / -e->conf.nearClipPlane;
+    const float at_far  = z_a + z_b / -e->conf.faarClipPlane;
+
+    z[ 0 ]    = fminf ( at_near, at_far );
+    z[ 1 ]    = fmaxf ( at_near, at_far );
+    rect[ 0 ] = rect[ 1 ] = 0;
+    rect[ 2 ] = ( int ) tf->vp_w - 1;
+    rect[ 3 ] = ( int ) tf->vp_h - 1;
+    return 1;
+}
+
+/* quantize_z () of depth range z as z * scale + bias */
+static inline void
+z_quantizer ( const double * z, double * scale, double * bias )
+{
+    *scale = ( ( double ) UINT64_MAX - 1 ) / ( z[ 1 ] * 1.001 );
+    *bias  = 1.0 - z[ 0 ] * *scale;
+}
+
+/* splats o into f inside rect, depth quantized over the range z as
+ * quantize_z () does it for triangles */
+static void
+splat_object ( RObject *          o,
+               Engine *           e,
+               Framebuffer *      f,
+               const Transforms * tf,
+               const int *        rect,
+               const double *     z )
+{
+    SplatParams sp;
+
+    /* the chain of view_vertex () and target_vertex () in one */
+    glm_mat4_mul (
+        ( vec4 * ) tf->viewport_proj, ( vec4 * ) tf->view_proj, sp.to_px );
+    glm_mat4_mul ( sp.to_px, ( vec4 * ) tf->cam_rot, sp.to_px );
+    glm_mat4_mul ( sp.to_px, ( vec4 * ) tf->cam_proj, sp.to_px );
+    glm_mat4_mul ( sp.to_px, ( vec4 * ) tf->world_proj, sp.to_px );
+
+    sp.w_min    = -e->conf.nearClipPlane;
+    sp.w_max    = -e->conf.faarClipPlane;
+    sp.z_a      = tf->view_proj[ 2 ][ 2 ] / tf->view_proj[ 2 ][ 3 ];
+    sp.z_b      = tf->view_proj[ 3 ][ 2 ];
+    z_quantizer ( z, &sp.zq_scale, &sp.zq_bias );
+
+    sp.rect[ 0 ] = MAX2 ( rect[ 0 ], f->clip[ 0 ] );
+    sp.rect[ 1 ] = MAX2 ( rect[ 1 ], f->clip[ 1 ] );
+    sp.rect[ 2 ] = MIN2 ( rect[ 2 ], f->clip[ 2 ] );
+    sp.rect[ 3 ] = MIN2 ( rect[ 3 ], f->clip[ 3 ] );
+    sp.fill      = e->conf.point_fill;
+
+    splatPoints ( f, o->points, &sp );
+}
+
+/* transforms, culls and projects the picked LOD (or the resident clusters
+ * of a streamed object) into o->v, updates o->rect and the depth range */
+void
+vertexStage ( RObject * o, Engine * e )
+{
+    if ( o->points )
+    {
+        Transforms tf;
+        double     z[ 2 ];
+        setupTransforms ( o, e, &tf );
+
+        o->v_cnt = 0;
+        if ( ! point_extent ( o, e, &tf, o->rect, z ) )
+        {
+            o->rect[ 0 ] = o->rect[ 1 ] = 0;
+            o->rect[ 2 ] = o->rect[ 3 ] = -1;
+        }
+        o->z_min = z[ 0 ];
+        o->z_max = z[ 1 ];
+        return;
+    }
+
+    beginFrameStage ( &e->arenas, FRAME_STAGE_VERTEX );
+
+    VertexJob j;
+    j.o = o;
+    j.e = e;
+    F_ALLOC ( &e->arenas, j.slice, VertexSlice, VERTEX_SLICES );
+    setupTransforms ( o, e, &j.tf );
+
+    const float vp_w = j.tf.vp_w, vp_h = j.tf.vp_h;
+    VertexSlice acc  = {
+        0, vp_w, vp_h, -1.0f, -1.0f, DBL_MAX, -DBL_MAX, 0, 0 };
+
+    o->v_cnt = 0;
+    if ( o->stream )
+    {
+        ClusterStream * s = o->stream;
+        for ( uint32_t i = 0; i < s->draw_cnt; i++ )
+            vertex_mesh ( &j, &s->clusters[ s->draw[ i ] ].mesh, &acc );
+    }
+    else
+    {
+        o->lod = selectLod ( o, e );
+        vertex_mesh ( &j, &o->lods[ o->lod ], &acc );
+    }
+
+    /* the depth range is seeded from o->v[ 0 ][ 0 ], as it always was;
+     * without vertices nothing is drawn and o->v holds nothing yet (a
+     * streamed object before its first clusters) */
+    o->z_min = o->z_max = 0.0;
+    if ( o->v_cnt )
+    {
+        o->z_min = fmin ( o->v[ 0 ][ 0 ], acc.min_z );
+        o->z_max = fmax ( o->v[ 0 ][ 0 ], acc.max_z );
+    }
+
+    /* conservative pixel bounds, clamped to the render target */
+    o->rect[ 0 ] = MAX2 ( ( int ) floorf ( acc.min_x ), 0 );
+    o->rect[ 1 ] = MAX2 ( ( int ) floorf ( acc.min_y ), 0 );
+    o->rect[ 2 ] = MIN2 ( ( int ) ceilf ( acc.max_x ), ( int ) vp_w - 1 );
+    o->rect[ 3 ] = MIN2 ( ( int ) ceilf ( acc.max_y ), ( int ) vp_h - 1 );
+
+    add_vertex_stats ( &e->framebuffer->stats, &acc );
+    endFrameStage ( &e->arenas );
+}
+
+typedef struct
+{
+    vec3 *     v;
+    double     min_z, max_z;
+    uint64_t * zi;
+} QuantizeJob;
+
+static void
+quantize_z ( void * arg, int begin, int end, int worker )
+{
+    QuantizeJob * j     = arg;
+    const double  min_z = j->min_z;
+    const double  max_z = j->max_z;
+    ( void ) worker;
+
+    for ( int i = begin; i < end; i++ )
+    {
+        j->zi[ i ] = ( ( ( double ) j->v[ i ][ 2 ] - min_z ) /
+                       ( max_z * 1.001 ) ) *
+                         ( ( double ) UINT64_MAX - 1 ) +
+                     1;
+    }
+}
+
+static vec4 raster_colors[ 3 ] = { { 1.0f, 1.0f, 0.0f, 0.0f },
+                                   { 1.0f, 0.0f, 0.5f, 0.5f },
+                                   { 1.0f, 0.0f, 1.0f, 0.0f } };
+
+/* 19.10.26 ::: "wireframe" in the debug window, a FragShader: the vertex
+ * colours with the edges of every triangle over them in white. A
+ * barycentric times the height over its opposite edge is the distance
+ * to that edge in pixels. */
+#define WIRE_PX 1.0f
+
+static void
+wireShader ( FragBatch * b, void * user )
+{
+    vec3 * v = b->v;
+    ( void ) user;
+
+    shadeVertexColors ( b, NULL );
+
+    const float area2 =
+        fabsf ( ( v[ 1 ][ 0 ] - v[ 0 ][ 0 ] ) * ( v[ 2 ][ 1 ] - v[ 0 ][ 1 ] ) -
+                ( v[ 2 ][ 0 ] - v[ 0 ][ 0 ] ) * ( v[ 1 ][ 1 ] - v[ 0 ][ 1 ] ) );
+
+    __m128 h[ 3 ];
+    for ( int i = 0; i < 3; i++ )
+    {
+        const float * p   = v[ ( i + 1 ) % 3 ];
+        const float * q   = v[ ( i + 2 ) % 3 ];
+        const float   len = hypotf ( p[ 0 ] - q[ 0 ], p[ 1 ] - q[ 1 ] );
+        h[ i ]            = _mm_set1_ps ( len > 0.0f ? area2 / len : 0.0f );
+    }
+
+    const __m128 white = _mm_set1_ps ( 1.0f );
+    for ( int l = 0; l < FRAG_BATCH; l += 4 )
+    {
+        __m128 d = _mm_mul_ps ( _mm_load_ps ( b->b[ 0 ] + l ), h[ 0 ] );
+        for ( int i = 1; i < 3; i++ )
+            d = _mm_min_ps (
+                d, _mm_mul_ps ( _mm_load_ps ( b->b[ i ] + l ), h[ i ] ) );
+
+        /* colour channels only, alpha stays */
+        const __m128 on = _mm_cmplt_ps ( d, _mm_set1_ps ( WIRE_PX ) );
+        for ( int ch = 1; ch < 4; ch++ )
+        {
+            const __m128 c = _mm_load_ps ( b->out[ ch ] + l );
+            _mm_store_ps ( b->out[ ch ] + l,
+                           _mm_or_ps ( _mm_and_ps ( on, white ),
+                                       _mm_andnot_ps ( on, c ) ) );
+        }
+    }
+}
+
+/* quantizes depth and rasterizes o->v as produced by vertexStage () */
+void
+rasterStage ( RObject * o, Engine * e )
+{
+    beginFrameStage ( &e->arenas, FRAME_STAGE_RASTER );
+
+    if ( o->points )
+    {
+        Transforms   tf;
+        const double z[ 2 ] = { o->z_min, o->z_max };
+        setupTransforms ( o, e, &tf );
+        splat_object ( o, e, e->framebuffer, &tf, o->rect, z );
+        endFrameStage ( &e->arenas );
+        return;
+    }
+
+    QuantizeJob j = { o->v, o->z_min, o->z_max, NULL };
+    F_ALLOC ( &e->arenas, j.zi, uint64_t, o->v_cnt );
+
+    parallelFor ( e->framebuffer->jobs, quantize_z, &j, o->v_cnt, 16384 );
+
+    e->framebuffer->shader      = o->shader;
+    e->framebuffer->shader_user = o->shader_user;
+    rasterizeBinned (
+        e->framebuffer, o->v, j.zi, raster_colors, o->v_cnt / 3 );
+    e->framebuffer->shader = NULL;
+
+    endFrameStage ( &e->arenas );
+}
+
+/* 1 if the bounds of o are off the render target or behind Engine.occ;
+ * o is then left with nothing to draw */
+static int
+cullRObject ( RObject * o, Engine * e )
+{
+    Transforms tf;
+    setupTransforms ( o, e, &tf );
+
+    int       rect[ 4 ];
+    float     z_near;
+    const int on = project_bounds (
+        &tf, e, o->aabb_min, o->aabb_max, rect, &z_near, NULL );
+
+    o->culled =
+        ! on || ( on == 1 && testOcclusion ( &e->occ, rect, z_near ) );
+    if ( o->culled )
+    {
+        o->v_cnt     = 0;
+        o->rect[ 0 ] = o->rect[ 1 ] = 0;
+        o->rect[ 2 ] = o->rect[ 3 ] = -1;
+    }
+    return o->culled;
+}
+
+/* distance from the camera of tf to the middle of c, -1 when c is off
+ * the render target */
+static float
+cluster_want ( const Transforms * tf, Engine * e, const Cluster * c )
+{
+    int   rect[ 4 ];
+    float z_near;
+    vec3  mid;
+    vec4  v4;
+
+    if ( ! project_bounds ( tf,
+                            e,
+                            c->entry.aabb_min,
+                            c->entry.aabb_max,
+                            rect,
+                            &z_near,
+                            NULL ) )
+    {
+        return -1.0f;
+    }
+    glm_vec3_center ( ( float * ) c->entry.aabb_min,
+                      ( float * ) c->entry.aabb_max,
+                      mid );
+    view_vertex ( tf, mid, v4 );
+    return glm_vec3_norm ( v4 );
+}
+
+/* 19.10.26 ::: Streamed objects ask for their on screen clusters, nearest
+ * first, before anything else looks at them. Returns 1 when the set that
+ * gets drawn changed, i.e. clusters came in or went away. */
+static int
+streamStage ( RObject * o, Engine * e )
+{
+    ClusterStream * s = o->stream;
+    Transforms      tf;
+    setupTransforms ( o, e, &tf );
+
+    for ( uint32_t i = 0; i < s->cluster_cnt; i++ )
+        s->clusters[ i ].want = cluster_want ( &tf, e, s->clusters + i );
+
+    updateClusterStream ( s );
+    return s->changed;
+}
+
+/* has to be drawn again: moved, or its resident clusters changed */
+static inline int
+redrawRObject ( RObject * o )
+{
+    return movedRObject ( o ) || ( o->stream && o->stream->changed );
+}
+
+void
+defaultShader ( RObject * o, Engine * e )
+{
+    if ( o->stream ) streamStage ( o, e );
+    if ( ! o->occluder && cullRObject ( o, e ) ) return;
+
+    vertexStage ( o, e );
+    rasterStage ( o, e );
+}
+
+/* 19.10.26 ::: Occluders go through vertexStage () first and are drawn
+ * into Engine.occ; every other object is only transformed when its bounds
+ * survive the test against it. */
+static void
+occlusionStage ( Engine * e, RObject ** scene, int scene_cnt )
+{
+    clearOcclusion ( &e->occ, e->framebuffer->w, e->framebuffer->h );
+
+    for ( int i = 0; i < scene_cnt; i++ )
+    {
+        if ( ! scene[ i ]->occluder ) continue;
+        vertexStage ( scene[ i ], e );
+        drawOccluder ( &e->occ, scene[ i ]->v, scene[ i ]->v_cnt / 3 );
+    }
+
+    for ( int i = 0; i < scene_cnt; i++ )
+    {
+        if ( scene[ i ]->occluder ) continue;
+        if ( ! cullRObject ( scene[ i ], e ) ) vertexStage ( scene[ i ], e );
+    }
+}
+
+/* UI window bounds clamped to the surface */
+static SDL_Rect
+uiSurfaceRect ( Engine * e, struct nk_rect b )
+{
+    SDL_Surface * sf = e->framebuffer->surface;
+
+    int x0 = MAX2 ( ( int ) floorf ( b.x ), 0 );
+    int y0 = MAX2 ( ( int ) floorf ( b.y ), 0 );
+    int x1 = MIN2 ( ( int ) ceilf ( b.x + b.w ), sf->w );
+    int y1 = MIN2 ( ( int ) ceilf ( b.y + b.h ), sf->h );
+
+    return ( SDL_Rect ) { x0, y0, MAX2 ( x1 - x0, 0 ), MAX2 ( y1 - y0, 0 ) };
+}
+
+/* re-merges the scene over a surface area the UI window covered */
+static void
+restoreUnderUI ( Engine * e, SDL_Rect ui, SDL_Rect * changed )
+{
+    Framebuffer * f = e->framebuffer;
+    if ( ui.w <= 0 || ui.h <= 0 ) return;
+
+    int under[ 4 ] = { ui.x * ( int ) f->w / f->surface->w,
+                       ui.y * ( int ) f->h / f->surface->h,
+                       ( ui.x + ui.w ) * ( int ) f->w / f->surface->w,
+                       ( ui.y + ui.h ) * ( int ) f->h / f->surface->h };
+    under[ 2 ] = MIN2 ( under[ 2 ], ( int ) f->w - 1 );
+    under[ 3 ] = MIN2 ( under[ 3 ], ( int ) f->h - 1 );
+
+    SDL_Rect r;
+    mergeRect ( f, under, &r );
+    SDL_UnionRect ( changed, &r, changed );
+}
+
+/* 19.10.26 ::: The UI lives in its own layer. It is re-rendered only when
+ * the command buffer hash changes, and composited back over a freshly
+ * merged scene only when either the UI or the scene under it changed. */
+static void
+composeUI ( Engine *       e,
+            struct nk_rect prev,
+            int            was_shown,
+            int            full,
+            SDL_Rect *     changed )
+{
+    NuklearUI *   ui    = &e->nk_ui;
+    SDL_Surface * sf    = e->framebuffer->surface;
+    SDL_Rect      old_r = { 0, 0, 0, 0 }, new_r = { 0, 0, 0, 0 };
+
+    if ( was_shown ) old_r = uiSurfaceRect ( e, prev );
+    if ( ui->shown ) new_r = uiSurfaceRect ( e, ui->drawn );
+
+    const uint64_t hash =
+        ui->shown ? hashNKCommands ( &ui->context->ctx ) : 0;
+    const int redraw_layer =
+        ui->shown && ( hash != ui->hash || ! was_shown );
+    ui->hash = hash;
+
+    if ( redraw_layer )
+    {
+        const SDL_Rect * clr[ 2 ] = { &old_r, &new_r };
+        for ( int i = 0; i < 2; i++ )
+        {
+            for ( int y = clr[ i ]->y; y < clr[ i ]->y + clr[ i ]->h; y++ )
+            {
+                memset ( ui->layer + y * sf->w + clr[ i ]->x,
+                         0,
+                         clr[ i ]->w * sizeof ( uint32_t ) );
+            }
+        }
+        nk_rawfb_render ( ui->context, ui->clear, 0 );
+    }
+    else if ( ui->shown )
+    {
+        /* nk_rawfb_render () would have done it */
+        nk_clear ( &ui->context->ctx );
+    }
+
+    const int moved = was_shown != ui->shown ||
+                      memcmp ( &old_r, &new_r, sizeof ( SDL_Rect ) );
+
+    if ( ! redraw_layer && ! moved && ! full &&
+         ! SDL_HasIntersection ( changed, &new_r ) )
+    {
+        return;
+    }
+
+    if ( ! full )
+    {
+        restoreUnderUI ( e, old_r, changed );
+        restoreUnderUI ( e, new_r, changed );
+    }
+    if ( ui->shown )
+    {
+        compositeLayer (
+            e->framebuffer, ui->layer, sf->format->Ashift, &new_r );
+        SDL_UnionRect ( changed, &new_r, changed );
+    }
+}
+
+/* 19.10.26 ::: Shadows and AO for what the full raster left, see
+ * raytrace.h. Every object with triangles is traced, culled ones too:
+ * they still cast shadows; point clouds and streamed objects are not. */
+static void
+rayStage ( Engine * e, RObject ** scene, int scene_cnt )
+{
+    Framebuffer * f = e->framebuffer;
+    beginFrameStage ( &e->arenas, FRAME_STAGE_RAYS );
+
+    RayInstance * inst;
+    F_ALLOC ( &e->arenas, inst, RayInstance, scene_cnt );
+
+    Transforms tf;
+    int        cnt = 0;
+    for ( int i = 0; i < scene_cnt; i++ )
+    {
+        RObject * o = scene[ i ];
+        if ( o->points || o->stream ) continue;
+        if ( ! o->bvh ) o->bvh = buildBVH ( &o->lods[ 0 ] );
+        if ( ! o->bvh ) continue;
+
+        const double z[ 2 ] = { o->z_min, o->z_max };
+        setup_world ( o, &tf );
+        glm_mat4_inv ( tf.world_proj, inst[ cnt ].to_obj );
+        z_quantizer ( z, &inst[ cnt ].zq_scale, &inst[ cnt ].zq_bias );
+        inst[ cnt++ ].bvh = o->bvh;
+    }
+
+    /* camera rays through NDC nx, ny: cam_rot transposed applied to
+     * ( nx / P00, ny / P11, -1 ), the camera looks down -z */
+    setup_camera ( &e->camera,
+                   e->conf.fovy_rad,
+                   ( float ) e->width / ( float ) e->height,
+                   f,
+                   e,
+                   &tf );
+
+    TraceParams tp;
+    glm_vec3_copy ( e->camera.position, tp.eye );
+    for ( int k = 0; k < 3; k++ )
+    {
+        tp.right[ k ] = tf.cam_rot[ k ][ 0 ] / tf.view_proj[ 0 ][ 0 ];
+        tp.up[ k ]    = tf.cam_rot[ k ][ 1 ] / tf.view_proj[ 1 ][ 1 ];
+        tp.fwd[ k ]   = -tf.cam_rot[ k ][ 2 ];
+    }
+    tp.z_a = tf.view_proj[ 2 ][ 2 ] / tf.view_proj[ 2 ][ 3 ];
+    tp.z_b = tf.view_proj[ 3 ][ 2 ];
+    glm_vec3_copy ( e->conf.rt_light, tp.light );
+    tp.ao_radius = e->conf.rt_ao_radius;
+    tp.budget    = e->conf.rt_budget;
+
+    traceLighting ( f, inst, cnt, &tp );
+
+    endFrameStage ( &e->arenas );
+}
+
+/* 19.10.26 ::: Incremental redraw. Returns the surface area that changed
+ * (empty when the frame can be presented as is) and whether everything
+ * was redrawn. A full redraw happens on camera, resolution or window
+ * changes; otherwise only the old and new rects of moved objects are
+ * cleared and re-rasterized, with every overlapping object clipped to
+ * them. Partial clears leave the DBuffer and sample pools as is, so a well
+ * used pool forces a full redraw as well, and so does Framebuffer.count;
+ * with Config.rt so does any moved object. Framebuffer.stats is of the
+ * last call. */
+static int
+renderScene ( Engine * e, RObject ** scene, int scene_cnt, SDL_Rect * changed )
+{
+    Framebuffer * f = e->framebuffer;
+
+    /* everything the last frame left in the arenas is dead by now */
+    resetFrameArenas ( &e->arenas );
+
+    if ( f->capture )
+    {
+        uint32_t lost = 0;
+        for ( int i = 0; i < scene_cnt; i++ )
+        {
+            if ( scene[ i ]->points ) lost |= CAPTURE_LOST_SPLATS;
+            if ( scene[ i ]->shader ) lost |= CAPTURE_LOST_SHADERS;
+        }
+        if ( e->conf.rt ) lost |= CAPTURE_LOST_RAYS;
+        if ( e->conf.heatmap ) lost |= CAPTURE_LOST_HEATMAP;
+        captureFrame ( f->capture, f, lost );
+    }
+
+    /* streaming only prefetches, the clusters it asks for with the camera
+     * of the last sample do as well */
+    for ( int i = 0; i < scene_cnt; i++ )
+    {
+        if ( scene[ i ]->stream ) streamStage ( scene[ i ], e );
+    }
+
+    if ( e->latch ) e->latch ( e );
+
+    /* counted frames are drawn whole, the counts are of the whole frame */
+    memset ( &f->stats, 0, sizeof ( PipeStats ) );
+    f->count = e->conf.counters || e->conf.heatmap;
+
+    int full = e->full_redraw || f->count ||
+               memcmp ( &e->camera, &e->drawn_camera, sizeof ( Camera ) ) ||
+               framebufferSpent ( f );
+
+    /* a moved occluder invalidates Engine.occ and every cull made with it;
+     * with Config.rt anything moved may shadow anywhere */
+    for ( int i = 0; i < scene_cnt && ! full; i++ )
+    {
+        full = ( scene[ i ]->occluder || e->conf.rt ) &&
+               redrawRObject ( scene[ i ] );
+    }
+
+    *changed = ( SDL_Rect ) { 0, 0, 0, 0 };
+
+    if ( full )
+    {
+        /* the clear only has to land before the first raster */
+        JobCounter cleared = { 0 };
+        cleanFramebufferAsync ( f, &cleared );
+        occlusionStage ( e, scene, scene_cnt );
+        waitJobs ( f->jobs, &cleared );
+
+        for ( int i = 0; i < scene_cnt; i++ )
+        {
+            if ( ! scene[ i ]->culled ) rasterStage ( scene[ i ], e );
+        }
+        if ( e->conf.rt ) rayStage ( e, scene, scene_cnt );
+        if ( f->count ) countPixels ( f );
+        merge ( f );
+        if ( e->conf.heatmap ) drawHeatmap ( f, e->conf.heatmap == 2 );
+        *changed = ( SDL_Rect ) { 0, 0, f->surface->w, f->surface->h };
+    }
+    else
+    {
+        /* the occlusion buffer is still good for whatever did not move */
+        int dirty[ 4 ] = { 0, 0, -1, -1 };
+        for ( int i = 0; i < scene_cnt; i++ )
+        {
+            if ( ! redrawRObject ( scene[ i ] ) ) continue;
+            rect_union ( dirty, scene[ i ]->rect );
+            if ( ! cullRObject ( scene[ i ], e ) )
+                vertexStage ( scene[ i ], e );
+            rect_union ( dirty, scene[ i ]->rect );
+        }
+
+        if ( ! rect_empty ( dirty ) )
+        {
+            cleanFramebufferRect ( f, dirty );
+            setClipRect ( f, dirty );
+            for ( int i = 0; i < scene_cnt; i++ )
+            {
+                if ( rect_overlap ( dirty, scene[ i ]->rect ) )
+                    rasterStage ( scene[ i ], e );
+            }
+            setClipRect ( f, NULL );
+            mergeRect ( f, dirty, changed );
+        }
+    }
+
+    for ( int i = 0; i < scene_cnt; i++ ) markDrawnRObject ( scene[ i ] );
+    e->drawn_camera = e->camera;
+    e->full_redraw  = 0;
+
+    return full;
+}
+
+/* 19.10.26 ::: Multi-view. renderViews () draws the scene for every view
+ * but goes over its geometry once: the vertices of an object are taken to
+ * world space a single time, each view then only applies its camera,
+ * culls, projects and rasterizes into its own target. The views of an
+ * object run as jobs next to each other. There is no occlusion culling
+ * and no incremental redraw, every call draws all views in full; an
+ * object is drawn at the finest LOD any view picks for it, streamed ones
+ * keep the clusters nearest to any view resident. */
+
+typedef struct
+{
+    Engine *   e;
+    Transforms tf;       /* world_proj only */
+    RMesh **   mesh;     /* what gets drawn of the object, in order */
+    int        mesh_cnt;
+    uint32_t * vbase;    /* mesh_cnt + 1, first vertex of mesh i */
+    uint32_t * tbase;    /* mesh_cnt + 1, first triangle of mesh i */
+    vec4 *     world;    /* vbase[ mesh_cnt ] world space vertices */
+    FragShader shader;   /* the object's */
+    void *     shader_user;
+} MultiObject;
+
+typedef struct
+{
+    MultiObject * mo;
+    View *        view;
+    Transforms    tf;
+    float         fovy;
+    int           on; /* the bounds of the object are on the target */
+
+    /* per vertex of mo->world: in target pixels if between the planes */
+    vec3 *    px;
+    uint8_t * inside;
+
+    VertexSlice * slice; /* VERTEX_SLICES */
+    int           grain;
+} ViewPass;
+
+/* the mesh item i is in, base being a mesh_cnt + 1 prefix sum */
+static int
+mesh_of ( const uint32_t * base, int mesh_cnt, uint32_t i )
+{
+    int lo = 0, hi = mesh_cnt - 1;
+    while ( lo < hi )
+    {
+        const int mid = ( lo + hi + 1 ) / 2;
+        if ( base[ mid ] <= i )
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+static void
+world_verts ( void * arg, int begin, int end, int worker )
+{
+    MultiObject * mo = arg;
+    int           m  = mesh_of ( mo->vbase, mo->mesh_cnt, begin );
+    ( void ) worker;
+
+    for ( int i = begin; i < end; i++ )
+    {
+        while ( i >= ( int ) mo->vbase[ m + 1 ] ) m++;
+        world_vertex ( &mo->tf,
+                       mo->mesh[ m ]->vertices + ( i - mo->vbase[ m ] ) * 3,
+                       mo->world[ i ] );
+    }
+}
+
+/* project_vertex () for every vertex, from world space on */
+static void
+view_verts ( void * arg, int begin, int end, int worker )
+{
+    ViewPass *     p = arg;
+    const Engine * e = p->mo->e;
+    ( void ) worker;
+
+    for ( int i = begin; i < end; i++ )
+    {
+        vec4 v4;
+        glm_vec4_copy ( p->mo->world[ i ], v4 );
+        camera_vertex ( &p->tf, v4 );
+
+        p->inside[ i ] = in_depth ( e, v4 );
+        if ( p->inside[ i ] ) target_vertex ( &p->tf, v4, p->px[ i ] );
+    }
+}
+
+/* vertex_slice_body () over the triangles of every mesh in a row */
+static void
+view_tris ( void * arg, int begin, int end, int worker )
+{
+    ViewPass *          p   = arg;
+    const MultiObject * mo  = p->mo;
+    VertexSlice *       sl  = p->slice + begin / p->grain;
+    vec3 *              out = p->view->v + begin * 3;
+    int                 m   = mesh_of ( mo->tbase, mo->mesh_cnt, begin );
+    ( void ) worker;
+
+    slice_open ( sl, p->tf.vp_w, p->tf.vp_h );
+    sl->tris = end - begin;
 
-#define CPI 3.14159265358979323846f
+    vec3 v[ 3 ];
+    for ( int t = begin; t < end; t++ )
+    {
+        while ( t >= ( int ) mo->tbase[ m + 1 ] ) m++;
 
-int an_x = 20;
-int an_z = 20;
+        const uint32_t * idx =
+            mo->mesh[ m ]->idx + ( t - mo->tbase[ m ] ) * 3;
+        const uint8_t *  in  = p->inside + mo->vbase[ m ];
+        vec3 *           px  = p->px + mo->vbase[ m ];
 
-static int
-sdl_button_to_nk ( int button )
+        if ( ! in[ idx[ 0 ] ] || ! in[ idx[ 1 ] ] || ! in[ idx[ 2 ] ] )
+        {
+            sl->clipped++;
+            continue;
+        }
+
+        for ( int k = 0; k < 3; k++ ) glm_vec3_copy ( px[ idx[ k ] ], v[ k ] );
+        slice_keep ( sl, out, v );
+    }
+}
+
+/* vertexStage () of one view, into View.v */
+static void
+view_geometry ( ViewPass * p )
 {
-    switch ( button )
+    MultiObject * mo = p->mo;
+    View *        w  = p->view;
+    JobSystem *   js = w->target->jobs;
+
+    w->v_cnt = 0;
+    if ( ! p->on ) return;
+
+    const uint32_t vert_cnt = mo->vbase[ mo->mesh_cnt ];
+    const uint32_t tri_cnt  = mo->tbase[ mo->mesh_cnt ];
+    if ( tri_cnt * 3 > w->v_cap )
     {
-    default:
-    /* ft */
-    case SDL_BUTTON_LEFT: return NK_BUTTON_LEFT; break;
-    case SDL_BUTTON_MIDDLE: return NK_BUTTON_MIDDLE; break;
-    case SDL_BUTTON_RIGHT: return NK_BUTTON_RIGHT; break;
+        w->v_cap = tri_cnt * 3;
+        w->v     = realloc ( w->v, w->v_cap * sizeof ( vec3 ) );
+        if ( ! w->v )
+        {
+            printf ( "error: view vertex buffer of %u entries\n", w->v_cap );
+            exit ( EXIT_FAILURE );
+        }
     }
+
+    F_ALLOC ( &mo->e->arenas, p->px, vec3, vert_cnt );
+    F_ALLOC ( &mo->e->arenas, p->inside, uint8_t, vert_cnt );
+    parallelFor ( js, view_verts, p, vert_cnt, 4096 );
+
+    p->grain = MAX2 ( VERTEX_GRAIN_MIN,
+                      ( tri_cnt + VERTEX_SLICES - 1 ) / VERTEX_SLICES );
+    const int slices = ( tri_cnt + p->grain - 1 ) / p->grain;
+
+    F_ALLOC ( &mo->e->arenas, p->slice, VertexSlice, VERTEX_SLICES );
+    memset ( p->slice, 0, slices * sizeof ( VertexSlice ) );
+    parallelFor ( js, view_tris, p, tri_cnt, p->grain );
+
+    const float vp_w = p->tf.vp_w, vp_h = p->tf.vp_h;
+    VertexSlice acc  = {
+        0, vp_w, vp_h, -1.0f, -1.0f, DBL_MAX, -DBL_MAX, 0, 0 };
+    w->v_cnt = pack_slices ( p->slice, slices, p->grain, w->v, &acc );
+
+    /* every view has its own target */
+    add_vertex_stats ( &w->target->stats, &acc );
+    if ( ! w->v_cnt ) return;
+
+    /* seeded from v[ 0 ][ 0 ] like vertexStage (), same depth, same
+     * pixels */
+    w->z_min = fmin ( w->v[ 0 ][ 0 ], acc.min_z );
+    w->z_max = fmax ( w->v[ 0 ][ 0 ], acc.max_z );
 }
 
-void
-defaultShader ( RObject * o, Engine * e )
+static void
+view_geometry_jobs ( void * arg, int begin, int end, int worker )
 {
-    vec4 c[ 3 ] = { { 1.0f, 1.0f, 0.0f, 0.0f },
-                    { 1.0f, 0.0f, 0.5f, 0.5f },
-                    { 1.0f, 0.0f, 1.0f, 0.0f } };
+    ViewPass * p = arg;
+    ( void ) worker;
 
-    mat4 view_proj, cam_proj, cam_rot, world_proj;
+    for ( int i = begin; i < end; i++ ) view_geometry ( p + i );
+}
 
-    /* World projection: */
-    vec3 Ncenter;
-    glm_vec3_negate_to ( o->center, Ncenter );
-    glm_translate_make ( world_proj, o->position );
-    glm_quat_rotate ( world_proj, o->quaternion, world_proj );
-    glm_scale ( world_proj, o->scale );
-    glm_translate ( world_proj, Ncenter );
+/* rasterStage () of one view */
+static void
+view_raster_jobs ( void * arg, int begin, int end, int worker )
+{
+    ViewPass * p = arg;
+    ( void ) worker;
 
-    /* Camera Space projection: I - EYE */
+    for ( int i = begin; i < end; i++ )
+    {
+        View * w = p[ i ].view;
+        if ( ! w->v_cnt ) continue;
 
-    vec3 Neye;
+        QuantizeJob j = { w->v, w->z_min, w->z_max, NULL };
+        F_ALLOC ( &p[ i ].mo->e->arenas, j.zi, uint64_t, w->v_cnt );
 
-    glm_vec3_negate_to ( e->camera.position, Neye );
-    glm_translate_make ( cam_proj, Neye );
-    glm_euler ( ( vec3 ) { glm_rad ( e->camera.pitch ),
-                           glm_rad ( e->camera.yaw ),
-                           0 },
-                cam_rot );
+        parallelFor ( w->target->jobs, quantize_z, &j, w->v_cnt, 16384 );
 
-    /* Perspective projection */
-    float fovy    = e->conf.fovy_rad;
-    float aspect  = ( float ) e->width / ( float ) e->height;
-    float nearVal = e->conf.nearClipPlane;
-    float farVal  = e->conf.faarClipPlane;
-    glm_perspective ( fovy, aspect, nearVal, farVal, view_proj );
+        w->target->shader      = p[ i ].mo->shader;
+        w->target->shader_user = p[ i ].mo->shader_user;
+        rasterizeBinned (
+            w->target, w->v, j.zi, raster_colors, w->v_cnt / 3 );
+        w->target->shader = NULL;
+    }
+}
 
-    /* Viewport */
+/* streamStage () for all views: a cluster is wanted at the nearest any
+ * view has it on its target */
+static void
+streamViews ( RObject * o, Engine * e, ViewPass * pass, int view_cnt )
+{
+    ClusterStream * s = o->stream;
 
-    mat4 viewport_proj;
-    glm_translate_make (
-        viewport_proj, ( vec3 ) { e->width / 2.0f, e->height / 2.0f, 0.0f } );
-    glm_scale ( viewport_proj,
-                ( vec3 ) { e->width / 2.0f, e->height / 2.0f, 1.0f } );
+    for ( uint32_t i = 0; i < s->cluster_cnt; i++ )
+    {
+        Cluster * c = s->clusters + i;
 
-    float face_offset = 0;
-    vec4  v4;
-    vec3  v[ 3 ];
-    // TODO : Handle SHAPES
+        c->want = -1.0f;
+        for ( int k = 0; k < view_cnt; k++ )
+        {
+            const float d = cluster_want ( &pass[ k ].tf, e, c );
+            if ( d >= 0.0f && ( c->want < 0.0f || d < c->want ) )
+                c->want = d;
+        }
+    }
 
-    o->v_cnt = 0;
-    for ( uint32_t nfc = 0; nfc < o->attrib.num_face_num_verts; nfc++ )
+    updateClusterStream ( s );
+}
+
+/* Draws the scene into the target of every view and merges them. The
+ * targets get the engine's jobs and arenas; Engine.camera, its
+ * framebuffer and the incremental redraw state are left alone. */
+void
+renderViews ( Engine *   e,
+              RObject ** scene,
+              int        scene_cnt,
+              View *     views,
+              int        view_cnt )
+{
+    resetFrameArenas ( &e->arenas );
+
+    /* outside of a stage: lives until the next reset */
+    ViewPass * pass;
+    F_ALLOC ( &e->arenas, pass, ViewPass, view_cnt );
+
+    /* the clears only have to land before the first raster */
+    JobCounter cleared = { 0 };
+    for ( int k = 0; k < view_cnt; k++ )
+    {
+        Framebuffer * f = views[ k ].target;
+        f->jobs         = &e->jobs;
+        f->arenas       = &e->arenas;
+        setClipRect ( f, NULL );
+        cleanFramebufferAsync ( f, &cleared );
+        memset ( &f->stats, 0, sizeof ( PipeStats ) );
+
+        pass[ k ].view = views + k;
+        pass[ k ].fovy = views[ k ].fovy_rad > 0.0f ? views[ k ].fovy_rad
+                                                    : e->conf.fovy_rad;
+        setup_camera ( &views[ k ].camera,
+                       pass[ k ].fovy,
+                       ( float ) f->surface->w / ( float ) f->surface->h,
+                       f,
+                       e,
+                       &pass[ k ].tf );
+    }
+
+    for ( int i = 0; i < scene_cnt; i++ )
     {
-        int face_cnt   = o->attrib.face_num_verts[ nfc ];
-        int face_1_idx = face_offset;
-        for ( int face_idx = face_offset + 1;
-              face_idx < face_offset + face_cnt - 1;
-              face_idx++ )
+        RObject *   o = scene[ i ];
+        MultiObject mo;
+        mo.e           = e;
+        mo.shader      = o->shader;
+        mo.shader_user = o->shader_user;
+        setup_world ( o, &mo.tf );
+
+        int lod = o->lod_cnt - 1, on = 0;
+        for ( int k = 0; k < view_cnt; k++ )
+        {
+            ViewPass * p = pass + k;
+            int        rect[ 4 ];
+            float      z_near;
+
+            p->mo = &mo;
+            glm_mat4_copy ( mo.tf.world_proj, p->tf.world_proj );
+            p->on = project_bounds ( &p->tf,
+                                     e,
+                                     o->aabb_min,
+                                     o->aabb_max,
+                                     rect,
+                                     &z_near,
+                                     NULL ) != 0;
+            if ( ! p->on ) continue;
+
+            on  = 1;
+            lod = MIN2 ( lod,
+                         selectLodAt ( o,
+                                       e,
+                                       views[ k ].camera.position,
+                                       p->fovy,
+                                       views[ k ].target->surface->h ) );
+        }
+
+        if ( o->stream ) streamViews ( o, e, pass, view_cnt );
+        if ( ! on ) continue;
+
+        if ( o->points )
         {
-            for ( int j = 0; j < 3; j++ )
+            waitJobs ( &e->jobs, &cleared );
+
+            beginFrameStage ( &e->arenas, FRAME_STAGE_RASTER );
+            for ( int k = 0; k < view_cnt; k++ )
             {
-                v[ 0 ][ j ] = o->attrib.vertices[ //
-                    o->attrib.faces[ face_1_idx ].v_idx * 3 + j ];
-                v[ 1 ][ j ] = o->attrib.vertices[ //
-                    o->attrib.faces[ face_idx ].v_idx * 3 + j ];
-                v[ 2 ][ j ] = o->attrib.vertices[ //
-                    o->attrib.faces[ face_idx + 1 ].v_idx * 3 + j ];
+                int    rect[ 4 ];
+                double z[ 2 ];
+                if ( pass[ k ].on &&
+                     point_extent ( o, e, &pass[ k ].tf, rect, z ) )
+                    splat_object (
+                        o, e, views[ k ].target, &pass[ k ].tf, rect, z );
             }
+            endFrameStage ( &e->arenas );
+            continue;
+        }
 
-            /* ========= Transforms & rotations ========= */
-            for ( int j = 0; j < 3; j++ )
-            {
-                glm_vec4 ( v[ j ], 1.0, v4 );
-                glm_mat4_mulv ( world_proj, v4, v4 );
-                v4[ 3 ] = 1.0f;
-                glm_mat4_mulv ( cam_proj, v4, v4 );
-                glm_mat4_mulv ( cam_rot, v4, v4 );
-
-                if ( v4[ 2 ] < e->conf.faarClipPlane ||
-                     v4[ 2 ] > e->conf.nearClipPlane )
-                {
-                    goto next_face;
-                }
+        RMesh * one;
+        if ( o->stream )
+        {
+            ClusterStream * s = o->stream;
+            mo.mesh_cnt       = s->draw_cnt;
+            F_ALLOC ( &e->arenas, mo.mesh, RMesh *, mo.mesh_cnt );
+            for ( int m = 0; m < mo.mesh_cnt; m++ )
+                mo.mesh[ m ] = &s->clusters[ s->draw[ m ] ].mesh;
+        }
+        else
+        {
+            o->lod      = lod;
+            one         = &o->lods[ lod ];
+            mo.mesh     = &one;
+            mo.mesh_cnt = 1;
+        }
+        if ( ! mo.mesh_cnt ) continue;
+
+        F_ALLOC ( &e->arenas, mo.vbase, uint32_t, mo.mesh_cnt + 1 );
+        F_ALLOC ( &e->arenas, mo.tbase, uint32_t, mo.mesh_cnt + 1 );
+        mo.vbase[ 0 ] = mo.tbase[ 0 ] = 0;
+        for ( int m = 0; m < mo.mesh_cnt; m++ )
+        {
+            mo.vbase[ m + 1 ] = mo.vbase[ m ] + mo.mesh[ m ]->vert_cnt;
+            mo.tbase[ m + 1 ] = mo.tbase[ m ] + mo.mesh[ m ]->tri_cnt;
+        }
+        if ( ! mo.tbase[ mo.mesh_cnt ] ) continue;
 
-                v4[ 3 ] = 1.0f;
-                glm_mat4_mulv ( view_proj, v4, v4 );
-                glm_vec4_scale ( v4, 1 / v4[ 3 ], v4 );
-                v4[ 3 ] = 1.0f;
+        beginFrameStage ( &e->arenas, FRAME_STAGE_VERTEX );
+        F_ALLOC ( &e->arenas, mo.world, vec4, mo.vbase[ mo.mesh_cnt ] );
+        parallelFor (
+            &e->jobs, world_verts, &mo, mo.vbase[ mo.mesh_cnt ], 4096 );
+        parallelFor ( &e->jobs, view_geometry_jobs, pass, view_cnt, 1 );
+        endFrameStage ( &e->arenas );
 
-                glm_mat4_mulv ( viewport_proj, v4, v4 );
-                glm_vec4_scale ( v4, 1 / v4[ 3 ], v4 );
-                glm_vec3 ( v4, v[ j ] );
-            }
+        waitJobs ( &e->jobs, &cleared );
+
+        beginFrameStage ( &e->arenas, FRAME_STAGE_RASTER );
+        parallelFor ( &e->jobs, view_raster_jobs, pass, view_cnt, 1 );
+        endFrameStage ( &e->arenas );
+    }
 
-            /* ========= Backface culling ========= */
-            vec3 normal, v1, v2, view_dir = { 0.0f, 0.0f, 1.0f };
+    waitJobs ( &e->jobs, &cleared );
+    for ( int k = 0; k < view_cnt; k++ )
+    {
+        if ( views[ k ].target->count ) countPixels ( views[ k ].target );
+        merge ( views[ k ].target );
+    }
+}
 
-            glm_vec3_sub ( v[ 1 ], v[ 0 ], v1 );
-            glm_vec3_sub ( v[ 2 ], v[ 0 ], v2 );
-            glm_vec3_cross ( v1, v2, normal );
-            float dot_product = glm_vec3_dot ( normal, view_dir );
+/* 19.10.26 ::: app --serve, see server.h. Frames are rendered like the
+ * interactive ones, renderScene () redraws what a request changed. */
+static volatile sig_atomic_t serve_stop = 0;
 
-            if ( dot_product > 0 )
-            {
-                o->v_cnt += 3;
+static void
+serve_signal ( int sig )
+{
+    ( void ) sig;
+    serve_stop = 1;
+}
+
+static int
+has_suffix ( const char * path, const char * suffix )
+{
+    const size_t n = strlen ( path ), k = strlen ( suffix );
+    return n > k && ! strcmp ( path + n - k, suffix );
+}
+
+/* "occ:" in front of an OBJ path loads it as an occluder, see
+ * occlusionStage () */
+#define OCCLUDER_PREFIX "occ:"
+
+/* by suffix: .rcl streamed within budget_mb, .rpt points, OBJ otherwise */
+static RObject *
+load_model ( const char * path, size_t budget_mb )
+{
+    const size_t pre = strlen ( OCCLUDER_PREFIX );
+    const int    occ = ! strncmp ( path, OCCLUDER_PREFIX, pre );
+    if ( occ ) path += pre;
+
+    RObject * o;
+    if ( has_suffix ( path, ".rcl" ) )
+        o = loadStreamedRObject ( path, budget_mb << 20 );
+    else if ( has_suffix ( path, ".rpt" ) )
+        o = loadPointRObject ( path );
+    else
+        o = loadRObject ( path );
+    if ( ! o || ! occ ) return o;
+
+    if ( o->stream || o->points )
+        printf ( "%s: only OBJ models occlude, drawn as is\n", path );
+    else
+        o->occluder = 1;
+    return o;
+}
+
+static int
+serve ( const char * path, const char * size, char ** models, int model_cnt )
+{
+    unsigned w, h;
+    if ( sscanf ( size, "%ux%u", &w, &h ) != 2 || ! w || ! h ||
+         ( w | h ) & 1 )
+    {
+        printf ( "error: frame size %s, want an even WxH\n", size );
+        return -1;
+    }
+    if ( model_cnt > SERVE_OBJECTS )
+    {
+        printf ( "error: %d models, at most %d\n", model_cnt, SERVE_OBJECTS );
+        return -1;
+    }
+
+    /* requests not naming an object get it as loaded */
+    RObject *   scene[ SERVE_OBJECTS ];
+    ServeObject base[ SERVE_OBJECTS ];
+    int         cnt = 0, err = -1;
+
+    Engine E;
+    Server s;
+    memset ( &E, 0, sizeof ( Engine ) );
+    s.listen_fd = -1;
+
+    if ( initHeadlessEngine ( &E, h, w ) ) goto serve_exit;
+    for ( ; cnt < model_cnt; cnt++ )
+    {
+        RObject * o = load_model ( models[ cnt ], STREAM_BUDGET_MB );
+        if ( ! o ) goto serve_exit;
+
+        memcpy ( base[ cnt ].position, o->position, sizeof ( vec3 ) );
+        memcpy ( base[ cnt ].quaternion, o->quaternion, sizeof ( versor ) );
+        memcpy ( base[ cnt ].scale, o->scale, sizeof ( vec3 ) );
+        scene[ cnt ] = o;
+    }
+    if ( openServer ( &s, path, w, h, cnt ) ) goto serve_exit;
+
+    signal ( SIGINT, serve_signal );
+    signal ( SIGTERM, serve_signal );
+
+    while ( ! serve_stop )
+    {
+        const int n = serverBatch ( &s, 1000 );
+        if ( n < 0 ) break;
 
-                glm_vec3_copy ( v[ 2 ], o->v[ o->v_cnt - 1 ] );
-                glm_vec3_copy ( v[ 1 ], o->v[ o->v_cnt - 2 ] );
-                glm_vec3_copy ( v[ 0 ], o->v[ o->v_cnt - 3 ] );
+        for ( int i = 0; i < n; )
+        {
+            const ServeRequest * q = &s.batch[ i ].req;
 
-                //rasterize ( e->framebuffer, v, c );
+            memcpy ( E.camera.position, q->position, sizeof ( vec3 ) );
+            E.camera.yaw   = q->yaw;
+            E.camera.pitch = q->pitch;
+            for ( int k = 0; k < cnt; k++ )
+            {
+                const ServeObject * t =
+                    k < ( int ) q->obj_cnt ? q->obj + k : base + k;
+                memcpy ( scene[ k ]->position, t->position, sizeof ( vec3 ) );
+                memcpy ( scene[ k ]->quaternion,
+                         t->quaternion,
+                         sizeof ( versor ) );
+                memcpy ( scene[ k ]->scale, t->scale, sizeof ( vec3 ) );
             }
+
+            SDL_Rect changed;
+            renderScene ( &E, scene, cnt, &changed );
+            s.frame++;
+
+            /* the batch is sorted, equal states are next to each other */
+            int j = i;
+            while ( j < n && sameServeState ( q, &s.batch[ j ].req ) )
+                serverReply ( &s, s.batch + j++, E.framebuffer );
+            i = j;
         }
-    next_face:
-        face_offset += face_cnt;
     }
+    err = 0;
 
-    double min_z = o->v[ 0 ][ 0 ];
-    double max_z = o->v[ 0 ][ 0 ];
-    for ( int i = 0; i < o->v_cnt; i++ )
+serve_exit:
+    closeServer ( &s );
+    for ( int k = 0; k < cnt; k++ ) destroyRObject ( scene[ k ] );
+    destroyEngine ( &E );
+    return err;
+}
+
+/* 19.10.26 ::: app --cubemap model SIZE [loops] renders the six faces of
+ * a cubemap next to the model, once with renderViews () and once as six
+ * renderScene () frames, and prints the best time of both and how many
+ * faces came out the same */
+static int
+cubemap ( const char * model, int size, int loops )
+{
+    const float yaw[ 6 ]   = { 0.0f, 90.0f, 180.0f, 270.0f, 0.0f, 0.0f };
+    const float pitch[ 6 ] = { 0.0f, 0.0f, 0.0f, 0.0f, 90.0f, -90.0f };
+
+    Engine    E;
+    View      views[ 6 ];
+    RObject * o   = NULL;
+    int       err = -1;
+    memset ( &E, 0, sizeof ( Engine ) );
+    memset ( views, 0, sizeof ( views ) );
+
+    if ( size <= 0 )
     {
-        if ( o->v[ i ][ 2 ] < min_z ) min_z = o->v[ i ][ 2 ];
-        if ( o->v[ i ][ 2 ] > max_z ) max_z = o->v[ i ][ 2 ];
+        printf ( "error: cubemap size %d\n", size );
+        return -1;
     }
+    if ( initHeadlessEngine ( &E, size, size ) ) goto cubemap_exit;
+    E.conf.fovy_rad = glm_rad ( 90.0f );
+
+    o = load_model ( model, STREAM_BUDGET_MB );
+    if ( ! o ) goto cubemap_exit;
 
-    for ( int i = 0; i < o->v_cnt; i += 3 )
+    /* off the model along +z, the first face looks at it */
+    vec3 ext;
+    glm_vec3_sub ( o->aabb_max, o->aabb_min, ext );
+    glm_vec3_mul ( ext, o->scale, ext );
+    glm_vec3_copy ( o->position, E.camera.position );
+    E.camera.position[ 2 ] += glm_vec3_norm ( ext );
+
+    for ( int k = 0; k < 6; k++ )
     {
+        views[ k ].camera       = E.camera;
+        views[ k ].camera.yaw   = yaw[ k ];
+        views[ k ].camera.pitch = pitch[ k ];
+        views[ k ].target       = createFramebuffer ( size, size );
+        if ( ! views[ k ].target ) goto cubemap_exit;
+    }
 
-        uint64_t z_int[ 3 ];
+    const double freq  = SDL_GetPerformanceFrequency ();
+    double       multi = DBL_MAX, single = DBL_MAX;
+    int          same  = 0;
+    for ( int l = 0; l < MAX2 ( loops, 1 ); l++ )
+    {
+        uint64_t t = SDL_GetPerformanceCounter ();
+        renderViews ( &E, &o, 1, views, 6 );
+        multi = fmin ( multi, ( SDL_GetPerformanceCounter () - t ) / freq );
 
-        for ( int j = 0; j < 3; j++ )
+        double sum = 0.0;
+        same       = 0;
+        for ( int k = 0; k < 6; k++ )
         {
-            z_int[ j ] = ( ( ( double ) o->v[ i + j ][ 2 ] - min_z ) /
-                           ( max_z * 1.001 ) ) *
-                             ( ( double ) UINT64_MAX - 1 ) +
-                         1;
+            SDL_Rect changed;
+            E.camera = views[ k ].camera;
+            t        = SDL_GetPerformanceCounter ();
+            renderScene ( &E, &o, 1, &changed );
+            sum += ( SDL_GetPerformanceCounter () - t ) / freq;
+
+            const SDL_Surface * a = E.framebuffer->surface;
+            const SDL_Surface * b = views[ k ].target->surface;
+            int                 y = 0;
+            while ( y < a->h &&
+                    ! memcmp ( ( uint8_t * ) a->pixels + y * a->pitch,
+                               ( uint8_t * ) b->pixels + y * b->pitch,
+                               a->w * 4 ) )
+                y++;
+            same += y == a->h;
         }
-        rasterize ( e->framebuffer, ( o->v ) + i, z_int, c );
+        single = fmin ( single, sum );
+    }
+
+    printf ( "cubemap %dx%d: 6 views %.2f ms, 6 frames %.2f ms, "
+             "%d of 6 faces the same\n",
+             size,
+             size,
+             multi * 1000.0,
+             single * 1000.0,
+             same );
+    err = 0;
+
+cubemap_exit:
+    for ( int k = 0; k < 6; k++ )
+    {
+        if ( views[ k ].target ) destroyFramebuffer ( views[ k ].target );
+        free ( views[ k ].v );
+    }
+    if ( o ) destroyRObject ( o );
+    destroyEngine ( &E );
+    return err;
+}
+
+/* 19.10.26 ::: Camera input. Mouse motion is the relative state SDL
+ * accumulated since the last sample rather than the motion events, so one
+ * sample a frame sees all of it wherever it is taken: at the top of the
+ * main loop, or as Engine.latch with Config.late_latch, after everything
+ * of the frame that does not need the camera. */
+static void
+latchInput ( Engine * e )
+{
+    int dx, dy;
+    SDL_PumpEvents ();
+    SDL_GetRelativeMouseState ( &dx, &dy );
+    const Uint8 * state = SDL_GetKeyboardState ( NULL );
+    e->input_tick       = SDL_GetPerformanceCounter ();
+
+    /* the UI has the mouse, motion is dropped */
+    if ( ! e->godmod )
+    {
+        e->camera.yaw += dx * e->conf.mouse_sensitivity;
+        e->camera.pitch -= dy * e->conf.mouse_sensitivity;
+        e->camera.pitch = fmaxf ( -89.0f, fminf ( 89.0f, e->camera.pitch ) );
+        e->camera.yaw   = fmodf ( e->camera.yaw, 360.0f );
+    }
+
+    float c = cos ( glm_rad ( e->camera.yaw ) ) * e->camera.speed,
+          s = sin ( glm_rad ( e->camera.yaw ) ) * e->camera.speed;
+
+    if ( state[ SDL_SCANCODE_W ] )
+    {
+        e->camera.position[ 0 ] += s;
+        e->camera.position[ 2 ] -= c;
+    }
+    if ( state[ SDL_SCANCODE_S ] )
+    {
+        e->camera.position[ 0 ] -= s;
+        e->camera.position[ 2 ] += c;
+    }
+    if ( state[ SDL_SCANCODE_A ] )
+    {
+        e->camera.position[ 0 ] -= c;
+        e->camera.position[ 2 ] -= s;
+    }
+    if ( state[ SDL_SCANCODE_D ] )
+    {
+        e->camera.position[ 0 ] += c;
+        e->camera.position[ 2 ] += s;
+    }
+    if ( state[ SDL_SCANCODE_X ] )
+    {
+        e->camera.position[ 1 ] += e->camera.speed;
+    }
+    if ( state[ SDL_SCANCODE_Z ] )
+    {
+        e->camera.position[ 1 ] -= e->camera.speed;
     }
 }
 
 int
-main ( void )
+main ( int argc, char ** argv )
 {
     // RObject * seahawk_ro = loadRObject (
     //     "/mydata/Notebooks/c_learn/graphics/pure_c_render/models/xmax_tree/"
     //     "tree.obj" );
 
-    RObject * seahawk_ro    = loadRObject ( "models/Seahawk.obj" );
-    seahawk_ro->center[ 0 ] = 0.0119630;
-    seahawk_ro->center[ 1 ] = 31.758559;
-    seahawk_ro->center[ 2 ] = 0.9221725;
+    /* app --cluster in.obj out.rcl [tris] writes a cluster file,
+     * app model.rcl [budget_mb] streams one,
+     * app --points in.txt out.rpt writes a point file (see points.h),
+     * app cloud.rpt splats one, app model.obj draws an OBJ,
+     * app --replay frames.rcap [loops] times a capture (see capture.h),
+     * app --serve sock WxH model... serves frames (see server.h),
+     * app --cubemap model SIZE [loops] times renderViews () */
+    if ( argc > 4 && ! strcmp ( argv[ 1 ], "--serve" ) )
+    {
+        return serve ( argv[ 2 ], argv[ 3 ], argv + 4, argc - 4 )
+                   ? EXIT_FAILURE
+                   : EXIT_SUCCESS;
+    }
+
+    if ( argc > 3 && ! strcmp ( argv[ 1 ], "--cubemap" ) )
+    {
+        const int loops = argc > 4 ? atoi ( argv[ 4 ] ) : 1;
+        return cubemap ( argv[ 2 ], atoi ( argv[ 3 ] ), loops )
+                   ? EXIT_FAILURE
+                   : EXIT_SUCCESS;
+    }
+
+    if ( argc > 2 && ! strcmp ( argv[ 1 ], "--replay" ) )
+    {
+        const int loops = argc > 3 ? atoi ( argv[ 3 ] ) : 1;
+        return replayCapture ( argv[ 2 ], loops ) ? EXIT_FAILURE
+                                                  : EXIT_SUCCESS;
+    }
+
+    if ( argc > 3 && ! strcmp ( argv[ 1 ], "--cluster" ) )
+    {
+        RObject * src = loadRObject ( argv[ 2 ] );
+        if ( ! src ) return EXIT_FAILURE;
+
+        const int tris = argc > 4 ? atoi ( argv[ 4 ] ) : CLUSTER_TRIS;
+        const int err  = writeClusterFile (
+            &src->lods[ 0 ], argv[ 3 ], tris > 0 ? tris : CLUSTER_TRIS );
+        destroyRObject ( src );
+        return err ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if ( argc > 3 && ! strcmp ( argv[ 1 ], "--points" ) )
+    {
+        return writePointFile ( argv[ 2 ], argv[ 3 ] ) ? EXIT_FAILURE
+                                                       : EXIT_SUCCESS;
+    }
+
+    RObject * seahawk_ro;
+    if ( argc > 1 )
+    {
+        const size_t budget_mb =
+            argc > 2 ? strtoul ( argv[ 2 ], NULL, 10 ) : STREAM_BUDGET_MB;
+        seahawk_ro = load_model ( argv[ 1 ], budget_mb );
+        if ( ! seahawk_ro ) return EXIT_FAILURE;
+    }
+    else
+    {
+        seahawk_ro = loadRObject ( "models/Seahawk.obj" );
+        if ( ! seahawk_ro ) return EXIT_FAILURE;
+        seahawk_ro->center[ 0 ] = 0.0119630;
+        seahawk_ro->center[ 1 ] = 31.758559;
+        seahawk_ro->center[ 2 ] = 0.9221725;
+    }
+
+    RObject * scene[]   = { seahawk_ro };
+    const int scene_cnt = sizeof ( scene ) / sizeof ( scene[ 0 ] );
 
     uint64_t last_time = SDL_GetPerformanceCounter ();
     int      frames    = 0;
+    int      idle      = 0;
 
     Engine         E;
     const uint16_t WIDTH = 1920, HEIGHT = 1080;
 
+    /* the debug UI starts and stops it, RENDER_CAPTURE names the file */
+    Capture capture;
+    memset ( &capture, 0, sizeof ( Capture ) );
+
+    /* Y4M out, same: RENDER_Y4M names the file or "|command",
+     * RENDER_Y4M_FPS the rate */
+    VideoSink video;
+    memset ( &video, 0, sizeof ( VideoSink ) );
+
+    /* input sample to present, per presented frame: the debug UI shows the
+     * last and the worst of the last second, RENDER_LATENCY_LOG names a
+     * file that gets every frame */
+    double       latency_ms = 0.0, latency_max = 0.0, latency_worst = 0.0;
+    const char * latency_path = getenv ( "RENDER_LATENCY_LOG" );
+    FILE *       latency_log  = NULL;
+    if ( latency_path ) latency_log = fopen ( latency_path, "w" );
+    if ( latency_path && ! latency_log )
+        printf ( "error: can't write %s\n", latency_path );
+    if ( latency_log )
+        fprintf ( latency_log, "frame input_to_present_ms render_ms late\n" );
+    uint32_t presented = 0;
+
     int err;
     err = initEngine ( &E, HEIGHT, WIDTH );
     if ( err ) { goto exit_routine; }
@@ -261,7 +1918,10 @@ main ( void )
     char fps_str[ 16 ];
     while ( E.running )
     {
-        const Uint8 * state = SDL_GetKeyboardState ( NULL );
+        /* nothing changed last frame: sleep until input (or the timeout,
+         * so the fps label still ticks) instead of spinning */
+        if ( idle ) SDL_WaitEventTimeout ( NULL, IDLE_WAIT_MS );
+
         /* FPS count */
         uint64_t current_time = SDL_GetPerformanceCounter ();
         frames++;
@@ -269,8 +1929,10 @@ main ( void )
                SDL_GetPerformanceFrequency () ) >= 1.0 )
         {
             snprintf ( fps_str, sizeof ( fps_str ), "%u", frames );
-            frames    = 0;
-            last_time = current_time;
+            frames        = 0;
+            last_time     = current_time;
+            latency_worst = latency_max;
+            latency_max   = 0.0;
         }
 
         while ( SDL_PollEvent ( &event ) )
@@ -280,16 +1942,7 @@ main ( void )
             {
             case SDL_QUIT: goto exit_routine;
             case SDL_MOUSEMOTION:
-                if ( ! E.godmod )
-                {
-                    E.camera.yaw +=
-                        event.motion.xrel * E.conf.mouse_sensitivity;
-                    E.camera.pitch -=
-                        event.motion.yrel * E.conf.mouse_sensitivity;
-                    E.camera.pitch =
-                        fmaxf ( -89.0f, fminf ( 89.0f, E.camera.pitch ) );
-                    E.camera.yaw = fmodf ( E.camera.yaw, 360.0f );
-                }
+                /* the camera takes it in latchInput () */
                 nk_input_motion ( pNK_CTX, event.motion.x, event.motion.y );
                 break;
 
@@ -329,51 +1982,62 @@ main ( void )
 
                 break;
 
+            case SDL_WINDOWEVENT: E.full_redraw = 1; break;
+
             default: break;
             }
         }
 
-        float c = cos ( glm_rad ( E.camera.yaw ) ) * E.camera.speed,
-              s = sin ( glm_rad ( E.camera.yaw ) ) * E.camera.speed;
-
-        if ( state[ SDL_SCANCODE_W ] )
-        {
-            E.camera.position[ 0 ] += s;
-            E.camera.position[ 2 ] -= c;
-        }
-        if ( state[ SDL_SCANCODE_S ] )
-        {
-            E.camera.position[ 0 ] -= s;
-            E.camera.position[ 2 ] += c;
-        }
-        if ( state[ SDL_SCANCODE_A ] )
-        {
-            E.camera.position[ 0 ] -= c;
-            E.camera.position[ 2 ] -= s;
-        }
-        if ( state[ SDL_SCANCODE_D ] )
-        {
-            E.camera.position[ 0 ] += c;
-            E.camera.position[ 2 ] += s;
-        }
-        if ( state[ SDL_SCANCODE_X ] )
-        {
-            E.camera.position[ 1 ] += E.camera.speed;
-        }
-        if ( state[ SDL_SCANCODE_Z ] )
-        {
-            E.camera.position[ 1 ] -= E.camera.speed;
-        }
-
-        cleanFramebuffer ( E.framebuffer );
+        /* early, or late from inside renderScene () */
+        E.latch = E.conf.late_latch ? latchInput : NULL;
+        if ( ! E.latch ) latchInput ( &E );
 
         /* ========= Rendering pipeline ========= */
-        defaultShader ( seahawk_ro, &E );
-        // defaultShader ( seahawk_ro2, &E );
-        merge ( E.framebuffer );
+        uint64_t render_start = SDL_GetPerformanceCounter ();
+        SDL_Rect changed;
+        int      full = renderScene ( &E, scene, scene_cnt, &changed );
+
+        struct nk_rect ui_prev      = E.nk_ui.drawn;
+        int            ui_was_shown = E.nk_ui.shown;
+        E.nk_ui.shown               = 0;
 
         char triangles_str[ 100 ];
         sprintf ( triangles_str, "%d", seahawk_ro->v_cnt / 3 );
+        char res_str[ 32 ];
+        sprintf ( res_str, "%ux%u", E.framebuffer->w, E.framebuffer->h );
+        char latency_str[ 48 ];
+        snprintf ( latency_str,
+                   sizeof ( latency_str ),
+                   "%.1f / %.1f ms",
+                   latency_ms,
+                   latency_worst );
+        /* frame arena use per stage, last frame / peak */
+        char arena_str[ FRAME_STAGE_CNT ][ 48 ];
+        for ( int k = 0; k < FRAME_STAGE_CNT; k++ )
+        {
+            snprintf ( arena_str[ k ],
+                       sizeof ( arena_str[ k ] ),
+                       "%zu / %zu KB",
+                       E.arenas.last[ k ] >> 10,
+                       E.arenas.peak[ k ] >> 10 );
+        }
+        /* pipeline counters of the frame; pixels only while counting */
+        const PipeStats * ps                = &E.framebuffer->stats;
+        const uint64_t    stat[ STAT_ROWS ] = {
+            ps->submitted,  ps->clipped,   ps->backface,   ps->frustum,
+            ps->degenerate, ps->scissored, ps->rasterized, ps->rays,
+            ps->tested,     ps->passed,    ps->transparent };
+        char stat_str[ STAT_ROWS ][ 32 ];
+        for ( int k = 0; k < STAT_ROWS; k++ )
+        {
+            if ( k >= STAT_ROWS - STAT_PX_ROWS && ! E.framebuffer->count )
+                snprintf ( stat_str[ k ], sizeof ( stat_str[ k ] ), "-" );
+            else
+                snprintf ( stat_str[ k ],
+                           sizeof ( stat_str[ k ] ),
+                           "%llu",
+                           ( unsigned long long ) stat[ k ] );
+        }
 
         /* Nuklear UI devfinition */
         nk_input_end ( pNK_CTX );
@@ -394,6 +2058,150 @@ main ( void )
                 nk_layout_row_dynamic ( pNK_CTX, 45, 2 );
                 nk_label ( pNK_CTX, "triangles:", NK_TEXT_LEFT );
                 nk_label ( pNK_CTX, triangles_str, NK_TEXT_RIGHT );
+                nk_layout_row_dynamic ( pNK_CTX, 45, 2 );
+                nk_label ( pNK_CTX, "render res:", NK_TEXT_LEFT );
+                nk_label ( pNK_CTX, res_str, NK_TEXT_RIGHT );
+                nk_layout_row_dynamic ( pNK_CTX, 45, 2 );
+                nk_label ( pNK_CTX, "input latency:", NK_TEXT_LEFT );
+                nk_label ( pNK_CTX, latency_str, NK_TEXT_RIGHT );
+                nk_layout_row_dynamic ( pNK_CTX, 45, 2 );
+                nk_label ( pNK_CTX, "kernels:", NK_TEXT_LEFT );
+                nk_label ( pNK_CTX, isaNames[ isaLevel ], NK_TEXT_RIGHT );
+                for ( int k = 0; k < FRAME_STAGE_CNT; k++ )
+                {
+                    nk_layout_row_dynamic ( pNK_CTX, 45, 2 );
+                    nk_label ( pNK_CTX, frameStageNames[ k ], NK_TEXT_LEFT );
+                    nk_label ( pNK_CTX, arena_str[ k ], NK_TEXT_RIGHT );
+                }
+                for ( int k = 0; k < STAT_ROWS; k++ )
+                {
+                    nk_layout_row_dynamic ( pNK_CTX, 45, 2 );
+                    nk_label ( pNK_CTX, stat_name[ k ], NK_TEXT_LEFT );
+                    nk_label ( pNK_CTX, stat_str[ k ], NK_TEXT_RIGHT );
+                }
+
+                nk_layout_row_dynamic ( pNK_CTX, 30, 1 );
+                nk_bool msaa = E.framebuffer->msaa;
+                nk_checkbox_label ( pNK_CTX, "MSAA 4x", &msaa );
+                if ( msaa != E.framebuffer->msaa )
+                {
+                    E.framebuffer->msaa = msaa;
+                    E.full_redraw       = 1;
+                }
+
+                nk_layout_row_dynamic ( pNK_CTX, 30, 1 );
+                nk_bool tiled = E.framebuffer->tiled;
+                nk_checkbox_label ( pNK_CTX, "tiled planes", &tiled );
+                if ( tiled != E.framebuffer->tiled )
+                {
+                    /* the planes are cleaned whole in the new layout */
+                    E.framebuffer->tiled = tiled;
+                    E.full_redraw        = 1;
+                }
+
+                nk_layout_row_dynamic ( pNK_CTX, 30, 1 );
+                nk_bool ordered = E.framebuffer->ordered;
+                nk_checkbox_label ( pNK_CTX, "front to back", &ordered );
+                E.framebuffer->ordered = ordered;
+
+                nk_layout_row_dynamic ( pNK_CTX, 30, 1 );
+                nk_bool wire = seahawk_ro->shader == wireShader;
+                nk_checkbox_label ( pNK_CTX, "wireframe shader", &wire );
+                if ( wire != ( seahawk_ro->shader == wireShader ) )
+                {
+                    seahawk_ro->shader = wire ? wireShader : NULL;
+                    E.full_redraw      = 1;
+                }
+
+                nk_layout_row_dynamic ( pNK_CTX, 30, 1 );
+                nk_bool late = E.conf.late_latch;
+                nk_checkbox_label ( pNK_CTX, "late input latch", &late );
+                E.conf.late_latch = late;
+
+                nk_layout_row_dynamic ( pNK_CTX, 30, 1 );
+                nk_bool counting = E.conf.counters;
+                nk_checkbox_label ( pNK_CTX, "pipeline counters", &counting );
+                E.conf.counters = counting;
+
+                /* the heatmap counts; off again, the scene comes back */
+                nk_layout_row_dynamic ( pNK_CTX, 30, 2 );
+                nk_bool heat   = E.conf.heatmap != 0;
+                nk_bool writes = E.conf.heatmap == 2;
+                nk_checkbox_label ( pNK_CTX, "overdraw heatmap", &heat );
+                nk_checkbox_label ( pNK_CTX, "writes only", &writes );
+                const uint8_t mode = heat ? 1 + writes : 0;
+                if ( mode != E.conf.heatmap )
+                {
+                    E.conf.heatmap = mode;
+                    E.full_redraw  = 1;
+                }
+
+                nk_layout_row_dynamic ( pNK_CTX, 30, 1 );
+                nk_bool rt = E.conf.rt;
+                nk_checkbox_label ( pNK_CTX, "ray traced shadows / AO", &rt );
+                if ( rt != E.conf.rt )
+                {
+                    E.conf.rt     = rt;
+                    E.full_redraw = 1;
+                }
+
+                nk_layout_row_dynamic ( pNK_CTX, 30, 1 );
+                nk_bool fill = E.conf.point_fill;
+                nk_checkbox_label ( pNK_CTX, "fill point holes", &fill );
+                if ( fill != E.conf.point_fill )
+                {
+                    E.conf.point_fill = fill;
+                    E.full_redraw     = 1;
+                }
+
+                nk_layout_row_dynamic ( pNK_CTX, 30, 1 );
+                nk_bool capturing = capture.file != NULL;
+                nk_checkbox_label ( pNK_CTX, "capture frames", &capturing );
+                if ( capturing && ! capture.file )
+                {
+                    const char * path = getenv ( "RENDER_CAPTURE" );
+                    if ( ! openCapture ( &capture,
+                                         path ? path : "capture.rcap" ) )
+                    {
+                        /* replays start from a whole frame */
+                        E.framebuffer->capture = &capture;
+                        E.full_redraw          = 1;
+                    }
+                }
+                else if ( ! capturing && capture.file )
+                {
+                    closeCapture ( &capture );
+                    printf ( "captured %u frames, %llu MB\n",
+                             capture.frames,
+                             ( unsigned long long ) capture.bytes >> 20 );
+                }
+                if ( ! capture.file ) E.framebuffer->capture = NULL;
+
+                nk_layout_row_dynamic ( pNK_CTX, 30, 1 );
+                nk_bool streaming = video.out != NULL;
+                nk_checkbox_label ( pNK_CTX, "video out", &streaming );
+                if ( streaming && ! video.out )
+                {
+                    const char * target = getenv ( "RENDER_Y4M" );
+                    const char * fps    = getenv ( "RENDER_Y4M_FPS" );
+                    if ( ! openVideo ( &video,
+                                       target ? target : "render.y4m",
+                                       E.framebuffer->surface,
+                                       fps ? atoi ( fps ) : 30 ) )
+                    {
+                        /* partial merges update a whole frame */
+                        E.framebuffer->video = &video;
+                        E.full_redraw        = 1;
+                    }
+                }
+                else if ( ! streaming && video.out )
+                {
+                    closeVideo ( &video );
+                    printf ( "video: %u frames, %u late\n",
+                             video.frames,
+                             video.late );
+                }
+                if ( ! video.out ) E.framebuffer->video = NULL;
 
                 nk_layout_row_dynamic ( pNK_CTX, 45, 1 );
                 nk_label ( pNK_CTX, "scale:", NK_TEXT_LEFT );
@@ -403,20 +2211,66 @@ main ( void )
                 seahawk_ro->scale[ 1 ] = seahawk_ro->scale[ 0 ];
                 seahawk_ro->scale[ 2 ] = seahawk_ro->scale[ 0 ];
 
+                E.nk_ui.drawn = nk_window_get_bounds ( pNK_CTX );
+                E.nk_ui.shown = 1;
+
                 nk_end ( pNK_CTX );
-                nk_rawfb_render ( E.nk_ui.context, E.nk_ui.clear, 0 );
             }
+        composeUI ( &E, ui_prev, ui_was_shown, full, &changed );
+
+        /* the UI is not in the video, it sees the merged scene */
+        if ( E.framebuffer->video )
+        {
+            if ( videoFrame ( &video ) )
+            {
+                closeVideo ( &video );
+                E.framebuffer->video = NULL;
+            }
+        }
+
+        idle = changed.w <= 0 || changed.h <= 0;
+        if ( ! idle )
+        {
+            SDL_Surface * sf = E.framebuffer->surface;
+            SDL_UpdateTexture ( E.texture,
+                                &changed,
+                                ( uint8_t * ) sf->pixels +
+                                    changed.y * sf->pitch + changed.x * 4,
+                                sf->pitch );
+            SDL_RenderClear ( E.renderer );
+            SDL_RenderCopy ( E.renderer, E.texture, NULL, NULL );
+            SDL_RenderPresent ( E.renderer );
+
+            const uint64_t now  = SDL_GetPerformanceCounter ();
+            const double   freq = SDL_GetPerformanceFrequency ();
+            latency_ms  = ( now - E.input_tick ) * 1000.0 / freq;
+            latency_max = fmax ( latency_max, latency_ms );
+            if ( latency_log )
+            {
+                fprintf ( latency_log,
+                          "%u %.3f %.3f %d\n",
+                          presented,
+                          latency_ms,
+                          ( now - render_start ) * 1000.0 / freq,
+                          E.latch != NULL );
+            }
+            presented++;
+        }
 
-        SDL_UpdateTexture ( E.texture,
-                            NULL,
-                            E.framebuffer->surface->pixels,
-                            E.framebuffer->surface->pitch );
-        SDL_RenderClear ( E.renderer );
-        SDL_RenderCopy ( E.renderer, E.texture, NULL, NULL );
-        SDL_RenderPresent ( E.renderer );
+        /* only full frames say what the current render scale costs */
+        if ( full )
+        {
+            updateRenderScale ( &E,
+                                ( double ) ( SDL_GetPerformanceCounter () -
+                                             render_start ) *
+                                    1000.0 / SDL_GetPerformanceFrequency () );
+        }
     }
 
 exit_routine:
+    if ( latency_log ) fclose ( latency_log );
+    closeCapture ( &capture );
+    closeVideo ( &video );
     destroyEngine ( &E );
     if ( seahawk_ro ) destroyRObject ( seahawk_ro );
     return 0;
@@ -0,0 +1,860 @@
+#include "mesh.h"
+
+#include <math.h>
+#include <string.h>
+
+/*
+ * Quadric edge collapse.
+ *
+ * Every vertex carries the sum of the plane quadrics of its triangles, an
+ * edge costs the quadric error of the merged vertex. Instead of a heap the
+ * edges are swept in passes with a growing error threshold (Forstmann), so
+ * the whole thing is a few flat arrays and no priority queue.
+ *
+ *   ┌────────┐  collapse (v0, v1) -> v0'   ┌────────┐
+ *   │╲  v1  ╱│  ─────────────────────────> │╲      ╱│
+ *   │ ╲ ╱╲ ╱ │                             │  ╲  ╱  │
+ *   │  v0  ╲ │                             │   v0'  │
+ *   └────────┘                             └────────┘
+ */
+
+/* symmetric 4x4, upper triangle */
+typedef struct
+{
+    double m[ 10 ];
+} Quadric;
+
+typedef struct
+{
+    uint32_t v[ 3 ];
+    double   err[ 4 ]; /* per edge, [ 3 ] is the min */
+    vec3     n;
+    uint8_t  deleted;
+    uint8_t  dirty;
+} STri;
+
+typedef struct
+{
+    vec3     p;
+    Quadric  q;
+    uint32_t tstart; /* first ref */
+    uint32_t tcount;
+    uint8_t  border;
+} SVert;
+
+/* vertex -> triangle back reference */
+typedef struct
+{
+    uint32_t tid;
+    uint32_t tvertex;
+} SRef;
+
+typedef struct
+{
+    STri *   tris;
+    uint32_t tri_cnt;
+    SVert *  verts;
+    uint32_t vert_cnt;
+
+    SRef *   refs;
+    uint32_t ref_cnt;
+    uint32_t ref_cap;
+
+    /* per-ref "triangle dies with this collapse" flags */
+    uint8_t * del0;
+    uint8_t * del1;
+    uint32_t  del_cap;
+} Simplifier;
+
+static void *
+grow ( void * p, size_t size )
+{
+    void * np = realloc ( p, size );
+    if ( ! np )
+    {
+        printf ( "error: grow of size %zu", size );
+        exit ( EXIT_FAILURE );
+    }
+    return np;
+}
+
+static inline void
+quadric_plane ( Quadric * q, double a, double b, double c, double d )
+{
+    q->m[ 0 ] = a * a;
+    q->m[ 1 ] = a * b;
+    q->m[ 2 ] = a * c;
+    q->m[ 3 ] = a * d;
+    q->m[ 4 ] = b * b;
+    q->m[ 5 ] = b * c;
+    q->m[ 6 ] = b * d;
+    q->m[ 7 ] = c * c;
+    q->m[ 8 ] = c * d;
+    q->m[ 9 ] = d * d;
+}
+
+static inline void
+quadric_add ( Quadric * r, const Quadric * a, const Quadric * b )
+{
+    for ( int i = 0; i < 10; i++ ) r->m[ i ] = a->m[ i ] + b->m[ i ];
+}
+
+static inline double
+quadric_det ( const Quadric * q,
+              int             a11,
+              int             a12,
+              int             a13,
+              int             a21,
+              int             a22,
+              int             a23,
+              int             a31,
+              int             a32,
+              int             a33 )
+{
+    const double * m = q->m;
+    return m[ a11 ] * m[ a22 ] * m[ a33 ] + m[ a13 ] * m[ a21 ] * m[ a32 ] +
+           m[ a12 ] * m[ a23 ] * m[ a31 ] - m[ a13 ] * m[ a22 ] * m[ a31 ] -
+           m[ a11 ] * m[ a23 ] * m[ a32 ] - m[ a12 ] * m[ a21 ] * m[ a33 ];
+}
+
+static inline double
+vertex_error ( const Quadric * q, double x, double y, double z )
+{
+    const double * m = q->m;
+    return m[ 0 ] * x * x + 2 * m[ 1 ] * x * y + 2 * m[ 2 ] * x * z +
+           2 * m[ 3 ] * x + m[ 4 ] * y * y + 2 * m[ 5 ] * y * z +
+           2 * m[ 6 ] * y + m[ 7 ] * z * z + 2 * m[ 8 ] * z + m[ 9 ];
+}
+
+/* cost of merging i0 and i1, optimal position into p */
+static double
+calc_error ( Simplifier * s, uint32_t i0, uint32_t i1, vec3 p )
+{
+    Quadric q;
+    quadric_add ( &q, &s->verts[ i0 ].q, &s->verts[ i1 ].q );
+
+    int    border = s->verts[ i0 ].border & s->verts[ i1 ].border;
+    double det    = quadric_det ( &q, 0, 1, 2, 1, 4, 5, 2, 5, 7 );
+
+    if ( det != 0 && ! border )
+    {
+        p[ 0 ] = -1 / det * quadric_det ( &q, 1, 2, 3, 4, 5, 6, 5, 7, 8 );
+        p[ 1 ] = 1 / det * quadric_det ( &q, 0, 2, 3, 1, 5, 6, 2, 7, 8 );
+        p[ 2 ] = -1 / det * quadric_det ( &q, 0, 1, 3, 1, 4, 6, 2, 5, 8 );
+        return vertex_error ( &q, p[ 0 ], p[ 1 ], p[ 2 ] );
+    }
+
+    /* singular: best of the two ends and the midpoint */
+    float * p0 = s->verts[ i0 ].p;
+    float * p1 = s->verts[ i1 ].p;
+    vec3    pm;
+    glm_vec3_add ( p0, p1, pm );
+    glm_vec3_scale ( pm, 0.5f, pm );
+
+    double e0 = vertex_error ( &q, p0[ 0 ], p0[ 1 ], p0[ 2 ] );
+    double e1 = vertex_error ( &q, p1[ 0 ], p1[ 1 ], p1[ 2 ] );
+    double em = vertex_error ( &q, pm[ 0 ], pm[ 1 ], pm[ 2 ] );
+
+    double err = fmin ( e0, fmin ( e1, em ) );
+    if ( err == e0 ) glm_vec3_copy ( p0, p );
+    if ( err == e1 ) glm_vec3_copy ( p1, p );
+    if ( err == em ) glm_vec3_copy ( pm, p );
+    return err;
+}
+
+static void
+tri_errors ( Simplifier * s, STri * t )
+{
+    vec3 p;
+    for ( int j = 0; j < 3; j++ )
+    {
+        t->err[ j ] = calc_error ( s, t->v[ j ], t->v[ ( j + 1 ) % 3 ], p );
+    }
+    t->err[ 3 ] = fmin ( t->err[ 0 ], fmin ( t->err[ 1 ], t->err[ 2 ] ) );
+}
+
+static inline void
+ref_push ( Simplifier * s, SRef r )
+{
+    if ( s->ref_cnt == s->ref_cap )
+    {
+        s->ref_cap  = s->ref_cap * 2 + 16;
+        s->refs     = grow ( s->refs, s->ref_cap * sizeof ( SRef ) );
+    }
+    s->refs[ s->ref_cnt++ ] = r;
+}
+
+/* would moving v0 (from edge i0-i1) to p flip or squash a triangle? */
+static int
+flipped ( Simplifier * s,
+          vec3         p,
+          uint32_t     i1,
+          SVert *      v0,
+          uint8_t *    deleted )
+{
+    for ( uint32_t k = 0; k < v0->tcount; k++ )
+    {
+        SRef   r = s->refs[ v0->tstart + k ];
+        STri * t = &s->tris[ r.tid ];
+        if ( t->deleted ) continue;
+
+        uint32_t id1 = t->v[ ( r.tvertex + 1 ) % 3 ];
+        uint32_t id2 = t->v[ ( r.tvertex + 2 ) % 3 ];
+
+        /* shares the collapsed edge: goes away */
+        if ( id1 == i1 || id2 == i1 )
+        {
+            deleted[ k ] = 1;
+            continue;
+        }
+
+        vec3 d1, d2, n;
+        glm_vec3_sub ( s->verts[ id1 ].p, p, d1 );
+        glm_vec3_normalize ( d1 );
+        glm_vec3_sub ( s->verts[ id2 ].p, p, d2 );
+        glm_vec3_normalize ( d2 );
+        if ( fabsf ( glm_vec3_dot ( d1, d2 ) ) > 0.999f ) return 1;
+
+        glm_vec3_cross ( d1, d2, n );
+        glm_vec3_normalize ( n );
+        deleted[ k ] = 0;
+        if ( glm_vec3_dot ( n, t->n ) < 0.2f ) return 1;
+    }
+    return 0;
+}
+
+static void
+update_triangles ( Simplifier * s,
+                   uint32_t     i0,
+                   SVert *      v,
+                   uint8_t *    deleted,
+                   uint32_t *   deleted_cnt )
+{
+    for ( uint32_t k = 0; k < v->tcount; k++ )
+    {
+        SRef   r = s->refs[ v->tstart + k ];
+        STri * t = &s->tris[ r.tid ];
+        if ( t->deleted ) continue;
+
+        if ( deleted[ k ] )
+        {
+            t->deleted = 1;
+            ( *deleted_cnt )++;
+            continue;
+        }
+
+        t->v[ r.tvertex ] = i0;
+        t->dirty          = 1;
+        tri_errors ( s, t );
+        ref_push ( s, r );
+    }
+}
+
+static void
+mark_borders ( Simplifier * s )
+{
+    uint32_t * vids   = NULL;
+    uint32_t * vcount = NULL;
+    uint32_t   cap    = 0;
+
+    for ( uint32_t i = 0; i < s->vert_cnt; i++ )
+    {
+        SVert *  v = &s->verts[ i ];
+        uint32_t n = 0;
+
+        for ( uint32_t k = 0; k < v->tcount; k++ )
+        {
+            STri * t = &s->tris[ s->refs[ v->tstart + k ].tid ];
+            for ( int j = 0; j < 3; j++ )
+            {
+                uint32_t id = t->v[ j ], m = 0;
+                while ( m < n && vids[ m ] != id ) m++;
+                if ( m < n )
+                {
+                    vcount[ m ]++;
+                    continue;
+                }
+                if ( n == cap )
+                {
+                    cap    = cap * 2 + 16;
+                    vids   = grow ( vids, cap * sizeof ( uint32_t ) );
+                    vcount = grow ( vcount, cap * sizeof ( uint32_t ) );
+                }
+                vids[ n ]     = id;
+                vcount[ n++ ] = 1;
+            }
+        }
+
+        /* a neighbour seen through one triangle only sits on an open edge */
+        for ( uint32_t m = 0; m < n; m++ )
+        {
+            if ( vcount[ m ] == 1 ) s->verts[ vids[ m ] ].border = 1;
+        }
+    }
+
+    free ( vids );
+    free ( vcount );
+}
+
+static void
+update_mesh ( Simplifier * s, int iteration )
+{
+    if ( iteration > 0 )
+    {
+        uint32_t dst = 0;
+        for ( uint32_t i = 0; i < s->tri_cnt; i++ )
+        {
+            if ( ! s->tris[ i ].deleted ) s->tris[ dst++ ] = s->tris[ i ];
+        }
+        s->tri_cnt = dst;
+    }
+
+    for ( uint32_t i = 0; i < s->vert_cnt; i++ ) s->verts[ i ].tcount = 0;
+    for ( uint32_t i = 0; i < s->tri_cnt; i++ )
+    {
+        for ( int j = 0; j < 3; j++ ) s->verts[ s->tris[ i ].v[ j ] ].tcount++;
+    }
+
+    uint32_t tstart = 0;
+    for ( uint32_t i = 0; i < s->vert_cnt; i++ )
+    {
+        s->verts[ i ].tstart = tstart;
+        tstart += s->verts[ i ].tcount;
+        s->verts[ i ].tcount = 0;
+    }
+
+    if ( s->ref_cap < s->tri_cnt * 3 )
+    {
+        s->ref_cap = s->tri_cnt * 3;
+        s->refs    = grow ( s->refs, s->ref_cap * sizeof ( SRef ) );
+    }
+    s->ref_cnt = s->tri_cnt * 3;
+
+    for ( uint32_t i = 0; i < s->tri_cnt; i++ )
+    {
+        for ( uint32_t j = 0; j < 3; j++ )
+        {
+            SVert * v = &s->verts[ s->tris[ i ].v[ j ] ];
+            s->refs[ v->tstart + v->tcount ].tid     = i;
+            s->refs[ v->tstart + v->tcount ].tvertex = j;
+            v->tcount++;
+        }
+    }
+
+    if ( iteration != 0 ) return;
+
+    mark_borders ( s );
+
+    for ( uint32_t i = 0; i < s->vert_cnt; i++ )
+    {
+        memset ( &s->verts[ i ].q, 0, sizeof ( Quadric ) );
+    }
+
+    for ( uint32_t i = 0; i < s->tri_cnt; i++ )
+    {
+        STri *  t = &s->tris[ i ];
+        float * p = s->verts[ t->v[ 0 ] ].p;
+        vec3    e1, e2;
+        glm_vec3_sub ( s->verts[ t->v[ 1 ] ].p, p, e1 );
+        glm_vec3_sub ( s->verts[ t->v[ 2 ] ].p, p, e2 );
+        glm_vec3_cross ( e1, e2, t->n );
+        glm_vec3_normalize ( t->n );
+
+        Quadric q;
+        quadric_plane (
+            &q, t->n[ 0 ], t->n[ 1 ], t->n[ 2 ], -glm_vec3_dot ( t->n, p ) );
+        for ( int j = 0; j < 3; j++ )
+        {
+            Quadric * vq = &s->verts[ t->v[ j ] ].q;
+            quadric_add ( vq, vq, &q );
+        }
+    }
+
+    for ( uint32_t i = 0; i < s->tri_cnt; i++ ) tri_errors ( s, &s->tris[ i ] );
+}
+
+void
+simplifyMesh ( RMesh * in, uint32_t target_tris, RMesh * out )
+{
+    Simplifier s;
+    memset ( &s, 0, sizeof ( s ) );
+
+    s.tri_cnt  = in->tri_cnt;
+    s.vert_cnt = in->vert_cnt;
+    U_ALLOC ( s.tris, STri, s.tri_cnt );
+    U_ALLOC ( s.verts, SVert, s.vert_cnt );
+
+    vec3 lo, hi;
+    glm_vec3_copy ( in->vertices, lo );
+    glm_vec3_copy ( in->vertices, hi );
+    for ( uint32_t i = 0; i < s.vert_cnt; i++ )
+    {
+        memset ( &s.verts[ i ], 0, sizeof ( SVert ) );
+        glm_vec3_copy ( in->vertices + i * 3, s.verts[ i ].p );
+        glm_vec3_minv ( lo, s.verts[ i ].p, lo );
+        glm_vec3_maxv ( hi, s.verts[ i ].p, hi );
+    }
+    for ( uint32_t i = 0; i < s.tri_cnt; i++ )
+    {
+        memset ( &s.tris[ i ], 0, sizeof ( STri ) );
+        for ( int j = 0; j < 3; j++ ) s.tris[ i ].v[ j ] = in->idx[ i * 3 + j ];
+    }
+
+    /* thresholds below are tuned for unit sized models */
+    double scale2 = glm_vec3_distance ( lo, hi );
+    scale2 *= scale2;
+
+    uint32_t deleted_cnt = 0;
+    for ( int iteration = 0; iteration < 100; iteration++ )
+    {
+        if ( s.tri_cnt - deleted_cnt <= target_tris ) break;
+
+        /* refs grow with every collapse, rebuild them now and then */
+        if ( iteration % 5 == 0 )
+        {
+            update_mesh ( &s, iteration );
+            deleted_cnt = 0;
+        }
+
+        for ( uint32_t i = 0; i < s.tri_cnt; i++ ) s.tris[ i ].dirty = 0;
+
+        double threshold = 1e-9 * pow ( iteration + 3, 7 ) * scale2;
+
+        for ( uint32_t i = 0; i < s.tri_cnt; i++ )
+        {
+            STri * t = &s.tris[ i ];
+            if ( t->err[ 3 ] > threshold || t->deleted || t->dirty ) continue;
+
+            for ( int j = 0; j < 3; j++ )
+            {
+                if ( t->err[ j ] >= threshold ) continue;
+
+                uint32_t i0 = t->v[ j ];
+                uint32_t i1 = t->v[ ( j + 1 ) % 3 ];
+                SVert *  v0 = &s.verts[ i0 ];
+                SVert *  v1 = &s.verts[ i1 ];
+
+                if ( v0->border != v1->border ) continue;
+
+                vec3 p;
+                calc_error ( &s, i0, i1, p );
+
+                uint32_t need = v0->tcount > v1->tcount ? v0->tcount
+                                                         : v1->tcount;
+                if ( need > s.del_cap )
+                {
+                    s.del_cap = need * 2;
+                    s.del0    = grow ( s.del0, s.del_cap );
+                    s.del1    = grow ( s.del1, s.del_cap );
+                }
+
+                if ( flipped ( &s, p, i1, v0, s.del0 ) ) continue;
+                if ( flipped ( &s, p, i0, v1, s.del1 ) ) continue;
+
+                glm_vec3_copy ( p, v0->p );
+                quadric_add ( &v0->q, &v0->q, &v1->q );
+
+                uint32_t tstart = s.ref_cnt;
+                update_triangles ( &s, i0, v0, s.del0, &deleted_cnt );
+                update_triangles ( &s, i0, v1, s.del1, &deleted_cnt );
+
+                uint32_t tcount = s.ref_cnt - tstart;
+                if ( tcount <= v0->tcount )
+                {
+                    /* fits into the old slot, keeps refs from exploding */
+                    if ( tcount )
+                    {
+                        memcpy ( s.refs + v0->tstart,
+                                 s.refs + tstart,
+                                 tcount * sizeof ( SRef ) );
+                    }
+                }
+                else
+                {
+                    v0->tstart = tstart;
+                }
+                v0->tcount = tcount;
+                break;
+            }
+
+            if ( s.tri_cnt - deleted_cnt <= target_tris ) break;
+        }
+    }
+
+    /* compact: keep referenced vertices only, tstart becomes the new id */
+    for ( uint32_t i = 0; i < s.vert_cnt; i++ ) s.verts[ i ].tcount = 0;
+
+    uint32_t tri_cnt = 0;
+    for ( uint32_t i = 0; i < s.tri_cnt; i++ )
+    {
+        if ( s.tris[ i ].deleted ) continue;
+        tri_cnt++;
+        for ( int j = 0; j < 3; j++ ) s.verts[ s.tris[ i ].v[ j ] ].tcount = 1;
+    }
+
+    uint32_t vert_cnt = 0;
+    for ( uint32_t i = 0; i < s.vert_cnt; i++ )
+    {
+        if ( s.verts[ i ].tcount ) s.verts[ i ].tstart = vert_cnt++;
+    }
+
+    out->tri_cnt  = tri_cnt;
+    out->vert_cnt = vert_cnt;
+    U_ALLOC ( out->idx, uint32_t, tri_cnt * 3 + 1 );
+    U_ALLOC ( out->vertices, float, vert_cnt * 3 + 1 );
+
+    for ( uint32_t i = 0; i < s.vert_cnt; i++ )
+    {
+        if ( ! s.verts[ i ].tcount ) continue;
+        glm_vec3_copy ( s.verts[ i ].p,
+                        out->vertices + s.verts[ i ].tstart * 3 );
+    }
+
+    uint32_t k = 0;
+    for ( uint32_t i = 0; i < s.tri_cnt; i++ )
+    {
+        if ( s.tris[ i ].deleted ) continue;
+        for ( int j = 0; j < 3; j++ )
+        {
+            out->idx[ k++ ] = s.verts[ s.tris[ i ].v[ j ] ].tstart;
+        }
+    }
+
+    free ( s.tris );
+    free ( s.verts );
+    free ( s.refs );
+    free ( s.del0 );
+    free ( s.del1 );
+}
+
+void
+triangulateMesh ( tinyobj_attrib_t * attrib, RMesh * m )
+{
+    uint32_t tri_cnt = 0;
+    for ( uint32_t nfc = 0; nfc < attrib->num_face_num_verts; nfc++ )
+    {
+        if ( attrib->face_num_verts[ nfc ] >= 3 )
+            tri_cnt += attrib->face_num_verts[ nfc ] - 2;
+    }
+
+    m->tri_cnt  = tri_cnt;
+    m->vert_cnt = attrib->num_vertices;
+    U_ALLOC ( m->idx, uint32_t, tri_cnt * 3 + 1 );
+    U_ALLOC ( m->vertices, float, m->vert_cnt * 3 + 1 );
+    memcpy ( m->vertices,
+             attrib->vertices,
+             m->vert_cnt * 3 * sizeof ( float ) );
+
+    uint32_t   face_offset = 0;
+    uint32_t * idx         = m->idx;
+    for ( uint32_t nfc = 0; nfc < attrib->num_face_num_verts; nfc++ )
+    {
+        int face_cnt = attrib->face_num_verts[ nfc ];
+        for ( int k = 1; k < face_cnt - 1; k++ )
+        {
+            *( idx++ ) = attrib->faces[ face_offset ].v_idx;
+            *( idx++ ) = attrib->faces[ face_offset + k ].v_idx;
+            *( idx++ ) = attrib->faces[ face_offset + k + 1 ].v_idx;
+        }
+        face_offset += face_cnt;
+    }
+}
+
+/*
+ * Vertex cache optimisation (Forsyth, "Linear-Speed Vertex Cache
+ * Optimisation"). Triangles are emitted greedily by the score of their
+ * vertices in a simulated LRU cache: recently used vertices score high,
+ * vertices with few triangles left get a boost so islands get finished.
+ * Only triangles touching the cache are rescored after every step.
+ */
+#define VCACHE_SIZE        32
+#define VCACHE_VALENCE_MAX 64 /* valence table size, clamped above */
+
+typedef struct
+{
+    float pos[ VCACHE_SIZE ];
+    float valence[ VCACHE_VALENCE_MAX ];
+} VCacheScores;
+
+static void
+vcache_scores ( VCacheScores * t )
+{
+    for ( int i = 0; i < VCACHE_SIZE; i++ )
+    {
+        /* the last triangle's vertices, on purpose a bit below the next
+         * ones so strips don't get favoured over fans */
+        if ( i < 3 )
+            t->pos[ i ] = 0.75f;
+        else
+            t->pos[ i ] = powf (
+                1.0f - ( float ) ( i - 3 ) / ( VCACHE_SIZE - 3 ), 1.5f );
+    }
+    t->valence[ 0 ] = 0.0f;
+    for ( int i = 1; i < VCACHE_VALENCE_MAX; i++ )
+        t->valence[ i ] = 2.0f * powf ( ( float ) i, -0.5f );
+}
+
+static inline __attribute__ ( ( always_inline ) ) float
+vcache_score ( const VCacheScores * t, int pos, uint32_t valence )
+{
+    if ( ! valence ) return -1.0f;
+    if ( valence >= VCACHE_VALENCE_MAX ) valence = VCACHE_VALENCE_MAX - 1;
+    return ( pos < 0 ? 0.0f : t->pos[ pos ] ) + t->valence[ valence ];
+}
+
+void
+optimizeMesh ( RMesh * m )
+{
+    const uint32_t tri_cnt = m->tri_cnt, vert_cnt = m->vert_cnt;
+    if ( ! tri_cnt ) return;
+
+    VCacheScores tab;
+    vcache_scores ( &tab );
+
+    /* vertex -> remaining triangles, removed by swapping with the last */
+    uint32_t * valence;
+    uint32_t * adj_start;
+    uint32_t * adj;
+    int *      cache_pos;
+    float *    vscore;
+    float *    tscore;
+    uint8_t *  emitted;
+    uint32_t * order;
+    U_ALLOC ( valence, uint32_t, vert_cnt + 1 );
+    U_ALLOC ( adj_start, uint32_t, vert_cnt + 1 );
+    U_ALLOC ( adj, uint32_t, tri_cnt * 3 );
+    U_ALLOC ( cache_pos, int, vert_cnt + 1 );
+    U_ALLOC ( vscore, float, vert_cnt + 1 );
+    U_ALLOC ( tscore, float, tri_cnt );
+    U_ALLOC ( emitted, uint8_t, tri_cnt );
+    U_ALLOC ( order, uint32_t, tri_cnt );
+
+    memset ( valence, 0, vert_cnt * sizeof ( uint32_t ) );
+    for ( uint32_t i = 0; i < tri_cnt * 3; i++ ) valence[ m->idx[ i ] ]++;
+
+    uint32_t sum = 0;
+    for ( uint32_t v = 0; v < vert_cnt; v++ )
+    {
+        adj_start[ v ] = sum;
+        sum += valence[ v ];
+        valence[ v ]   = 0;
+        cache_pos[ v ] = -1;
+    }
+    for ( uint32_t t = 0; t < tri_cnt; t++ )
+    {
+        for ( int k = 0; k < 3; k++ )
+        {
+            const uint32_t v = m->idx[ t * 3 + k ];
+            adj[ adj_start[ v ] + valence[ v ]++ ] = t;
+        }
+    }
+
+    for ( uint32_t v = 0; v < vert_cnt; v++ )
+        vscore[ v ] = vcache_score ( &tab, -1, valence[ v ] );
+
+    int64_t best = 0;
+    for ( uint32_t t = 0; t < tri_cnt; t++ )
+    {
+        emitted[ t ] = 0;
+        tscore[ t ]  = vscore[ m->idx[ t * 3 ] ] +
+                      vscore[ m->idx[ t * 3 + 1 ] ] +
+                      vscore[ m->idx[ t * 3 + 2 ] ];
+        if ( tscore[ t ] > tscore[ best ] ) best = t;
+    }
+
+    /* three extra slots for what gets pushed out by the new triangle */
+    int32_t  cache[ VCACHE_SIZE + 3 ];
+    int      cache_cnt = 0;
+    uint32_t cursor    = 0;
+
+    for ( uint32_t n = 0; n < tri_cnt; n++ )
+    {
+        /* dead end: nothing in the cache has triangles left */
+        if ( best < 0 )
+        {
+            while ( emitted[ cursor ] ) cursor++;
+            best = cursor;
+        }
+
+        const uint32_t * tv = m->idx + best * 3;
+        order[ n ]          = best;
+        emitted[ best ]     = 1;
+
+        int32_t next[ VCACHE_SIZE + 3 ];
+        int     next_cnt = 0;
+        for ( int k = 0; k < 3; k++ )
+        {
+            const uint32_t v = tv[ k ];
+
+            /* drop best from the remaining triangles of v */
+            uint32_t * a = adj + adj_start[ v ];
+            for ( uint32_t i = 0; i < valence[ v ]; i++ )
+            {
+                if ( a[ i ] != ( uint32_t ) best ) continue;
+                a[ i ] = a[ --valence[ v ] ];
+                break;
+            }
+
+            /* repeated vertex in a degenerate triangle */
+            if ( ( k > 0 && v == tv[ 0 ] ) || ( k > 1 && v == tv[ 1 ] ) )
+                continue;
+            next[ next_cnt++ ] = v;
+        }
+        for ( int i = 0; i < cache_cnt; i++ )
+        {
+            const int32_t v = cache[ i ];
+            if ( v != ( int32_t ) tv[ 0 ] && v != ( int32_t ) tv[ 1 ] &&
+                 v != ( int32_t ) tv[ 2 ] )
+            {
+                next[ next_cnt++ ] = v;
+            }
+        }
+
+        for ( int i = 0; i < next_cnt; i++ )
+        {
+            const int32_t v = next[ i ];
+            cache_pos[ v ]  = i < VCACHE_SIZE ? i : -1;
+            vscore[ v ] = vcache_score ( &tab, cache_pos[ v ], valence[ v ] );
+        }
+
+        /* rescore what the cache touches, pick the best of it */
+        best             = -1;
+        float best_score = -1.0f;
+        for ( int i = 0; i < next_cnt; i++ )
+        {
+            const int32_t    v = next[ i ];
+            const uint32_t * a = adj + adj_start[ v ];
+            for ( uint32_t j = 0; j < valence[ v ]; j++ )
+            {
+                const uint32_t   t  = a[ j ];
+                const uint32_t * ti = m->idx + t * 3;
+                tscore[ t ] = vscore[ ti[ 0 ] ] + vscore[ ti[ 1 ] ] +
+                              vscore[ ti[ 2 ] ];
+                if ( tscore[ t ] > best_score )
+                {
+                    best_score = tscore[ t ];
+                    best       = t;
+                }
+            }
+        }
+
+        cache_cnt = next_cnt < VCACHE_SIZE ? next_cnt : VCACHE_SIZE;
+        memcpy ( cache, next, cache_cnt * sizeof ( int32_t ) );
+    }
+
+    /* triangles in the new order, vertices renumbered by first use so the
+     * vertex stage reads them front to back; unused ones are dropped */
+    uint32_t * idx;
+    uint32_t * remap = valence; /* all 0 by now */
+    float *    verts;
+    U_ALLOC ( idx, uint32_t, tri_cnt * 3 + 1 );
+    U_ALLOC ( verts, float, vert_cnt * 3 + 1 );
+
+    uint32_t used = 0;
+    for ( uint32_t n = 0; n < tri_cnt; n++ )
+    {
+        for ( int k = 0; k < 3; k++ )
+        {
+            const uint32_t v = m->idx[ order[ n ] * 3 + k ];
+            if ( ! remap[ v ] )
+            {
+                remap[ v ] = ++used;
+                memcpy ( verts + ( used - 1 ) * 3,
+                         m->vertices + v * 3,
+                         3 * sizeof ( float ) );
+            }
+            idx[ n * 3 + k ] = remap[ v ] - 1;
+        }
+    }
+
+    free ( m->idx );
+    free ( m->vertices );
+    m->idx      = idx;
+    m->vertices = verts;
+    m->vert_cnt = used;
+
+    free ( valence );
+    free ( adj_start );
+    free ( adj );
+    free ( cache_pos );
+    free ( vscore );
+    free ( tscore );
+    free ( emitted );
+    free ( order );
+}
+
+void
+buildLodChain ( RObject * o )
+{
+    o->lod_cnt = 1;
+    o->lod     = 0;
+
+    for ( int l = 1; l < LOD_MAX; l++ )
+    {
+        RMesh *  prev   = &o->lods[ l - 1 ];
+        uint32_t target = prev->tri_cnt / 2;
+        if ( target < LOD_MIN_TRIS ) break;
+
+        simplifyMesh ( prev, target, &o->lods[ l ] );
+
+        /* borders and flip checks stopped the collapse, no point going on */
+        if ( o->lods[ l ].tri_cnt > prev->tri_cnt / 4 * 3 )
+        {
+            destroyMesh ( &o->lods[ l ] );
+            break;
+        }
+
+        optimizeMesh ( &o->lods[ l ] );
+        o->lod_cnt++;
+        printf ( "lod %d: %u triangles\n", l, o->lods[ l ].tri_cnt );
+    }
+}
+
+int
+selectLodAt ( RObject *  o,
+              Engine *   e,
+              const vec3 eye,
+              float      fovy_rad,
+              float      height )
+{
+    /* bounding sphere around the (possibly user moved) center */
+    vec3 ext;
+    for ( int i = 0; i < 3; i++ )
+    {
+        ext[ i ] = fmaxf ( fabsf ( o->aabb_max[ i ] - o->center[ i ] ),
+                           fabsf ( o->aabb_min[ i ] - o->center[ i ] ) ) *
+                   o->scale[ i ];
+    }
+    float r    = glm_vec3_norm ( ext );
+    float dist = glm_vec3_distance ( o->position, ( float * ) eye );
+
+    if ( dist <= r || o->lod_cnt < 2 ) return 0;
+
+    float r_px = r / ( dist * tanf ( fovy_rad * 0.5f ) ) * ( height * 0.5f );
+    float want = e->conf.lod_tris_per_px * ( float ) GLM_PI * r_px * r_px;
+
+    int lod = 0;
+    while ( lod + 1 < o->lod_cnt && o->lods[ lod + 1 ].tri_cnt >= want )
+    {
+        lod++;
+    }
+    return lod;
+}
+
+int
+selectLod ( RObject * o, Engine * e )
+{
+    return selectLodAt (
+        o, e, e->camera.position, e->conf.fovy_rad, e->height );
+}
+
+void
+destroyMesh ( RMesh * m )
+{
+    free ( m->vertices );
+    free ( m->idx );
+    m->vertices = NULL;
+    m->idx      = NULL;
+    m->tri_cnt  = 0;
+    m->vert_cnt = 0;
+}
@@ -0,0 +1,42 @@
+#pragma once
+#ifndef CUSTOM_RENDER_MESH_H
+#define CUSTOM_RENDER_MESH_H
+
+#include "engine.h"
+
+#include <stdint.h>
+
+/* fan-triangulates every tinyobj face into m, copies the vertex array */
+void
+triangulateMesh ( tinyobj_attrib_t * attrib, RMesh * m );
+
+/* reorders triangles for post-transform vertex cache hits (Forsyth) and
+ * vertices by first use, dropping unreferenced ones */
+void
+optimizeMesh ( RMesh * m );
+
+/* Quadric edge collapse (Garland-Heckbert, collapse order as in Forstmann's
+ * "Fast Quadric Mesh Simplification") down to about target_tris. */
+void
+simplifyMesh ( RMesh * in, uint32_t target_tris, RMesh * out );
+
+/* fills o->lods[ 1.. ] from o->lods[ 0 ] */
+void
+buildLodChain ( RObject * o );
+
+/* picks the level from the projected bounding sphere size */
+int
+selectLod ( RObject * o, Engine * e );
+
+/* the same for a camera at eye, fovy_rad, height pixels tall */
+int
+selectLodAt ( RObject *  o,
+              Engine *   e,
+              const vec3 eye,
+              float      fovy_rad,
+              float      height );
+
+void
+destroyMesh ( RMesh * m );
+
+#endif /* CUSTOM_RENDER_MESH_H */
@@ -0,0 +1,312 @@
+#include "occlusion.h"
+
+#include <emmintrin.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#define OCC_FULL 0xffffffffu
+
+static inline __attribute__ ( ( always_inline ) ) int
+occ_min ( int a, int b )
+{
+    return a < b ? a : b;
+}
+
+static inline __attribute__ ( ( always_inline ) ) int
+occ_max ( int a, int b )
+{
+    return a < b ? b : a;
+}
+
+/* bits of a tile hanging over the right or bottom border; nothing is
+ * drawn there, so they count as covered */
+static uint32_t
+tile_outside ( OcclusionBuffer * ob, int tx, int ty )
+{
+    const int cols = ob->w - tx * OCC_TILE_W;
+    const int rows = ob->h - ty * OCC_TILE_H;
+    if ( cols >= OCC_TILE_W && rows >= OCC_TILE_H ) return 0;
+
+    uint32_t m = 0;
+    for ( int r = 0; r < OCC_TILE_H; r++ )
+        for ( int c = 0; c < OCC_TILE_W; c++ )
+            if ( c >= cols || r >= rows ) m |= 1u << ( r * OCC_TILE_W + c );
+    return m;
+}
+
+void
+clearOcclusion ( OcclusionBuffer * ob, uint32_t w, uint32_t h )
+{
+    ob->w  = ( w + OCC_SCALE - 1 ) / OCC_SCALE;
+    ob->h  = ( h + OCC_SCALE - 1 ) / OCC_SCALE;
+    ob->tw = ( ob->w + OCC_TILE_W - 1 ) / OCC_TILE_W;
+    ob->th = ( ob->h + OCC_TILE_H - 1 ) / OCC_TILE_H;
+
+    if ( ob->tw * ob->th > ob->cap )
+    {
+        free ( ob->tiles );
+        ob->cap = ob->tw * ob->th;
+        U_ALLOC ( ob->tiles, OcclusionTile, ob->cap );
+    }
+
+    for ( int ty = 0; ty < ob->th; ty++ )
+    {
+        for ( int tx = 0; tx < ob->tw; tx++ )
+        {
+            OcclusionTile * t = ob->tiles + ty * ob->tw + tx;
+            t->z0             = -FLT_MAX;
+            t->z1             = FLT_MAX;
+            t->mask           = tile_outside ( ob, tx, ty );
+        }
+    }
+}
+
+/* merges coverage cov of a triangle no farther than tz into the tile */
+static inline __attribute__ ( ( always_inline ) ) void
+update_tile ( OcclusionBuffer * ob, int tx, int ty, uint32_t cov, float tz )
+{
+    OcclusionTile * t = ob->tiles + ty * ob->tw + tx;
+
+    /* nothing to gain over the reference layer */
+    if ( ! cov || tz <= t->z0 ) return;
+
+    /* the triangle is much farther than the working layer, compared to
+     * how much it would improve z0: start the working layer over */
+    if ( t->z1 - tz > tz - t->z0 )
+    {
+        t->z1   = FLT_MAX;
+        t->mask = tile_outside ( ob, tx, ty );
+    }
+
+    t->mask |= cov;
+    t->z1 = fminf ( t->z1, tz );
+
+    if ( t->mask == OCC_FULL )
+    {
+        t->z0   = fmaxf ( t->z0, t->z1 );
+        t->z1   = FLT_MAX;
+        t->mask = tile_outside ( ob, tx, ty );
+    }
+}
+
+/* same winding the rasterizer accepts */
+static inline __attribute__ ( ( always_inline ) ) int
+front_facing ( vec3 * t )
+{
+    return ( t[ 0 ][ 0 ] - t[ 2 ][ 0 ] ) * ( t[ 1 ][ 1 ] - t[ 2 ][ 1 ] ) -
+               ( t[ 1 ][ 0 ] - t[ 2 ][ 0 ] ) * ( t[ 0 ][ 1 ] - t[ 2 ][ 1 ] ) >
+           0;
+}
+
+/* a screen space edge from a to b, by the bits of x, y of both ends */
+typedef struct
+{
+    uint32_t k[ 4 ];
+} OccEdge;
+
+static inline OccEdge
+occ_edge ( const float * a, const float * b )
+{
+    OccEdge e;
+    memcpy ( e.k, a, 2 * sizeof ( float ) );
+    memcpy ( e.k + 2, b, 2 * sizeof ( float ) );
+    return e;
+}
+
+static inline uint32_t
+edge_hash ( const OccEdge * e )
+{
+    uint32_t h = 2166136261u;
+    for ( int i = 0; i < 4; i++ ) h = ( h ^ e->k[ i ] ) * 16777619u;
+    return h ^ ( h >> 15 );
+}
+
+/* open addressing, used[ i ] marks a taken slot */
+typedef struct
+{
+    OccEdge * e;
+    uint8_t * used;
+    uint32_t  mask;
+} EdgeSet;
+
+static int
+edge_find ( const EdgeSet * s, const OccEdge * e, int add )
+{
+    for ( uint32_t i = edge_hash ( e ) & s->mask;; i = ( i + 1 ) & s->mask )
+    {
+        if ( ! s->used[ i ] )
+        {
+            if ( add )
+            {
+                s->used[ i ] = 1;
+                s->e[ i ]    = *e;
+            }
+            return 0;
+        }
+        if ( ! memcmp ( s->e + i, e, sizeof ( OccEdge ) ) ) return 1;
+    }
+}
+
+/* per front facing triangle, bit k set when its edge k (the one facing
+ * vertex k) is shared with another front facing triangle, running the
+ * other way: inside the occluder's silhouette */
+static uint8_t *
+inner_edges ( vec3 * v, int cnt )
+{
+    EdgeSet  s;
+    uint32_t size = 64;
+    while ( size < ( uint32_t ) cnt * 6 ) size *= 2;
+    s.mask = size - 1;
+    U_ALLOC ( s.e, OccEdge, size );
+    U_ALLOC ( s.used, uint8_t, size );
+    memset ( s.used, 0, size );
+
+    uint8_t * inner;
+    U_ALLOC ( inner, uint8_t, cnt );
+
+    for ( int i = 0; i < cnt; i++ )
+    {
+        vec3 * t = v + i * 3;
+        if ( ! front_facing ( t ) ) continue;
+        for ( int k = 0; k < 3; k++ )
+        {
+            const OccEdge e =
+                occ_edge ( t[ ( k + 1 ) % 3 ], t[ ( k + 2 ) % 3 ] );
+            edge_find ( &s, &e, 1 );
+        }
+    }
+    for ( int i = 0; i < cnt; i++ )
+    {
+        vec3 * t = v + i * 3;
+        inner[ i ]     = 0;
+        if ( ! front_facing ( t ) ) continue;
+        for ( int k = 0; k < 3; k++ )
+        {
+            const OccEdge e =
+                occ_edge ( t[ ( k + 2 ) % 3 ], t[ ( k + 1 ) % 3 ] );
+            if ( edge_find ( &s, &e, 0 ) ) inner[ i ] |= 1 << k;
+        }
+    }
+
+    free ( s.e );
+    free ( s.used );
+    return inner;
+}
+
+void
+drawOccluder ( OcclusionBuffer * ob, vec3 * v, int cnt )
+{
+    const float  inv   = 1.0f / OCC_SCALE;
+    const __m128 lanes = _mm_set_ps ( 3.0f, 2.0f, 1.0f, 0.0f );
+
+    uint8_t * inner = inner_edges ( v, cnt );
+
+    for ( int i = 0; i < cnt; i++, v += 3 )
+    {
+        if ( ! front_facing ( v ) ) continue;
+
+        const float x1 = v[ 0 ][ 0 ] * inv, y1 = v[ 0 ][ 1 ] * inv;
+        const float x2 = v[ 1 ][ 0 ] * inv, y2 = v[ 1 ][ 1 ] * inv;
+        const float x3 = v[ 2 ][ 0 ] * inv, y3 = v[ 2 ][ 1 ] * inv;
+
+        const float tz =
+            fminf ( v[ 0 ][ 2 ], fminf ( v[ 1 ][ 2 ], v[ 2 ][ 2 ] ) );
+
+        /* coarse pixels the triangle touches at all */
+        const float min_x = fminf ( x1, fminf ( x2, x3 ) );
+        const float min_y = fminf ( y1, fminf ( y2, y3 ) );
+        const float max_x = fmaxf ( x1, fmaxf ( x2, x3 ) );
+        const float max_y = fmaxf ( y1, fmaxf ( y2, y3 ) );
+
+        const int cx0 = occ_max ( ( int ) floorf ( min_x ), 0 );
+        const int cy0 = occ_max ( ( int ) floorf ( min_y ), 0 );
+        const int cx1 = occ_min ( ( int ) ceilf ( max_x ), ob->w ) - 1;
+        const int cy1 = occ_min ( ( int ) ceilf ( max_y ), ob->h ) - 1;
+        if ( cx0 > cx1 || cy0 > cy1 ) continue;
+
+        /* edge functions as in setup_tri (), at coarse pixel centres.
+         * Silhouette edges only count a coarse pixel when all of it is on
+         * the inside: at its centre they have to clear half the pixel,
+         * ( |a| + |b| ) / 2. Edges shared inside the occluder test the
+         * centre alone, with a hair of slack for the rounding of either
+         * side, so its triangles stay closed. */
+        const float a[ 3 ]  = { y2 - y3, y3 - y1, y1 - y2 };
+        const float b[ 3 ]  = { x3 - x2, x1 - x3, x2 - x1 };
+        const float ox[ 3 ] = { x3, x3, x1 };
+        const float oy[ 3 ] = { y3, y3, y1 };
+        __m128      step[ 3 ], clear[ 3 ];
+        for ( int k = 0; k < 3; k++ )
+        {
+            step[ k ]  = _mm_mul_ps ( lanes, _mm_set1_ps ( a[ k ] ) );
+            const float len = fabsf ( a[ k ] ) + fabsf ( b[ k ] );
+            clear[ k ] = _mm_set1_ps ( inner[ i ] >> k & 1 ? -1e-3f * len
+                                                           : 0.5f * len );
+        }
+
+        for ( int ty = cy0 / OCC_TILE_H; ty <= cy1 / OCC_TILE_H; ty++ )
+        {
+            for ( int tx = cx0 / OCC_TILE_W; tx <= cx1 / OCC_TILE_W; tx++ )
+            {
+                const float px = tx * OCC_TILE_W + 0.5f;
+                uint32_t    cov = 0;
+
+                for ( int r = 0; r < OCC_TILE_H; r++ )
+                {
+                    const float py = ty * OCC_TILE_H + r + 0.5f;
+
+                    __m128 lo = _mm_castsi128_ps ( _mm_set1_epi32 ( -1 ) );
+                    __m128 hi = lo;
+                    for ( int k = 0; k < 3; k++ )
+                    {
+                        const __m128 e0 = _mm_set1_ps (
+                            a[ k ] * ( px - ox[ k ] ) +
+                            b[ k ] * ( py - oy[ k ] ) );
+                        const __m128 e_lo = _mm_add_ps ( e0, step[ k ] );
+                        const __m128 e_hi = _mm_add_ps (
+                            e_lo, _mm_set1_ps ( 4.0f * a[ k ] ) );
+
+                        lo = _mm_and_ps (
+                            lo, _mm_cmpge_ps ( e_lo, clear[ k ] ) );
+                        hi = _mm_and_ps (
+                            hi, _mm_cmpge_ps ( e_hi, clear[ k ] ) );
+                    }
+
+                    const uint32_t row = _mm_movemask_ps ( lo ) |
+                                         ( _mm_movemask_ps ( hi ) << 4 );
+                    cov |= row << ( r * OCC_TILE_W );
+                }
+
+                update_tile ( ob, tx, ty, cov, tz );
+            }
+        }
+    }
+
+    free ( inner );
+}
+
+int
+testOcclusion ( OcclusionBuffer * ob, const int * rect, float z_near )
+{
+    const int cx0 = occ_max ( rect[ 0 ] / OCC_SCALE, 0 );
+    const int cy0 = occ_max ( rect[ 1 ] / OCC_SCALE, 0 );
+    const int cx1 = occ_min ( rect[ 2 ] / OCC_SCALE, ob->w - 1 );
+    const int cy1 = occ_min ( rect[ 3 ] / OCC_SCALE, ob->h - 1 );
+
+    for ( int ty = cy0 / OCC_TILE_H; ty <= cy1 / OCC_TILE_H; ty++ )
+    {
+        for ( int tx = cx0 / OCC_TILE_W; tx <= cx1 / OCC_TILE_W; tx++ )
+        {
+            if ( ! ( ob->tiles[ ty * ob->tw + tx ].z0 > z_near ) ) return 0;
+        }
+    }
+    return 1;
+}
+
+void
+destroyOcclusion ( OcclusionBuffer * ob )
+{
+    free ( ob->tiles );
+    ob->tiles = NULL;
+    ob->cap   = 0;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#ifndef CUSTOM_RENDER_OCCLUSION_H
+#define CUSTOM_RENDER_OCCLUSION_H
+
+#include "engine.h"
+
+#include <stdint.h>
+
+/* sizes ob for a w x h render target and empties it */
+void
+clearOcclusion ( OcclusionBuffer * ob, uint32_t w, uint32_t h );
+
+/* cnt triangles in render target pixels, as vertexStage () leaves o->v;
+ * a coarse pixel is covered only when the triangle contains all of it,
+ * depth is conservative */
+void
+drawOccluder ( OcclusionBuffer * ob, vec3 * v, int cnt );
+
+/* 1 if every tile under rect { xmin, ymin, xmax, ymax } (render target
+ * pixels, inclusive) has occluders nearer than z_near */
+int
+testOcclusion ( OcclusionBuffer * ob, const int * rect, float z_near );
+
+void
+destroyOcclusion ( OcclusionBuffer * ob );
+
+#endif /* CUSTOM_RENDER_OCCLUSION_H */
@@ -1,4 +1,6 @@
 #include "pipeline.h"
+#include "capture.h"
+#include "video.h"
 
 /*
  * Framebuffer, and [ ] are pixels.
@@ -85,240 +87,1947 @@ clip ( int val, int min, int max )
     return fast_max ( min, fast_min ( max, val ) );
 }
 
+#define X1  v[ 0 ][ 0 ]
+#define X2  v[ 1 ][ 0 ]
+#define X3  v[ 2 ][ 0 ]
+#define Y1  v[ 0 ][ 1 ]
+#define Y2  v[ 1 ][ 1 ]
+#define Y3  v[ 2 ][ 1 ]
+#define ZI1 zi[ 0 ]
+#define ZI2 zi[ 1 ]
+#define ZI3 zi[ 2 ]
+
+/* 28.4 fixed point: vertices are snapped to 1/16 px, so edge functions are
+ * exact integers and two triangles sharing an edge agree on every pixel. */
+#define SUBPIX_BITS 4
+#define SUBPIX      ( 1 << SUBPIX_BITS )
+#define SUBPIX_HALF ( SUBPIX >> 1 )
+
 static inline __attribute__ ( ( always_inline ) ) int
-fast_floorf ( float x )
+to_fixed ( float x )
 {
-    int i = ( int ) x;
-    return ( x < 0 && x != ( float ) i ) ? i - 1 : i;
+    /* rasterize() rejects negative coords, so rounding is just +0.5 */
+    return ( int ) ( x * ( float ) SUBPIX + 0.5f );
 }
 
-static inline __attribute__ ( ( always_inline ) ) int
-fast_ceilf ( float x )
+/* Top-left fill rule: a pixel centre lying exactly on an edge belongs to
+ * the triangle only if that edge is a left edge (interior to the right) or
+ * a top edge (horizontal, interior below). Others get biased by -1 so the
+ * `w >= 0` test becomes `w > 0` for them. */
+static inline __attribute__ ( ( always_inline ) ) int32_t
+edge_bias ( int32_t a, int32_t b )
 {
-    int i = ( int ) x;
-    return ( x > 0 && x != ( float ) i ) ? i + 1 : i;
+    return ( a > 0 || ( a == 0 && b > 0 ) ) ? 0 : -1;
 }
 
-void
-draw_edgef ( float x0,
-             float y0,
-             float x1,
-             float y1,
-             int * l_x,
-             int * r_x,
-             int   min_y,
-             int   max_y,
-             int   min_x,
-             int   max_x )
+/* edge value offsets of 4 neighbouring pixels */
+static inline __attribute__ ( ( always_inline ) ) __m128i
+lane_offsets ( int32_t d )
+{
+    return _mm_set_epi32 ( 3 * d, 2 * d, d, 0 );
+}
+
+/* 19.10.26 ::: one depth test of pixel idx into Framebuffer.heat. Bands
+ * draw disjoint rows, so plain adds do. */
+static inline __attribute__ ( ( always_inline ) ) void
+count_px ( Framebuffer * f, uint32_t idx, int pass )
 {
-    if ( y0 > y1 )
+    if ( f->count ) f->heat[ idx ] += pass ? HEAT_TEST + HEAT_WRITE : HEAT_TEST;
+}
+
+/* colour cpx of a fragment that passed the depth test into pixel idx */
+static inline __attribute__ ( ( always_inline ) ) void
+write_px ( Framebuffer * f, uint32_t idx, uint64_t z_px, vec4 cpx )
+{
+    DBuffer ** faint_ll = f->transparent + idx;
+    vec4 *     curr_c   = f->opaque_c + idx;
+    uint64_t * curr_z   = f->opaque_z + idx;
+
+    if ( cpx[ ALPHA_IDX ] >= OPAQUE_THRSHD )
     {
-        float tx = x0, ty = y0;
-        x0 = x1;
-        y0 = y1;
-        x1 = tx;
-        y1 = ty;
+        glm_vec4_copy ( cpx, *curr_c );
+        *curr_z = z_px;
     }
+    else
+    {
+        if ( f->count )
+            __atomic_fetch_add ( &f->stats.transparent, 1, __ATOMIC_RELAXED );
+
+        DBuffer * newBuf = getAuxDBuffer ( f );
+        glm_vec4_copy ( cpx, newBuf->color );
+        newBuf->z    = z_px;
+        newBuf->next = NULL;
 
-    float dy = y1 - y0;
-    if ( dy == 0.0f ) return;
+        if ( ! ( *faint_ll ) )
+        {
+            ( *faint_ll ) = newBuf;
+            return;
+        }
+        while ( ( *faint_ll )->next && ( *faint_ll )->next->z >= z_px )
+        {
+            ( *faint_ll ) = ( *faint_ll )->next;
+        }
+        newBuf->next        = ( *faint_ll )->next;
+        ( *faint_ll )->next = newBuf;
+    }
+}
 
-    float dx      = ( x1 - x0 ) / dy;
-    int   y_start = ( int ) ceilf ( y0 );
-    int   y_end   = ( int ) floorf ( y1 );
-    if ( y_end < min_y || y_start > max_y ) return;
+static inline __attribute__ ( ( always_inline ) ) void
+shade_px ( Framebuffer * f,
+           uint32_t      idx,
+           float         w1,
+           float         w2,
+           float         w3,
+           float         denom,
+           uint64_t *    zi,
+           vec4 *        c )
+{
+    vec4 ctemp;
 
-    if ( y_start < min_y ) y_start = min_y;
-    if ( y_end > max_y ) y_end = max_y;
+    uint64_t z_px =
+        ( w1 * ( float ) ZI1 + w2 * ( float ) ZI2 + w3 * ( float ) ZI3 ) /
+        denom;
 
-    float x = x0 + dx * ( y_start - y0 );
-    for ( int y = y_start; y <= y_end; y++ )
+    if ( z_px < f->opaque_z[ idx ] )
     {
-        int xi = ( int ) ( x + 0.5f );
-        if ( xi < min_x ) xi = min_x;
-        if ( xi > max_x ) xi = max_x;
-        if ( xi <= l_x[ y ] ) l_x[ y ] = xi;
-        if ( xi >= r_x[ y ] ) r_x[ y ] = xi;
-        x += dx;
+        count_px ( f, idx, 0 );
+        return;
     }
+    count_px ( f, idx, 1 );
+
+    vec4 cpx;
+    glm_vec4_scale ( c[ 0 ], w1, cpx );
+    glm_vec4_scale ( c[ 1 ], w2, ctemp );
+    glm_vec4_add ( cpx, ctemp, cpx );
+    glm_vec4_scale ( c[ 2 ], w3, ctemp );
+    glm_vec4_add ( cpx, ctemp, cpx );
+    glm_vec4_divs ( cpx, denom, cpx );
+
+    write_px ( f, idx, z_px, cpx );
 }
 
-void
-rasterize ( Framebuffer * f, vec3 * v, uint64_t * zi, vec4 * c )
+/* 19.10.26 ::: Fragments for Framebuffer.shader, see FragBatch. A batch
+ * is one step of the edge walk; its fragments are depth tested first,
+ * then the whole step is set up at once, shaded and written. */
+typedef struct
 {
+    FragBatch b;
+    uint32_t  idx[ FRAG_BATCH ];
+    uint64_t  z[ FRAG_BATCH ]; /* as tested */
 
-#define X1  v[ 0 ][ 0 ]
-#define X2  v[ 1 ][ 0 ]
-#define X3  v[ 2 ][ 0 ]
-#define Y1  v[ 0 ][ 1 ]
-#define Y2  v[ 1 ][ 1 ]
-#define Y3  v[ 2 ][ 1 ]
-#define Z1  v[ 0 ][ 2 ]
-#define Z2  v[ 1 ][ 2 ]
-#define Z3  v[ 2 ][ 2 ]
-#define ZI1 zi[ 0 ]
-#define ZI2 zi[ 1 ]
-#define ZI3 zi[ 2 ]
+    /* MSAA: the covered samples, their edge values and the edge values
+     * the colour is taken at */
+    int     mask[ FRAG_BATCH ];
+    __m128i e[ FRAG_BATCH ][ 3 ];
+    int32_t w[ 3 ][ FRAG_BATCH ];
+
+    /* of the triangle */
+    uint64_t * zi;
+    float      denom;
+    __m128     rcp;   /* 1 / denom */
+    __m128     vz[ 3 ]; /* z of v */
+} FragQueue;
+
+/* z and pixels of the lanes from the barycentrics, 4 lanes from lane */
+static inline __attribute__ ( ( always_inline ) ) void
+frag_lanes ( FragQueue * q, int lane, int x, int y )
+{
+    const __m128 b1 = _mm_load_ps ( q->b.b[ 0 ] + lane );
+    const __m128 b2 = _mm_load_ps ( q->b.b[ 1 ] + lane );
+    const __m128 b3 = _mm_load_ps ( q->b.b[ 2 ] + lane );
+
+    _mm_store_ps ( q->b.z + lane,
+                   _mm_add_ps ( _mm_add_ps ( _mm_mul_ps ( b1, q->vz[ 0 ] ),
+                                             _mm_mul_ps ( b2, q->vz[ 1 ] ) ),
+                                _mm_mul_ps ( b3, q->vz[ 2 ] ) ) );
+    _mm_store_si128 ( ( __m128i * ) ( q->b.x + lane ),
+                      _mm_add_epi32 ( _mm_set1_epi32 ( x ),
+                                      _mm_set_epi32 ( 3, 2, 1, 0 ) ) );
+    _mm_store_si128 ( ( __m128i * ) ( q->b.y + lane ), _mm_set1_epi32 ( y ) );
+}
 
-    if ( X1 < 0 || X2 < 0 || X3 < 0 || Y1 < 0 || Y2 < 0 || Y3 < 0 ||
-         X1 > f->surface->w - 1 || X2 > f->surface->w - 1 ||
-         X3 > f->surface->w - 1 || Y1 > f->surface->h - 1 ||
-         Y2 > f->surface->h - 1 || Y3 > f->surface->h - 1 )
+/* the barycentrics of width lanes of a row from pixel x on, where the
+ * edge values are w and step by dx */
+static inline __attribute__ ( ( always_inline ) ) void
+frag_row ( FragQueue *     q,
+           const int32_t * w,
+           const int32_t * dx,
+           int             x,
+           int             y,
+           int             width )
+{
+    for ( int lane = 0; lane < width; lane += 4 )
     {
-        return;
+        for ( int e = 0; e < 3; e++ )
+        {
+            const __m128i we = _mm_add_epi32 (
+                _mm_set1_epi32 ( w[ e ] + lane * dx[ e ] ),
+                lane_offsets ( dx[ e ] ) );
+            _mm_store_ps ( q->b.b[ e ] + lane,
+                           _mm_mul_ps ( _mm_cvtepi32_ps ( we ), q->rcp ) );
+        }
+        frag_lanes ( q, lane, x + lane, y );
+    }
+}
+
+/* the shaded planes back to one vec4 per lane, width lanes */
+static inline __attribute__ ( ( always_inline ) ) void
+frag_colors ( const FragQueue * q, vec4 * cpx, int width )
+{
+    for ( int l = 0; l < width; l += 4 )
+    {
+        __m128 a = _mm_load_ps ( q->b.out[ 0 ] + l );
+        __m128 b = _mm_load_ps ( q->b.out[ 1 ] + l );
+        __m128 g = _mm_load_ps ( q->b.out[ 2 ] + l );
+        __m128 r = _mm_load_ps ( q->b.out[ 3 ] + l );
+        _MM_TRANSPOSE4_PS ( a, b, g, r );
+
+        _mm_store_ps ( cpx[ l + 0 ], a );
+        _mm_store_ps ( cpx[ l + 1 ], b );
+        _mm_store_ps ( cpx[ l + 2 ], g );
+        _mm_store_ps ( cpx[ l + 3 ], r );
     }
+}
+
+/* shade_px () for the covered pixels mask of a row, lane i at pixel
+ * x + i with edge values w + i * dx; plane row row */
+static inline __attribute__ ( ( always_inline ) ) void
+queue_row ( Framebuffer *   f,
+            FragQueue *     q,
+            uint32_t        row,
+            int             x,
+            int             y,
+            const int32_t * w,
+            const int32_t * dx,
+            int             mask,
+            int             width )
+{
+    const uint64_t * zi   = q->zi;
+    int              live = 0;
+
+    while ( mask )
+    {
+        const int lane = __builtin_ctz ( mask );
+        mask &= mask - 1;
+
+        const uint32_t idx  = row + pxCol ( f, x + lane );
+        const uint64_t z_px = ( ( float ) ( w[ 0 ] + lane * dx[ 0 ] ) *
+                                    ( float ) ZI1 +
+                                ( float ) ( w[ 1 ] + lane * dx[ 1 ] ) *
+                                    ( float ) ZI2 +
+                                ( float ) ( w[ 2 ] + lane * dx[ 2 ] ) *
+                                    ( float ) ZI3 ) /
+                              q->denom;
 
-#define FREAK_CMP <=
-    /* 03.01.25 ::: NOTE ::: Trying to reduce aliasing: < . */
+        if ( z_px < f->opaque_z[ idx ] )
+        {
+            count_px ( f, idx, 0 );
+            continue;
+        }
+        count_px ( f, idx, 1 );
+
+        q->idx[ lane ] = idx;
+        q->z[ lane ]   = z_px;
+        live |= 1 << lane;
+    }
+    if ( ! live ) return;
 
-    int xmin = ( int ) fast_floorf ( min3 ( X1, X2, X3 ) );
-    int ymin = ( int ) fast_floorf ( min3 ( Y1, Y2, Y3 ) );
-    int xmax = ( int ) fast_ceilf ( max3 ( X1, X2, X3 ) );
-    int ymax = ( int ) fast_ceilf ( max3 ( Y1, Y2, Y3 ) );
+    frag_row ( q, w, dx, x, y, width );
+    q->b.live = live;
+    f->shader ( &q->b, f->shader_user );
 
-    for ( int i = ymin; i <= ymax; i++ )
+    vec4 cpx[ FRAG_BATCH ];
+    frag_colors ( q, cpx, width );
+    while ( live )
     {
-        // fill with sentinel value:
-        f->min_x[ i ] = xmax + 1;
-        f->max_x[ i ] = xmin - 1;
+        const int i = __builtin_ctz ( live );
+        live &= live - 1;
+
+        write_px ( f, q->idx[ i ], q->z[ i ], cpx[ i ] );
     }
+}
+
+/* Everything rasterize() needs once the triangle is snapped. w is the
+ * biased edge value at the centre of pixel (xmin, ymin); w[0] is the edge
+ * v2->v3, w[1] v3->v1, w[2] v1->v2. Values fit int32 as long as the
+ * triangle is on screen (|w| < 2 * 1920 * 1080 * 256). */
+typedef struct
+{
+    int32_t w[ 3 ];
+    int32_t dx[ 3 ];
+    int32_t dy[ 3 ];
+    int     xmin, ymin, xmax, ymax;
+    int     top; /* first row before the clip */
+    float   denom;
+} TriSetup;
+
+/* what setup_tri () made of a triangle, PipeStats rows */
+enum
+{
+    TRI_DRAWN,
+    TRI_OFF_TARGET,
+    TRI_DEGENERATE,
+    TRI_SCISSORED
+};
+
+/* triangles reaching outside the render target are not drawn */
+static inline __attribute__ ( ( always_inline ) ) int
+on_target ( Framebuffer * f, vec3 * v )
+{
+    return ! ( X1 < 0 || X2 < 0 || X3 < 0 || Y1 < 0 || Y2 < 0 || Y3 < 0 ||
+               X1 > f->w - 1 || X2 > f->w - 1 || X3 > f->w - 1 ||
+               Y1 > f->h - 1 || Y2 > f->h - 1 || Y3 > f->h - 1 );
+}
+
+/* TRI_DRAWN if the triangle produces pixels inside clip, else why not */
+static inline __attribute__ ( ( always_inline ) ) int
+setup_tri ( Framebuffer * f, const int * clip, vec3 * v, TriSetup * t )
+{
+    if ( ! on_target ( f, v ) ) return TRI_OFF_TARGET;
+
+    /* 19.10.26 ::: float spans + (int)(x + 0.5f) gave cracks and
+     * double-hits on shared edges (the old FREAK_CMP hack). Fixed point
+     * edge functions + top-left rule are watertight instead. */
+    const int32_t x1 = to_fixed ( X1 ), y1 = to_fixed ( Y1 );
+    const int32_t x2 = to_fixed ( X2 ), y2 = to_fixed ( Y2 );
+    const int32_t x3 = to_fixed ( X3 ), y3 = to_fixed ( Y3 );
 
-    draw_edgef ( X1, Y1, X2, Y2, f->min_x, f->max_x, ymin, ymax, xmin, xmax );
-    draw_edgef ( X2, Y2, X3, Y3, f->min_x, f->max_x, ymin, ymax, xmin, xmax );
-    draw_edgef ( X3, Y3, X1, Y1, f->min_x, f->max_x, ymin, ymax, xmin, xmax );
+    t->top = min3 ( y1, y2, y3 ) >> SUBPIX_BITS;
 
-    DBuffer ** faint_ll;
-    vec4 *     curr_c;
-    uint64_t * curr_z;
+    /* twice the signed area in 1/256 px^2; <= 0 is degenerate or facing
+     * away (those were never drawn: all weights came out negative) */
+    const int64_t area = ( int64_t ) ( x1 - x3 ) * ( y2 - y3 ) -
+                         ( int64_t ) ( x2 - x3 ) * ( y1 - y3 );
+    if ( area <= 0 ) return TRI_DEGENERATE;
 
-    vec4  ctemp;
-    float denom, w1, w2, w3;
+    t->xmin = min3 ( x1, x2, x3 ) >> SUBPIX_BITS;
+    t->ymin = t->top;
+    t->xmax = max3 ( x1, x2, x3 ) >> SUBPIX_BITS;
+    t->ymax = max3 ( y1, y2, y3 ) >> SUBPIX_BITS;
 
-    denom = ( X1 - X3 ) * ( Y2 - Y3 ) - ( X2 - X3 ) * ( Y1 - Y3 );
+    t->xmin = fast_max ( t->xmin, clip[ 0 ] );
+    t->ymin = fast_max ( t->ymin, clip[ 1 ] );
+    t->xmax = fast_min ( t->xmax, clip[ 2 ] );
+    t->ymax = fast_min ( t->ymax, clip[ 3 ] );
+    if ( t->xmin > t->xmax || t->ymin > t->ymax ) return TRI_SCISSORED;
 
-    if ( fabsf ( ( float ) denom ) < 1e-6 ) return; /* Degenerate */
+    /* a is the step per subpixel in x, b per subpixel in y */
+    const int32_t a[ 3 ]  = { y2 - y3, y3 - y1, y1 - y2 };
+    const int32_t b[ 3 ]  = { x3 - x2, x1 - x3, x2 - x1 };
+    const int32_t ox[ 3 ] = { x3, x3, x1 };
+    const int32_t oy[ 3 ] = { y3, y3, y1 };
 
-    float dw1x  = ( Y2 - Y3 );
-    float dw2x  = ( Y3 - Y1 );
-    float dw3x  = -dw1x - dw2x;
-    float y2sy3 = ( Y2 - Y3 );
-    float y3sy1 = ( Y3 - Y1 );
-    float x3sx2 = ( X3 - X2 );
-    float x1sx3 = ( X1 - X3 );
+    const int32_t px0 = ( t->xmin << SUBPIX_BITS ) + SUBPIX_HALF;
+    const int32_t py0 = ( t->ymin << SUBPIX_BITS ) + SUBPIX_HALF;
 
-    for ( int py = ymin; py <= ymax; py++ )
+    for ( int i = 0; i < 3; i++ )
     {
-        int l_x = f->min_x[ py ], r_x = f->max_x[ py ];
-        /* go to current row */
-        float fx = ( l_x + 0.5f ) - X3;
-        float fy = ( py + 0.5f ) - Y3;
+        t->w[ i ] = ( int32_t ) ( ( int64_t ) a[ i ] * ( px0 - ox[ i ] ) +
+                                  ( int64_t ) b[ i ] * ( py0 - oy[ i ] ) ) +
+                    edge_bias ( a[ i ], b[ i ] );
+        t->dx[ i ] = a[ i ] << SUBPIX_BITS;
+        t->dy[ i ] = b[ i ] << SUBPIX_BITS;
+    }
 
-        w1 = y2sy3 * fx + x3sx2 * fy;
-        w2 = y3sy1 * fx + x1sx3 * fy;
-        w3 = denom - w1 - w2;
+    t->denom = ( float ) area;
+    return TRI_DRAWN;
+}
 
-        faint_ll = ( f->transparent + ( py * f->surface->w ) + l_x );
-        curr_c   = ( f->opaque_c + ( py * f->surface->w ) + l_x );
-        curr_z   = ( f->opaque_z + ( py * f->surface->w ) + l_x );
+/* coverage of the 4 pixels whose edge values start at w1, w2, w3 */
+static inline __attribute__ ( ( always_inline ) ) int
+cover4 ( int32_t       w1,
+         int32_t       w2,
+         int32_t       w3,
+         const __m128i lane1,
+         const __m128i lane2,
+         const __m128i lane3 )
+{
+    __m128i e1 = _mm_add_epi32 ( _mm_set1_epi32 ( w1 ), lane1 );
+    __m128i e2 = _mm_add_epi32 ( _mm_set1_epi32 ( w2 ), lane2 );
+    __m128i e3 = _mm_add_epi32 ( _mm_set1_epi32 ( w3 ), lane3 );
 
-        for ( int px = l_x; px <= r_x; px++ )
-        {
-            if ( w1 < 0 || w2 < 0 || w3 < 0 ) { goto l_next_pixel; }
+    /* sign bit of (e1 | e2 | e3) set => outside some edge */
+    return ~_mm_movemask_ps ( _mm_castsi128_ps (
+               _mm_or_si128 ( _mm_or_si128 ( e1, e2 ), e3 ) ) ) &
+           0xF;
+}
+
+/* the same for 8 pixels, off[ edge ][ lane ] is lane * dx[ edge ] */
+static ISA_TARGET_AVX2 int
+cover8 ( int32_t w1, int32_t w2, int32_t w3, int32_t ( *off )[ 8 ] )
+{
+    const int32_t w[ 3 ] = { w1, w2, w3 };
+    __m256i       any    = _mm256_setzero_si256 ();
+
+    for ( int i = 0; i < 3; i++ )
+    {
+        const __m256i lanes = _mm256_loadu_si256 ( ( __m256i * ) off[ i ] );
+        any = _mm256_or_si256 (
+            any, _mm256_add_epi32 ( _mm256_set1_epi32 ( w[ i ] ), lanes ) );
+    }
+    return ~_mm256_movemask_ps ( _mm256_castsi256_ps ( any ) ) & 0xFF;
+}
+
+/* 4 pixels per step, 8 from ISA_AVX2 on; with q each step is a batch
+ * for the shader */
+static inline __attribute__ ( ( always_inline ) ) void
+raster_tri ( int isa,
+             Framebuffer *    f,
+             const TriSetup * t,
+             uint64_t *       zi,
+             vec4 *           c,
+             FragQueue *      q )
+{
+    const int     step  = isa >= ISA_AVX2 ? 8 : 4;
+    const __m128i lane1 = lane_offsets ( t->dx[ 0 ] );
+    const __m128i lane2 = lane_offsets ( t->dx[ 1 ] );
+    const __m128i lane3 = lane_offsets ( t->dx[ 2 ] );
 
-            uint64_t z_px = ( w1 * ( float ) ZI1 + w2 * ( float ) ZI2 +
-                              w3 * ( float ) ZI3 ) /
-                            denom;
+    int32_t off[ 3 ][ 8 ];
+    if ( isa >= ISA_AVX2 )
+    {
+        for ( int e = 0; e < 3; e++ )
+            for ( int lane = 0; lane < 8; lane++ )
+                off[ e ][ lane ] = lane * t->dx[ e ];
+    }
 
-            vec4 cpx;
-            glm_vec4_scale ( c[ 0 ], w1, cpx );
-            glm_vec4_scale ( c[ 1 ], w2, ctemp );
-            glm_vec4_add ( cpx, ctemp, cpx );
-            glm_vec4_scale ( c[ 2 ], w3, ctemp );
-            glm_vec4_add ( cpx, ctemp, cpx );
-            glm_vec4_divs ( cpx, denom, cpx );
+    int32_t row1 = t->w[ 0 ], row2 = t->w[ 1 ], row3 = t->w[ 2 ];
+
+    for ( int py = t->ymin; py <= t->ymax; py++ )
+    {
+        int32_t        w1  = row1, w2 = row2, w3 = row3;
+        const uint32_t row = pxRow ( f, py );
 
-            if ( z_px < *curr_z ) goto l_next_pixel;
+        for ( int px = t->xmin; px <= t->xmax; px += step )
+        {
+            int mask = isa >= ISA_AVX2
+                           ? cover8 ( w1, w2, w3, off )
+                           : cover4 ( w1, w2, w3, lane1, lane2, lane3 );
+            if ( t->xmax - px < step - 1 )
+                mask &= ( 1 << ( t->xmax - px + 1 ) ) - 1;
 
-            if ( cpx[ ALPHA_IDX ] >= OPAQUE_THRSHD )
+            if ( q && mask )
             {
-                glm_vec4_copy ( cpx, *curr_c );
-                *curr_z = z_px;
+                const int32_t w[ 3 ] = { w1, w2, w3 };
+                queue_row ( f, q, row, px, py, w, t->dx, mask, step );
             }
-            else
+            else if ( ! q )
             {
-                DBuffer * newBuf = getAuxDBuffer ( f );
-                glm_vec4_copy ( cpx, newBuf->color );
-                newBuf->z    = z_px;
-                newBuf->next = NULL;
-
-                if ( ! ( *faint_ll ) )
+                while ( mask )
                 {
-                    ( *faint_ll ) = newBuf;
-                    goto l_next_pixel;
+                    int lane = __builtin_ctz ( mask );
+                    mask &= mask - 1;
+
+                    shade_px ( f,
+                               row + pxCol ( f, px + lane ),
+                               ( float ) ( w1 + lane * t->dx[ 0 ] ),
+                               ( float ) ( w2 + lane * t->dx[ 1 ] ),
+                               ( float ) ( w3 + lane * t->dx[ 2 ] ),
+                               t->denom,
+                               zi,
+                               c );
                 }
-                while ( ( *faint_ll )->next &&
-                        ( *faint_ll )->next->z >= z_px )
+            }
+
+            w1 += step * t->dx[ 0 ];
+            w2 += step * t->dx[ 1 ];
+            w3 += step * t->dx[ 2 ];
+        }
+
+        row1 += t->dy[ 0 ];
+        row2 += t->dy[ 1 ];
+        row3 += t->dy[ 2 ];
+    }
+}
+
+/* Coverage of the whole STAMP_SIZE x STAMP_SIZE box as one bitmask, bit
+ * (row * 8 + col). Each row is two 4-wide compares per edge. */
+static inline __attribute__ ( ( always_inline ) ) uint64_t
+stamp_mask ( const TriSetup * t )
+{
+    __m128i lo[ 3 ], hi[ 3 ], row[ 3 ], step[ 3 ];
+    for ( int i = 0; i < 3; i++ )
+    {
+        /* columns 0..3 and 4..7 */
+        __m128i four = _mm_set1_epi32 ( 4 * t->dx[ i ] );
+
+        lo[ i ]   = lane_offsets ( t->dx[ i ] );
+        hi[ i ]   = _mm_add_epi32 ( lo[ i ], four );
+        row[ i ]  = _mm_set1_epi32 ( t->w[ i ] );
+        step[ i ] = _mm_set1_epi32 ( t->dy[ i ] );
+    }
+
+    const uint32_t cols = ( 1u << ( t->xmax - t->xmin + 1 ) ) - 1;
+    const int      rows = t->ymax - t->ymin + 1;
+
+    uint64_t mask = 0;
+    for ( int r = 0; r < rows; r++ )
+    {
+        __m128i out_lo = _mm_setzero_si128 ();
+        __m128i out_hi = _mm_setzero_si128 ();
+        for ( int i = 0; i < 3; i++ )
+        {
+            __m128i e_lo = _mm_add_epi32 ( row[ i ], lo[ i ] );
+            __m128i e_hi = _mm_add_epi32 ( row[ i ], hi[ i ] );
+
+            out_lo   = _mm_or_si128 ( out_lo, e_lo );
+            out_hi   = _mm_or_si128 ( out_hi, e_hi );
+            row[ i ] = _mm_add_epi32 ( row[ i ], step[ i ] );
+        }
+
+        uint32_t outside =
+            _mm_movemask_ps ( _mm_castsi128_ps ( out_lo ) ) |
+            ( _mm_movemask_ps ( _mm_castsi128_ps ( out_hi ) ) << 4 );
+
+        mask |= ( uint64_t ) ( ~outside & cols ) << ( r * STAMP_SIZE );
+    }
+
+    return mask;
+}
+
+/* Small triangles: no per-row loop bookkeeping, just walk the set bits */
+static inline __attribute__ ( ( always_inline ) ) void
+raster_stamp ( Framebuffer *    f,
+               const TriSetup * t,
+               uint64_t *       zi,
+               vec4 *           c,
+               FragQueue *      q )
+{
+    uint64_t mask = stamp_mask ( t );
+
+    /* a batch per stamp row */
+    for ( int row = 0; q && mask; row++ )
+    {
+        const int rmask = mask & 0xFF;
+        mask >>= STAMP_SIZE;
+        if ( ! rmask ) continue;
+
+        const int32_t w[ 3 ] = { t->w[ 0 ] + row * t->dy[ 0 ],
+                                 t->w[ 1 ] + row * t->dy[ 1 ],
+                                 t->w[ 2 ] + row * t->dy[ 2 ] };
+        queue_row ( f,
+                    q,
+                    pxRow ( f, t->ymin + row ),
+                    t->xmin,
+                    t->ymin + row,
+                    w,
+                    t->dx,
+                    rmask,
+                    STAMP_SIZE );
+    }
+
+    while ( mask )
+    {
+        int bit = __builtin_ctzll ( mask );
+        mask &= mask - 1;
+
+        int col = bit & ( STAMP_SIZE - 1 );
+        int row = bit / STAMP_SIZE;
+
+        int32_t w1 = t->w[ 0 ] + col * t->dx[ 0 ] + row * t->dy[ 0 ];
+        int32_t w2 = t->w[ 1 ] + col * t->dx[ 1 ] + row * t->dy[ 1 ];
+        int32_t w3 = t->w[ 2 ] + col * t->dx[ 2 ] + row * t->dy[ 2 ];
+
+        shade_px ( f,
+                   pxIndex ( f, t->xmin + col, t->ymin + row ),
+                   ( float ) w1,
+                   ( float ) w2,
+                   ( float ) w3,
+                   t->denom,
+                   zi,
+                   c );
+    }
+}
+
+/* 19.10.26 ::: 4x MSAA, rotated grid, offsets in 1/16 px from the centre */
+static const int32_t ms_ox[ MSAA_SAMPLES ] = { -2, 6, -6, 2 };
+static const int32_t ms_oy[ MSAA_SAMPLES ] = { -6, -2, 2, 6 };
+
+/* e1..e3 are the edge values at the 4 samples, mask the covered ones. The
+ * colour is shaded once at the edge values w1..w3 this leaves; 0 when the
+ * pixel is rejected, else its depth goes to z_c. */
+static inline __attribute__ ( ( always_inline ) ) int
+ms_centre ( Framebuffer * f,
+            uint32_t      idx,
+            int32_t *     w1,
+            int32_t *     w2,
+            int32_t *     w3,
+            __m128i       e1,
+            __m128i       e2,
+            __m128i       e3,
+            int           mask,
+            float         denom,
+            uint64_t *    zi,
+            uint64_t *    z_c )
+{
+    /* centre outside the triangle: shade at the first covered sample so
+     * the colour is not extrapolated past the edge */
+    if ( ( *w1 | *w2 | *w3 ) < 0 )
+    {
+        int32_t s1[ 4 ], s2[ 4 ], s3[ 4 ];
+        _mm_storeu_si128 ( ( __m128i * ) s1, e1 );
+        _mm_storeu_si128 ( ( __m128i * ) s2, e2 );
+        _mm_storeu_si128 ( ( __m128i * ) s3, e3 );
+
+        int s = __builtin_ctz ( mask );
+        *w1   = s1[ s ];
+        *w2   = s2[ s ];
+        *w3   = s3[ s ];
+    }
+
+    *z_c = ( *w1 * ( float ) ZI1 + *w2 * ( float ) ZI2 +
+             *w3 * ( float ) ZI3 ) /
+           denom;
+
+    /* an interior pixel nobody expanded and this is behind: neither path
+     * of ms_write () would write it, so it is not shaded */
+    if ( ! f->ms_idx[ idx ] && mask == 0xF && *z_c < f->opaque_z[ idx ] )
+    {
+        count_px ( f, idx, 0 );
+        return 0;
+    }
+    return 1;
+}
+
+/* the colour cpx of a pixel ms_centre () let through, depth tested per
+ * sample */
+static inline __attribute__ ( ( always_inline ) ) void
+ms_write ( Framebuffer * f,
+           uint32_t      idx,
+           __m128i       e1,
+           __m128i       e2,
+           __m128i       e3,
+           int           mask,
+           float         denom,
+           uint64_t *    zi,
+           uint64_t      z_c,
+           vec4          cpx )
+{
+    uint32_t * slot = f->ms_idx + idx;
+
+    /* what shade_px () does with it */
+    if ( cpx[ ALPHA_IDX ] < OPAQUE_THRSHD )
+    {
+        if ( z_c < f->opaque_z[ idx ] )
+        {
+            count_px ( f, idx, 0 );
+            return;
+        }
+        count_px ( f, idx, 1 );
+        write_px ( f, idx, z_c, cpx );
+        return;
+    }
+
+    /* the common case, an interior pixel nobody expanded */
+    if ( ! *slot && mask == 0xF )
+    {
+        count_px ( f, idx, 1 );
+        glm_vec4_copy ( cpx, f->opaque_c[ idx ] );
+        f->opaque_z[ idx ] = z_c;
+        return;
+    }
+    float zs[ MSAA_SAMPLES ];
+    _mm_storeu_ps (
+        zs,
+        _mm_div_ps (
+            _mm_add_ps (
+                _mm_add_ps ( _mm_mul_ps ( _mm_cvtepi32_ps ( e1 ),
+                                          _mm_set1_ps ( ( float ) ZI1 ) ),
+                             _mm_mul_ps ( _mm_cvtepi32_ps ( e2 ),
+                                          _mm_set1_ps ( ( float ) ZI2 ) ) ),
+                _mm_mul_ps ( _mm_cvtepi32_ps ( e3 ),
+                             _mm_set1_ps ( ( float ) ZI3 ) ) ),
+            _mm_set1_ps ( denom ) ) );
+
+    if ( ! *slot )
+    {
+        /* first edge through this pixel: expand what is there so far */
+        MSBlock * b = getMSBlock ( f, idx );
+        for ( int s = 0; s < MSAA_SAMPLES; s++ )
+        {
+            glm_vec4_copy ( f->opaque_c[ idx ], b->color[ s ] );
+            b->z[ s ] = f->opaque_z[ idx ];
+        }
+        /* every band job may raise it */
+        __atomic_store_n ( &f->ms_dirty, 1, __ATOMIC_RELAXED );
+    }
+
+    MSBlock * b    = MS_BLOCK ( f, *slot - 1 );
+    int       pass = 0;
+    for ( int s = 0; s < MSAA_SAMPLES; s++ )
+    {
+        const uint64_t z = zs[ s ];
+        if ( ! ( mask & ( 1 << s ) ) || z < b->z[ s ] ) continue;
+
+        glm_vec4_copy ( cpx, b->color[ s ] );
+        b->z[ s ] = z;
+        pass |= 1 << s;
+    }
+    count_px ( f, idx, pass );
+
+    /* the whole pixel went to this triangle: back to a single colour */
+    if ( pass == 0xF )
+    {
+        *slot = 0;
+        glm_vec4_copy ( cpx, f->opaque_c[ idx ] );
+        f->opaque_z[ idx ] = z_c;
+    }
+    else if ( pass )
+    {
+        __atomic_store_n ( &f->ms_dirty, 1, __ATOMIC_RELAXED );
+    }
+}
+
+static inline __attribute__ ( ( always_inline ) ) void
+shade_px_ms ( Framebuffer * f,
+              uint32_t      idx,
+              int32_t       w1,
+              int32_t       w2,
+              int32_t       w3,
+              __m128i       e1,
+              __m128i       e2,
+              __m128i       e3,
+              int           mask,
+              float         denom,
+              uint64_t *    zi,
+              vec4 *        c )
+{
+    uint64_t z_c;
+    if ( ! ms_centre (
+             f, idx, &w1, &w2, &w3, e1, e2, e3, mask, denom, zi, &z_c ) )
+        return;
+
+    vec4 cpx, ctemp;
+    glm_vec4_scale ( c[ 0 ], w1, cpx );
+    glm_vec4_scale ( c[ 1 ], w2, ctemp );
+    glm_vec4_add ( cpx, ctemp, cpx );
+    glm_vec4_scale ( c[ 2 ], w3, ctemp );
+    glm_vec4_add ( cpx, ctemp, cpx );
+    glm_vec4_divs ( cpx, denom, cpx );
+
+    ms_write ( f, idx, e1, e2, e3, mask, denom, zi, z_c, cpx );
+}
+
+/* shade_px_ms () with the colour left to the shader: lane l of the step
+ * is depth tested and kept for frag_step_ms () */
+static inline __attribute__ ( ( always_inline ) ) void
+queue_px_ms ( Framebuffer * f,
+              FragQueue *   q,
+              int           l,
+              uint32_t      idx,
+              int32_t       w1,
+              int32_t       w2,
+              int32_t       w3,
+              __m128i       e1,
+              __m128i       e2,
+              __m128i       e3,
+              int           mask )
+{
+    uint64_t z_c;
+    if ( ! ms_centre (
+             f, idx, &w1, &w2, &w3, e1, e2, e3, mask, q->denom, q->zi, &z_c ) )
+        return;
+
+    q->idx[ l ]    = idx;
+    q->z[ l ]      = z_c;
+    q->mask[ l ]   = mask;
+    q->e[ l ][ 0 ] = e1;
+    q->e[ l ][ 1 ] = e2;
+    q->e[ l ][ 2 ] = e3;
+    q->w[ 0 ][ l ] = w1;
+    q->w[ 1 ][ l ] = w2;
+    q->w[ 2 ][ l ] = w3;
+    q->b.live |= 1 << l;
+}
+
+/* shades and writes the 4 pixel step at x, y queue_px_ms () kept */
+static inline __attribute__ ( ( always_inline ) ) void
+frag_step_ms ( Framebuffer * f, FragQueue * q, int x, int y )
+{
+    int live = q->b.live;
+    if ( ! live ) return;
+
+    for ( int e = 0; e < 3; e++ )
+    {
+        const __m128i w = _mm_loadu_si128 ( ( __m128i * ) q->w[ e ] );
+        _mm_store_ps ( q->b.b[ e ],
+                       _mm_mul_ps ( _mm_cvtepi32_ps ( w ), q->rcp ) );
+    }
+    frag_lanes ( q, 0, x, y );
+    f->shader ( &q->b, f->shader_user );
+
+    vec4 cpx[ 4 ];
+    frag_colors ( q, cpx, 4 );
+    while ( live )
+    {
+        const int i = __builtin_ctz ( live );
+        live &= live - 1;
+
+        ms_write ( f,
+                   q->idx[ i ],
+                   q->e[ i ][ 0 ],
+                   q->e[ i ][ 1 ],
+                   q->e[ i ][ 2 ],
+                   q->mask[ i ],
+                   q->denom,
+                   q->zi,
+                   q->z[ i ],
+                   cpx[ i ] );
+    }
+    q->b.live = 0;
+}
+
+/* 4 pixels per step like raster_tri (). Per edge, centre + the smallest
+ * sample offset >= 0 means all samples are inside (the pixel takes the
+ * cheap path), centre + the largest < 0 means none are. Only pixels in
+ * between get their 4 samples tested. The bbox from setup_tri () already
+ * holds every pixel a sample can land in. */
+static inline __attribute__ ( ( always_inline ) ) void
+raster_tri_msaa ( Framebuffer *    f,
+                  const TriSetup * t,
+                  uint64_t *       zi,
+                  vec4 *           c,
+                  FragQueue *      q )
+{
+    __m128i so[ 3 ], so_min[ 3 ], so_max[ 3 ], lane[ 3 ];
+    for ( int i = 0; i < 3; i++ )
+    {
+        const int32_t a = t->dx[ i ] >> SUBPIX_BITS;
+        const int32_t b = t->dy[ i ] >> SUBPIX_BITS;
+
+        int32_t o[ MSAA_SAMPLES ], lo = INT32_MAX, hi = INT32_MIN;
+        for ( int s = 0; s < MSAA_SAMPLES; s++ )
+        {
+            o[ s ] = a * ms_ox[ s ] + b * ms_oy[ s ];
+            lo     = o[ s ] < lo ? o[ s ] : lo;
+            hi     = o[ s ] > hi ? o[ s ] : hi;
+        }
+
+        so[ i ]     = _mm_set_epi32 ( o[ 3 ], o[ 2 ], o[ 1 ], o[ 0 ] );
+        so_min[ i ] = _mm_set1_epi32 ( lo );
+        so_max[ i ] = _mm_set1_epi32 ( hi );
+        lane[ i ]   = lane_offsets ( t->dx[ i ] );
+    }
+
+    int32_t row1 = t->w[ 0 ], row2 = t->w[ 1 ], row3 = t->w[ 2 ];
+
+    for ( int py = t->ymin; py <= t->ymax; py++ )
+    {
+        int32_t        w1  = row1, w2 = row2, w3 = row3;
+        const uint32_t row = pxRow ( f, py );
+
+        for ( int px = t->xmin; px <= t->xmax; px += 4 )
+        {
+            __m128i e1 = _mm_add_epi32 ( _mm_set1_epi32 ( w1 ), lane[ 0 ] );
+            __m128i e2 = _mm_add_epi32 ( _mm_set1_epi32 ( w2 ), lane[ 1 ] );
+            __m128i e3 = _mm_add_epi32 ( _mm_set1_epi32 ( w3 ), lane[ 2 ] );
+
+            int any = ~_mm_movemask_ps ( _mm_castsi128_ps ( _mm_or_si128 (
+                          _mm_or_si128 ( _mm_add_epi32 ( e1, so_max[ 0 ] ),
+                                         _mm_add_epi32 ( e2, so_max[ 1 ] ) ),
+                          _mm_add_epi32 ( e3, so_max[ 2 ] ) ) ) ) &
+                      0xF;
+            if ( t->xmax - px < 3 ) any &= ( 1 << ( t->xmax - px + 1 ) ) - 1;
+
+            const int full =
+                ~_mm_movemask_ps ( _mm_castsi128_ps ( _mm_or_si128 (
+                    _mm_or_si128 ( _mm_add_epi32 ( e1, so_min[ 0 ] ),
+                                   _mm_add_epi32 ( e2, so_min[ 1 ] ) ),
+                    _mm_add_epi32 ( e3, so_min[ 2 ] ) ) ) ) &
+                any;
+
+            while ( any )
+            {
+                int l = __builtin_ctz ( any );
+                any &= any - 1;
+
+                const int32_t c1 = w1 + l * t->dx[ 0 ];
+                const int32_t c2 = w2 + l * t->dx[ 1 ];
+                const int32_t c3 = w3 + l * t->dx[ 2 ];
+
+                __m128i s1 = _mm_add_epi32 ( _mm_set1_epi32 ( c1 ), so[ 0 ] );
+                __m128i s2 = _mm_add_epi32 ( _mm_set1_epi32 ( c2 ), so[ 1 ] );
+                __m128i s3 = _mm_add_epi32 ( _mm_set1_epi32 ( c3 ), so[ 2 ] );
+
+                int mask = 0xF;
+                if ( ! ( full & ( 1 << l ) ) )
                 {
-                    ( *faint_ll ) = ( *faint_ll )->next;
+                    mask = ~_mm_movemask_ps ( _mm_castsi128_ps ( _mm_or_si128 (
+                               _mm_or_si128 ( s1, s2 ), s3 ) ) ) &
+                           0xF;
+                    if ( ! mask ) continue;
                 }
-                newBuf->next        = ( *faint_ll )->next;
-                ( *faint_ll )->next = newBuf;
-            }
 
-        l_next_pixel:
-            w1 += dw1x;
-            w2 += dw2x;
-            w3 += dw3x;
+                if ( q )
+                    queue_px_ms ( f,
+                                  q,
+                                  l,
+                                  row + pxCol ( f, px + l ),
+                                  c1,
+                                  c2,
+                                  c3,
+                                  s1,
+                                  s2,
+                                  s3,
+                                  mask );
+                else
+                    shade_px_ms ( f,
+                                  row + pxCol ( f, px + l ),
+                                  c1,
+                                  c2,
+                                  c3,
+                                  s1,
+                                  s2,
+                                  s3,
+                                  mask,
+                                  t->denom,
+                                  zi,
+                                  c );
+            }
+            if ( q ) frag_step_ms ( f, q, px, py );
 
-            faint_ll++;
-            curr_c++;
-            curr_z++;
+            w1 += 4 * t->dx[ 0 ];
+            w2 += 4 * t->dx[ 1 ];
+            w3 += 4 * t->dx[ 2 ];
         }
+
+        row1 += t->dy[ 0 ];
+        row2 += t->dy[ 1 ];
+        row3 += t->dy[ 2 ];
     }
 }
 
-void
-merge ( Framebuffer * f )
+/* bands and slices run side by side */
+static inline __attribute__ ( ( always_inline ) ) void
+add_stat ( uint64_t * stat, uint32_t n )
+{
+    if ( n ) __atomic_fetch_add ( stat, n, __ATOMIC_RELAXED );
+}
+
+static inline __attribute__ ( ( always_inline ) ) int
+is_small ( const TriSetup * t )
+{
+    return t->xmax - t->xmin < STAMP_SIZE && t->ymax - t->ymin < STAMP_SIZE;
+}
+
+/* one set up triangle; q as for raster_tri () */
+static inline __attribute__ ( ( always_inline ) ) void
+raster_one ( int              isa,
+             Framebuffer *    f,
+             const TriSetup * t,
+             uint64_t *       zi,
+             vec4 *           c,
+             FragQueue *      q )
+{
+    if ( f->msaa )
+        raster_tri_msaa ( f, t, zi, c, q );
+    else if ( is_small ( t ) )
+        raster_stamp ( f, t, zi, c, q );
+    else
+        raster_tri ( isa, f, t, zi, c, q );
+}
+
+/* triangles tris[ 0 .. cnt ) of v / zi, or the first cnt when tris is
+ * NULL, clipped to clip */
+static inline __attribute__ ( ( always_inline ) ) void
+raster_tris_body ( int              isa,
+                   Framebuffer *    f,
+                   const int *      clip,
+                   vec3 *           v,
+                   uint64_t *       zi,
+                   vec4 *           c,
+                   const uint32_t * tris,
+                   int              cnt )
 {
+    /* set up the whole batch first: distant meshes are mostly stamps, so
+     * this keeps the setup math in one tight loop */
+    TriSetup t[ RASTER_BATCH ];
+    uint32_t live[ RASTER_BATCH ];
+
+    /* per TRI_ outcome; a triangle split over bands is counted by the one
+     * holding its first row */
+    uint32_t seen[ 4 ] = { 0, 0, 0, 0 };
 
-    vec4 * curr_c = f->opaque_c;
-    // float * curr_z = f->opaque_z;
+    /* with a shader the fragments go through q */
+    FragQueue q;
+    if ( f->shader )
+    {
+        memset ( &q, 0, sizeof ( FragQueue ) );
+        q.b.attr = c;
+    }
 
-    uint32_t * curr_out = f->surface->pixels;
-    const int  num_px   = f->surface->h * f->surface->w;
-    for ( int i = 0; i < num_px; i++ )
+    for ( int base = 0; base < cnt; base += RASTER_BATCH )
     {
-        vec4 out_color;
+        int n = cnt - base < RASTER_BATCH ? cnt - base : RASTER_BATCH;
+        int k = 0;
 
-        glm_vec4_zero ( out_color );
-        glm_vec4_copy ( *curr_c, out_color );
-        glm_vec4_scale ( out_color, 255.0f, out_color );
+        for ( int i = 0; i < n; i++ )
+        {
+            const uint32_t tri =
+                tris ? tris[ base + i ] : ( uint32_t ) ( base + i );
+            const int r = setup_tri ( f, clip, v + tri * 3, &t[ k ] );
+            if ( r == TRI_OFF_TARGET ||
+                 fast_max ( t[ k ].top, f->clip[ 1 ] ) >= clip[ 1 ] )
+                seen[ r ]++;
+            if ( r == TRI_DRAWN ) live[ k++ ] = tri;
+        }
 
-        __m128  color     = _mm_loadu_ps ( out_color );
-        __m128i color_int = _mm_cvtps_epi32 ( color );
+        for ( int i = 0; i < k; i++ )
+        {
+            uint64_t * tzi = zi + live[ i ] * 3;
+            if ( ! f->shader )
+            {
+                raster_one ( isa, f, &t[ i ], tzi, c, NULL );
+                continue;
+            }
 
-        color_int = _mm_packs_epi32 ( color_int, color_int );
-        color_int = _mm_packus_epi16 ( color_int, color_int );
+            q.b.tri = live[ i ];
+            q.b.v   = v + live[ i ] * 3;
+            q.zi    = tzi;
+            q.denom = t[ i ].denom;
+            q.rcp   = _mm_set1_ps ( 1.0f / t[ i ].denom );
+            for ( int e = 0; e < 3; e++ )
+                q.vz[ e ] = _mm_set1_ps ( q.b.v[ e ][ 2 ] );
+            raster_one ( isa, f, &t[ i ], tzi, c, &q );
+        }
+    }
 
-        *curr_out = _mm_cvtsi128_si32 ( color_int );
-        //  __m128  color     = _mm_loadu_ps ( out_color );
-        //  __m128i color_int = _mm_cvttps_epi32 ( color );
+    add_stat ( &f->stats.rasterized, seen[ TRI_DRAWN ] );
+    add_stat ( &f->stats.frustum, seen[ TRI_OFF_TARGET ] );
+    add_stat ( &f->stats.degenerate, seen[ TRI_DEGENERATE ] );
+    add_stat ( &f->stats.scissored, seen[ TRI_SCISSORED ] );
+}
 
-        //  int r = _mm_extract_epi32 ( color_int, 0 );
-        //  int g = _mm_extract_epi32 ( color_int, 1 );
-        //  int b = _mm_extract_epi32 ( color_int, 2 );
-        //  int a = _mm_extract_epi32 ( color_int, 3 );
+ISA_KERNEL ( raster_tris,
+             ( Framebuffer *    f,
+               const int *      clip,
+               vec3 *           v,
+               uint64_t *       zi,
+               vec4 *           c,
+               const uint32_t * tris,
+               int              cnt ),
+             f,
+             clip,
+             v,
+             zi,
+             c,
+             tris,
+             cnt );
 
-        //  *curr_out = ( a << 24 ) | ( b << 16 ) | ( g << 8 ) | r;
+void
+shadeVertexColors ( FragBatch * b, void * user )
+{
+    ( void ) user;
 
-        //  uint32_t r = ( uint32_t ) ( *out_color_temp++ );
-        //  uint32_t g = ( uint32_t ) ( *out_color_temp++ );
-        //  uint32_t b = ( uint32_t ) ( *out_color_temp++ );
-        //  uint32_t a = ( uint32_t ) ( *out_color );
-        //  *curr_out = ( r ) | ( g << 8 ) | ( b << 16 ) | ( a << 24 );
+    for ( int l = 0; l < FRAG_BATCH; l += 4 )
+    {
+        const __m128 b1 = _mm_load_ps ( b->b[ 0 ] + l );
+        const __m128 b2 = _mm_load_ps ( b->b[ 1 ] + l );
+        const __m128 b3 = _mm_load_ps ( b->b[ 2 ] + l );
 
-        curr_c++;
-        // curr_z++;
-        curr_out++;
+        for ( int ch = 0; ch < 4; ch++ )
+        {
+            __m128 o = _mm_mul_ps ( b1, _mm_set1_ps ( b->attr[ 0 ][ ch ] ) );
+            o        = _mm_add_ps (
+                o, _mm_mul_ps ( b2, _mm_set1_ps ( b->attr[ 1 ][ ch ] ) ) );
+            o = _mm_add_ps (
+                o, _mm_mul_ps ( b3, _mm_set1_ps ( b->attr[ 2 ][ ch ] ) ) );
+            _mm_store_ps ( b->out[ ch ] + l, o );
+        }
     }
 }
+
+void
+rasterize ( Framebuffer * f, vec3 * v, uint64_t * zi, vec4 * c )
+{
+    if ( f->capture ) captureDraw ( f->capture, v, zi, c, 1 );
+    raster_tris_isa[ isaLevel ] ( f, f->clip, v, zi, c, NULL, 1 );
+}
+
+void
+rasterizeBatch ( Framebuffer * f, vec3 * v, uint64_t * zi, vec4 * c, int cnt )
+{
+    if ( f->capture ) captureDraw ( f->capture, v, zi, c, cnt );
+    raster_tris_isa[ isaLevel ] ( f, f->clip, v, zi, c, NULL, cnt );
+}
+
+/* 19.10.26 ::: Sort-middle over f->jobs. The clip rect is cut into bands
+ * of rows; binning slices of the triangle list count, then fill, per band
+ * lists, and every band rasterizes its list clipped to its rows. Lists
+ * keep submission order and the edge walk is exact integer math, so the
+ * result is the same as rasterizeBatch () bit for bit. */
+#define BIN_SLICES        64
+#define RASTER_BANDS_MAX  64
+#define RASTER_BAND_MIN_H 16
+#define BIN_NONE          0xff
+
+typedef struct
+{
+    Framebuffer *    f;
+    vec3 *           v;
+    uint64_t *       zi;
+    vec4 *           c;
+    const uint32_t * order; /* draw order, NULL for submission order */
+    int              cnt;
+    int              grain; /* triangles per slice */
+    int           bands;
+    int           band_h;
+
+    /* first / last band per triangle and the per band triangle lists,
+     * off the frame arenas */
+    uint8_t *  band;
+    uint32_t * tris;
+
+    /* per slice and band: the count, then the slice's write offset */
+    uint32_t at[ BIN_SLICES ][ RASTER_BANDS_MAX ];
+    uint32_t band_start[ RASTER_BANDS_MAX + 1 ];
+
+    JobCounter counted;
+    JobCounter filled;
+    JobCounter done;
+} BinJob;
+
+static void
+bin_count ( void * arg, int begin, int end, int worker )
+{
+    BinJob *      j = arg;
+    Framebuffer * f = j->f;
+    uint32_t *    n = j->at[ begin / j->grain ];
+    uint32_t      off_target = 0, scissored = 0;
+    ( void ) worker;
+
+    for ( int i = begin; i < end; i++ )
+    {
+        const uint32_t tri  = j->order ? j->order[ i ] : ( uint32_t ) i;
+        vec3 *         v    = j->v + tri * 3;
+        uint8_t *      band = j->band + i * 2;
+
+        band[ 0 ] = band[ 1 ] = BIN_NONE;
+        if ( ! on_target ( f, v ) )
+        {
+            off_target++;
+            continue;
+        }
+
+        /* same rows setup_tri () ends up with */
+        int ymin = min3 ( to_fixed ( Y1 ), to_fixed ( Y2 ), to_fixed ( Y3 ) );
+        int ymax = max3 ( to_fixed ( Y1 ), to_fixed ( Y2 ), to_fixed ( Y3 ) );
+        ymin     = fast_max ( ymin >> SUBPIX_BITS, f->clip[ 1 ] );
+        ymax     = fast_min ( ymax >> SUBPIX_BITS, f->clip[ 3 ] );
+        if ( ymin > ymax )
+        {
+            scissored++;
+            continue;
+        }
+
+        band[ 0 ] = ( ymin - f->clip[ 1 ] ) / j->band_h;
+        band[ 1 ] = ( ymax - f->clip[ 1 ] ) / j->band_h;
+        for ( int b = band[ 0 ]; b <= band[ 1 ]; b++ ) n[ b ]++;
+    }
+
+    /* the rest are counted by the bands */
+    add_stat ( &f->stats.frustum, off_target );
+    add_stat ( &f->stats.scissored, scissored );
+}
+
+static void
+bin_fill ( void * arg, int begin, int end, int worker )
+{
+    BinJob *   j  = arg;
+    uint32_t * at = j->at[ begin / j->grain ];
+    ( void ) worker;
+
+    for ( int i = begin; i < end; i++ )
+    {
+        const uint8_t * band = j->band + i * 2;
+        if ( band[ 0 ] == BIN_NONE ) continue;
+
+        const uint32_t tri = j->order ? j->order[ i ] : ( uint32_t ) i;
+        for ( int b = band[ 0 ]; b <= band[ 1 ]; b++ )
+            j->tris[ at[ b ]++ ] = tri;
+    }
+}
+
+static void
+bin_band_raster ( void * arg, int begin, int end, int worker )
+{
+    BinJob *      j = arg;
+    Framebuffer * f = j->f;
+    ( void ) worker;
+
+    for ( int b = begin; b < end; b++ )
+    {
+        const int y0      = f->clip[ 1 ] + b * j->band_h;
+        const int clip[ 4 ] = {
+            f->clip[ 0 ],
+            y0,
+            f->clip[ 2 ],
+            fast_min ( y0 + j->band_h - 1, f->clip[ 3 ] ) };
+
+        raster_tris_isa[ isaLevel ] ( f,
+                                      clip,
+                                      j->v,
+                                      j->zi,
+                                      j->c,
+                                      j->tris + j->band_start[ b ],
+                                      j->band_start[ b + 1 ] -
+                                          j->band_start[ b ] );
+    }
+}
+
+/* turns the counts into write offsets, then queues the fill */
+static void
+bin_prefix ( void * arg, int begin, int end, int worker )
+{
+    BinJob *      j      = arg;
+    Framebuffer * f      = j->f;
+    const int     slices = ( j->cnt + j->grain - 1 ) / j->grain;
+    uint32_t      total  = 0;
+    ( void ) begin;
+    ( void ) end;
+    ( void ) worker;
+
+    for ( int b = 0; b < j->bands; b++ )
+    {
+        j->band_start[ b ] = total;
+        for ( int s = 0; s < slices; s++ )
+        {
+            const uint32_t n = j->at[ s ][ b ];
+            j->at[ s ][ b ]  = total;
+            total += n;
+        }
+    }
+    j->band_start[ j->bands ] = total;
+
+    /* this worker's arena, given back when the caller's stage ends */
+    F_ALLOC ( f->arenas, j->tris, uint32_t, total );
+
+    parallelForAsync ( f->jobs, bin_fill, j, j->cnt, j->grain, &j->filled );
+}
+
+static void
+bin_raster ( void * arg, int begin, int end, int worker )
+{
+    BinJob * j = arg;
+    ( void ) begin;
+    ( void ) end;
+    ( void ) worker;
+
+    parallelForAsync ( j->f->jobs, bin_band_raster, j, j->bands, 1, &j->done );
+}
+
+/* 19.10.26 ::: Draw order. shade_px () drops a pixel on its depth before
+ * shading it, which only pays when near surfaces come first. Runs of
+ * ORDER_RUN consecutive triangles, neighbours after optimizeMesh (), are
+ * radix sorted on the top 16 bits of their nearest depth, nearest first.
+ * Triangles keep their order inside a run, runs of one key keep theirs;
+ * only depth ties between triangles can come out differently. */
+#define ORDER_RUN      64
+#define ORDER_MIN_TRIS 4096 /* fewer go as submitted */
+
+typedef struct
+{
+    const uint64_t * zi;
+    int              cnt;   /* triangles */
+    uint16_t *       key;   /* per run */
+    uint32_t *       run;   /* runs, sorted */
+    uint32_t *       start; /* per sorted run, its first slot in tris */
+    uint32_t *       tris;
+} OrderJob;
+
+static void
+order_keys ( void * arg, int begin, int end, int worker )
+{
+    OrderJob * j = arg;
+    ( void ) worker;
+
+    for ( int r = begin; r < end; r++ )
+    {
+        const int last = fast_min ( ( r + 1 ) * ORDER_RUN, j->cnt ) * 3;
+
+        uint64_t near = 0;
+        for ( int i = r * ORDER_RUN * 3; i < last; i++ )
+            near = j->zi[ i ] > near ? j->zi[ i ] : near;
+
+        /* larger is nearer, the sort is ascending */
+        j->key[ r ] = ( uint16_t ) ~( near >> 48 );
+    }
+}
+
+/* two stable 8 bit passes, the runs end up back in j->run */
+static void
+order_sort ( OrderJob * j, int runs, uint32_t * tmp )
+{
+    uint32_t * src = j->run;
+    uint32_t * dst = tmp;
+
+    for ( int r = 0; r < runs; r++ ) src[ r ] = r;
+
+    for ( int shift = 0; shift < 16; shift += 8 )
+    {
+        uint32_t at[ 256 ];
+        memset ( at, 0, sizeof ( at ) );
+        for ( int r = 0; r < runs; r++ )
+            at[ ( j->key[ src[ r ] ] >> shift ) & 0xFF ]++;
+
+        uint32_t total = 0;
+        for ( int b = 0; b < 256; b++ )
+        {
+            const uint32_t n = at[ b ];
+            at[ b ]          = total;
+            total += n;
+        }
+
+        for ( int r = 0; r < runs; r++ )
+            dst[ at[ ( j->key[ src[ r ] ] >> shift ) & 0xFF ]++ ] = src[ r ];
+
+        uint32_t * t = src;
+        src          = dst;
+        dst          = t;
+    }
+}
+
+static void
+order_expand ( void * arg, int begin, int end, int worker )
+{
+    OrderJob * j = arg;
+    ( void ) worker;
+
+    for ( int k = begin; k < end; k++ )
+    {
+        const int  first = j->run[ k ] * ORDER_RUN;
+        const int  n     = fast_min ( ORDER_RUN, j->cnt - first );
+        uint32_t * out   = j->tris + j->start[ k ];
+
+        for ( int t = 0; t < n; t++ ) out[ t ] = first + t;
+    }
+}
+
+/* draw order for cnt triangles of zi off f->arenas, NULL to draw them as
+ * submitted */
+static const uint32_t *
+order_tris ( Framebuffer * f, const uint64_t * zi, int cnt )
+{
+    if ( ! f->ordered || ! f->arenas || cnt < ORDER_MIN_TRIS ) return NULL;
+
+    const int  runs = ( cnt + ORDER_RUN - 1 ) / ORDER_RUN;
+    OrderJob   j    = { zi, cnt, NULL, NULL, NULL, NULL };
+    uint32_t * tmp;
+    F_ALLOC ( f->arenas, j.key, uint16_t, runs );
+    F_ALLOC ( f->arenas, j.run, uint32_t, runs );
+    F_ALLOC ( f->arenas, j.start, uint32_t, runs );
+    F_ALLOC ( f->arenas, j.tris, uint32_t, cnt );
+    F_ALLOC ( f->arenas, tmp, uint32_t, runs );
+
+    parallelFor ( f->jobs, order_keys, &j, runs, 256 );
+    order_sort ( &j, runs, tmp );
+
+    uint32_t at = 0;
+    for ( int k = 0; k < runs; k++ )
+    {
+        j.start[ k ] = at;
+        at += fast_min ( ORDER_RUN, cnt - ( int ) j.run[ k ] * ORDER_RUN );
+    }
+    parallelFor ( f->jobs, order_expand, &j, runs, 256 );
+
+    return j.tris;
+}
+
+void
+rasterizeBinned ( Framebuffer * f, vec3 * v, uint64_t * zi, vec4 * c, int cnt )
+{
+    const int rows = f->clip[ 3 ] - f->clip[ 1 ] + 1;
+
+    if ( f->capture ) captureDraw ( f->capture, v, zi, c, cnt );
+
+    const uint32_t * order = order_tris ( f, zi, cnt );
+
+    /* not worth the binning */
+    if ( ! f->jobs || ! f->arenas || f->jobs->worker_cnt < 2 ||
+         cnt < RASTER_BATCH || rows < 2 * RASTER_BAND_MIN_H )
+    {
+        raster_tris_isa[ isaLevel ] ( f, f->clip, v, zi, c, order, cnt );
+        return;
+    }
+
+    BinJob j;
+    j.f     = f;
+    j.v     = v;
+    j.zi    = zi;
+    j.c     = c;
+    j.order = order;
+    j.cnt   = cnt;
+    j.grain = ( cnt + BIN_SLICES - 1 ) / BIN_SLICES;
+
+    /* a few bands per worker so stealing can even out dense rows */
+    int bands = fast_min ( f->jobs->worker_cnt * 4, RASTER_BANDS_MAX );
+    bands     = fast_min ( bands, rows / RASTER_BAND_MIN_H );
+    j.band_h  = ( rows + bands - 1 ) / bands;
+    j.bands   = ( rows + j.band_h - 1 ) / j.band_h;
+
+    memset ( j.at, 0, sizeof ( j.at ) );
+    memset ( &j.counted, 0, sizeof ( JobCounter ) );
+    memset ( &j.filled, 0, sizeof ( JobCounter ) );
+    memset ( &j.done, 0, sizeof ( JobCounter ) );
+
+    F_ALLOC ( f->arenas, j.band, uint8_t, cnt * 2 );
+
+    /* count -> prefix -> fill -> raster, chained on counters */
+    parallelForAsync ( f->jobs, bin_count, &j, cnt, j.grain, &j.counted );
+    submitJobAfter ( f->jobs, &j.counted, bin_prefix, &j, &j.filled );
+    submitJobAfter ( f->jobs, &j.filled, bin_raster, &j, &j.done );
+    waitJobs ( f->jobs, &j.done );
+}
+
+/* one vec4 colour in 0..1 -> packed 8 bit channels */
+static inline __attribute__ ( ( always_inline ) ) uint32_t
+pack_px ( __m128 color )
+{
+    __m128i color_int =
+        _mm_cvtps_epi32 ( _mm_mul_ps ( color, _mm_set1_ps ( 255.0f ) ) );
+
+    color_int = _mm_packs_epi32 ( color_int, color_int );
+    color_int = _mm_packus_epi16 ( color_int, color_int );
+
+    return _mm_cvtsi128_si32 ( color_int );
+}
+
+/* four vec4 colours -> four packed pixels, same rounding as pack_px () */
+static inline __attribute__ ( ( always_inline ) ) __m128i
+pack_px4 ( __m128 c0, __m128 c1, __m128 c2, __m128 c3 )
+{
+    const __m128 s = _mm_set1_ps ( 255.0f );
+
+    __m128i lo = _mm_packs_epi32 ( _mm_cvtps_epi32 ( _mm_mul_ps ( c0, s ) ),
+                                   _mm_cvtps_epi32 ( _mm_mul_ps ( c1, s ) ) );
+    __m128i hi = _mm_packs_epi32 ( _mm_cvtps_epi32 ( _mm_mul_ps ( c2, s ) ),
+                                   _mm_cvtps_epi32 ( _mm_mul_ps ( c3, s ) ) );
+
+    return _mm_packus_epi16 ( lo, hi );
+}
+
+/* 19.10.26 ::: a full merge writes the whole surface, which is gone from
+ * the cache again by the time the texture upload reads it: those rows
+ * are streamed (no read for ownership). Partial merges store normally. */
+static inline __attribute__ ( ( always_inline ) ) void
+store_px4 ( uint32_t * out, __m128i px, int stream )
+{
+    if ( stream )
+        _mm_stream_si128 ( ( __m128i * ) out, px );
+    else
+        _mm_storeu_si128 ( ( __m128i * ) out, px );
+}
+
+/* pixels to write one by one before out is align (a power of 2) byte
+ * aligned */
+static inline __attribute__ ( ( always_inline ) ) int
+px_head ( const uint32_t * out, int w, int stream, int align )
+{
+    const int head =
+        stream ? ( ( align - ( ( uintptr_t ) out & ( align - 1 ) ) ) &
+                   ( align - 1 ) ) /
+                     4
+               : 0;
+    return fast_min ( head, w );
+}
+
+/* 19.10.26 ::: render target smaller than the surface. One vec4 is one
+ * SSE register, so every tap is a single load; the horizontal taps and
+ * weights per surface column are precomputed in resizeFramebuffer(). */
+static inline __attribute__ ( ( always_inline ) ) __m128
+upscale_px ( Framebuffer * f, vec4 * row0, vec4 * row1, __m128 fy, int x )
+{
+    const int    x0 = f->up_x[ x ];
+    const int    c0 = pxCol ( f, x0 );
+    const int    c1 = f->w > 1 ? ( int ) pxCol ( f, x0 + 1 ) : c0;
+    const __m128 fx = _mm_set1_ps ( f->up_fx[ x ] );
+
+    __m128 c00 = _mm_loadu_ps ( row0[ c0 ] );
+    __m128 c10 = _mm_loadu_ps ( row0[ c1 ] );
+    __m128 c01 = _mm_loadu_ps ( row1[ c0 ] );
+    __m128 c11 = _mm_loadu_ps ( row1[ c1 ] );
+
+    __m128 top =
+        _mm_add_ps ( c00, _mm_mul_ps ( _mm_sub_ps ( c10, c00 ), fx ) );
+    __m128 bot =
+        _mm_add_ps ( c01, _mm_mul_ps ( _mm_sub_ps ( c11, c01 ), fx ) );
+
+    return _mm_add_ps ( top, _mm_mul_ps ( _mm_sub_ps ( bot, top ), fy ) );
+}
+
+static inline __attribute__ ( ( always_inline ) ) void
+merge_upscale ( Framebuffer * f, const SDL_Rect * out_r, int stream )
+{
+    const int src_h = f->h;
+
+    const float sy_step = ( float ) src_h / ( float ) f->surface->h;
+
+    for ( int y = out_r->y; y < out_r->y + out_r->h; y++ )
+    {
+        float sy = ( y + 0.5f ) * sy_step - 0.5f;
+        sy       = sy < 0 ? 0 : sy;
+        int y0   = ( int ) sy;
+        if ( y0 > src_h - 2 ) y0 = src_h > 1 ? src_h - 2 : 0;
+        int y1 = src_h > 1 ? y0 + 1 : y0;
+
+        const __m128 fy = _mm_set1_ps ( fminf ( sy - y0, 1.0f ) );
+
+        vec4 * row0 = f->opaque_c + pxRow ( f, y0 );
+        vec4 * row1 = f->opaque_c + pxRow ( f, y1 );
+
+        uint32_t * out = ( uint32_t * ) f->surface->pixels +
+                         y * f->surface->w + out_r->x;
+
+        const int x_end = out_r->x + out_r->w;
+        int       x     = out_r->x;
+
+        for ( const int h = x + px_head ( out, out_r->w, stream, 16 ); x < h;
+              x++ )
+            *( out++ ) = pack_px ( upscale_px ( f, row0, row1, fy, x ) );
+
+        for ( ; x + 4 <= x_end; x += 4, out += 4 )
+        {
+            store_px4 ( out,
+                        pack_px4 ( upscale_px ( f, row0, row1, fy, x ),
+                                   upscale_px ( f, row0, row1, fy, x + 1 ),
+                                   upscale_px ( f, row0, row1, fy, x + 2 ),
+                                   upscale_px ( f, row0, row1, fy, x + 3 ) ),
+                        stream );
+        }
+
+        for ( ; x < x_end; x++ )
+            *( out++ ) = pack_px ( upscale_px ( f, row0, row1, fy, x ) );
+    }
+}
+
+static void
+resolve_range ( void * arg, int begin, int end, int worker )
+{
+    Framebuffer * f = arg;
+    ( void ) worker;
+
+    const __m128 inv = _mm_set1_ps ( 1.0f / MSAA_SAMPLES );
+    for ( uint32_t i = begin; i < ( uint32_t ) end; i++ )
+    {
+        MSBlock * b = MS_BLOCK ( f, i );
+
+        /* collapsed back, or the pixel was cleared since */
+        if ( f->ms_idx[ b->px ] != i + 1 ) continue;
+
+        __m128 sum = _mm_loadu_ps ( b->color[ 0 ] );
+        for ( int s = 1; s < MSAA_SAMPLES; s++ )
+            sum = _mm_add_ps ( sum, _mm_loadu_ps ( b->color[ s ] ) );
+
+        _mm_storeu_ps ( f->opaque_c[ b->px ], _mm_mul_ps ( sum, inv ) );
+    }
+}
+
+/* averages the samples of every still expanded pixel into opaque_c, so
+ * both merge paths can read opaque_c only */
+static void
+resolve_samples ( Framebuffer * f )
+{
+    if ( ! f->ms_dirty ) return;
+
+    parallelFor ( f->jobs, resolve_range, f, f->ms_used, MS_CHUNK_LEN / 4 );
+    f->ms_dirty = 0;
+}
+
+/* pack_px4 () over 8 pixels, 2 per register; returns how many of the n
+ * pixels were written (a multiple of 8). out is 32 byte aligned when
+ * streaming. */
+static ISA_TARGET_AVX2 int
+merge_px8 ( uint32_t * out, vec4 * c, int n, int stream )
+{
+    const __m256  s = _mm256_set1_ps ( 255.0f );
+    const __m256i order = _mm256_setr_epi32 ( 0, 4, 1, 5, 2, 6, 3, 7 );
+
+    int x = 0;
+    for ( ; x + 8 <= n; x += 8 )
+    {
+        __m256i p[ 4 ];
+        for ( int k = 0; k < 4; k++ )
+        {
+            p[ k ] = _mm256_cvtps_epi32 (
+                _mm256_mul_ps ( _mm256_loadu_ps ( c[ x + 2 * k ] ), s ) );
+        }
+
+        /* per 128 bit lane, so the pixels come out as 0 2 4 6 1 3 5 7 */
+        __m256i px =
+            _mm256_packus_epi16 ( _mm256_packs_epi32 ( p[ 0 ], p[ 1 ] ),
+                                  _mm256_packs_epi32 ( p[ 2 ], p[ 3 ] ) );
+        px = _mm256_permutevar8x32_epi32 ( px, order );
+
+        if ( stream )
+            _mm256_stream_si256 ( ( __m256i * ) ( out + x ), px );
+        else
+            _mm256_storeu_si256 ( ( __m256i * ) ( out + x ), px );
+    }
+    return x;
+}
+
+/* the same over 16 pixels, 4 per register, a cache line per store */
+static ISA_TARGET_AVX512 int
+merge_px16 ( uint32_t * out, vec4 * c, int n, int stream )
+{
+    const __m512  s     = _mm512_set1_ps ( 255.0f );
+    const __m512i order = _mm512_setr_epi32 (
+        0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15 );
+
+    int x = 0;
+    for ( ; x + 16 <= n; x += 16 )
+    {
+        __m512i p[ 4 ];
+        for ( int k = 0; k < 4; k++ )
+        {
+            p[ k ] = _mm512_cvtps_epi32 (
+                _mm512_mul_ps ( _mm512_loadu_ps ( c[ x + 4 * k ] ), s ) );
+        }
+
+        __m512i px =
+            _mm512_packus_epi16 ( _mm512_packs_epi32 ( p[ 0 ], p[ 1 ] ),
+                                  _mm512_packs_epi32 ( p[ 2 ], p[ 3 ] ) );
+        px = _mm512_permutexvar_epi32 ( order, px );
+
+        if ( stream )
+            _mm512_stream_si512 ( ( __m512i * ) ( out + x ), px );
+        else
+            _mm512_storeu_si512 ( out + x, px );
+    }
+    return x;
+}
+
+static inline __attribute__ ( ( always_inline ) ) void
+merge_px4 ( uint32_t * out, vec4 * c, int stream )
+{
+    store_px4 ( out,
+                pack_px4 ( _mm_loadu_ps ( c[ 0 ] ),
+                           _mm_loadu_ps ( c[ 1 ] ),
+                           _mm_loadu_ps ( c[ 2 ] ),
+                           _mm_loadu_ps ( c[ 3 ] ) ),
+                stream );
+}
+
+/* n contiguous plane pixels c to out. Streamed runs go 4 pixels at a
+ * time up to the alignment of the wide stores, tiled runs (8 pixels)
+ * mostly never reach it. */
+static inline __attribute__ ( ( always_inline ) ) void
+merge_run ( int isa, uint32_t * out, vec4 * c, int n, int stream )
+{
+    int x = 0;
+    for ( const int h = px_head ( out, n, stream, 16 ); x < h; x++ )
+        out[ x ] = pack_px ( _mm_loadu_ps ( c[ x ] ) );
+
+    if ( isa >= ISA_AVX2 )
+    {
+        const uintptr_t wide = isa >= ISA_AVX512 ? 63 : 31;
+        for ( ; stream && ( ( uintptr_t ) ( out + x ) & wide ) && x + 4 <= n;
+              x += 4 )
+        {
+            merge_px4 ( out + x, c + x, stream );
+        }
+
+        if ( isa >= ISA_AVX512 )
+            x += merge_px16 ( out + x, c + x, n - x, stream );
+        else
+            x += merge_px8 ( out + x, c + x, n - x, stream );
+    }
+
+    for ( ; x + 4 <= n; x += 4 ) merge_px4 ( out + x, c + x, stream );
+
+    for ( ; x < n; x++ ) out[ x ] = pack_px ( _mm_loadu_ps ( c[ x ] ) );
+}
+
+/* surface rows of r, render target at surface size. Rows rather than
+ * tiles: streaming stores to 8 rows at once would split write combining. */
+static inline __attribute__ ( ( always_inline ) ) void
+merge_native ( int isa, Framebuffer * f, const SDL_Rect * r, int stream )
+{
+    const int x_end = r->x + r->w;
+
+    for ( int y = r->y; y < r->y + r->h; y++ )
+    {
+        uint32_t *       out = ( uint32_t * ) f->surface->pixels +
+                         y * f->surface->w;
+        vec4 *           row = f->opaque_c + pxRow ( f, y );
+
+        for ( int x = r->x; x < x_end; )
+        {
+            const int n = fast_min ( pxRun ( f, x ), x_end - x );
+            merge_run ( isa, out + x, row + pxCol ( f, x ), n, stream );
+            x += n;
+        }
+    }
+}
+
+typedef struct
+{
+    Framebuffer * f;
+    SDL_Rect      r;
+    int           native;
+    int           stream;
+    VideoSink *   video;
+} MergeJob;
+
+static inline __attribute__ ( ( always_inline ) ) void
+merge_rows_body ( int isa, void * arg, int begin, int end, int worker )
+{
+    MergeJob *     m    = arg;
+    const SDL_Rect rows = { m->r.x, m->r.y + begin, m->r.w, end - begin };
+    ( void ) worker;
+
+    if ( m->native )
+        merge_native ( isa, m->f, &rows, m->stream );
+    else
+        merge_upscale ( m->f, &rows, m->stream );
+
+    /* 19.10.26 ::: while the rows are still in cache; jobs start on even
+     * rows (MERGE_ROWS is) of an even rect, so 2x2 chroma blocks never
+     * straddle two jobs */
+    if ( m->video )
+        videoConvert (
+            m->video, m->f->surface->pixels, m->f->surface->w, &rows );
+
+    /* streaming stores are weakly ordered, the job counter is not */
+    if ( m->stream ) _mm_sfence ();
+}
+
+ISA_KERNEL ( merge_rows,
+             ( void * arg, int begin, int end, int worker ),
+             arg,
+             begin,
+             end,
+             worker );
+
+#define MERGE_ROWS 16
+
+static void
+merge_surface_rect ( Framebuffer * f, const SDL_Rect * r, int stream )
+{
+    MergeJob m = { f,
+                   *r,
+                   f->w == ( uint32_t ) f->surface->w &&
+                       f->h == ( uint32_t ) f->surface->h,
+                   stream,
+                   f->video };
+
+    parallelFor ( f->jobs, merge_rows_isa[ isaLevel ], &m, r->h, MERGE_ROWS );
+}
+
+void
+mergeRect ( Framebuffer * f, const int * rect, SDL_Rect * touched )
+{
+    if ( f->capture ) captureRect ( f->capture, CAPTURE_MERGE, rect );
+    resolve_samples ( f );
+
+    const int out_w = f->surface->w;
+    const int out_h = f->surface->h;
+
+    /* render target rect -> surface rect, one source pixel of margin for
+     * the bilinear footprint */
+    const int native =
+        f->w == ( uint32_t ) out_w && f->h == ( uint32_t ) out_h;
+
+    SDL_Rect r;
+    if ( native )
+    {
+        r.x = rect[ 0 ];
+        r.y = rect[ 1 ];
+        r.w = rect[ 2 ] - rect[ 0 ] + 1;
+        r.h = rect[ 3 ] - rect[ 1 ] + 1;
+    }
+    else
+    {
+        int x0 = fast_max ( 0, ( rect[ 0 ] - 1 ) * out_w / ( int ) f->w );
+        int y0 = fast_max ( 0, ( rect[ 1 ] - 1 ) * out_h / ( int ) f->h );
+        int x1 = fast_min ( out_w, ( rect[ 2 ] + 2 ) * out_w / ( int ) f->w );
+        int y1 = fast_min ( out_h, ( rect[ 3 ] + 2 ) * out_h / ( int ) f->h );
+
+        r = ( SDL_Rect ) { x0, y0, x1 - x0, y1 - y0 };
+    }
+    if ( f->video )
+    {
+        /* whole 2x2 chroma blocks, the surface size is even */
+        const int x1 = fast_min ( out_w, ( r.x + r.w + 1 ) & ~1 );
+        const int y1 = fast_min ( out_h, ( r.y + r.h + 1 ) & ~1 );
+
+        r.x &= ~1;
+        r.y &= ~1;
+        r.w = x1 - r.x;
+        r.h = y1 - r.y;
+    }
+    if ( touched ) *touched = r;
+
+    merge_surface_rect ( f, &r, 0 );
+}
+
+/* x / 255 for x in 0..255*255, exact after rounding */
+static inline __attribute__ ( ( always_inline ) ) __m128i
+div255_epi16 ( __m128i x )
+{
+    x = _mm_add_epi16 ( x, _mm_set1_epi16 ( 128 ) );
+    return _mm_srli_epi16 ( _mm_add_epi16 ( x, _mm_srli_epi16 ( x, 8 ) ), 8 );
+}
+
+void
+compositeLayer ( Framebuffer *    f,
+                 const uint32_t * layer,
+                 int              ashift,
+                 const SDL_Rect * r )
+{
+    const int     pitch = f->surface->w;
+    const __m128i zero  = _mm_setzero_si128 ();
+    const __m128i full  = _mm_set1_epi16 ( 255 );
+    const __m128i a_up  = _mm_cvtsi32_si128 ( 24 - ashift );
+
+    for ( int y = r->y; y < r->y + r->h; y++ )
+    {
+        const uint32_t * src = layer + y * pitch + r->x;
+        uint32_t * dst = ( uint32_t * ) f->surface->pixels + y * pitch + r->x;
+
+        int x = 0;
+        for ( ; x + 4 <= r->w; x += 4 )
+        {
+            __m128i s = _mm_loadu_si128 ( ( const __m128i * ) ( src + x ) );
+
+            /* alpha of every pixel broadcast to its 4 bytes */
+            __m128i a = _mm_sll_epi32 ( s, a_up );
+            a         = _mm_srli_epi32 ( a, 24 );
+            a         = _mm_or_si128 ( a, _mm_slli_epi32 ( a, 8 ) );
+            a         = _mm_or_si128 ( a, _mm_slli_epi32 ( a, 16 ) );
+
+            /* empty UI pixels are most of the rect */
+            if ( _mm_movemask_epi8 ( _mm_cmpeq_epi8 ( a, zero ) ) == 0xffff )
+                continue;
+
+            __m128i d = _mm_loadu_si128 ( ( __m128i * ) ( dst + x ) );
+
+            __m128i a_lo = _mm_unpacklo_epi8 ( a, zero );
+            __m128i a_hi = _mm_unpackhi_epi8 ( a, zero );
+
+            __m128i lo = _mm_add_epi16 (
+                _mm_mullo_epi16 ( _mm_unpacklo_epi8 ( s, zero ), a_lo ),
+                _mm_mullo_epi16 ( _mm_unpacklo_epi8 ( d, zero ),
+                                  _mm_sub_epi16 ( full, a_lo ) ) );
+            __m128i hi = _mm_add_epi16 (
+                _mm_mullo_epi16 ( _mm_unpackhi_epi8 ( s, zero ), a_hi ),
+                _mm_mullo_epi16 ( _mm_unpackhi_epi8 ( d, zero ),
+                                  _mm_sub_epi16 ( full, a_hi ) ) );
+
+            _mm_storeu_si128 ( ( __m128i * ) ( dst + x ),
+                               _mm_packus_epi16 ( div255_epi16 ( lo ),
+                                                  div255_epi16 ( hi ) ) );
+        }
+
+        for ( ; x < r->w; x++ )
+        {
+            const uint32_t sp = src[ x ], dp = dst[ x ];
+            const uint32_t a  = ( sp >> ashift ) & 0xff;
+            if ( ! a ) continue;
+
+            uint32_t out = 0;
+            for ( int ch = 0; ch < 32; ch += 8 )
+            {
+                uint32_t v = ( ( sp >> ch ) & 0xff ) * a +
+                             ( ( dp >> ch ) & 0xff ) * ( 255 - a ) + 128;
+                out |= ( ( v + ( v >> 8 ) ) >> 8 ) << ch;
+            }
+            dst[ x ] = out;
+        }
+    }
+}
+
+void
+merge ( Framebuffer * f )
+{
+    if ( f->capture ) captureRect ( f->capture, CAPTURE_MERGE, NULL );
+    resolve_samples ( f );
+
+    /* video converts the rows right after, out of the cache the
+     * streaming stores would bypass */
+    SDL_Rect all = { 0, 0, f->surface->w, f->surface->h };
+    merge_surface_rect ( f, &all, ! f->video );
+}
+
+/* 19.10.26 ::: Overdraw. With Framebuffer.count set every depth test of a
+ * pixel went into f->heat, see count_px (). */
+static void
+heat_sum ( void * arg, int begin, int end, int worker )
+{
+    Framebuffer * f      = arg;
+    uint64_t      tested = 0, passed = 0;
+    ( void ) worker;
+
+    for ( int y = begin; y < end; y++ )
+    {
+        const uint32_t row = pxRow ( f, y );
+        for ( uint32_t x = 0; x < f->w; x++ )
+        {
+            const uint64_t h = f->heat[ row + pxCol ( f, x ) ];
+            tested += h & ( HEAT_WRITE - 1 );
+            passed += h / HEAT_WRITE;
+        }
+    }
+
+    __atomic_fetch_add ( &f->stats.tested, tested, __ATOMIC_RELAXED );
+    __atomic_fetch_add ( &f->stats.passed, passed, __ATOMIC_RELAXED );
+}
+
+void
+countPixels ( Framebuffer * f )
+{
+    f->stats.tested = 0;
+    f->stats.passed = 0;
+    parallelFor ( f->jobs, heat_sum, f, f->h, 32 );
+}
+
+#define HEAT_STEPS 8
+
+/* none, 1 .. 6, more; R G B */
+static const uint8_t heat_rgb[ HEAT_STEPS ][ 3 ] = {
+    { 0, 0, 0 },     { 0, 0, 255 },   { 0, 255, 255 }, { 0, 255, 0 },
+    { 255, 255, 0 }, { 255, 128, 0 }, { 255, 0, 0 },   { 255, 255, 255 } };
+
+typedef struct
+{
+    Framebuffer * f;
+    int           shift; /* 0 for tests, 32 for writes */
+} HeatJob;
+
+static void
+heat_rows ( void * arg, int begin, int end, int worker )
+{
+    const HeatJob *     j  = arg;
+    Framebuffer *       f  = j->f;
+    const SDL_Surface * sf = f->surface;
+    ( void ) worker;
+
+    /* nearest render target pixel of every surface one */
+    for ( int y = begin; y < end; y++ )
+    {
+        const uint32_t row = pxRow ( f, y * ( int ) f->h / sf->h );
+        uint32_t *     out =
+            ( uint32_t * ) ( ( uint8_t * ) sf->pixels + y * sf->pitch );
+
+        for ( int x = 0; x < sf->w; x++ )
+        {
+            const uint32_t  px  = pxCol ( f, x * ( int ) f->w / sf->w );
+            /* the low 32 bits: tests, or writes once shifted */
+            const uint32_t  n = f->heat[ row + px ] >> j->shift;
+            const uint8_t * rgb =
+                heat_rgb[ n < HEAT_STEPS ? n : HEAT_STEPS - 1 ];
+
+            /* RGBA8888, see createFramebuffer () */
+            out[ x ] = ( uint32_t ) rgb[ 0 ] << 24 |
+                       ( uint32_t ) rgb[ 1 ] << 16 |
+                       ( uint32_t ) rgb[ 2 ] << 8 | 0xFF;
+        }
+    }
+}
+
+void
+drawHeatmap ( Framebuffer * f, int writes )
+{
+    HeatJob j = { f, writes ? 32 : 0 };
+    parallelFor ( f->jobs, heat_rows, &j, f->surface->h, 32 );
+}
@@ -8,7 +8,7 @@
 #include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <xmmintrin.h>
+#include <immintrin.h>
 
 typedef struct
 {
@@ -21,10 +21,88 @@ typedef struct
     uint32_t w;
 } Fragments;
 
+/* triangles whose bounding box fits a STAMP_SIZE square skip the scanline
+ * walk; rasterizeBatch() takes up to RASTER_BATCH triangles per setup pass */
+#define STAMP_SIZE   8
+#define RASTER_BATCH 64
+
+/* 19.10.26 ::: Fragment shaders. With Framebuffer.shader set the raster
+ * does not colour pixels itself: each step of the edge walk, up to
+ * FRAG_BATCH pixels side by side in one row of one triangle, is depth
+ * tested and the ones that pass go to the shader as one batch, in planes.
+ * Their colours are then written the way the built-in ones are, alpha
+ * below the opaque threshold goes to the transparent lists. With MSAA a
+ * fragment is a pixel, shaded once at its centre (or first covered
+ * sample) like the built-in colour. Captures record the draws, not the
+ * shader. */
+#define FRAG_BATCH 8
+
+typedef struct __attribute__ ( ( aligned ( 32 ) ) ) FragBatch
+{
+    /* written by the shader, colour planes in vec4 order: alpha, blue,
+     * green, red */
+    float out[ 4 ][ FRAG_BATCH ];
+
+    /* per fragment: barycentrics (weights of v[ 0 ], v[ 1 ], v[ 2 ],
+     * summing to 1), interpolated z of v and the render target pixel.
+     * Only the lanes with their bit in live are written, the others may
+     * be outside the triangle; shading them is fine. */
+    float   b[ 3 ][ FRAG_BATCH ];
+    float   z[ FRAG_BATCH ];
+    int32_t x[ FRAG_BATCH ];
+    int32_t y[ FRAG_BATCH ];
+    int     live;
+
+    /* the triangle: its index in the draw, its vertices in render target
+     * pixels and the draw's c, one colour per corner; read only */
+    uint32_t tri;
+    vec3 *   v;
+    vec4 *   attr;
+} FragBatch;
+
+/* the built-in colours as a FragShader: attr interpolated, user unused */
+void
+shadeVertexColors ( FragBatch * b, void * user );
+
 void
 rasterize ( Framebuffer * f, vec3 * v, uint64_t * zi, vec4 * c );
 
+/* v and zi hold cnt * 3 entries; c is shared by the whole batch */
+void
+rasterizeBatch ( Framebuffer * f, vec3 * v, uint64_t * zi, vec4 * c, int cnt );
+
+/* same as rasterizeBatch (), split into bands of rows over f->jobs and,
+ * with f->ordered, drawn front to back; the bins and the order come off
+ * f->arenas, so call it inside a frame stage */
+void
+rasterizeBinned ( Framebuffer * f, vec3 * v, uint64_t * zi, vec4 * c, int cnt );
+
 void
 merge ( Framebuffer * f );
 
+/* merges only the render target rect { xmin, ymin, xmax, ymax }; touched
+ * (may be NULL) receives the surface area that was written */
+void
+mergeRect ( Framebuffer * f, const int * rect, SDL_Rect * touched );
+
+/* "over" blend of a surface formatted RGBA layer onto the surface, only
+ * inside the surface rect r */
+void
+compositeLayer ( Framebuffer *    f,
+                 const uint32_t * layer,
+                 int              ashift,
+                 const SDL_Rect * r );
+
+/* sums f->heat into f->stats.tested and .passed, once the frame is
+ * rasterized with f->count set */
+void
+countPixels ( Framebuffer * f );
+
+/* overwrites the merged surface with a heatmap of the depth tests, or
+ * with writes the depth passes, per pixel of f->heat: black for none,
+ * then blue, cyan, green, yellow, orange and red for 1 to 6, white for
+ * more. Video sinks get the colours, they convert during merge (). */
+void
+drawHeatmap ( Framebuffer * f, int writes );
+
 #endif /* CUSTOM_RENDER_PIPELINE_H */
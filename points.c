@@ -0,0 +1,526 @@
+#define _DEFAULT_SOURCE /* madvise (), pread () */
+#include "points.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <immintrin.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SPLAT_EMPTY UINT64_MAX
+#define SPLAT_GRAIN ( 1 << 16 ) /* points per job */
+
+int
+writePointFile ( const char * in, const char * out )
+{
+    FILE * src = fopen ( in, "r" );
+    if ( ! src )
+    {
+        printf ( "error: can't open %s\n", in );
+        return -1;
+    }
+    FILE * dst = fopen ( out, "wb" );
+    if ( ! dst )
+    {
+        printf ( "error: can't write %s\n", out );
+        fclose ( src );
+        return -1;
+    }
+
+    PointFileHeader h = { POINT_MAGIC,
+                          POINT_VERSION,
+                          0,
+                          { FLT_MAX, FLT_MAX, FLT_MAX },
+                          { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+
+    /* the header goes in again once the count and bounds are known */
+    int  err = fwrite ( &h, sizeof ( h ), 1, dst ) != 1;
+    char line[ 1024 ];
+    while ( ! err && fgets ( line, sizeof ( line ), src ) )
+    {
+        char * s    = line;
+        float  unit = 255.0f;
+        if ( s[ 0 ] == 'v' && isspace ( ( unsigned char ) s[ 1 ] ) )
+        {
+            s++;
+            unit = 1.0f;
+        }
+
+        float v[ 6 ] = { 0.0f, 0.0f, 0.0f, unit, unit, unit };
+        int   n      = 0;
+        for ( ; n < 6; n++ )
+        {
+            char * e;
+            v[ n ] = strtof ( s, &e );
+            if ( e == s ) break;
+            s = e;
+        }
+        /* comments, faces, normals, headers */
+        if ( n < 3 ) continue;
+        if ( n < 6 ) v[ 3 ] = v[ 4 ] = v[ 5 ] = unit;
+
+        PointRecord r;
+        for ( int k = 0; k < 3; k++ )
+        {
+            const float c = v[ 3 + k ] / unit * 255.0f + 0.5f;
+
+            r.p[ k ]    = v[ k ];
+            r.rgba[ k ] = c < 0.0f ? 0 : c > 255.0f ? 255 : ( uint8_t ) c;
+            h.aabb_min[ k ] = fminf ( h.aabb_min[ k ], v[ k ] );
+            h.aabb_max[ k ] = fmaxf ( h.aabb_max[ k ], v[ k ] );
+        }
+        r.rgba[ 3 ] = 255;
+
+        err = fwrite ( &r, sizeof ( r ), 1, dst ) != 1;
+        h.cnt++;
+    }
+    err = err || ferror ( src );
+
+    if ( ! err && ! h.cnt )
+    {
+        printf ( "error: no points in %s\n", in );
+        err = 1;
+    }
+    else if ( ! err )
+    {
+        err = fseek ( dst, 0, SEEK_SET ) ||
+              fwrite ( &h, sizeof ( h ), 1, dst ) != 1;
+    }
+    err = fclose ( dst ) || err;
+    fclose ( src );
+
+    if ( err )
+    {
+        printf ( "error: converting %s to %s failed\n", in, out );
+        return -1;
+    }
+    printf ( "%s: %llu points\n", out, ( unsigned long long ) h.cnt );
+    return 0;
+}
+
+PointCloud *
+openPointCloud ( const char * path )
+{
+    const int fd = open ( path, O_RDONLY );
+    if ( fd < 0 )
+    {
+        printf ( "error: can't open %s\n", path );
+        return NULL;
+    }
+
+    /* every record the header counts has to be inside the file */
+    struct stat     st;
+    PointFileHeader h;
+    if ( fstat ( fd, &st ) ||
+         pread ( fd, &h, sizeof ( h ), 0 ) != sizeof ( h ) ||
+         h.magic != POINT_MAGIC || h.version != POINT_VERSION ||
+         h.cnt > ( st.st_size - sizeof ( h ) ) / sizeof ( PointRecord ) )
+    {
+        printf ( "error: %s is not a point file\n", path );
+        close ( fd );
+        return NULL;
+    }
+
+    void * map = mmap ( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close ( fd );
+    if ( map == MAP_FAILED )
+    {
+        printf ( "error: can't map %s: %s\n", path, strerror ( errno ) );
+        return NULL;
+    }
+    /* every frame reads all of it */
+    madvise ( map, st.st_size, MADV_WILLNEED );
+
+    const uint8_t * recs = ( const uint8_t * ) map + sizeof ( h );
+
+    PointCloud * pc;
+    U_ALLOC ( pc, PointCloud, 1 );
+    pc->header    = h;
+    pc->pts       = ( const PointRecord * ) recs;
+    pc->map       = map;
+    pc->map_bytes = st.st_size;
+
+    printf ( "Mapped %s: %llu points\n", path, ( unsigned long long ) h.cnt );
+    return pc;
+}
+
+void
+closePointCloud ( PointCloud * pc )
+{
+    if ( ! pc ) return;
+
+    munmap ( pc->map, pc->map_bytes );
+    free ( pc );
+}
+
+/* ---- splatting ---- */
+
+typedef struct
+{
+    Framebuffer *       f;
+    const PointRecord * pts;
+    const SplatParams * sp;
+
+    /* rect sized, row major; fill writes out from buf */
+    uint64_t * buf;
+    uint64_t * out;
+    int        w, h;
+} SplatJob;
+
+/* x86 has no 64 bit atomic min; most points of a dense cloud are behind
+ * what is there already and never get to the exchange */
+static inline __attribute__ ( ( always_inline ) ) void
+splat_min ( uint64_t * p, uint64_t v )
+{
+    uint64_t cur = __atomic_load_n ( p, __ATOMIC_RELAXED );
+    while ( v < cur && ! __atomic_compare_exchange_n (
+                           p, &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+        ;
+}
+
+/* the lanes in mask, already known to be inside the rect */
+static inline __attribute__ ( ( always_inline ) ) void
+splat_lanes ( const SplatJob * j,
+              int              mask,
+              const float *    x,
+              const float *    y,
+              const float *    w,
+              const uint32_t * c )
+{
+    while ( mask )
+    {
+        const int l = __builtin_ctz ( mask );
+        mask &= mask - 1;
+
+        /* w > 0: its bits order like the floats */
+        uint32_t wb;
+        memcpy ( &wb, w + l, sizeof ( wb ) );
+
+        const int px = ( int ) x[ l ] - j->sp->rect[ 0 ];
+        const int py = ( int ) y[ l ] - j->sp->rect[ 1 ];
+        splat_min ( j->buf + ( size_t ) py * j->w + px,
+                    ( uint64_t ) wb << 32 | c[ l ] );
+    }
+}
+
+/* row r of to_px applied to x, y, z, 1; the same order of operations on
+ * every level, so every level splats the same pixels */
+#define SPLAT_ROW( m, r, x, y, z, mul, add )                      \
+    add ( add ( add ( mul ( m[ 0 ][ r ], x ), mul ( m[ 1 ][ r ], y ) ), \
+                mul ( m[ 2 ][ r ], z ) ),                         \
+          m[ 3 ][ r ] )
+
+/* 4 points, SSE2 */
+static inline __attribute__ ( ( always_inline ) ) void
+splat4 ( const SplatJob * j, const PointRecord * p, __m128 ( *m )[ 4 ] )
+{
+    const int * rect = j->sp->rect;
+
+    __m128 x = _mm_loadu_ps ( p[ 0 ].p );
+    __m128 y = _mm_loadu_ps ( p[ 1 ].p );
+    __m128 z = _mm_loadu_ps ( p[ 2 ].p );
+    __m128 c = _mm_loadu_ps ( p[ 3 ].p );
+    _MM_TRANSPOSE4_PS ( x, y, z, c );
+
+    const __m128 cx = SPLAT_ROW ( m, 0, x, y, z, _mm_mul_ps, _mm_add_ps );
+    const __m128 cy = SPLAT_ROW ( m, 1, x, y, z, _mm_mul_ps, _mm_add_ps );
+    const __m128 cw = SPLAT_ROW ( m, 3, x, y, z, _mm_mul_ps, _mm_add_ps );
+
+    const __m128 sx = _mm_div_ps ( cx, cw );
+    const __m128 sy = _mm_div_ps ( cy, cw );
+
+    /* between the planes, inside the rect */
+    const SplatParams * sp = j->sp;
+
+    __m128 ok = _mm_cmpge_ps ( cw, _mm_set1_ps ( sp->w_min ) );
+    ok = _mm_and_ps ( ok, _mm_cmple_ps ( cw, _mm_set1_ps ( sp->w_max ) ) );
+    ok = _mm_and_ps ( ok, _mm_cmpge_ps ( sx, _mm_set1_ps ( rect[ 0 ] ) ) );
+    ok = _mm_and_ps ( ok, _mm_cmplt_ps ( sx, _mm_set1_ps ( rect[ 2 ] + 1 ) ) );
+    ok = _mm_and_ps ( ok, _mm_cmpge_ps ( sy, _mm_set1_ps ( rect[ 1 ] ) ) );
+    ok = _mm_and_ps ( ok, _mm_cmplt_ps ( sy, _mm_set1_ps ( rect[ 3 ] + 1 ) ) );
+
+    const int mask = _mm_movemask_ps ( ok );
+    if ( ! mask ) return;
+
+    float    fx[ 4 ], fy[ 4 ], fw[ 4 ];
+    uint32_t fc[ 4 ];
+    _mm_storeu_ps ( fx, sx );
+    _mm_storeu_ps ( fy, sy );
+    _mm_storeu_ps ( fw, cw );
+    _mm_storeu_ps ( ( float * ) fc, c );
+    splat_lanes ( j, mask, fx, fy, fw, fc );
+}
+
+/* 8 points per step; lanes are points 0 2 4 6 1 3 5 7, which only the
+ * order of splat_lanes () sees */
+static ISA_TARGET_AVX2 int
+splat_run8 ( const SplatJob * j, int i, int end )
+{
+    const float ( *t )[ 4 ] = ( const float ( * )[ 4 ] ) j->sp->to_px;
+    const int * rect        = j->sp->rect;
+
+    __m256 m[ 4 ][ 4 ];
+    for ( int a = 0; a < 4; a++ )
+    {
+        for ( int b = 0; b < 4; b++ )
+            m[ a ][ b ] = _mm256_set1_ps ( t[ a ][ b ] );
+    }
+
+    const __m256 lo_x = _mm256_set1_ps ( rect[ 0 ] );
+    const __m256 hi_x = _mm256_set1_ps ( rect[ 2 ] + 1 );
+    const __m256 lo_y = _mm256_set1_ps ( rect[ 1 ] );
+    const __m256 hi_y = _mm256_set1_ps ( rect[ 3 ] + 1 );
+    const __m256 lo_w = _mm256_set1_ps ( j->sp->w_min );
+    const __m256 hi_w = _mm256_set1_ps ( j->sp->w_max );
+
+    for ( ; i + 8 <= end; i += 8 )
+    {
+        const float * p  = j->pts[ i ].p;
+        const __m256  a0 = _mm256_loadu_ps ( p );
+        const __m256  a1 = _mm256_loadu_ps ( p + 8 );
+        const __m256  a2 = _mm256_loadu_ps ( p + 16 );
+        const __m256  a3 = _mm256_loadu_ps ( p + 24 );
+
+        /* _MM_TRANSPOSE4_PS in both halves */
+        const __m256 t0 = _mm256_unpacklo_ps ( a0, a1 );
+        const __m256 t1 = _mm256_unpackhi_ps ( a0, a1 );
+        const __m256 t2 = _mm256_unpacklo_ps ( a2, a3 );
+        const __m256 t3 = _mm256_unpackhi_ps ( a2, a3 );
+        const __m256 x  = _mm256_shuffle_ps ( t0, t2, 0x44 );
+        const __m256 y  = _mm256_shuffle_ps ( t0, t2, 0xEE );
+        const __m256 z  = _mm256_shuffle_ps ( t1, t3, 0x44 );
+        const __m256 c  = _mm256_shuffle_ps ( t1, t3, 0xEE );
+
+        const __m256 cx =
+            SPLAT_ROW ( m, 0, x, y, z, _mm256_mul_ps, _mm256_add_ps );
+        const __m256 cy =
+            SPLAT_ROW ( m, 1, x, y, z, _mm256_mul_ps, _mm256_add_ps );
+        const __m256 cw =
+            SPLAT_ROW ( m, 3, x, y, z, _mm256_mul_ps, _mm256_add_ps );
+
+        const __m256 sx = _mm256_div_ps ( cx, cw );
+        const __m256 sy = _mm256_div_ps ( cy, cw );
+
+        __m256 ok = _mm256_cmp_ps ( cw, lo_w, _CMP_GE_OQ );
+        ok = _mm256_and_ps ( ok, _mm256_cmp_ps ( cw, hi_w, _CMP_LE_OQ ) );
+        ok = _mm256_and_ps ( ok, _mm256_cmp_ps ( sx, lo_x, _CMP_GE_OQ ) );
+        ok = _mm256_and_ps ( ok, _mm256_cmp_ps ( sx, hi_x, _CMP_LT_OQ ) );
+        ok = _mm256_and_ps ( ok, _mm256_cmp_ps ( sy, lo_y, _CMP_GE_OQ ) );
+        ok = _mm256_and_ps ( ok, _mm256_cmp_ps ( sy, hi_y, _CMP_LT_OQ ) );
+
+        const int mask = _mm256_movemask_ps ( ok );
+        if ( ! mask ) continue;
+
+        float    fx[ 8 ], fy[ 8 ], fw[ 8 ];
+        uint32_t fc[ 8 ];
+        _mm256_storeu_ps ( fx, sx );
+        _mm256_storeu_ps ( fy, sy );
+        _mm256_storeu_ps ( fw, cw );
+        _mm256_storeu_ps ( ( float * ) fc, c );
+        splat_lanes ( j, mask, fx, fy, fw, fc );
+    }
+    return i;
+}
+
+static inline __attribute__ ( ( always_inline ) ) void
+splat_range_body ( int isa, void * arg, int begin, int end, int worker )
+{
+    const SplatJob * j = arg;
+    const float ( *t )[ 4 ] = ( const float ( * )[ 4 ] ) j->sp->to_px;
+    ( void ) worker;
+
+    int i = begin;
+    if ( isa >= ISA_AVX2 ) i = splat_run8 ( j, i, end );
+
+    __m128 m[ 4 ][ 4 ];
+    for ( int a = 0; a < 4; a++ )
+        for ( int b = 0; b < 4; b++ ) m[ a ][ b ] = _mm_set1_ps ( t[ a ][ b ] );
+
+    for ( ; i + 4 <= end; i += 4 ) splat4 ( j, j->pts + i, m );
+
+    /* the tail, padded with copies of its last point */
+    if ( i < end )
+    {
+        PointRecord tail[ 4 ];
+        for ( int k = 0; k < 4; k++ )
+            tail[ k ] = j->pts[ i + k < end ? i + k : end - 1 ];
+        splat4 ( j, tail, m );
+    }
+}
+
+ISA_KERNEL ( splat_range,
+             ( void * arg, int begin, int end, int worker ),
+             arg,
+             begin,
+             end,
+             worker );
+
+static void
+splat_clear ( void * arg, int begin, int end, int worker )
+{
+    const SplatJob * j = arg;
+    ( void ) worker;
+
+    memset ( j->buf + ( size_t ) begin * j->w,
+             0xFF,
+             ( size_t ) ( end - begin ) * j->w * sizeof ( uint64_t ) );
+}
+
+static inline __attribute__ ( ( always_inline ) ) float
+splat_w ( uint64_t s )
+{
+    const uint32_t wb = s >> 32;
+    float          w;
+    memcpy ( &w, &wb, sizeof ( w ) );
+    return w;
+}
+
+static void
+splat_fill ( void * arg, int begin, int end, int worker )
+{
+    const SplatJob * j = arg;
+    ( void ) worker;
+
+    for ( int y = begin; y < end; y++ )
+    {
+        for ( int x = 0; x < j->w; x++ )
+        {
+            const uint64_t s    = j->buf[ ( size_t ) y * j->w + x ];
+            uint64_t       near = SPLAT_EMPTY;
+            int            cnt  = 0;
+
+            for ( int dy = -1; dy <= 1; dy++ )
+            {
+                if ( y + dy < 0 || y + dy >= j->h ) continue;
+                for ( int dx = -1; dx <= 1; dx++ )
+                {
+                    if ( ( ! dx && ! dy ) || x + dx < 0 || x + dx >= j->w )
+                        continue;
+
+                    const uint64_t n =
+                        j->buf[ ( size_t ) ( y + dy ) * j->w + x + dx ];
+                    if ( n == SPLAT_EMPTY ) continue;
+                    cnt++;
+                    if ( n < near ) near = n;
+                }
+            }
+
+            const float gap  = 1.0f + POINT_FILL_GAP;
+            const int   hole = cnt >= POINT_FILL_MIN &&
+                             ( s == SPLAT_EMPTY ||
+                               splat_w ( s ) > splat_w ( near ) * gap );
+            j->out[ ( size_t ) y * j->w + x ] = hole ? near : s;
+        }
+    }
+}
+
+/* opaque pixel writes the way shade_px_ms () in pipeline.c does them */
+static void
+splat_resolve ( void * arg, int begin, int end, int worker )
+{
+    const SplatJob *    j  = arg;
+    const SplatParams * sp = j->sp;
+    Framebuffer *       f  = j->f;
+    ( void ) worker;
+
+    for ( int y = begin; y < end; y++ )
+    {
+        for ( int x = 0; x < j->w; x++ )
+        {
+            const uint64_t s = j->out[ ( size_t ) y * j->w + x ];
+            if ( s == SPLAT_EMPTY ) continue;
+
+            double zq =
+                ( sp->z_a + sp->z_b / splat_w ( s ) ) * sp->zq_scale +
+                sp->zq_bias;
+            zq = zq < 1.0 ? 1.0 : zq >= 0x1p64 ? 0x1.fffffffffffffp63 : zq;
+            const uint64_t z = zq;
+
+            /* colours go A B G R, see pack_px () */
+            const uint8_t * rgba = ( const uint8_t * ) &s;
+            const vec4      c    = { 1.0f,
+                                     rgba[ 2 ] / 255.0f,
+                                     rgba[ 1 ] / 255.0f,
+                                     rgba[ 0 ] / 255.0f };
+
+            const uint32_t idx =
+                pxIndex ( f, sp->rect[ 0 ] + x, sp->rect[ 1 ] + y );
+            uint32_t * slot = f->ms_idx + idx;
+
+            if ( ! *slot )
+            {
+                if ( f->count )
+                    f->heat[ idx ] += z < f->opaque_z[ idx ]
+                                          ? HEAT_TEST
+                                          : HEAT_TEST + HEAT_WRITE;
+                if ( z < f->opaque_z[ idx ] ) continue;
+                glm_vec4_copy ( ( float * ) c, f->opaque_c[ idx ] );
+                f->opaque_z[ idx ] = z;
+                continue;
+            }
+
+            MSBlock * b    = MS_BLOCK ( f, *slot - 1 );
+            int       pass = 0;
+            for ( int k = 0; k < MSAA_SAMPLES; k++ )
+            {
+                if ( z < b->z[ k ] ) continue;
+                glm_vec4_copy ( ( float * ) c, b->color[ k ] );
+                b->z[ k ] = z;
+                pass |= 1 << k;
+            }
+            if ( f->count )
+                f->heat[ idx ] += pass ? HEAT_TEST + HEAT_WRITE : HEAT_TEST;
+
+            if ( pass == ( 1 << MSAA_SAMPLES ) - 1 )
+            {
+                *slot = 0;
+                glm_vec4_copy ( ( float * ) c, f->opaque_c[ idx ] );
+                f->opaque_z[ idx ] = z;
+            }
+            else if ( pass )
+            {
+                __atomic_store_n ( &f->ms_dirty, 1, __ATOMIC_RELAXED );
+            }
+        }
+    }
+}
+
+void
+splatPoints ( Framebuffer * f, const PointCloud * pc, const SplatParams * sp )
+{
+    const int * r = sp->rect;
+    if ( r[ 2 ] < r[ 0 ] || r[ 3 ] < r[ 1 ] ) return;
+
+    SplatJob j = { f, pc->pts, sp, NULL, NULL, r[ 2 ] - r[ 0 ] + 1,
+                   r[ 3 ] - r[ 1 ] + 1 };
+    F_ALLOC ( f->arenas, j.buf, uint64_t, ( size_t ) j.w * j.h );
+    j.out = j.buf;
+
+    parallelFor ( f->jobs, splat_clear, &j, j.h, 16 );
+
+    /* the jobs split the point range, a 32 bit int per slice */
+    for ( uint64_t i = 0; i < pc->header.cnt; i += INT32_MAX / 2 )
+    {
+        j.pts = pc->pts + i;
+        parallelFor ( f->jobs,
+                      splat_range_isa[ isaLevel ],
+                      &j,
+                      ( int ) ( pc->header.cnt - i < INT32_MAX / 2
+                                    ? pc->header.cnt - i
+                                    : INT32_MAX / 2 ),
+                      SPLAT_GRAIN );
+    }
+
+    if ( sp->fill )
+    {
+        F_ALLOC ( f->arenas, j.out, uint64_t, ( size_t ) j.w * j.h );
+        parallelFor ( f->jobs, splat_fill, &j, j.h, 16 );
+    }
+    parallelFor ( f->jobs, splat_resolve, &j, j.h, 16 );
+}
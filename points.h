@@ -0,0 +1,89 @@
+#pragma once
+#ifndef CUSTOM_RENDER_POINTS_H
+#define CUSTOM_RENDER_POINTS_H
+
+#include "engine.h"
+
+#include <stdint.h>
+
+/* 19.10.26 ::: Point clouds. Scans without faces live in a point file
+ *
+ *   PointFileHeader
+ *   PointRecord [ cnt ]
+ *
+ * host endian, written by app --points from text (see writePointFile ()).
+ * It is mapped read only and drawn straight from the mapping, nothing is
+ * loaded up front. splatPoints () transforms the points in SIMD batches
+ * over the jobs and splats each into one pixel of a 64 bit buffer, depth
+ * above colour, by atomic min: the nearest point of a pixel wins whatever
+ * thread gets there first. An optional screen space pass fills the holes
+ * between points, then the buffer is resolved into the planes the way an
+ * opaque triangle writes them. Captures (capture.h) do not record splats. */
+
+#define POINT_MAGIC   0x54505252u /* "RRPT" */
+#define POINT_VERSION 1
+
+/* hole filling: a pixel takes its nearest neighbour when at least
+ * POINT_FILL_MIN of its 8 have a point and it has none, or one more than
+ * POINT_FILL_GAP (relative depth) behind that neighbour */
+#define POINT_FILL_MIN 4
+#define POINT_FILL_GAP 0.02f
+
+typedef struct PointFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t cnt;
+    float    aabb_min[ 3 ];
+    float    aabb_max[ 3 ];
+} PointFileHeader;
+
+typedef struct PointRecord
+{
+    float   p[ 3 ];
+    uint8_t rgba[ 4 ]; /* alpha is ignored, points are opaque */
+} PointRecord;
+
+typedef struct PointCloud
+{
+    PointFileHeader     header;
+    const PointRecord * pts; /* header.cnt, in the mapping */
+    void *              map;
+    size_t              map_bytes;
+} PointCloud;
+
+typedef struct SplatParams
+{
+    /* object space to render target pixels, x / w and y / w; points
+     * with w outside w_min .. w_max are not between the planes */
+    mat4  to_px;
+    float w_min, w_max;
+
+    /* NDC z of a point at clip w is z_a + z_b / w, quantized to
+     * z * zq_scale + zq_bias as triangles of the object would be */
+    float  z_a, z_b;
+    double zq_scale, zq_bias;
+
+    int rect[ 4 ]; /* { xmin, ymin, xmax, ymax }, nothing outside changes */
+    int fill;      /* run the hole filling pass */
+} SplatParams;
+
+/* Converts text points, one per line, to a point file: "x y z [r g b]"
+ * with 0..255 colours, or OBJ "v x y z [r g b]" with 0..1 colours;
+ * anything else is skipped. Points without colour are white. */
+int
+writePointFile ( const char * in, const char * out );
+
+/* NULL on failure */
+PointCloud *
+openPointCloud ( const char * path );
+
+void
+closePointCloud ( PointCloud * pc );
+
+/* splats pc into f; the buffers come off f->arenas, so call it inside a
+ * frame stage */
+void
+splatPoints ( Framebuffer * f, const PointCloud * pc, const SplatParams * sp );
+
+#endif /* CUSTOM_RENDER_POINTS_H */
@@ -0,0 +1,875 @@
+#include "raytrace.h"
+
+#include <immintrin.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define RT_FAR  1e30f
+#define RT_BIAS 1e-3f /* of the distance to the eye, off the surface */
+
+/* ========= Build ========= */
+
+typedef struct
+{
+    const RMesh * m;
+    float *       c;  /* centroid, 3 per triangle */
+    float *       lo; /* bounds, 3 per triangle */
+    float *       hi;
+    uint32_t *    idx; /* triangles, leaf order once built */
+    BVH *         b;
+} BVHBuild;
+
+typedef struct
+{
+    uint32_t cnt;
+    float    lo[ 3 ], hi[ 3 ];
+} BVHBin;
+
+static inline float
+half_area ( const float * lo, const float * hi )
+{
+    const float dx = hi[ 0 ] - lo[ 0 ];
+    const float dy = hi[ 1 ] - lo[ 1 ];
+    const float dz = hi[ 2 ] - lo[ 2 ];
+    return dx * dy + dy * dz + dz * dx;
+}
+
+static inline void
+grow ( float * lo, float * hi, const float * plo, const float * phi )
+{
+    for ( int a = 0; a < 3; a++ )
+    {
+        lo[ a ] = fminf ( lo[ a ], plo[ a ] );
+        hi[ a ] = fmaxf ( hi[ a ], phi[ a ] );
+    }
+}
+
+static inline void
+empty_box ( float * lo, float * hi )
+{
+    for ( int a = 0; a < 3; a++ )
+    {
+        lo[ a ] = FLT_MAX;
+        hi[ a ] = -FLT_MAX;
+    }
+}
+
+static inline int
+bin_of ( float c, float c_min, float scale )
+{
+    const int k = ( int ) ( ( c - c_min ) * scale );
+    return k < BVH_BINS - 1 ? k : BVH_BINS - 1;
+}
+
+/* The cheapest plane between BVH_BINS bins of the centroids, on any axis,
+ * by the surface area heuristic with equal traversal and intersection
+ * costs. 0 when a leaf is cheaper (or nothing can be split). */
+static int
+sah_split ( const BVHBuild * bb,
+            uint32_t         begin,
+            uint32_t         end,
+            const float *    node_lo,
+            const float *    node_hi,
+            const float *    c_min,
+            const float *    c_max,
+            int *            axis,
+            int *            split )
+{
+    const uint32_t cnt  = end - begin;
+    const float    area = half_area ( node_lo, node_hi );
+    float          best = ( float ) cnt;
+    *axis               = -1;
+
+    for ( int a = 0; a < 3; a++ )
+    {
+        const float ext = c_max[ a ] - c_min[ a ];
+        if ( ext <= 0.0f ) continue;
+        const float scale = BVH_BINS / ext;
+
+        BVHBin bin[ BVH_BINS ];
+        for ( int k = 0; k < BVH_BINS; k++ )
+        {
+            bin[ k ].cnt = 0;
+            empty_box ( bin[ k ].lo, bin[ k ].hi );
+        }
+        for ( uint32_t i = begin; i < end; i++ )
+        {
+            const uint32_t t = bb->idx[ i ];
+            BVHBin * k = bin + bin_of ( bb->c[ t * 3 + a ], c_min[ a ], scale );
+            k->cnt++;
+            grow ( k->lo, k->hi, bb->lo + t * 3, bb->hi + t * 3 );
+        }
+
+        /* right of plane k is bins k .. BVH_BINS - 1 */
+        float    r_area[ BVH_BINS ];
+        uint32_t r_cnt[ BVH_BINS ];
+        float    lo[ 3 ], hi[ 3 ];
+        uint32_t n = 0;
+        empty_box ( lo, hi );
+        for ( int k = BVH_BINS - 1; k > 0; k-- )
+        {
+            n += bin[ k ].cnt;
+            if ( bin[ k ].cnt ) grow ( lo, hi, bin[ k ].lo, bin[ k ].hi );
+            r_cnt[ k ]  = n;
+            r_area[ k ] = n ? half_area ( lo, hi ) : 0.0f;
+        }
+
+        n = 0;
+        empty_box ( lo, hi );
+        for ( int k = 1; k < BVH_BINS; k++ )
+        {
+            n += bin[ k - 1 ].cnt;
+            if ( bin[ k - 1 ].cnt )
+                grow ( lo, hi, bin[ k - 1 ].lo, bin[ k - 1 ].hi );
+            if ( ! n || ! r_cnt[ k ] ) continue;
+
+            const float cost =
+                1.0f +
+                ( half_area ( lo, hi ) * n + r_area[ k ] * r_cnt[ k ] ) / area;
+            if ( cost < best )
+            {
+                best   = cost;
+                *axis  = a;
+                *split = k;
+            }
+        }
+    }
+
+    if ( *axis < 0 ) return 0;
+    return best < ( float ) cnt || cnt > BVH_LEAF_MAX;
+}
+
+static void
+bvh_node ( BVHBuild * bb, uint32_t n, uint32_t begin, uint32_t end, int depth )
+{
+    BVHNode * node = bb->b->nodes + n;
+
+    float c_min[ 3 ], c_max[ 3 ];
+    empty_box ( node->min, node->max );
+    empty_box ( c_min, c_max );
+    for ( uint32_t i = begin; i < end; i++ )
+    {
+        const uint32_t t = bb->idx[ i ];
+        grow ( node->min, node->max, bb->lo + t * 3, bb->hi + t * 3 );
+        grow ( c_min, c_max, bb->c + t * 3, bb->c + t * 3 );
+    }
+
+    node->first = begin;
+    node->cnt   = end - begin;
+
+    int axis, split;
+    if ( end - begin <= 2 || depth == BVH_DEPTH_MAX ||
+         ! sah_split ( bb,
+                       begin,
+                       end,
+                       node->min,
+                       node->max,
+                       c_min,
+                       c_max,
+                       &axis,
+                       &split ) )
+        return;
+
+    const float scale = BVH_BINS / ( c_max[ axis ] - c_min[ axis ] );
+    uint32_t    mid   = begin;
+    for ( uint32_t i = begin; i < end; i++ )
+    {
+        const uint32_t t = bb->idx[ i ];
+        if ( bin_of ( bb->c[ t * 3 + axis ], c_min[ axis ], scale ) < split )
+        {
+            bb->idx[ i ]     = bb->idx[ mid ];
+            bb->idx[ mid++ ] = t;
+        }
+    }
+
+    const uint32_t left = bb->b->node_cnt;
+    bb->b->node_cnt += 2;
+    node->first = left;
+    node->cnt   = 0;
+
+    bvh_node ( bb, left, begin, mid, depth + 1 );
+    bvh_node ( bb, left + 1, mid, end, depth + 1 );
+}
+
+BVH *
+buildBVH ( const RMesh * m )
+{
+    const uint32_t cnt = m->tri_cnt;
+    if ( ! cnt ) return NULL;
+
+    BVH * b;
+    U_ALLOC ( b, BVH, 1 );
+    U_ALLOC ( b->nodes, BVHNode, 2 * cnt - 1 );
+    U_ALLOC ( b->tris, BVHTri, cnt );
+    b->node_cnt = 1;
+    b->tri_cnt  = cnt;
+
+    BVHBuild bb = { m, NULL, NULL, NULL, NULL, b };
+    U_ALLOC ( bb.c, float, cnt * 3 );
+    U_ALLOC ( bb.lo, float, cnt * 3 );
+    U_ALLOC ( bb.hi, float, cnt * 3 );
+    U_ALLOC ( bb.idx, uint32_t, cnt );
+
+    for ( uint32_t t = 0; t < cnt; t++ )
+    {
+        const float * v[ 3 ];
+        for ( int k = 0; k < 3; k++ )
+            v[ k ] = m->vertices + m->idx[ t * 3 + k ] * 3;
+
+        for ( int a = 0; a < 3; a++ )
+        {
+            bb.lo[ t * 3 + a ] =
+                fminf ( fminf ( v[ 0 ][ a ], v[ 1 ][ a ] ), v[ 2 ][ a ] );
+            bb.hi[ t * 3 + a ] =
+                fmaxf ( fmaxf ( v[ 0 ][ a ], v[ 1 ][ a ] ), v[ 2 ][ a ] );
+            bb.c[ t * 3 + a ] =
+                ( bb.lo[ t * 3 + a ] + bb.hi[ t * 3 + a ] ) * 0.5f;
+        }
+        bb.idx[ t ] = t;
+    }
+
+    bvh_node ( &bb, 0, 0, cnt, 0 );
+
+    for ( uint32_t i = 0; i < cnt; i++ )
+    {
+        const uint32_t * tri = m->idx + bb.idx[ i ] * 3;
+        const float *    v0  = m->vertices + tri[ 0 ] * 3;
+        BVHTri *         out = b->tris + i;
+
+        for ( int a = 0; a < 3; a++ )
+        {
+            out->v0[ a ] = v0[ a ];
+            out->e1[ a ] = m->vertices[ tri[ 1 ] * 3 + a ] - v0[ a ];
+            out->e2[ a ] = m->vertices[ tri[ 2 ] * 3 + a ] - v0[ a ];
+        }
+    }
+
+    free ( bb.c );
+    free ( bb.lo );
+    free ( bb.hi );
+    free ( bb.idx );
+
+    printf ( "bvh: %u triangles, %u nodes\n", cnt, b->node_cnt );
+    return b;
+}
+
+void
+destroyBVH ( BVH * b )
+{
+    if ( ! b ) return;
+    free ( b->nodes );
+    free ( b->tris );
+    free ( b );
+}
+
+/* ========= Traversal ========= */
+
+/* four rays; t is the ray length, shortened to the nearest hit */
+typedef struct
+{
+    __m128 o[ 3 ];
+    __m128 d[ 3 ];
+    __m128 inv[ 3 ];
+    __m128 t;
+    float  dir[ 3 ]; /* sum of d over the lanes, orders the children */
+} RayPacket;
+
+static inline __attribute__ ( ( always_inline ) ) __m128
+sel_ps ( __m128 m, __m128 a, __m128 b )
+{
+    return _mm_or_ps ( _mm_and_ps ( m, a ), _mm_andnot_ps ( m, b ) );
+}
+
+static inline __attribute__ ( ( always_inline ) ) __m128i
+sel_epi32 ( __m128 m, __m128i a, __m128i b )
+{
+    const __m128i mi = _mm_castps_si128 ( m );
+    return _mm_or_si128 ( _mm_and_si128 ( mi, a ), _mm_andnot_si128 ( mi, b ) );
+}
+
+/* inv and dir from d; no component is 0, so the slabs never see 0 * inf */
+static inline __attribute__ ( ( always_inline ) ) void
+packet_dirs ( RayPacket * p )
+{
+    const __m128 tiny = _mm_set1_ps ( 1e-12f );
+    const __m128 sign = _mm_set1_ps ( -0.0f );
+    for ( int a = 0; a < 3; a++ )
+    {
+        const __m128 mag =
+            _mm_max_ps ( _mm_andnot_ps ( sign, p->d[ a ] ), tiny );
+        p->inv[ a ] = _mm_div_ps (
+            _mm_set1_ps ( 1.0f ),
+            _mm_or_ps ( mag, _mm_and_ps ( sign, p->d[ a ] ) ) );
+
+        float d[ 4 ];
+        _mm_storeu_ps ( d, p->d[ a ] );
+        p->dir[ a ] = d[ 0 ] + d[ 1 ] + d[ 2 ] + d[ 3 ];
+    }
+}
+
+/* lanes whose ray enters the box of n before their t */
+static inline __attribute__ ( ( always_inline ) ) int
+box_hit ( const RayPacket * p, const BVHNode * n )
+{
+    __m128 t_in  = _mm_setzero_ps ();
+    __m128 t_out = p->t;
+    for ( int a = 0; a < 3; a++ )
+    {
+        const __m128 t0 =
+            _mm_mul_ps ( _mm_sub_ps ( _mm_set1_ps ( n->min[ a ] ), p->o[ a ] ),
+                         p->inv[ a ] );
+        const __m128 t1 =
+            _mm_mul_ps ( _mm_sub_ps ( _mm_set1_ps ( n->max[ a ] ), p->o[ a ] ),
+                         p->inv[ a ] );
+        t_in  = _mm_max_ps ( t_in, _mm_min_ps ( t0, t1 ) );
+        t_out = _mm_min_ps ( t_out, _mm_max_ps ( t0, t1 ) );
+    }
+    return _mm_movemask_ps ( _mm_cmple_ps ( t_in, t_out ) );
+}
+
+static inline __attribute__ ( ( always_inline ) ) void
+cross3 ( const __m128 * a, const __m128 * b, __m128 * out )
+{
+    out[ 0 ] = _mm_sub_ps ( _mm_mul_ps ( a[ 1 ], b[ 2 ] ),
+                            _mm_mul_ps ( a[ 2 ], b[ 1 ] ) );
+    out[ 1 ] = _mm_sub_ps ( _mm_mul_ps ( a[ 2 ], b[ 0 ] ),
+                            _mm_mul_ps ( a[ 0 ], b[ 2 ] ) );
+    out[ 2 ] = _mm_sub_ps ( _mm_mul_ps ( a[ 0 ], b[ 1 ] ),
+                            _mm_mul_ps ( a[ 1 ], b[ 0 ] ) );
+}
+
+static inline __attribute__ ( ( always_inline ) ) __m128
+dot3 ( const __m128 * a, const __m128 * b )
+{
+    return _mm_add_ps ( _mm_add_ps ( _mm_mul_ps ( a[ 0 ], b[ 0 ] ),
+                                     _mm_mul_ps ( a[ 1 ], b[ 1 ] ) ),
+                        _mm_mul_ps ( a[ 2 ], b[ 2 ] ) );
+}
+
+/* lane bits to a lane mask */
+static inline __attribute__ ( ( always_inline ) ) __m128
+lane_mask ( int live )
+{
+    const __m128i bit = _mm_set_epi32 ( 8, 4, 2, 1 );
+    return _mm_castsi128_ps ( _mm_cmpeq_epi32 (
+        _mm_and_si128 ( _mm_set1_epi32 ( live ), bit ), bit ) );
+}
+
+/* Moller-Trumbore, the lanes in live against tri, either side; the ones
+ * hitting it before their t are returned and get t shortened */
+static inline __attribute__ ( ( always_inline ) ) int
+tri_hit ( RayPacket * p, const BVHTri * tri, int live )
+{
+    __m128 e1[ 3 ], e2[ 3 ], s[ 3 ], pv[ 3 ], qv[ 3 ];
+    for ( int a = 0; a < 3; a++ )
+    {
+        e1[ a ] = _mm_set1_ps ( tri->e1[ a ] );
+        e2[ a ] = _mm_set1_ps ( tri->e2[ a ] );
+        s[ a ]  = _mm_sub_ps ( p->o[ a ], _mm_set1_ps ( tri->v0[ a ] ) );
+    }
+    cross3 ( p->d, e2, pv );
+    cross3 ( s, e1, qv );
+
+    const __m128 det = dot3 ( e1, pv );
+    const __m128 inv = _mm_div_ps ( _mm_set1_ps ( 1.0f ), det );
+    const __m128 u   = _mm_mul_ps ( dot3 ( s, pv ), inv );
+    const __m128 v   = _mm_mul_ps ( dot3 ( p->d, qv ), inv );
+    const __m128 t   = _mm_mul_ps ( dot3 ( e2, qv ), inv );
+
+    const __m128 zero = _mm_setzero_ps ();
+    __m128       m    = _mm_and_ps ( _mm_cmpneq_ps ( det, zero ),
+                                     _mm_cmpge_ps ( u, zero ) );
+    m = _mm_and_ps ( m, _mm_cmpge_ps ( v, zero ) );
+    m = _mm_and_ps (
+        m, _mm_cmple_ps ( _mm_add_ps ( u, v ), _mm_set1_ps ( 1.0f ) ) );
+    m = _mm_and_ps ( m, _mm_cmpgt_ps ( t, zero ) );
+    m = _mm_and_ps ( m, _mm_cmplt_ps ( t, p->t ) );
+    m = _mm_and_ps ( m, lane_mask ( live ) );
+
+    p->t = sel_ps ( m, t, p->t );
+    return _mm_movemask_ps ( m );
+}
+
+/* The lanes in live through b, p in b's space. Returns the lanes that hit
+ * something; tri gets the nearest triangle of each, or with any the
+ * lanes stop at their first hit and tri is left alone. */
+static int
+trace_bvh ( const BVH * b, RayPacket * p, int live, int any, __m128i * tri )
+{
+    uint32_t stack[ BVH_DEPTH_MAX + 2 ];
+    int      sp  = 0;
+    int      hit = 0;
+    stack[ sp++ ] = 0;
+
+    while ( sp )
+    {
+        const BVHNode * n = b->nodes + stack[ --sp ];
+        if ( ! ( box_hit ( p, n ) & live ) ) continue;
+
+        if ( ! n->cnt )
+        {
+            /* the nearer child goes on top */
+            const BVHNode * l = b->nodes + n->first;
+            const BVHNode * r = l + 1;
+            float           d = 0.0f;
+            for ( int a = 0; a < 3; a++ )
+                d += ( l->min[ a ] + l->max[ a ] - r->min[ a ] - r->max[ a ] ) *
+                     p->dir[ a ];
+            stack[ sp++ ] = d > 0.0f ? n->first : n->first + 1;
+            stack[ sp++ ] = d > 0.0f ? n->first + 1 : n->first;
+            continue;
+        }
+
+        for ( uint32_t i = n->first; i < n->first + n->cnt; i++ )
+        {
+            const int m = tri_hit ( p, b->tris + i, live );
+            if ( ! m ) continue;
+
+            hit |= m;
+            if ( any )
+            {
+                live &= ~m;
+                if ( ! live ) return hit;
+            }
+            else
+            {
+                *tri = sel_epi32 ( lane_mask ( m ),
+                                   _mm_set1_epi32 ( ( int32_t ) i ),
+                                   *tri );
+            }
+        }
+    }
+    return hit;
+}
+
+/* row r of the affine m applied to x, y, z (and w) */
+static inline __attribute__ ( ( always_inline ) ) __m128
+affine_row ( const mat4 m, int r, const __m128 * v, float w )
+{
+    return _mm_add_ps (
+        _mm_add_ps ( _mm_mul_ps ( _mm_set1_ps ( m[ 0 ][ r ] ), v[ 0 ] ),
+                     _mm_mul_ps ( _mm_set1_ps ( m[ 1 ][ r ] ), v[ 1 ] ) ),
+        _mm_add_ps ( _mm_mul_ps ( _mm_set1_ps ( m[ 2 ][ r ] ), v[ 2 ] ),
+                     _mm_set1_ps ( m[ 3 ][ r ] * w ) ) );
+}
+
+/* World space w through every instance. d is not renormalized in object
+ * space, so t means the same everywhere. Closest: returns the lanes that
+ * hit, with the instance and triangle of each; any: the lanes blocked. */
+static int
+trace_world ( const RayInstance * inst,
+              int                 inst_cnt,
+              RayPacket *         w,
+              int                 live,
+              int                 any,
+              __m128i *           hit_inst,
+              __m128i *           hit_tri )
+{
+    int hit = 0;
+    for ( int i = 0; i < inst_cnt && live; i++ )
+    {
+        RayPacket p;
+        for ( int r = 0; r < 3; r++ )
+        {
+            p.o[ r ] = affine_row ( inst[ i ].to_obj, r, w->o, 1.0f );
+            p.d[ r ] = affine_row ( inst[ i ].to_obj, r, w->d, 0.0f );
+        }
+        p.t = w->t;
+        packet_dirs ( &p );
+
+        __m128i   tri = _mm_setzero_si128 ();
+        const int m   = trace_bvh ( inst[ i ].bvh, &p, live, any, &tri );
+        if ( ! m ) continue;
+
+        hit |= m;
+        if ( any )
+        {
+            live &= ~m;
+            continue;
+        }
+        w->t      = p.t;
+        *hit_tri  = sel_epi32 ( lane_mask ( m ), tri, *hit_tri );
+        *hit_inst =
+            sel_epi32 ( lane_mask ( m ), _mm_set1_epi32 ( i ), *hit_inst );
+    }
+    return hit;
+}
+
+/* ========= Lighting ========= */
+
+typedef struct
+{
+    Framebuffer *       f;
+    const RayInstance * inst;
+    int                 inst_cnt;
+    const TraceParams * tp;
+
+    /* grid point gx, gy is pixel gx * stride, gy * stride, clamped into
+     * the render target; its factor, or -1 where no surface was found */
+    uint32_t stride;
+    uint32_t gw;
+    uint32_t gh;
+    float *  grid;
+
+    float ao[ RT_AO_RAYS ][ 3 ]; /* cosine weighted, about z */
+} TraceJob;
+
+static inline __attribute__ ( ( always_inline ) ) int
+covered ( const Framebuffer * f, uint32_t idx )
+{
+    return f->opaque_z[ idx ] || ( f->msaa && f->ms_idx[ idx ] );
+}
+
+/* raster depth z, taken as in's, is at camera distance t */
+static inline int
+same_depth ( const TraceJob * tj, const RayInstance * in, uint64_t z, float t )
+{
+    if ( ! z ) return 0;
+    const double n = ( ( double ) z - in->zq_bias ) / in->zq_scale;
+    const float  w = tj->tp->z_b / ( float ) ( n - tj->tp->z_a );
+    return fabsf ( w - t ) <= RT_DEPTH_TOL * t;
+}
+
+/* the raster drew in at distance t into pixel idx: its opaque depth or
+ * one of its samples */
+static int
+drawn_by ( const TraceJob * tj, uint32_t idx, const RayInstance * in, float t )
+{
+    const Framebuffer * f = tj->f;
+    if ( same_depth ( tj, in, f->opaque_z[ idx ], t ) ) return 1;
+    if ( ! f->msaa || ! f->ms_idx[ idx ] ) return 0;
+
+    const MSBlock * b = MS_BLOCK ( f, f->ms_idx[ idx ] - 1 );
+    for ( int m = 0; m < MSAA_SAMPLES; m++ )
+        if ( same_depth ( tj, in, b->z[ m ], t ) ) return 1;
+    return 0;
+}
+
+/* AO rays of a surface point: the table about n, turned by a per pixel
+ * angle so neighbours sample different directions and the interpolation
+ * averages them out. Returns the rays blocked within ao_radius. */
+static int
+trace_ao ( const TraceJob * tj, const float * o, const float * n, uint32_t h )
+{
+    /* tangent frame */
+    const float a[ 3 ] = { fabsf ( n[ 0 ] ) > 0.9f ? 0.0f : 1.0f,
+                           fabsf ( n[ 0 ] ) > 0.9f ? 1.0f : 0.0f,
+                           0.0f };
+    float       t[ 3 ] = { a[ 1 ] * n[ 2 ] - a[ 2 ] * n[ 1 ],
+                           a[ 2 ] * n[ 0 ] - a[ 0 ] * n[ 2 ],
+                           a[ 0 ] * n[ 1 ] - a[ 1 ] * n[ 0 ] };
+    const float l      = 1.0f / sqrtf ( t[ 0 ] * t[ 0 ] + t[ 1 ] * t[ 1 ] +
+                                   t[ 2 ] * t[ 2 ] );
+    for ( int k = 0; k < 3; k++ ) t[ k ] *= l;
+    const float b[ 3 ] = { n[ 1 ] * t[ 2 ] - n[ 2 ] * t[ 1 ],
+                           n[ 2 ] * t[ 0 ] - n[ 0 ] * t[ 2 ],
+                           n[ 0 ] * t[ 1 ] - n[ 1 ] * t[ 0 ] };
+
+    const float turn = ( float ) h * ( 6.2831853f / 4294967296.0f );
+    const float c    = cosf ( turn );
+    const float s    = sinf ( turn );
+
+    int occ = 0;
+    for ( int i = 0; i < RT_AO_RAYS; i += 4 )
+    {
+        RayPacket p;
+        float     d[ 3 ][ 4 ];
+        for ( int j = 0; j < 4; j++ )
+        {
+            const float * r = tj->ao[ i + j ];
+            const float   x = r[ 0 ] * c - r[ 1 ] * s;
+            const float   y = r[ 0 ] * s + r[ 1 ] * c;
+            for ( int k = 0; k < 3; k++ )
+                d[ k ][ j ] = t[ k ] * x + b[ k ] * y + n[ k ] * r[ 2 ];
+        }
+        for ( int k = 0; k < 3; k++ )
+        {
+            p.o[ k ] = _mm_set1_ps ( o[ k ] );
+            p.d[ k ] = _mm_loadu_ps ( d[ k ] );
+        }
+        p.t = _mm_set1_ps ( tj->tp->ao_radius );
+        packet_dirs ( &p );
+
+        occ += __builtin_popcount (
+            trace_world ( tj->inst, tj->inst_cnt, &p, 0xf, 1, NULL, NULL ) );
+    }
+    return occ;
+}
+
+/* the 2 x 2 grid points from gx, gy; returns the rays cast */
+static uint64_t
+trace_quad ( const TraceJob * tj, uint32_t gx, uint32_t gy )
+{
+    const Framebuffer * f  = tj->f;
+    const TraceParams * tp = tj->tp;
+
+    float    nx[ 4 ] = { 0.0f }, ny[ 4 ] = { 0.0f };
+    uint32_t g[ 4 ] = { 0 }, idx[ 4 ] = { 0 };
+    int      live = 0;
+
+    for ( int l = 0; l < 4; l++ )
+    {
+        const uint32_t x = gx + ( l & 1 );
+        const uint32_t y = gy + ( l >> 1 );
+        if ( x >= tj->gw || y >= tj->gh ) continue;
+
+        const uint32_t px = x * tj->stride < f->w ? x * tj->stride : f->w - 1;
+        const uint32_t py = y * tj->stride < f->h ? y * tj->stride : f->h - 1;
+        g[ l ]            = y * tj->gw + x;
+        tj->grid[ g[ l ] ] = -1.0f;
+        idx[ l ]           = pxIndex ( f, px, py );
+        if ( ! covered ( f, idx[ l ] ) ) continue;
+
+        live |= 1 << l;
+        nx[ l ] = 2.0f * ( ( float ) px + 0.5f ) / ( float ) f->w - 1.0f;
+        ny[ l ] = 2.0f * ( ( float ) py + 0.5f ) / ( float ) f->h - 1.0f;
+    }
+    if ( ! live ) return 0;
+
+    /* camera rays, back to the surface the raster found */
+    RayPacket    cam;
+    const __m128 vx = _mm_loadu_ps ( nx );
+    const __m128 vy = _mm_loadu_ps ( ny );
+    for ( int a = 0; a < 3; a++ )
+    {
+        cam.o[ a ] = _mm_set1_ps ( tp->eye[ a ] );
+        cam.d[ a ] = _mm_add_ps (
+            _mm_set1_ps ( tp->fwd[ a ] ),
+            _mm_add_ps ( _mm_mul_ps ( _mm_set1_ps ( tp->right[ a ] ), vx ),
+                         _mm_mul_ps ( _mm_set1_ps ( tp->up[ a ] ), vy ) ) );
+    }
+    cam.t = _mm_set1_ps ( RT_FAR );
+    packet_dirs ( &cam );
+
+    __m128i  hit_inst = _mm_setzero_si128 ();
+    __m128i  hit_tri  = _mm_setzero_si128 ();
+    int      hit      = trace_world (
+        tj->inst, tj->inst_cnt, &cam, live, 0, &hit_inst, &hit_tri );
+    uint64_t rays = ( uint64_t ) __builtin_popcount ( live );
+
+    float   t[ 4 ], d[ 3 ][ 4 ];
+    int32_t ii[ 4 ], ti[ 4 ];
+    _mm_storeu_ps ( t, cam.t );
+    for ( int a = 0; a < 3; a++ ) _mm_storeu_ps ( d[ a ], cam.d[ a ] );
+    _mm_storeu_si128 ( ( __m128i * ) ii, hit_inst );
+    _mm_storeu_si128 ( ( __m128i * ) ti, hit_tri );
+
+    /* pixels of something untraced (points, streamed) stay as they are,
+     * also when a traced surface behind it was hit */
+    for ( int l = 0; l < 4; l++ )
+    {
+        if ( ! ( hit >> l & 1 ) ) continue;
+        if ( ! drawn_by ( tj, idx[ l ], tj->inst + ii[ l ], t[ l ] ) )
+            hit &= ~( 1 << l );
+    }
+    for ( int l = 0; l < 4; l++ )
+        if ( ( live & ~hit ) >> l & 1 ) tj->grid[ g[ l ] ] = 1.0f;
+    if ( ! hit ) return rays;
+
+    /* hit points, pushed off the surface, and world normals facing the
+     * eye: n by the transpose of to_obj, the inverse transpose of the
+     * object's world transform */
+    float o[ 3 ][ 4 ] = { { 0.0f } }, n[ 4 ][ 3 ];
+    int   lit         = 0;
+    for ( int l = 0; l < 4; l++ )
+    {
+        if ( ! ( hit >> l & 1 ) ) continue;
+
+        const RayInstance * in = tj->inst + ii[ l ];
+        const BVHTri *      tr = in->bvh->tris + ti[ l ];
+        const float         on[ 3 ] = {
+            tr->e1[ 1 ] * tr->e2[ 2 ] - tr->e1[ 2 ] * tr->e2[ 1 ],
+            tr->e1[ 2 ] * tr->e2[ 0 ] - tr->e1[ 0 ] * tr->e2[ 2 ],
+            tr->e1[ 0 ] * tr->e2[ 1 ] - tr->e1[ 1 ] * tr->e2[ 0 ] };
+
+        float len = 0.0f, facing = 0.0f, dl = 0.0f, nl = 0.0f;
+        for ( int r = 0; r < 3; r++ )
+        {
+            n[ l ][ r ] = in->to_obj[ r ][ 0 ] * on[ 0 ] +
+                          in->to_obj[ r ][ 1 ] * on[ 1 ] +
+                          in->to_obj[ r ][ 2 ] * on[ 2 ];
+            len += n[ l ][ r ] * n[ l ][ r ];
+            facing += n[ l ][ r ] * d[ r ][ l ];
+            dl += d[ r ][ l ] * d[ r ][ l ];
+        }
+        len = ( facing > 0.0f ? -1.0f : 1.0f ) / sqrtf ( len );
+
+        const float bias = RT_BIAS * t[ l ] * sqrtf ( dl );
+        for ( int r = 0; r < 3; r++ )
+        {
+            n[ l ][ r ] *= len;
+            nl += n[ l ][ r ] * tp->light[ r ];
+            o[ r ][ l ] =
+                tp->eye[ r ] + d[ r ][ l ] * t[ l ] + n[ l ][ r ] * bias;
+        }
+        if ( nl > 0.0f ) lit |= 1 << l;
+    }
+
+    /* shadow rays, only where the surface faces the light */
+    int blocked = 0;
+    if ( lit )
+    {
+        RayPacket sh;
+        for ( int a = 0; a < 3; a++ )
+        {
+            sh.o[ a ] = _mm_loadu_ps ( o[ a ] );
+            sh.d[ a ] = _mm_set1_ps ( tp->light[ a ] );
+        }
+        sh.t = _mm_set1_ps ( RT_FAR );
+        packet_dirs ( &sh );
+
+        blocked =
+            trace_world ( tj->inst, tj->inst_cnt, &sh, lit, 1, NULL, NULL );
+        rays += ( uint64_t ) __builtin_popcount ( lit );
+    }
+
+    for ( int l = 0; l < 4; l++ )
+    {
+        if ( ! ( hit >> l & 1 ) ) continue;
+
+        const float p[ 3 ] = { o[ 0 ][ l ], o[ 1 ][ l ], o[ 2 ][ l ] };
+        uint32_t    h      = ( gx + ( l & 1 ) ) * 0x9e3779b1u ^
+                     ( gy + ( l >> 1 ) ) * 0x85ebca77u;
+        h ^= h >> 15;
+        h *= 0x2c1b3c6du;
+
+        const int occ = trace_ao ( tj, p, n[ l ], h );
+        rays += RT_AO_RAYS;
+
+        const int shadowed = ! ( ( lit & ~blocked ) >> l & 1 );
+        tj->grid[ g[ l ] ] =
+            ( 1.0f - RT_AO_DARK * ( float ) occ / RT_AO_RAYS ) *
+            ( shadowed ? 1.0f - RT_SHADOW_DARK : 1.0f );
+    }
+    return rays;
+}
+
+/* grid rows 2 * begin .. 2 * end */
+static void
+trace_rows ( void * arg, int begin, int end, int worker )
+{
+    ( void ) worker;
+    const TraceJob * tj   = arg;
+    uint64_t         rays = 0;
+
+    for ( int r = begin; r < end; r++ )
+        for ( uint32_t gx = 0; gx < tj->gw; gx += 2 )
+            rays += trace_quad ( tj, gx, 2 * ( uint32_t ) r );
+
+    __atomic_fetch_add ( &tj->f->stats.rays, rays, __ATOMIC_RELAXED );
+}
+
+/* how far x is from grid point gx towards the next one */
+static inline float
+grid_frac ( uint32_t x, uint32_t gx, uint32_t stride, uint32_t size )
+{
+    const uint32_t x0 = gx * stride;
+    const uint32_t x1 = x0 + stride < size ? x0 + stride : size - 1;
+    return x1 > x0 ? ( float ) ( x - x0 ) / ( float ) ( x1 - x0 ) : 0.0f;
+}
+
+/* scales colour channels, not alpha */
+static inline __attribute__ ( ( always_inline ) ) void
+darken ( float * c, float k )
+{
+    c[ 1 ] *= k;
+    c[ 2 ] *= k;
+    c[ 3 ] *= k;
+}
+
+/* bilinear over the grid points around each covered pixel, leaving out
+ * those that found no surface */
+static void
+apply_rows ( void * arg, int begin, int end, int worker )
+{
+    ( void ) worker;
+    const TraceJob * tj = arg;
+    Framebuffer *    f  = tj->f;
+    const uint32_t   s  = tj->stride;
+
+    for ( uint32_t y = ( uint32_t ) begin; y < ( uint32_t ) end; y++ )
+    {
+        const uint32_t gy  = y / s;
+        const float    fy  = grid_frac ( y, gy, s, f->h );
+        const float *  g0  = tj->grid + gy * tj->gw;
+        const float *  g1  = gy + 1 < tj->gh ? g0 + tj->gw : g0;
+        const uint32_t row = pxRow ( f, y );
+
+        for ( uint32_t x = 0; x < f->w; x++ )
+        {
+            const uint32_t idx = row + pxCol ( f, x );
+            if ( ! covered ( f, idx ) ) continue;
+
+            const uint32_t gx  = x / s;
+            const uint32_t gx1 = gx + 1 < tj->gw ? gx + 1 : gx;
+            const float    fx  = grid_frac ( x, gx, s, f->w );
+
+            const float v[ 4 ]  = { g0[ gx ], g0[ gx1 ], g1[ gx ], g1[ gx1 ] };
+            const float wt[ 4 ] = { ( 1.0f - fx ) * ( 1.0f - fy ),
+                                    fx * ( 1.0f - fy ),
+                                    ( 1.0f - fx ) * fy,
+                                    fx * fy };
+            float       sum = 0.0f, wsum = 0.0f;
+            for ( int k = 0; k < 4; k++ )
+            {
+                if ( v[ k ] < 0.0f || wt[ k ] <= 0.0f ) continue;
+                sum += v[ k ] * wt[ k ];
+                wsum += wt[ k ];
+            }
+            if ( wsum <= 0.0f ) continue;
+
+            const float k = sum / wsum;
+            if ( k >= 1.0f ) continue;
+
+            darken ( f->opaque_c[ idx ], k );
+            if ( ! f->msaa || ! f->ms_idx[ idx ] ) continue;
+
+            MSBlock * b = MS_BLOCK ( f, f->ms_idx[ idx ] - 1 );
+            for ( int m = 0; m < MSAA_SAMPLES; m++ )
+                if ( b->z[ m ] ) darken ( b->color[ m ], k );
+        }
+    }
+}
+
+int
+traceLighting ( Framebuffer *       f,
+                const RayInstance * inst,
+                int                 inst_cnt,
+                const TraceParams * tp )
+{
+    if ( ! inst_cnt || ! f->w || ! f->h ) return 0;
+
+    TraceJob tj;
+    memset ( &tj, 0, sizeof ( tj ) );
+    tj.f        = f;
+    tj.inst     = inst;
+    tj.inst_cnt = inst_cnt;
+    tj.tp       = tp;
+
+    /* the smallest power of two stride within the budget; a grid point
+     * takes at most a camera, a shadow and the AO rays */
+    for ( tj.stride = 1;; tj.stride *= 2 )
+    {
+        tj.gw = ( f->w - 1 + tj.stride - 1 ) / tj.stride + 1;
+        tj.gh = ( f->h - 1 + tj.stride - 1 ) / tj.stride + 1;
+        if ( ( uint64_t ) tj.gw * tj.gh * ( 2 + RT_AO_RAYS ) <= tp->budget )
+            break;
+        if ( tj.stride >= RT_STRIDE_MAX ) return 0;
+    }
+    F_ALLOC ( f->arenas, tj.grid, float, tj.gw * tj.gh );
+
+    /* Fibonacci spiral over the disc, lifted onto the hemisphere */
+    for ( int i = 0; i < RT_AO_RAYS; i++ )
+    {
+        const float r   = sqrtf ( ( ( float ) i + 0.5f ) / RT_AO_RAYS );
+        const float phi = ( float ) i * 2.3999632f;
+        tj.ao[ i ][ 0 ] = r * cosf ( phi );
+        tj.ao[ i ][ 1 ] = r * sinf ( phi );
+        tj.ao[ i ][ 2 ] = sqrtf ( 1.0f - r * r );
+    }
+
+    parallelFor ( f->jobs, trace_rows, &tj, ( int ) ( tj.gh + 1 ) / 2, 1 );
+    parallelFor ( f->jobs, apply_rows, &tj, ( int ) f->h, 16 );
+    return ( int ) tj.stride;
+}
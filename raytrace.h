@@ -0,0 +1,113 @@
+#pragma once
+#ifndef CUSTOM_RENDER_RAYTRACE_H
+#define CUSTOM_RENDER_RAYTRACE_H
+
+#include "engine.h"
+
+#include <stdint.h>
+
+/* 19.10.26 ::: Ray traced shadows and ambient occlusion over the raster.
+ * Every RObject with triangles gets a BVH over lods[ 0 ] in object space,
+ * built with binned SAH the first time it is traced. After the raster,
+ * traceLighting () finds the surface under the covered pixels again with
+ * camera rays (the depth planes are quantized per object and can not be
+ * taken back to world space), then casts a shadow ray to the light and
+ * RT_AO_RAYS short rays over the hemisphere of the normal from each hit.
+ * Rays go four at a time, as SSE packets: 2 x 2 neighbouring pixels for
+ * camera and shadow rays, the AO rays of one pixel in fours. Objects are
+ * instances, a packet is taken into object space of every BVH in turn.
+ *
+ * The frame gets at most TraceParams.budget rays: pixels are traced every
+ * stride pixels per axis, the smallest power of two that fits, and the
+ * result is interpolated in between. A budget too small for RT_STRIDE_MAX
+ * leaves the frame as rasterized. The opaque colours (and samples) are
+ * darkened by it before merge (); transparent fragments are not. A camera
+ * ray whose hit is not what the raster drew there, within RT_DEPTH_TOL of
+ * the distance, leaves its pixel as is: an untraced object is in front. */
+
+#define BVH_BINS      16
+#define BVH_LEAF_MAX  8  /* more triangles only when they can't be split */
+#define BVH_DEPTH_MAX 48 /* leaves below, bounds the traversal stack */
+
+/* AO rays per traced pixel, a multiple of 4 */
+#define RT_AO_RAYS 8
+
+/* how dark shadow and full occlusion make a pixel */
+#define RT_SHADOW_DARK 0.5f
+#define RT_AO_DARK     0.6f
+
+#define RT_STRIDE_MAX 16
+
+/* the raster draws lower LODs than the rays see */
+#define RT_DEPTH_TOL 0.02f
+
+/* 32 bytes, the children of an inner node are next to each other */
+typedef struct BVHNode
+{
+    float    min[ 3 ];
+    uint32_t first; /* inner: left child, right is first + 1; leaf: first
+                     * triangle */
+    float    max[ 3 ];
+    uint32_t cnt; /* triangles of a leaf, 0 for inner nodes */
+} BVHNode;
+
+/* Moller-Trumbore form, in leaf order */
+typedef struct BVHTri
+{
+    float v0[ 3 ];
+    float e1[ 3 ];
+    float e2[ 3 ];
+} BVHTri;
+
+typedef struct BVH
+{
+    BVHNode * nodes;
+    uint32_t  node_cnt;
+    BVHTri *  tris;
+    uint32_t  tri_cnt;
+} BVH;
+
+/* an object as traceLighting () sees it */
+typedef struct RayInstance
+{
+    const BVH * bvh;
+    mat4        to_obj; /* world to object space */
+
+    /* the raster quantized the object's NDC z to z * zq_scale + zq_bias */
+    double zq_scale, zq_bias;
+} RayInstance;
+
+typedef struct TraceParams
+{
+    /* camera ray of render target pixel x, y (at its centre): from eye
+     * along right * nx + up * ny + fwd, nx and ny the NDC of the pixel */
+    vec3 eye;
+    vec3 right, up, fwd;
+
+    /* NDC z at camera distance w (the t of a camera ray) is z_a + z_b / w */
+    float z_a, z_b;
+
+    vec3  light;     /* direction to the light, world space, unit */
+    float ao_radius; /* AO ray length, world units */
+
+    uint32_t budget; /* rays per frame */
+} TraceParams;
+
+/* NULL for a mesh without triangles */
+BVH *
+buildBVH ( const RMesh * m );
+
+void
+destroyBVH ( BVH * b );
+
+/* darkens what the raster left in f, see above; the grid comes off
+ * f->arenas, so call it inside a frame stage. Returns the stride, or 0
+ * when even RT_STRIDE_MAX would take more than the budget and nothing was
+ * traced. */
+int
+traceLighting ( Framebuffer *       f,
+                const RayInstance * inst,
+                int                 inst_cnt,
+                const TraceParams * tp );
+
+#endif /* CUSTOM_RENDER_RAYTRACE_H */
@@ -0,0 +1,360 @@
+#define _GNU_SOURCE /* memfd_create () */
+#include "server.h"
+#include "video.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static int
+set_nonblock ( int fd )
+{
+    const int fl = fcntl ( fd, F_GETFL );
+    return fl < 0 || fcntl ( fd, F_SETFL, fl | O_NONBLOCK ) < 0 ? -1 : 0;
+}
+
+int
+openServer ( Server *     s,
+             const char * path,
+             uint32_t     w,
+             uint32_t     h,
+             uint32_t     objects )
+{
+    memset ( s, 0, sizeof ( Server ) );
+    s->listen_fd = -1;
+    s->path      = path;
+    s->w         = w;
+    s->h         = h;
+    s->objects   = objects;
+
+    /* the largest format, whole pages */
+    const size_t page = sysconf ( _SC_PAGESIZE );
+    s->slot_bytes     = ( ( size_t ) w * h * 4 + page - 1 ) & ~( page - 1 );
+
+    struct sockaddr_un addr;
+    memset ( &addr, 0, sizeof ( addr ) );
+    addr.sun_family = AF_UNIX;
+    if ( strlen ( path ) >= sizeof ( addr.sun_path ) )
+    {
+        printf ( "error: socket path %s too long\n", path );
+        return -1;
+    }
+    strcpy ( addr.sun_path, path );
+
+    s->listen_fd = socket ( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( s->listen_fd < 0 )
+    {
+        printf ( "error: socket: %s\n", strerror ( errno ) );
+        return -1;
+    }
+
+    /* a socket file left by a server that is gone */
+    unlink ( path );
+    if ( bind ( s->listen_fd, ( struct sockaddr * ) &addr, sizeof ( addr ) ) ||
+         listen ( s->listen_fd, SERVE_CLIENTS ) ||
+         set_nonblock ( s->listen_fd ) )
+    {
+        printf ( "error: can't listen on %s: %s\n", path, strerror ( errno ) );
+        close ( s->listen_fd );
+        s->listen_fd = -1;
+        return -1;
+    }
+
+    printf ( "serving %ux%u on %s\n", w, h, path );
+    return 0;
+}
+
+static void
+drop_client ( Server * s, ServeClient * c )
+{
+    if ( c->fd < 0 ) return;
+
+    close ( c->fd );
+    munmap ( c->shm, s->slot_bytes * SERVE_SLOTS );
+    c->fd = -1;
+}
+
+void
+closeServer ( Server * s )
+{
+    if ( s->listen_fd < 0 ) return;
+
+    for ( int i = 0; i < s->client_cnt; i++ ) drop_client ( s, s->clients + i );
+    s->client_cnt = 0;
+
+    close ( s->listen_fd );
+    unlink ( s->path );
+    s->listen_fd = -1;
+}
+
+/* hello and the shared memory fd, in one message */
+static int
+send_hello ( Server * s, int fd, int shm_fd )
+{
+    ServeHello hello = { SERVE_MAGIC,
+                         SERVE_VERSION,
+                         s->w,
+                         s->h,
+                         s->objects,
+                         SERVE_SLOTS,
+                         s->slot_bytes };
+
+    union
+    {
+        char           buf[ CMSG_SPACE ( sizeof ( int ) ) ];
+        struct cmsghdr align;
+    } ctl;
+    memset ( &ctl, 0, sizeof ( ctl ) );
+
+    struct iovec  iov = { &hello, sizeof ( hello ) };
+    struct msghdr msg;
+    memset ( &msg, 0, sizeof ( msg ) );
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof ( ctl.buf );
+
+    struct cmsghdr * cm = CMSG_FIRSTHDR ( &msg );
+    cm->cmsg_level      = SOL_SOCKET;
+    cm->cmsg_type       = SCM_RIGHTS;
+    cm->cmsg_len        = CMSG_LEN ( sizeof ( int ) );
+    memcpy ( CMSG_DATA ( cm ), &shm_fd, sizeof ( int ) );
+
+    return sendmsg ( fd, &msg, MSG_NOSIGNAL ) == sizeof ( hello ) ? 0 : -1;
+}
+
+static void
+accept_clients ( Server * s )
+{
+    for ( ;; )
+    {
+        const int fd = accept ( s->listen_fd, NULL, NULL );
+        if ( fd < 0 ) return;
+
+        if ( s->client_cnt == SERVE_CLIENTS )
+        {
+            printf ( "server: %d clients, refusing one\n", SERVE_CLIENTS );
+            close ( fd );
+            continue;
+        }
+
+        /* the client maps the fd; ours goes away with the mapping */
+        const size_t bytes  = s->slot_bytes * SERVE_SLOTS;
+        const int    shm_fd = memfd_create ( "render-frames", MFD_CLOEXEC );
+        void *       shm    = MAP_FAILED;
+        if ( shm_fd >= 0 && ! ftruncate ( shm_fd, bytes ) )
+        {
+            shm = mmap (
+                NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0 );
+        }
+
+        if ( shm == MAP_FAILED || set_nonblock ( fd ) ||
+             send_hello ( s, fd, shm_fd ) )
+        {
+            printf ( "server: client setup failed: %s\n", strerror ( errno ) );
+            if ( shm != MAP_FAILED ) munmap ( shm, bytes );
+            close ( fd );
+        }
+        else
+        {
+            ServeClient * c = s->clients + s->client_cnt++;
+            memset ( c, 0, sizeof ( ServeClient ) );
+            c->fd  = fd;
+            c->shm = shm;
+        }
+        if ( shm_fd >= 0 ) close ( shm_fd );
+    }
+}
+
+static void
+reply ( Server * s, ServeClient * c, const ServeReply * r )
+{
+    if ( c->fd < 0 ) return;
+
+    /* tiny next to the socket buffer: a full one means the client stopped
+     * reading its replies */
+    if ( send ( c->fd, r, sizeof ( *r ), MSG_NOSIGNAL | MSG_DONTWAIT ) !=
+         sizeof ( *r ) )
+        drop_client ( s, c );
+}
+
+static int
+valid_request ( const Server * s, const ServeRequest * r )
+{
+    return r->magic == SERVE_MAGIC &&
+           ( r->format == SERVE_RGBA || r->format == SERVE_YUV420 ) &&
+           r->obj_cnt <= SERVE_OBJECTS && r->obj_cnt <= s->objects;
+}
+
+/* complete requests of c into the batch until it would block; at most
+ * SERVE_SLOTS per batch, so its replies land in different slots. The
+ * rest stays in the socket for the next batch. */
+static int
+read_requests ( Server * s, int ci, int n )
+{
+    ServeClient * c = s->clients + ci;
+
+    while ( n < SERVE_BATCH && c->fd >= 0 && c->batched < SERVE_SLOTS )
+    {
+        const ssize_t got = recv ( c->fd,
+                                   ( uint8_t * ) &c->in + c->have,
+                                   sizeof ( ServeRequest ) - c->have,
+                                   0 );
+        if ( got < 0 && errno == EINTR ) continue;
+        if ( got < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) break;
+        if ( got <= 0 )
+        {
+            drop_client ( s, c );
+            break;
+        }
+
+        c->have += got;
+        if ( c->have < sizeof ( ServeRequest ) ) continue;
+        c->have = 0;
+
+        if ( valid_request ( s, &c->in ) )
+        {
+            s->batch[ n ] = ( ServePending ) { c->in, ci, s->seq++ };
+            n++;
+            c->batched++;
+        }
+        else
+        {
+            const ServeReply r = {
+                SERVE_MAGIC, c->in.id, SERVE_BAD_REQUEST, c->in.format,
+                0,           0,        0 };
+            reply ( s, c, &r );
+        }
+    }
+    return n;
+}
+
+static int
+camera_cmp ( const ServeRequest * a, const ServeRequest * b )
+{
+    return memcmp ( a->position,
+                    b->position,
+                    sizeof ( a->position ) + sizeof ( a->yaw ) +
+                        sizeof ( a->pitch ) );
+}
+
+int
+sameServeState ( const ServeRequest * a, const ServeRequest * b )
+{
+    return ! camera_cmp ( a, b ) && a->obj_cnt == b->obj_cnt &&
+           ! memcmp ( a->obj, b->obj, a->obj_cnt * sizeof ( ServeObject ) );
+}
+
+/* camera first: a change of camera is a full redraw, of objects not */
+static int
+pending_cmp ( const void * pa, const void * pb )
+{
+    const ServePending * a = pa;
+    const ServePending * b = pb;
+
+    int d = camera_cmp ( &a->req, &b->req );
+    if ( ! d ) d = ( int ) a->req.obj_cnt - ( int ) b->req.obj_cnt;
+    if ( ! d )
+        d = memcmp ( a->req.obj,
+                     b->req.obj,
+                     a->req.obj_cnt * sizeof ( ServeObject ) );
+    if ( ! d ) d = a->seq < b->seq ? -1 : a->seq > b->seq;
+    return d;
+}
+
+int
+serverBatch ( Server * s, int timeout_ms )
+{
+    /* replies of the last batch are out, indices can move again */
+    int live = 0;
+    for ( int i = 0; i < s->client_cnt; i++ )
+    {
+        if ( s->clients[ i ].fd >= 0 ) s->clients[ live++ ] = s->clients[ i ];
+    }
+    s->client_cnt = live;
+
+    struct pollfd fds[ SERVE_CLIENTS + 1 ];
+    fds[ 0 ] = ( struct pollfd ) { s->listen_fd, POLLIN, 0 };
+    for ( int i = 0; i < s->client_cnt; i++ )
+        fds[ i + 1 ] = ( struct pollfd ) { s->clients[ i ].fd, POLLIN, 0 };
+
+    const int ready = poll ( fds, s->client_cnt + 1, timeout_ms );
+    if ( ready < 0 ) return errno == EINTR ? 0 : -1;
+
+    int n = 0;
+    for ( int i = 0; i < s->client_cnt; i++ )
+    {
+        s->clients[ i ].batched = 0;
+        if ( fds[ i + 1 ].revents ) n = read_requests ( s, i, n );
+    }
+    /* new clients have not sent anything yet */
+    if ( fds[ 0 ].revents ) accept_clients ( s );
+
+    qsort ( s->batch, n, sizeof ( ServePending ), pending_cmp );
+    return n;
+}
+
+typedef struct
+{
+    VideoSink *      v;
+    const uint32_t * px;
+    int              pitch;
+    int              w;
+} YuvJob;
+
+static void
+yuv_rows ( void * arg, int begin, int end, int worker )
+{
+    const YuvJob * j = arg;
+    const SDL_Rect r = { 0, begin * 2, j->w, ( end - begin ) * 2 };
+    ( void ) worker;
+
+    videoConvert ( j->v, j->px, j->pitch, &r );
+}
+
+void
+serverReply ( Server * s, const ServePending * p, Framebuffer * f )
+{
+    ServeClient *       c  = s->clients + p->client;
+    const SDL_Surface * sf = f->surface;
+    if ( c->fd < 0 ) return;
+
+    ServeReply r = { SERVE_MAGIC,
+                     p->req.id,
+                     SERVE_OK,
+                     p->req.format,
+                     c->next_slot++ % SERVE_SLOTS,
+                     s->frame,
+                     0 };
+    uint8_t * out = c->shm + r.slot * s->slot_bytes;
+
+    if ( p->req.format == SERVE_YUV420 )
+    {
+        VideoSink v;
+        initVideoTarget ( &v, sf, out );
+
+        /* row pairs */
+        YuvJob j = { &v, sf->pixels, sf->pitch / 4, sf->w };
+        parallelFor ( f->jobs, yuv_rows, &j, sf->h / 2, 32 );
+        r.bytes = v.frame_bytes;
+    }
+    else
+    {
+        r.bytes = ( size_t ) sf->h * sf->w * 4;
+        for ( int y = 0; y < sf->h; y++ )
+        {
+            memcpy ( out + ( size_t ) y * sf->w * 4,
+                     ( uint8_t * ) sf->pixels + ( size_t ) y * sf->pitch,
+                     ( size_t ) sf->w * 4 );
+        }
+    }
+
+    reply ( s, c, &r );
+}
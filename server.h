@@ -0,0 +1,155 @@
+#pragma once
+#ifndef CUSTOM_RENDER_SERVER_H
+#define CUSTOM_RENDER_SERVER_H
+
+#include "engine.h"
+
+#include <stdint.h>
+
+/* 19.10.26 ::: Render server. app --serve sock WxH model... keeps the
+ * engine, the models and the framebuffer resident and renders frames for
+ * other local processes over a unix socket. A model given as occ:path is
+ * an occluder, everything else is culled against it (see occlusion.h).
+ *
+ *   - on connect the client gets a ServeHello, and with it (SCM_RIGHTS)
+ *     a shared memory fd of SERVE_SLOTS frame slots to mmap
+ *   - it sends ServeRequests: camera, object transforms, pixel format
+ *   - every request gets a ServeReply naming the slot its frame is in;
+ *     replies go round the slots, a slot is good until SERVE_SLOTS more
+ *     replies came in. Frames never go through the socket.
+ *   - a batch takes at most SERVE_SLOTS requests of a client, so none of
+ *     its frames is overwritten before the client saw the reply; what it
+ *     pipelined beyond that waits in the socket for the next batch
+ *
+ * Whatever is queued while a frame renders is served as one batch,
+ * ordered so requests with the same camera follow each other: moving
+ * objects in between then only redraws their rects. Requests for the
+ * same state share one frame.
+ *
+ * All structs are native byte order, the peer is on the same host. */
+
+#define SERVE_MAGIC   0x56525352 /* "RSRV" */
+#define SERVE_VERSION 1
+#define SERVE_OBJECTS 8  /* transforms per request */
+#define SERVE_SLOTS   4  /* per client */
+#define SERVE_CLIENTS 16
+#define SERVE_BATCH   64
+
+enum
+{
+    SERVE_RGBA,  /* surface pixels, SDL_PIXELFORMAT_RGBA8888 */
+    SERVE_YUV420 /* planar Y, U, V, BT.601 limited range, see video.h */
+};
+
+enum
+{
+    SERVE_OK,
+    SERVE_BAD_REQUEST
+};
+
+typedef struct
+{
+    float position[ 3 ];
+    float quaternion[ 4 ];
+    float scale[ 3 ];
+} ServeObject;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t id;     /* echoed in the reply */
+    uint32_t format; /* SERVE_RGBA, SERVE_YUV420 */
+
+    /* scene objects [ 0, obj_cnt ) take obj[], the rest are drawn as
+     * loaded, so a request always names one whole scene state */
+    uint32_t obj_cnt;
+
+    /* camera */
+    float position[ 3 ];
+    float yaw;
+    float pitch;
+    float reserved[ 3 ];
+
+    ServeObject obj[ SERVE_OBJECTS ];
+} ServeRequest;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t w, h;    /* frames */
+    uint32_t objects; /* in the scene */
+    uint32_t slots;
+    uint64_t slot_bytes; /* slot i is at i * slot_bytes */
+} ServeHello;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t id;
+    uint32_t status; /* SERVE_OK, SERVE_BAD_REQUEST */
+    uint32_t format;
+    uint32_t slot;
+    uint32_t frame; /* replies with the same frame shared a render */
+    uint64_t bytes;
+} ServeReply;
+
+typedef struct
+{
+    int          fd; /* -1 once gone */
+    uint8_t *    shm;
+    uint32_t     next_slot;
+    uint32_t     batched; /* requests in the current batch */
+    uint32_t     have;    /* bytes of in */
+    ServeRequest in;
+} ServeClient;
+
+typedef struct
+{
+    ServeRequest req;
+    int          client;
+    uint32_t     seq; /* arrival, keeps a client's order among equals */
+} ServePending;
+
+typedef struct Server
+{
+    int          listen_fd;
+    const char * path;
+
+    uint32_t w, h, objects;
+    size_t   slot_bytes;
+
+    ServeClient clients[ SERVE_CLIENTS ];
+    int         client_cnt;
+
+    ServePending batch[ SERVE_BATCH ];
+    uint32_t     seq;
+    uint32_t     frame;
+} Server;
+
+/* 0 on success; listens on path, replacing what is there */
+int
+openServer ( Server *     s,
+             const char * path,
+             uint32_t     w,
+             uint32_t     h,
+             uint32_t     objects );
+
+void
+closeServer ( Server * s );
+
+/* waits up to timeout_ms for requests and returns how many are in
+ * s->batch, sorted; bad ones are answered right away, -1 on error */
+int
+serverBatch ( Server * s, int timeout_ms );
+
+/* same camera and objects: one frame serves both */
+int
+sameServeState ( const ServeRequest * a, const ServeRequest * b );
+
+/* writes the surface of f to the client's next slot and replies with
+ * s->frame, which the caller bumps for every render */
+void
+serverReply ( Server * s, const ServePending * p, Framebuffer * f );
+
+#endif /* CUSTOM_RENDER_SERVER_H */
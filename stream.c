@@ -0,0 +1,451 @@
+#include "stream.h"
+#include "mesh.h"
+
+#include <string.h>
+
+typedef struct
+{
+    uint32_t code;
+    uint32_t tri;
+} MortonTri;
+
+/* spreads the low 10 bits of x to every third bit */
+static inline __attribute__ ( ( always_inline ) ) uint32_t
+morton_spread ( uint32_t x )
+{
+    x &= 0x3ff;
+    x = ( x | ( x << 16 ) ) & 0x030000ff;
+    x = ( x | ( x << 8 ) ) & 0x0300f00f;
+    x = ( x | ( x << 4 ) ) & 0x030c30c3;
+    x = ( x | ( x << 2 ) ) & 0x09249249;
+    return x;
+}
+
+static int
+morton_cmp ( const void * a, const void * b )
+{
+    const MortonTri * x = a;
+    const MortonTri * y = b;
+    if ( x->code != y->code ) return x->code < y->code ? -1 : 1;
+    return x->tri < y->tri ? -1 : x->tri > y->tri;
+}
+
+static inline __attribute__ ( ( always_inline ) ) size_t
+cluster_bytes ( const ClusterFileEntry * c )
+{
+    return ( size_t ) c->vert_cnt * 3 * sizeof ( float ) +
+           ( size_t ) c->tri_cnt * 3 * sizeof ( uint32_t );
+}
+
+int
+writeClusterFile ( RMesh * m, const char * path, uint32_t cluster_tris )
+{
+    if ( ! m->tri_cnt || ! cluster_tris )
+    {
+        printf ( "error: nothing to cluster for %s\n", path );
+        return -1;
+    }
+
+    FILE * f = fopen ( path, "wb" );
+    if ( ! f )
+    {
+        printf ( "error: can't open %s for writing\n", path );
+        return -1;
+    }
+
+    ClusterFileHeader h;
+    memset ( &h, 0, sizeof ( h ) );
+    h.magic       = CLUSTER_MAGIC;
+    h.version     = CLUSTER_VERSION;
+    h.cluster_cnt = ( m->tri_cnt + cluster_tris - 1 ) / cluster_tris;
+    memcpy ( h.aabb_min, m->vertices, sizeof ( h.aabb_min ) );
+    memcpy ( h.aabb_max, m->vertices, sizeof ( h.aabb_max ) );
+    for ( uint32_t i = 1; i < m->vert_cnt; i++ )
+    {
+        glm_vec3_minv ( h.aabb_min, m->vertices + i * 3, h.aabb_min );
+        glm_vec3_maxv ( h.aabb_max, m->vertices + i * 3, h.aabb_max );
+    }
+
+    /* Morton order of the centroids keeps every run of triangles compact */
+    MortonTri * order;
+    U_ALLOC ( order, MortonTri, m->tri_cnt );
+    vec3 ext;
+    glm_vec3_sub ( h.aabb_max, h.aabb_min, ext );
+    for ( uint32_t t = 0; t < m->tri_cnt; t++ )
+    {
+        uint32_t q[ 3 ];
+        for ( int a = 0; a < 3; a++ )
+        {
+            float c = 0.0f;
+            for ( int k = 0; k < 3; k++ )
+                c += m->vertices[ m->idx[ t * 3 + k ] * 3 + a ];
+            c = c / 3.0f - h.aabb_min[ a ];
+            q[ a ] = ext[ a ] > 0.0f ? ( uint32_t ) ( c / ext[ a ] * 1023.0f )
+                                     : 0;
+        }
+        order[ t ].code = morton_spread ( q[ 0 ] ) |
+                          morton_spread ( q[ 1 ] ) << 1 |
+                          morton_spread ( q[ 2 ] ) << 2;
+        order[ t ].tri = t;
+    }
+    qsort ( order, m->tri_cnt, sizeof ( MortonTri ), morton_cmp );
+
+    ClusterFileEntry * entries;
+    uint32_t *         remap;
+    U_ALLOC ( entries, ClusterFileEntry, h.cluster_cnt );
+    U_ALLOC ( remap, uint32_t, m->vert_cnt );
+    memset ( remap, 0xff, m->vert_cnt * sizeof ( uint32_t ) );
+
+    int      err = fwrite ( &h, sizeof ( h ), 1, f ) != 1;
+    uint64_t off = sizeof ( h ) + h.cluster_cnt * sizeof ( ClusterFileEntry );
+    err = err || fseek ( f, ( long ) off, SEEK_SET );
+
+    for ( uint32_t c = 0; c < h.cluster_cnt && ! err; c++ )
+    {
+        ClusterFileEntry * e     = entries + c;
+        const uint32_t     first = c * cluster_tris;
+        RMesh              cm;
+        cm.tri_cnt  = m->tri_cnt - first < cluster_tris ? m->tri_cnt - first
+                                                        : cluster_tris;
+        cm.vert_cnt = 0;
+        U_ALLOC ( cm.idx, uint32_t, cm.tri_cnt * 3 + 1 );
+        U_ALLOC ( cm.vertices, float, cm.tri_cnt * 9 + 1 );
+
+        for ( uint32_t t = 0; t < cm.tri_cnt; t++ )
+        {
+            for ( int k = 0; k < 3; k++ )
+            {
+                const uint32_t g = m->idx[ order[ first + t ].tri * 3 + k ];
+                if ( remap[ g ] == UINT32_MAX )
+                {
+                    remap[ g ] = cm.vert_cnt;
+                    memcpy ( cm.vertices + cm.vert_cnt * 3,
+                             m->vertices + g * 3,
+                             3 * sizeof ( float ) );
+                    cm.vert_cnt++;
+                }
+                cm.idx[ t * 3 + k ] = remap[ g ];
+            }
+        }
+
+        /* only the touched entries go back to unmapped */
+        for ( uint32_t t = 0; t < cm.tri_cnt; t++ )
+            for ( int k = 0; k < 3; k++ )
+                remap[ m->idx[ order[ first + t ].tri * 3 + k ] ] = UINT32_MAX;
+
+        /* Morton order picks the cluster, the cache order within it */
+        optimizeMesh ( &cm );
+
+        e->tri_cnt  = cm.tri_cnt;
+        e->vert_cnt = cm.vert_cnt;
+        e->offset   = off;
+        memcpy ( e->aabb_min, cm.vertices, sizeof ( e->aabb_min ) );
+        memcpy ( e->aabb_max, cm.vertices, sizeof ( e->aabb_max ) );
+        for ( uint32_t i = 0; i < e->vert_cnt; i++ )
+        {
+            glm_vec3_minv ( e->aabb_min, cm.vertices + i * 3, e->aabb_min );
+            glm_vec3_maxv ( e->aabb_max, cm.vertices + i * 3, e->aabb_max );
+        }
+
+        err = fwrite ( cm.vertices, sizeof ( float ), e->vert_cnt * 3, f ) !=
+                  e->vert_cnt * 3 ||
+              fwrite ( cm.idx, sizeof ( uint32_t ), e->tri_cnt * 3, f ) !=
+                  e->tri_cnt * 3;
+        off += cluster_bytes ( e );
+        destroyMesh ( &cm );
+    }
+
+    err = err || fseek ( f, sizeof ( h ), SEEK_SET ) ||
+          fwrite ( entries, sizeof ( ClusterFileEntry ), h.cluster_cnt, f ) !=
+              h.cluster_cnt;
+    err = fclose ( f ) || err;
+    if ( err ) printf ( "error: writing %s failed\n", path );
+
+    free ( order );
+    free ( entries );
+    free ( remap );
+    return err ? -1 : 0;
+}
+
+/* I/O thread only, s->file is its own */
+static int
+read_cluster ( ClusterStream * s, const ClusterFileEntry * e, RMesh * m )
+{
+    m->vert_cnt = e->vert_cnt;
+    m->tri_cnt  = e->tri_cnt;
+    U_ALLOC ( m->vertices, float, m->vert_cnt * 3 );
+    U_ALLOC ( m->idx, uint32_t, m->tri_cnt * 3 );
+
+    FILE * f  = s->file;
+    int    ok = ! fseek ( f, ( long ) e->offset, SEEK_SET ) &&
+             fread ( m->vertices, sizeof ( float ), m->vert_cnt * 3, f ) ==
+                 m->vert_cnt * 3 &&
+             fread ( m->idx, sizeof ( uint32_t ), m->tri_cnt * 3, f ) ==
+                 m->tri_cnt * 3;
+
+    for ( uint32_t i = 0; ok && i < m->tri_cnt * 3; i++ )
+        ok = m->idx[ i ] < m->vert_cnt;
+
+    if ( ! ok ) destroyMesh ( m );
+    return ok;
+}
+
+static void *
+stream_main ( void * arg )
+{
+    ClusterStream * s = arg;
+
+    pthread_mutex_lock ( &s->lock );
+    for ( ;; )
+    {
+        while ( s->running && s->queue_head == s->queue_cnt )
+            pthread_cond_wait ( &s->wake, &s->lock );
+        if ( ! s->running ) break;
+
+        Cluster * c = s->clusters + s->queue[ s->queue_head++ ];
+        c->state    = CLUSTER_LOADING;
+        pthread_mutex_unlock ( &s->lock );
+
+        RMesh     m;
+        const int ok = read_cluster ( s, &c->entry, &m );
+
+        pthread_mutex_lock ( &s->lock );
+        s->inflight_bytes -= cluster_bytes ( &c->entry );
+        if ( ok )
+        {
+            c->mesh = m;
+            s->resident_bytes += cluster_bytes ( &c->entry );
+        }
+        c->state = ok ? CLUSTER_RESIDENT : CLUSTER_FAILED;
+    }
+    pthread_mutex_unlock ( &s->lock );
+    return NULL;
+}
+
+ClusterStream *
+openClusterStream ( const char * path, size_t budget )
+{
+    FILE * f = fopen ( path, "rb" );
+    if ( ! f )
+    {
+        printf ( "error: can't open %s\n", path );
+        return NULL;
+    }
+
+    /* everything the table points at has to be inside the file */
+    long size = -1;
+    if ( ! fseek ( f, 0, SEEK_END ) ) size = ftell ( f );
+    rewind ( f );
+
+    ClusterFileHeader h;
+    if ( size < 0 || fread ( &h, sizeof ( h ), 1, f ) != 1 ||
+         h.magic != CLUSTER_MAGIC ||
+         h.version != CLUSTER_VERSION || ! h.cluster_cnt ||
+         h.cluster_cnt > ( uint64_t ) size / sizeof ( ClusterFileEntry ) )
+    {
+        printf ( "error: %s is not a cluster file\n", path );
+        fclose ( f );
+        return NULL;
+    }
+
+    ClusterStream * s;
+    U_ALLOC ( s, ClusterStream, 1 );
+    memset ( s, 0, sizeof ( ClusterStream ) );
+    s->file        = f;
+    s->header      = h;
+    s->cluster_cnt = h.cluster_cnt;
+    s->budget      = budget;
+    U_ALLOC ( s->clusters, Cluster, s->cluster_cnt );
+    U_ALLOC ( s->draw, uint32_t, s->cluster_cnt );
+    U_ALLOC ( s->prev_draw, uint32_t, s->cluster_cnt );
+    U_ALLOC ( s->queue, uint32_t, s->cluster_cnt );
+    U_ALLOC ( s->order, ClusterWant, s->cluster_cnt );
+    memset ( s->clusters, 0, s->cluster_cnt * sizeof ( Cluster ) );
+
+    size_t biggest = 0;
+    for ( uint32_t i = 0; i < s->cluster_cnt; i++ )
+    {
+        Cluster *          c = s->clusters + i;
+        ClusterFileEntry * e = &c->entry;
+        if ( fread ( e, sizeof ( ClusterFileEntry ), 1, f ) != 1 ||
+             e->vert_cnt > ( uint64_t ) e->tri_cnt * 3 ||
+             e->offset + cluster_bytes ( e ) > ( uint64_t ) size )
+        {
+            printf ( "error: %s: bad cluster table\n", path );
+            s->running = 0;
+            closeClusterStream ( s );
+            return NULL;
+        }
+        c->want = -1.0f;
+        if ( cluster_bytes ( &c->entry ) > biggest )
+            biggest = cluster_bytes ( &c->entry );
+    }
+    if ( biggest > budget )
+    {
+        printf ( "warning: %s: budget of %zu bytes is below the biggest "
+                 "cluster (%zu), some will never load\n",
+                 path,
+                 budget,
+                 biggest );
+    }
+
+    pthread_mutex_init ( &s->lock, NULL );
+    pthread_cond_init ( &s->wake, NULL );
+    s->running = 1;
+    if ( pthread_create ( &s->io, NULL, stream_main, s ) )
+    {
+        printf ( "error: can't start the I/O thread for %s\n", path );
+        s->running = 0;
+        pthread_mutex_destroy ( &s->lock );
+        pthread_cond_destroy ( &s->wake );
+        closeClusterStream ( s );
+        return NULL;
+    }
+
+    printf ( "Streaming %s: %u clusters\n", path, s->cluster_cnt );
+    return s;
+}
+
+void
+closeClusterStream ( ClusterStream * s )
+{
+    if ( ! s ) return;
+
+    if ( s->running )
+    {
+        pthread_mutex_lock ( &s->lock );
+        s->running = 0;
+        pthread_cond_signal ( &s->wake );
+        pthread_mutex_unlock ( &s->lock );
+        pthread_join ( s->io, NULL );
+        pthread_mutex_destroy ( &s->lock );
+        pthread_cond_destroy ( &s->wake );
+    }
+
+    for ( uint32_t i = 0; i < s->cluster_cnt; i++ )
+    {
+        if ( s->clusters[ i ].state == CLUSTER_RESIDENT )
+            destroyMesh ( &s->clusters[ i ].mesh );
+    }
+    fclose ( s->file );
+    free ( s->clusters );
+    free ( s->draw );
+    free ( s->prev_draw );
+    free ( s->queue );
+    free ( s->order );
+    free ( s );
+}
+
+static int
+want_cmp ( const void * a, const void * b )
+{
+    const ClusterWant * x = a;
+    const ClusterWant * y = b;
+    if ( x->dist != y->dist ) return x->dist < y->dist ? -1 : 1;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/* frees the least recently used cluster not needed this frame; lock held */
+static int
+evict_lru ( ClusterStream * s )
+{
+    Cluster * lru = NULL;
+    for ( uint32_t i = 0; i < s->cluster_cnt; i++ )
+    {
+        Cluster * c = s->clusters + i;
+        if ( c->state != CLUSTER_RESIDENT || c->last_used == s->frame )
+            continue;
+        if ( ! lru || c->last_used < lru->last_used ) lru = c;
+    }
+    if ( ! lru ) return 0;
+
+    destroyMesh ( &lru->mesh );
+    s->resident_bytes -= cluster_bytes ( &lru->entry );
+    lru->state = CLUSTER_EMPTY;
+    return 1;
+}
+
+/* frees the farthest resident cluster wanted after order[ i ], so the
+ * nearest ones win once nothing unused is left; lock held */
+static int
+evict_farther ( ClusterStream * s, uint32_t i, uint32_t want_cnt )
+{
+    for ( uint32_t k = want_cnt; k-- > i + 1; )
+    {
+        Cluster * c = s->clusters + s->order[ k ].id;
+        if ( c->state != CLUSTER_RESIDENT ) continue;
+
+        destroyMesh ( &c->mesh );
+        s->resident_bytes -= cluster_bytes ( &c->entry );
+        c->state = CLUSTER_EMPTY;
+        return 1;
+    }
+    return 0;
+}
+
+void
+updateClusterStream ( ClusterStream * s )
+{
+    uint32_t want_cnt = 0;
+    for ( uint32_t i = 0; i < s->cluster_cnt; i++ )
+    {
+        if ( s->clusters[ i ].want < 0.0f ) continue;
+        s->order[ want_cnt ].dist = s->clusters[ i ].want;
+        s->order[ want_cnt ].id   = i;
+        want_cnt++;
+    }
+    qsort ( s->order, want_cnt, sizeof ( ClusterWant ), want_cmp );
+
+    pthread_mutex_lock ( &s->lock );
+    s->frame++;
+
+    /* requests nobody took yet are replaced by this frame's */
+    for ( uint32_t q = s->queue_head; q < s->queue_cnt; q++ )
+    {
+        Cluster * c = s->clusters + s->queue[ q ];
+        c->state    = CLUSTER_EMPTY;
+        s->inflight_bytes -= cluster_bytes ( &c->entry );
+    }
+    s->queue_head = s->queue_cnt = 0;
+
+    for ( uint32_t i = 0; i < want_cnt; i++ )
+    {
+        Cluster * c = s->clusters + s->order[ i ].id;
+        if ( c->state == CLUSTER_RESIDENT ) c->last_used = s->frame;
+    }
+
+    for ( uint32_t i = 0; i < want_cnt; i++ )
+    {
+        Cluster * c = s->clusters + s->order[ i ].id;
+        if ( c->state != CLUSTER_EMPTY ) continue;
+
+        const size_t need = cluster_bytes ( &c->entry );
+        while ( s->resident_bytes + s->inflight_bytes + need > s->budget &&
+                ( evict_lru ( s ) || evict_farther ( s, i, want_cnt ) ) )
+            ;
+        /* the rest is farther, and the budget holds nearer ones already */
+        if ( s->resident_bytes + s->inflight_bytes + need > s->budget ) break;
+
+        c->state = CLUSTER_QUEUED;
+        s->inflight_bytes += need;
+        s->queue[ s->queue_cnt++ ] = s->order[ i ].id;
+    }
+    if ( s->queue_cnt ) pthread_cond_signal ( &s->wake );
+
+    uint32_t * t     = s->prev_draw;
+    s->prev_draw     = s->draw;
+    s->prev_draw_cnt = s->draw_cnt;
+    s->draw          = t;
+    s->draw_cnt      = 0;
+    for ( uint32_t i = 0; i < want_cnt; i++ )
+    {
+        if ( s->clusters[ s->order[ i ].id ].state == CLUSTER_RESIDENT )
+            s->draw[ s->draw_cnt++ ] = s->order[ i ].id;
+    }
+    pthread_mutex_unlock ( &s->lock );
+
+    s->changed = s->draw_cnt != s->prev_draw_cnt ||
+                 memcmp ( s->draw,
+                          s->prev_draw,
+                          s->draw_cnt * sizeof ( uint32_t ) );
+}
@@ -0,0 +1,125 @@
+#pragma once
+#ifndef CUSTOM_RENDER_STREAM_H
+#define CUSTOM_RENDER_STREAM_H
+
+#include "engine.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* 19.10.26 ::: Out-of-core meshes. A cluster file holds a mesh cut into
+ * spatially coherent clusters that load on their own:
+ *
+ *   ClusterFileHeader
+ *   ClusterFileEntry [ cluster_cnt ]
+ *   per cluster: float vertices[ vert_cnt * 3 ], uint32_t idx[ tri_cnt * 3 ]
+ *
+ * indices are local to their cluster, everything is host endian. At run
+ * time an I/O thread reads the clusters the renderer asks for, nearest
+ * first, and the main thread evicts the least recently used ones to stay
+ * under the memory budget. Only resident clusters get drawn. */
+
+#define CLUSTER_MAGIC   0x554c4352u /* "RCLU" */
+#define CLUSTER_VERSION 1
+#define CLUSTER_TRIS    4096 /* default triangles per cluster */
+
+typedef struct ClusterFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cluster_cnt;
+    uint32_t reserved;
+    float    aabb_min[ 3 ];
+    float    aabb_max[ 3 ];
+} ClusterFileHeader;
+
+typedef struct ClusterFileEntry
+{
+    uint64_t offset; /* of the vertices, from the start of the file */
+    uint32_t vert_cnt;
+    uint32_t tri_cnt;
+    float    aabb_min[ 3 ];
+    float    aabb_max[ 3 ];
+} ClusterFileEntry;
+
+enum
+{
+    CLUSTER_EMPTY,
+    CLUSTER_QUEUED,  /* waiting for the I/O thread, can still be dropped */
+    CLUSTER_LOADING, /* being read */
+    CLUSTER_RESIDENT,
+    CLUSTER_FAILED /* read error, never asked for again */
+};
+
+typedef struct Cluster
+{
+    ClusterFileEntry entry;
+    RMesh            mesh; /* valid while resident */
+    int              state;
+    uint64_t         last_used; /* frame it was last drawn */
+
+    /* set by the caller before updateClusterStream (): distance to the
+     * eye when on screen this frame, < 0 otherwise */
+    float want;
+} Cluster;
+
+typedef struct ClusterWant
+{
+    float    dist;
+    uint32_t id;
+} ClusterWant;
+
+typedef struct ClusterStream
+{
+    FILE *            file; /* the I/O thread's once it runs */
+    ClusterFileHeader header;
+    Cluster *         clusters;
+    uint32_t          cluster_cnt;
+
+    size_t budget;
+    size_t resident_bytes;
+    size_t inflight_bytes; /* queued or loading */
+
+    /* resident and wanted this frame, nearest first */
+    uint32_t * draw;
+    uint32_t   draw_cnt;
+    uint8_t    changed; /* draw list differs from the previous frame */
+
+    uint64_t frame;
+
+    /* requests, nearest first; the I/O thread takes from queue_head */
+    uint32_t * queue;
+    uint32_t   queue_head;
+    uint32_t   queue_cnt;
+
+    ClusterWant * order; /* scratch for the wanted list */
+    uint32_t *    prev_draw;
+    uint32_t      prev_draw_cnt;
+
+    pthread_t       io;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    int             running;
+} ClusterStream;
+
+/* cuts m into clusters of about cluster_tris triangles along a Morton
+ * curve of the triangle centroids and writes them to path */
+int
+writeClusterFile ( RMesh * m, const char * path, uint32_t cluster_tris );
+
+/* reads the header and cluster table and starts the I/O thread; budget is
+ * in bytes of resident vertex and index data */
+ClusterStream *
+openClusterStream ( const char * path, size_t budget );
+
+void
+closeClusterStream ( ClusterStream * s );
+
+/* main thread, once per frame after setting every Cluster.want: touches
+ * the wanted resident clusters, evicts for and queues the missing ones
+ * and rebuilds the draw list */
+void
+updateClusterStream ( ClusterStream * s );
+
+#endif /* CUSTOM_RENDER_STREAM_H */
@@ -0,0 +1,512 @@
+#define _DEFAULT_SOURCE /* popen () */
+#include "video.h"
+
+#include <immintrin.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* BT.601, limited range, 8 bit fixed point:
+ *   Y = (  66 R + 129 G +  25 B + 128 ) / 256 + 16
+ *   U = ( -38 R -  74 G + 112 B + 128 ) / 256 + 128
+ *   V = ( 112 R -  94 G -  18 B + 128 ) / 256 + 128
+ * with the offsets folded into the rounding constant (U and V stay
+ * positive before the shift). Chroma is taken from the 2x2 average. */
+#define Y_BIAS  ( 128 + ( 16 << 8 ) )
+#define UV_BIAS ( 128 + ( 128 << 8 ) )
+
+/* two int16 per int32 lane, for madd */
+#define PAIR16( lo, hi ) \
+    ( int ) ( ( uint16_t ) ( lo ) | ( uint32_t ) ( uint16_t ) ( hi ) << 16 )
+
+static inline __attribute__ ( ( always_inline ) ) void
+yuv_px2 ( const VideoSink * v,
+          const uint32_t *  t,
+          const uint32_t *  b,
+          uint8_t *         y0,
+          uint8_t *         y1,
+          uint8_t *         u,
+          uint8_t *         w,
+          int               x )
+{
+    const uint32_t px[ 4 ] = { t[ x ], t[ x + 1 ], b[ x ], b[ x + 1 ] };
+    uint8_t *      out[ 4 ] = { y0 + x, y0 + x + 1, y1 + x, y1 + x + 1 };
+
+    int rs = 0, gs = 0, bs = 0;
+    for ( int i = 0; i < 4; i++ )
+    {
+        const int r  = ( px[ i ] >> v->rshift ) & 0xff;
+        const int g  = ( px[ i ] >> v->gshift ) & 0xff;
+        const int bl = ( px[ i ] >> v->bshift ) & 0xff;
+
+        *out[ i ] = ( 66 * r + 129 * g + 25 * bl + Y_BIAS ) >> 8;
+        rs += r;
+        gs += g;
+        bs += bl;
+    }
+    rs = ( rs + 2 ) >> 2;
+    gs = ( gs + 2 ) >> 2;
+    bs = ( bs + 2 ) >> 2;
+
+    u[ x / 2 ] = ( -38 * rs - 74 * gs + 112 * bs + UV_BIAS ) >> 8;
+    w[ x / 2 ] = ( 112 * rs - 94 * gs - 18 * bs + UV_BIAS ) >> 8;
+}
+
+/* ---- SSE2: 8 pixels of a row pair per step ---- */
+
+static inline __attribute__ ( ( always_inline ) ) void
+rgb4 ( const VideoSink * v, __m128i px, __m128i * r, __m128i * g, __m128i * b )
+{
+    const __m128i m = _mm_set1_epi32 ( 0xff );
+    *r = _mm_and_si128 ( _mm_srl_epi32 ( px, _mm_cvtsi32_si128 ( v->rshift ) ),
+                         m );
+    *g = _mm_and_si128 ( _mm_srl_epi32 ( px, _mm_cvtsi32_si128 ( v->gshift ) ),
+                         m );
+    *b = _mm_and_si128 ( _mm_srl_epi32 ( px, _mm_cvtsi32_si128 ( v->bshift ) ),
+                         m );
+}
+
+static inline __attribute__ ( ( always_inline ) ) __m128i
+luma4 ( __m128i r, __m128i g, __m128i b )
+{
+    const __m128i rg = _mm_or_si128 ( r, _mm_slli_epi32 ( g, 16 ) );
+    const __m128i b1 = _mm_or_si128 ( b, _mm_set1_epi32 ( 1 << 16 ) );
+
+    return _mm_srli_epi32 (
+        _mm_add_epi32 (
+            _mm_madd_epi16 ( rg, _mm_set1_epi32 ( PAIR16 ( 66, 129 ) ) ),
+            _mm_madd_epi16 ( b1, _mm_set1_epi32 ( PAIR16 ( 25, Y_BIAS ) ) ) ),
+        8 );
+}
+
+/* ( r, g, b ) . ( cr, cg, cb ), biased and shifted like the luma */
+static inline __attribute__ ( ( always_inline ) ) __m128i
+chroma4 ( __m128i r, __m128i g, __m128i b, int cr, int cg, int cb )
+{
+    const __m128i rg = _mm_or_si128 ( r, _mm_slli_epi32 ( g, 16 ) );
+
+    return _mm_srli_epi32 (
+        _mm_add_epi32 (
+            _mm_add_epi32 (
+                _mm_madd_epi16 ( rg, _mm_set1_epi32 ( PAIR16 ( cr, cg ) ) ),
+                _mm_madd_epi16 ( b, _mm_set1_epi32 ( PAIR16 ( cb, 0 ) ) ) ),
+            _mm_set1_epi32 ( UV_BIAS ) ),
+        8 );
+}
+
+/* sums of the horizontal pairs of a ( 0+1, 2+3 ) and b, rounded 2x2
+ * average once top and bottom were added */
+static inline __attribute__ ( ( always_inline ) ) __m128i
+avg2x2 ( __m128i a, __m128i b )
+{
+    a = _mm_add_epi32 ( a, _mm_srli_epi64 ( a, 32 ) );
+    b = _mm_add_epi32 ( b, _mm_srli_epi64 ( b, 32 ) );
+
+    const __m128i s = _mm_castps_si128 ( _mm_shuffle_ps (
+        _mm_castsi128_ps ( a ), _mm_castsi128_ps ( b ), 0x88 ) );
+    return _mm_srli_epi32 ( _mm_add_epi32 ( s, _mm_set1_epi32 ( 2 ) ), 2 );
+}
+
+static inline __attribute__ ( ( always_inline ) ) void
+store_u8x4 ( uint8_t * out, __m128i v )
+{
+    const __m128i w = _mm_packs_epi32 ( v, v );
+    const int32_t b = _mm_cvtsi128_si32 ( _mm_packus_epi16 ( w, w ) );
+    memcpy ( out, &b, 4 );
+}
+
+static inline __attribute__ ( ( always_inline ) ) void
+yuv_px8 ( const VideoSink * v,
+          const uint32_t *  t,
+          const uint32_t *  b,
+          uint8_t *         y0,
+          uint8_t *         y1,
+          uint8_t *         u,
+          uint8_t *         w,
+          int               x )
+{
+    __m128i r[ 4 ], g[ 4 ], bl[ 4 ];
+    rgb4 ( v, _mm_loadu_si128 ( ( const __m128i * ) ( t + x ) ), r, g, bl );
+    rgb4 ( v,
+           _mm_loadu_si128 ( ( const __m128i * ) ( t + x + 4 ) ),
+           r + 1,
+           g + 1,
+           bl + 1 );
+    rgb4 ( v,
+           _mm_loadu_si128 ( ( const __m128i * ) ( b + x ) ),
+           r + 2,
+           g + 2,
+           bl + 2 );
+    rgb4 ( v,
+           _mm_loadu_si128 ( ( const __m128i * ) ( b + x + 4 ) ),
+           r + 3,
+           g + 3,
+           bl + 3 );
+
+    __m128i l[ 4 ];
+    for ( int i = 0; i < 4; i++ ) l[ i ] = luma4 ( r[ i ], g[ i ], bl[ i ] );
+
+    const __m128i top = _mm_packs_epi32 ( l[ 0 ], l[ 1 ] );
+    const __m128i bot = _mm_packs_epi32 ( l[ 2 ], l[ 3 ] );
+    _mm_storel_epi64 ( ( __m128i * ) ( y0 + x ),
+                       _mm_packus_epi16 ( top, top ) );
+    _mm_storel_epi64 ( ( __m128i * ) ( y1 + x ),
+                       _mm_packus_epi16 ( bot, bot ) );
+
+    const __m128i ra = avg2x2 ( _mm_add_epi32 ( r[ 0 ], r[ 2 ] ),
+                                _mm_add_epi32 ( r[ 1 ], r[ 3 ] ) );
+    const __m128i ga = avg2x2 ( _mm_add_epi32 ( g[ 0 ], g[ 2 ] ),
+                                _mm_add_epi32 ( g[ 1 ], g[ 3 ] ) );
+    const __m128i ba = avg2x2 ( _mm_add_epi32 ( bl[ 0 ], bl[ 2 ] ),
+                                _mm_add_epi32 ( bl[ 1 ], bl[ 3 ] ) );
+
+    store_u8x4 ( u + x / 2, chroma4 ( ra, ga, ba, -38, -74, 112 ) );
+    store_u8x4 ( w + x / 2, chroma4 ( ra, ga, ba, 112, -94, -18 ) );
+}
+
+/* ---- AVX2: 16 pixels of a row pair per step, same arithmetic ---- */
+
+static inline ISA_TARGET_AVX2 void
+rgb8 ( const VideoSink * v, __m256i px, __m256i * r, __m256i * g, __m256i * b )
+{
+    const __m256i m = _mm256_set1_epi32 ( 0xff );
+    *r              = _mm256_and_si256 (
+        _mm256_srl_epi32 ( px, _mm_cvtsi32_si128 ( v->rshift ) ), m );
+    *g = _mm256_and_si256 (
+        _mm256_srl_epi32 ( px, _mm_cvtsi32_si128 ( v->gshift ) ), m );
+    *b = _mm256_and_si256 (
+        _mm256_srl_epi32 ( px, _mm_cvtsi32_si128 ( v->bshift ) ), m );
+}
+
+static inline ISA_TARGET_AVX2 __m256i
+luma8 ( __m256i r, __m256i g, __m256i b )
+{
+    const __m256i rg = _mm256_or_si256 ( r, _mm256_slli_epi32 ( g, 16 ) );
+    const __m256i b1 = _mm256_or_si256 ( b, _mm256_set1_epi32 ( 1 << 16 ) );
+
+    return _mm256_srli_epi32 (
+        _mm256_add_epi32 (
+            _mm256_madd_epi16 ( rg, _mm256_set1_epi32 ( PAIR16 ( 66, 129 ) ) ),
+            _mm256_madd_epi16 ( b1,
+                                _mm256_set1_epi32 ( PAIR16 ( 25, Y_BIAS ) ) ) ),
+        8 );
+}
+
+static inline ISA_TARGET_AVX2 __m256i
+chroma8 ( __m256i r, __m256i g, __m256i b, int cr, int cg, int cb )
+{
+    const __m256i rg = _mm256_or_si256 ( r, _mm256_slli_epi32 ( g, 16 ) );
+
+    return _mm256_srli_epi32 (
+        _mm256_add_epi32 (
+            _mm256_add_epi32 (
+                _mm256_madd_epi16 ( rg,
+                                    _mm256_set1_epi32 ( PAIR16 ( cr, cg ) ) ),
+                _mm256_madd_epi16 ( b,
+                                    _mm256_set1_epi32 ( PAIR16 ( cb, 0 ) ) ) ),
+            _mm256_set1_epi32 ( UV_BIAS ) ),
+        8 );
+}
+
+static inline ISA_TARGET_AVX2 __m256i
+avg2x2_8 ( __m256i a, __m256i b )
+{
+    a = _mm256_add_epi32 ( a, _mm256_srli_epi64 ( a, 32 ) );
+    b = _mm256_add_epi32 ( b, _mm256_srli_epi64 ( b, 32 ) );
+
+    /* per lane: pairs 0 1 4 5 | 2 3 6 7 */
+    __m256i s = _mm256_castps_si256 ( _mm256_shuffle_ps (
+        _mm256_castsi256_ps ( a ), _mm256_castsi256_ps ( b ), 0x88 ) );
+    s = _mm256_permutevar8x32_epi32 (
+        s, _mm256_setr_epi32 ( 0, 1, 4, 5, 2, 3, 6, 7 ) );
+    return _mm256_srli_epi32 ( _mm256_add_epi32 ( s, _mm256_set1_epi32 ( 2 ) ),
+                               2 );
+}
+
+/* 8 int32 -> 8 int16 */
+static inline ISA_TARGET_AVX2 __m128i
+pack8 ( __m256i v )
+{
+    return _mm_packs_epi32 ( _mm256_castsi256_si128 ( v ),
+                             _mm256_extracti128_si256 ( v, 1 ) );
+}
+
+static ISA_TARGET_AVX2 int
+yuv_run16 ( const VideoSink * v,
+            const uint32_t *  t,
+            const uint32_t *  b,
+            uint8_t *         y0,
+            uint8_t *         y1,
+            uint8_t *         u,
+            uint8_t *         w,
+            int               x,
+            int               end )
+{
+    for ( ; x + 16 <= end; x += 16 )
+    {
+        const uint32_t * src[ 4 ] = { t + x, t + x + 8, b + x, b + x + 8 };
+
+        __m256i r[ 4 ], g[ 4 ], bl[ 4 ], l[ 4 ];
+        for ( int i = 0; i < 4; i++ )
+        {
+            rgb8 ( v,
+                   _mm256_loadu_si256 ( ( const __m256i * ) src[ i ] ),
+                   r + i,
+                   g + i,
+                   bl + i );
+            l[ i ] = luma8 ( r[ i ], g[ i ], bl[ i ] );
+        }
+
+        _mm_storeu_si128 ( ( __m128i * ) ( y0 + x ),
+                           _mm_packus_epi16 ( pack8 ( l[ 0 ] ),
+                                              pack8 ( l[ 1 ] ) ) );
+        _mm_storeu_si128 ( ( __m128i * ) ( y1 + x ),
+                           _mm_packus_epi16 ( pack8 ( l[ 2 ] ),
+                                              pack8 ( l[ 3 ] ) ) );
+
+        const __m256i ra = avg2x2_8 ( _mm256_add_epi32 ( r[ 0 ], r[ 2 ] ),
+                                      _mm256_add_epi32 ( r[ 1 ], r[ 3 ] ) );
+        const __m256i ga = avg2x2_8 ( _mm256_add_epi32 ( g[ 0 ], g[ 2 ] ),
+                                      _mm256_add_epi32 ( g[ 1 ], g[ 3 ] ) );
+        const __m256i ba = avg2x2_8 ( _mm256_add_epi32 ( bl[ 0 ], bl[ 2 ] ),
+                                      _mm256_add_epi32 ( bl[ 1 ], bl[ 3 ] ) );
+
+        const __m128i cu = pack8 ( chroma8 ( ra, ga, ba, -38, -74, 112 ) );
+        const __m128i cv = pack8 ( chroma8 ( ra, ga, ba, 112, -94, -18 ) );
+        _mm_storel_epi64 ( ( __m128i * ) ( u + x / 2 ),
+                           _mm_packus_epi16 ( cu, cu ) );
+        _mm_storel_epi64 ( ( __m128i * ) ( w + x / 2 ),
+                           _mm_packus_epi16 ( cv, cv ) );
+    }
+    return x;
+}
+
+static inline __attribute__ ( ( always_inline ) ) void
+yuv_rect_body ( int                isa,
+                VideoSink *        v,
+                const uint32_t *   px,
+                int                pitch,
+                const SDL_Rect *   r )
+{
+    const int cw     = v->w / 2;
+    uint8_t * luma   = v->yuv;
+    uint8_t * cb     = luma + ( size_t ) v->w * v->h;
+    uint8_t * cr     = cb + ( size_t ) cw * ( v->h / 2 );
+    const int x_end  = r->x + r->w;
+
+    for ( int y = r->y; y < r->y + r->h; y += 2 )
+    {
+        const uint32_t * t  = px + ( size_t ) y * pitch;
+        const uint32_t * b  = t + pitch;
+        uint8_t *        y0 = luma + ( size_t ) y * v->w;
+        uint8_t *        y1 = y0 + v->w;
+        uint8_t *        u  = cb + ( size_t ) ( y / 2 ) * cw;
+        uint8_t *        w  = cr + ( size_t ) ( y / 2 ) * cw;
+
+        int x = r->x;
+        if ( isa >= ISA_AVX2 )
+            x = yuv_run16 ( v, t, b, y0, y1, u, w, x, x_end );
+        for ( ; x + 8 <= x_end; x += 8 ) yuv_px8 ( v, t, b, y0, y1, u, w, x );
+        for ( ; x < x_end; x += 2 ) yuv_px2 ( v, t, b, y0, y1, u, w, x );
+    }
+}
+
+ISA_KERNEL ( yuv_rect,
+             ( VideoSink * v,
+               const uint32_t * px,
+               int pitch,
+               const SDL_Rect * r ),
+             v,
+             px,
+             pitch,
+             r );
+
+void
+videoConvert ( VideoSink *      v,
+               const uint32_t * px,
+               int              pitch,
+               const SDL_Rect * r )
+{
+    yuv_rect_isa[ isaLevel ]( v, px, pitch, r );
+}
+
+/* ---- writer ---- */
+
+static void *
+writer_main ( void * arg )
+{
+    VideoSink * v = arg;
+
+    pthread_mutex_lock ( &v->lock );
+    for ( ;; )
+    {
+        while ( v->running && ! v->queued )
+            pthread_cond_wait ( &v->cond, &v->lock );
+        if ( ! v->queued ) break;
+
+        const uint8_t * frame  = v->slot[ v->head ];
+        const int       repeat = v->repeat[ v->head ];
+        int             failed = v->failed;
+        pthread_mutex_unlock ( &v->lock );
+
+        /* the slot stays ours until head moves past it */
+        for ( int i = 0; i < repeat && ! failed; i++ )
+        {
+            failed = fputs ( "FRAME\n", v->out ) == EOF ||
+                     fwrite ( frame, 1, v->frame_bytes, v->out ) !=
+                         v->frame_bytes;
+        }
+
+        pthread_mutex_lock ( &v->lock );
+        if ( failed && ! v->failed ) printf ( "error: video write failed\n" );
+        v->failed = failed;
+        if ( ! failed ) v->frames += repeat;
+        v->head = ( v->head + 1 ) % VIDEO_SLOTS;
+        v->queued--;
+    }
+    pthread_mutex_unlock ( &v->lock );
+    return NULL;
+}
+
+void
+initVideoTarget ( VideoSink * v, const SDL_Surface * surface, uint8_t * yuv )
+{
+    memset ( v, 0, sizeof ( VideoSink ) );
+    v->w           = surface->w;
+    v->h           = surface->h;
+    v->rshift      = surface->format->Rshift;
+    v->gshift      = surface->format->Gshift;
+    v->bshift      = surface->format->Bshift;
+    v->frame_bytes = ( size_t ) v->w * v->h * 3 / 2;
+    v->yuv         = yuv;
+}
+
+int
+openVideo ( VideoSink *         v,
+            const char *        target,
+            const SDL_Surface * surface,
+            int                 fps )
+{
+    memset ( v, 0, sizeof ( VideoSink ) );
+
+    if ( ( surface->w | surface->h ) & 1 )
+    {
+        printf ( "error: video needs an even size, surface is %dx%d\n",
+                 surface->w,
+                 surface->h );
+        return -1;
+    }
+
+    const int pipe = target[ 0 ] == '|';
+    FILE *    out;
+    if ( pipe )
+    {
+        /* a dead encoder fails the write instead of killing the app */
+        signal ( SIGPIPE, SIG_IGN );
+        out = popen ( target + 1, "w" );
+    }
+    else
+        out = fopen ( target, "wb" );
+    if ( ! out )
+    {
+        printf ( "error: can't open video output %s\n", target );
+        return -1;
+    }
+
+    uint8_t * yuv;
+    U_ALLOC ( yuv, uint8_t, ( size_t ) surface->w * surface->h * 3 / 2 );
+    initVideoTarget ( v, surface, yuv );
+    v->out  = out;
+    v->pipe = pipe;
+    v->fps  = fps > 0 ? fps : 30;
+
+    for ( int i = 0; i < VIDEO_SLOTS; i++ )
+        U_ALLOC ( v->slot[ i ], uint8_t, v->frame_bytes );
+
+    /* black until the first merge */
+    memset ( v->yuv, 16, ( size_t ) v->w * v->h );
+    memset ( v->yuv + ( size_t ) v->w * v->h, 128, v->frame_bytes / 3 );
+
+    fprintf ( v->out,
+              "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XYSCSS=420JPEG "
+              "XCOLORRANGE=LIMITED\n",
+              v->w,
+              v->h,
+              v->fps );
+
+    pthread_mutex_init ( &v->lock, NULL );
+    pthread_cond_init ( &v->cond, NULL );
+    v->running = 1;
+    if ( pthread_create ( &v->writer, NULL, writer_main, v ) )
+    {
+        printf ( "error: pthread_create of the video writer failed\n" );
+        v->running = 0;
+        closeVideo ( v );
+        return -1;
+    }
+
+    v->start = SDL_GetPerformanceCounter ();
+    return 0;
+}
+
+void
+closeVideo ( VideoSink * v )
+{
+    if ( ! v->out ) return;
+
+    if ( v->running )
+    {
+        pthread_mutex_lock ( &v->lock );
+        v->running = 0;
+        pthread_cond_signal ( &v->cond );
+        pthread_mutex_unlock ( &v->lock );
+        pthread_join ( v->writer, NULL );
+    }
+    pthread_mutex_destroy ( &v->lock );
+    pthread_cond_destroy ( &v->cond );
+
+    const int err = v->pipe ? pclose ( v->out ) != 0 : fclose ( v->out ) != 0;
+    if ( err ) printf ( "error: video output close failed\n" );
+    v->out = NULL;
+
+    free ( v->yuv );
+    for ( int i = 0; i < VIDEO_SLOTS; i++ ) free ( v->slot[ i ] );
+}
+
+int
+videoFrame ( VideoSink * v )
+{
+    /* ticks of the stream's clock since the last frame sent */
+    const uint64_t due = ( SDL_GetPerformanceCounter () - v->start ) *
+                             v->fps / SDL_GetPerformanceFrequency () +
+                         1;
+    if ( due <= v->ticks ) return 0;
+
+    pthread_mutex_lock ( &v->lock );
+    const int failed = v->failed;
+    const int full   = v->queued == VIDEO_SLOTS;
+    const int slot   = ( v->head + v->queued ) % VIDEO_SLOTS;
+    pthread_mutex_unlock ( &v->lock );
+
+    if ( failed ) return -1;
+
+    /* the next frame that finds a slot covers these ticks as well */
+    if ( full )
+    {
+        v->late++;
+        return 0;
+    }
+
+    /* not queued yet, the writer doesn't look at it */
+    memcpy ( v->slot[ slot ], v->yuv, v->frame_bytes );
+
+    pthread_mutex_lock ( &v->lock );
+    v->repeat[ slot ] = ( int ) ( due - v->ticks );
+    v->queued++;
+    pthread_cond_signal ( &v->cond );
+    pthread_mutex_unlock ( &v->lock );
+
+    v->ticks = due;
+    return 0;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#ifndef CUSTOM_RENDER_VIDEO_H
+#define CUSTOM_RENDER_VIDEO_H
+
+#include "engine.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* 19.10.26 ::: Y4M video out. While Framebuffer.video is set the merge
+ * jobs convert every row they write to BT.601 YUV 4:2:0 (limited range)
+ * right after writing it, so the frame is converted from cache instead
+ * of being read back from memory; partial merges keep the YUV frame as
+ * current as the surface. videoFrame () hands a copy of it to a writer
+ * thread, so a slow file or encoder never stalls the frame loop.
+ *
+ * The target is a file (or a fifo), or "|command" to pipe the stream
+ * into an encoder, e.g. "|ffmpeg -i - out.mp4". Frames are paced to the
+ * header's rate by wall clock: a frame is repeated for the ticks it was
+ * on screen, and frames between two ticks are not sent. */
+
+#define VIDEO_SLOTS 3 /* frames queued for the writer */
+
+typedef struct VideoSink
+{
+    FILE * out;
+    int    pipe;
+    int    w, h, fps;
+
+    /* byte positions of the channels in a surface pixel */
+    int rshift, gshift, bshift;
+
+    /* current frame, Y then U then V */
+    uint8_t * yuv;
+    size_t    frame_bytes;
+
+    /* writer queue, slot[ head ] .. slot[ head + queued - 1 ] */
+    uint8_t *       slot[ VIDEO_SLOTS ];
+    int             repeat[ VIDEO_SLOTS ];
+    int             head, queued;
+    int             running, failed; /* under lock */
+    pthread_t       writer;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    uint64_t start;  /* SDL_GetPerformanceCounter () at open */
+    uint64_t ticks;  /* frames sent, repeats included */
+    uint32_t frames; /* frames written */
+    uint32_t late;   /* videoFrame () calls the writer had no slot for */
+} VideoSink;
+
+/* 0 on success; writes the stream header. The surface needs an even
+ * size, 4:2:0 has one chroma sample per 2x2 pixels. */
+int
+openVideo ( VideoSink * v,
+            const char * target,
+            const SDL_Surface * surface,
+            int fps );
+
+/* sends what is queued, then closes */
+void
+closeVideo ( VideoSink * v );
+
+/* queues the current frame; -1 once a write failed */
+int
+videoFrame ( VideoSink * v );
+
+/* sets v up to convert surface pixels into yuv (frame_bytes of it), for
+ * videoConvert () alone: no output, no writer */
+void
+initVideoTarget ( VideoSink * v, const SDL_Surface * surface, uint8_t * yuv );
+
+/* converts r of the surface pixels px (pitch in pixels) into the current
+ * frame; r has even bounds. Merge jobs call it for their rows. */
+void
+videoConvert ( VideoSink * v,
+               const uint32_t * px,
+               int pitch,
+               const SDL_Rect * r );
+
+#endif /* CUSTOM_RENDER_VIDEO_H */